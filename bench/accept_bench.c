@@ -0,0 +1,112 @@
+/*
+ * Connection-rate benchmark for the Jeux server.
+ *
+ * Each client thread repeatedly connects to the server, sends a USERS
+ * request (which the server answers with a NACK, since the connection
+ * is not logged in), waits for the reply and drops the connection with a
+ * reset.  Waiting for the reply means every counted connection was
+ * actually accepted and serviced, not just queued in the listen backlog.
+ * The result is reported as connections per second.
+ *
+ * Usage: accept_bench -p <port> [-h <host>] [-c <client threads>] [-d <seconds>]
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "bench.h"
+
+static struct sockaddr_in server;
+static atomic_int running = 1;
+static atomic_long connections;
+static atomic_long failures;
+
+/*
+ * Make one connection and complete one request/reply on it.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int one_connection(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  // close with a reset, so the client does not run out of ports in TIME_WAIT
+  struct linger lg = {.l_onoff = 1, .l_linger = 0};
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  int ret = -1;
+  if (connect(fd, (struct sockaddr *)&server, sizeof(server)) == 0) {
+    BENCH_CLIENT c = {.fd = fd};
+    JEUX_PACKET_HEADER hdr;
+    if (send_packet(&c, JEUX_USERS_PKT, 0, 0, NULL) == 0 && recv_packet(&c, &hdr) == 0 &&
+        hdr.type == JEUX_NACK_PKT) {
+      ret = 0;
+    }
+  }
+  close(fd);
+  return ret;
+}
+
+static void *client_thread(void *arg) {
+  while (atomic_load_explicit(&running, memory_order_relaxed)) {
+    if (one_connection() == 0) {
+      atomic_fetch_add_explicit(&connections, 1, memory_order_relaxed);
+    } else {
+      atomic_fetch_add_explicit(&failures, 1, memory_order_relaxed);
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  int nclients = 16;
+  double duration = 5;
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:c:d:")) != -1) {
+    switch (opt) {
+      case 'h':
+        target.host = optarg;
+        break;
+      case 'p':
+        target.port = atoi(optarg);
+        break;
+      case 'c':
+        nclients = atoi(optarg);
+        break;
+      case 'd':
+        duration = atof(optarg);
+        break;
+      default:
+        target.port = 0;
+        break;
+    }
+  }
+  if (target.port <= 0 || nclients <= 0 || duration <= 0) {
+    fprintf(stderr, "Usage: %s -p <port> [-h <host>] [-c <client threads>] [-d <seconds>]\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (tcp_address(&server) == -1) {
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_t *tids = calloc(nclients, sizeof(pthread_t));
+  double start = now();
+  for (int i = 0; i < nclients; i++) {
+    pthread_create(&tids[i], NULL, client_thread, NULL);
+  }
+  struct timespec ts = {.tv_sec = (time_t)duration,
+                        .tv_nsec = (long)((duration - (time_t)duration) * 1e9)};
+  nanosleep(&ts, NULL);
+  atomic_store(&running, 0);
+  for (int i = 0; i < nclients; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  double elapsed = now() - start;
+  long n = atomic_load(&connections);
+  printf("%ld connections in %.2fs: %.0f conn/s (%ld failed)\n", n, elapsed,
+         n / elapsed, atomic_load(&failures));
+  free(tids);
+  return 0;
+}
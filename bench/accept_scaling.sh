@@ -0,0 +1,27 @@
+#!/bin/sh
+# Measure connection acceptance rate as the number of SO_REUSEPORT
+# acceptors goes from 1 to the number of online CPUs.
+#
+# Usage: bench/accept_scaling.sh [port] [seconds] [extra server options...]
+# Run `make bench` first.
+
+DEFAULT_SETTING=5
+. "$(dirname "$0")/common.sh"
+SECS=$SETTING
+NCPU=$(getconf _NPROCESSORS_ONLN)
+CLIENTS=$((NCPU * 8))
+
+run() {
+  start_server -p "$PORT" "$@"
+  bin/accept_bench -p "$PORT" -c "$CLIENTS" -d "$SECS"
+  stop_server
+}
+
+printf "%-14s " "single"
+run "$@"
+N=1
+while [ $N -le "$NCPU" ]; do
+  printf "%-14s " "-a $N -c"
+  run -a $N -c "$@"
+  N=$((N + 1))
+done
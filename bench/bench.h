@@ -0,0 +1,316 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * The client side of the Jeux protocol, shared by the benchmarks:
+ * connecting to the server, logging in, and sending and receiving
+ * packets in the standard and the compact framing.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "game.h"
+
+// capability bits of a LOGIN, as in protocol_ext.h
+#define CAP_COMPACT 0x1
+#define CAP_TIMESTAMPS 0x2
+#define CAP_DELTA 0x4
+#define CAP_MUX 0x8
+#define CAP_CORRELATION 0x10
+
+// packets that arrived while another one was expected
+#define MAX_PENDING 16
+
+/*
+ * The server: the Unix domain socket at path, if there is one, otherwise
+ * host and port over TCP.
+ */
+static struct {
+  const char *host;
+  int port;
+  const char *path;
+} target = {.host = "127.0.0.1"};
+
+/*
+ * A logged-in client, with the packets that arrived while it waited for
+ * others and the bytes it has written and read.
+ */
+typedef struct bench_client {
+  int fd;
+  // the capabilities the server accepted
+  int caps;
+  // acknowledge every read at once (see client_read())
+  int quickack;
+  size_t sent;
+  size_t received;
+  JEUX_PACKET_HEADER pending[MAX_PENDING];
+  int npending;
+} BENCH_CLIENT;
+
+static int read_fully(int fd, void *buf, size_t len) {
+  size_t have = 0;
+  while (have < len) {
+    ssize_t n = read(fd, (char *)buf + have, len - have);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    have += n;
+  }
+  return 0;
+}
+
+static int write_fully(int fd, const void *buf, size_t len) {
+  return write(fd, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * Fill in the TCP address of the server.
+ */
+static int tcp_address(struct sockaddr_in *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(target.port);
+  if (inet_pton(AF_INET, target.host, &addr->sin_addr) != 1) {
+    fprintf(stderr, "bad address: %s\n", target.host);
+    return -1;
+  }
+  return 0;
+}
+
+static int connect_server(void) {
+  int fd;
+  if (target.path != NULL) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, target.path, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      return fd;
+    }
+  } else {
+    struct sockaddr_in addr;
+    if (tcp_address(&addr) == -1) {
+      return -1;
+    }
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    if (fd >= 0 && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0 &&
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      return fd;
+    }
+  }
+  perror("connect");
+  if (fd >= 0) {
+    close(fd);
+  }
+  return -1;
+}
+
+/*
+ * Read exactly len bytes for a client.  With quickack set, each read is
+ * acknowledged at once: a player waiting for its opponent's move has
+ * nothing to send that the acknowledgement could ride on, and a delayed
+ * one would hold the server's next small write back behind Nagle's
+ * algorithm.
+ */
+static int client_read(BENCH_CLIENT *c, void *buf, size_t len) {
+  size_t have = 0;
+  int one = 1;
+  while (have < len) {
+    ssize_t n = read(c->fd, (char *)buf + have, len - have);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    have += n;
+    if (c->quickack) {
+      setsockopt(c->fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+    }
+  }
+  c->received += len;
+  return 0;
+}
+
+/*
+ * Send a packet in the client's framing, header and payload in one
+ * write, as a client library would.
+ */
+static int send_packet(BENCH_CLIENT *c, int type, int id, int role, const char *payload) {
+  unsigned char buf[sizeof(JEUX_PACKET_HEADER) + 64];
+  size_t len = payload != NULL ? strlen(payload) : 0;
+  size_t hlen;
+  if (c->caps & CAP_COMPACT) {
+    int ts = c->caps & CAP_TIMESTAMPS;
+    buf[0] = type | (role << 6) | (ts ? 0x20 : 0);
+    buf[1] = id;
+    // payloads here are all shorter than 128 bytes, so one size byte
+    buf[2] = len;
+    hlen = 3;
+    if (ts) {
+      memset(buf + hlen, 0, 8);
+      hlen += 8;
+    }
+  } else {
+    JEUX_PACKET_HEADER *hdr = (JEUX_PACKET_HEADER *)buf;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->type = type;
+    hdr->id = id;
+    hdr->role = role;
+    hdr->size = htons(len);
+    hlen = sizeof(*hdr);
+  }
+  memcpy(buf + hlen, payload, len);
+  if (write_fully(c->fd, buf, hlen + len) == -1) {
+    return -1;
+  }
+  c->sent += hlen + len;
+  return 0;
+}
+
+/*
+ * Read one packet in the client's framing, discarding its payload.
+ */
+static int recv_packet(BENCH_CLIENT *c, JEUX_PACKET_HEADER *hdr) {
+  memset(hdr, 0, sizeof(*hdr));
+  size_t size;
+  if (c->caps & CAP_COMPACT) {
+    unsigned char fixed[2], b;
+    if (client_read(c, fixed, sizeof(fixed)) == -1) {
+      return -1;
+    }
+    hdr->type = fixed[0] & 0x1f;
+    hdr->role = fixed[0] >> 6;
+    hdr->id = fixed[1];
+    size = 0;
+    int shift = 0;
+    do {
+      if (client_read(c, &b, 1) == -1) {
+        return -1;
+      }
+      size |= (size_t)(b & 0x7f) << shift;
+      shift += 7;
+    } while (b & 0x80);
+    if (fixed[0] & 0x20) {
+      char ts[8];
+      if (client_read(c, ts, sizeof(ts)) == -1) {
+        return -1;
+      }
+    }
+  } else {
+    if (client_read(c, hdr, sizeof(*hdr)) == -1) {
+      return -1;
+    }
+    size = ntohs(hdr->size);
+  }
+  char payload[1024];
+  while (size > 0) {
+    size_t chunk = size < sizeof(payload) ? size : sizeof(payload);
+    if (client_read(c, payload, chunk) == -1) {
+      return -1;
+    }
+    size -= chunk;
+  }
+  return 0;
+}
+
+/*
+ * Wait for a packet of the given type, keeping any others that arrive
+ * first for later calls.
+ *
+ * @return the ID field of the packet, or -1 if the connection failed
+ * or a NACK arrived instead.
+ */
+static int expect_packet(BENCH_CLIENT *c, int type) {
+  for (int i = 0; i < c->npending; i++) {
+    if (c->pending[i].type == type) {
+      int id = c->pending[i].id;
+      c->pending[i] = c->pending[--c->npending];
+      return id;
+    }
+  }
+  while (1) {
+    JEUX_PACKET_HEADER hdr;
+    if (recv_packet(c, &hdr) == -1 || hdr.type == JEUX_NACK_PKT) {
+      return -1;
+    }
+    if (hdr.type == type) {
+      return hdr.id;
+    }
+    if (c->npending == MAX_PENDING) {
+      return -1;
+    }
+    c->pending[c->npending++] = hdr;
+  }
+}
+
+/*
+ * Connect a client and log it in, asking for capabilities.  The LOGIN
+ * and its ACK are always in the standard framing.
+ */
+static int login(BENCH_CLIENT *c, const char *name, int caps) {
+  memset(c, 0, sizeof(*c));
+  if ((c->fd = connect_server()) < 0 || send_packet(c, JEUX_LOGIN_PKT, 0, caps, name) == -1) {
+    return -1;
+  }
+  JEUX_PACKET_HEADER ack;
+  if (recv_packet(c, &ack) == -1 || ack.type != JEUX_ACK_PKT) {
+    return -1;
+  }
+  c->caps = ack.role;
+  return 0;
+}
+
+/*
+ * Have a invite the client logged in as bname to a game, as the second
+ * player, and b accept.
+ *
+ * @return 0 with the game's invitation ID for each of them in *aidp and
+ * *bidp, or -1 on failure.
+ */
+static int start_game(BENCH_CLIENT *a, BENCH_CLIENT *b, const char *bname, int *aidp, int *bidp) {
+  if (send_packet(a, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, bname) == -1 ||
+      (*aidp = expect_packet(a, JEUX_ACK_PKT)) == -1 ||
+      (*bidp = expect_packet(b, JEUX_INVITED_PKT)) == -1 ||
+      send_packet(b, JEUX_ACCEPT_PKT, *bidp, 0, NULL) == -1 ||
+      expect_packet(b, JEUX_ACK_PKT) == -1 || expect_packet(a, JEUX_ACCEPTED_PKT) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+static size_t put_varint(unsigned char *p, unsigned int v) {
+  size_t i = 0;
+  while (v >= 0x80) {
+    p[i++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[i++] = v;
+  return i;
+}
+
+/*
+ * The monotonic clock, in seconds.
+ */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
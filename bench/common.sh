@@ -0,0 +1,24 @@
+# Sourced by the benchmark scripts, which all take
+#
+#   [port] [setting] [extra server options...]
+#
+# Set DEFAULT_SETTING and source this with the script's arguments still
+# in "$@": it sets PORT and SETTING, and leaves only the extra server
+# options in "$@".
+
+PORT=${1:-9999}
+SETTING=${2:-$DEFAULT_SETTING}
+if [ $# -ge 2 ]; then shift 2; else shift $#; fi
+
+# Start the server with some options and give it time to listen.
+start_server() {
+  bin/jeux "$@" 2>/dev/null &
+  SERVER_PID=$!
+  sleep 0.5
+}
+
+# Stop the server started by start_server() the way SIGHUP always does.
+stop_server() {
+  kill -HUP "$SERVER_PID"
+  wait "$SERVER_PID"
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Compare MOVE/ACK round-trip latency over loopback TCP and over the
+# server's Unix domain socket, with one server listening on both.
+#
+# Usage: bench/local_latency.sh [port] [games] [extra server options...]
+# Run `make bench` first.
+
+DEFAULT_SETTING=1000
+. "$(dirname "$0")/common.sh"
+GAMES=$SETTING
+SOCK=${TMPDIR:-/tmp}/jeux-bench-$$.sock
+
+start_server -p "$PORT" -u "$SOCK" "$@"
+printf "%-6s " "tcp"
+bin/move_rtt_bench -p "$PORT" -n "$GAMES"
+printf "%-6s " "unix"
+bin/move_rtt_bench -u "$SOCK" -n "$GAMES"
+stop_server
@@ -0,0 +1,114 @@
+/*
+ * MOVE/ACK round-trip latency benchmark for the Jeux server.
+ *
+ * Two clients log in over TCP or over the server's Unix domain socket
+ * and play games against each other: after an invitation is accepted,
+ * they make the first eight moves of a drawn game, alternately, and the
+ * first player then resigns.  Each MOVE is timed from the moment it is
+ * written until its ACK has been read.  The opponent's MOVED is read
+ * only after that, so it does not count towards the round trip.  The
+ * result is reported as the mean and percentiles of the round trips.
+ *
+ * Usage: move_rtt_bench -p <port> | -u <socket path> [-h <host>] [-n <games>]
+ */
+#include "bench.h"
+
+// the first eight moves of a game that ends in a draw, so no move ends it
+static const char *moves[] = {"1", "2", "3", "5", "4", "6", "8", "7"};
+#define NMOVES (sizeof(moves) / sizeof(moves[0]))
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Play one game, recording the round trip of each of its moves.  Client
+ * a invites b, who is logged in as bname.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int play_game(BENCH_CLIENT *a, BENCH_CLIENT *b, const char *bname, double *rtts) {
+  int aid, bid;
+  if (start_game(a, b, bname, &aid, &bid) == -1) {
+    return -1;
+  }
+  for (size_t i = 0; i < NMOVES; i++) {
+    BENCH_CLIENT *mover = i % 2 == 0 ? a : b;
+    BENCH_CLIENT *other = i % 2 == 0 ? b : a;
+    double start = now();
+    if (send_packet(mover, JEUX_MOVE_PKT, i % 2 == 0 ? aid : bid, 0, moves[i]) == -1 ||
+        expect_packet(mover, JEUX_ACK_PKT) == -1) {
+      return -1;
+    }
+    rtts[i] = (now() - start) * 1e6;
+    if (expect_packet(other, JEUX_MOVED_PKT) == -1) {
+      return -1;
+    }
+  }
+  if (send_packet(a, JEUX_RESIGN_PKT, aid, 0, NULL) == -1 ||
+      expect_packet(a, JEUX_ACK_PKT) == -1 || expect_packet(b, JEUX_RESIGNED_PKT) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int ngames = 1000;
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:u:n:")) != -1) {
+    switch (opt) {
+      case 'h':
+        target.host = optarg;
+        break;
+      case 'p':
+        target.port = atoi(optarg);
+        break;
+      case 'u':
+        target.path = optarg;
+        break;
+      case 'n':
+        ngames = atoi(optarg);
+        break;
+      default:
+        ngames = 0;
+        break;
+    }
+  }
+  if ((target.port <= 0 && target.path == NULL) || ngames <= 0) {
+    fprintf(stderr, "Usage: %s -p <port> | -u <socket path> [-h <host>] [-n <games>]\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  // names of our own, so that several runs can share a server
+  BENCH_CLIENT a, b;
+  char aname[32], bname[32];
+  snprintf(aname, sizeof(aname), "rtt-a-%d", getpid());
+  snprintf(bname, sizeof(bname), "rtt-b-%d", getpid());
+  if (login(&a, aname, 0) == -1 || login(&b, bname, 0) == -1) {
+    fprintf(stderr, "login failed\n");
+    exit(EXIT_FAILURE);
+  }
+  size_t nrtts = (size_t)ngames * NMOVES;
+  double *rtts = calloc(nrtts, sizeof(double));
+  if (rtts == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  for (int g = 0; g < ngames; g++) {
+    if (play_game(&a, &b, bname, rtts + (size_t)g * NMOVES) == -1) {
+      fprintf(stderr, "game %d failed\n", g);
+      exit(EXIT_FAILURE);
+    }
+  }
+  qsort(rtts, nrtts, sizeof(double), compare_doubles);
+  double sum = 0;
+  for (size_t i = 0; i < nrtts; i++) {
+    sum += rtts[i];
+  }
+  printf("%zu moves: mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n", nrtts,
+         sum / nrtts, rtts[nrtts / 2], rtts[nrtts * 99 / 100], rtts[nrtts - 1]);
+  free(rtts);
+  close(a.fd);
+  close(b.fd);
+  return 0;
+}
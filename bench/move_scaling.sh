@@ -0,0 +1,15 @@
+#!/bin/sh
+# Measure how move throughput grows with the number of games played at
+# once, from one game up to one per online CPU.
+#
+# Usage: bench/move_scaling.sh [port] [seconds] [extra server options...]
+# Run `make bench` first.
+
+DEFAULT_SETTING=3
+. "$(dirname "$0")/common.sh"
+SECS=$SETTING
+NCPU=$(getconf _NPROCESSORS_ONLN)
+
+start_server -p "$PORT" "$@"
+bin/move_scaling_bench -p "$PORT" -g "$NCPU" -d "$SECS"
+stop_server
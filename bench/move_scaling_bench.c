@@ -0,0 +1,166 @@
+/*
+ * Move throughput of the Jeux server as more games are played at once.
+ *
+ * Each game is played by a thread of its own with two connections, one
+ * per player: an invitation, its acceptance and the nine moves of a
+ * drawn game, over and over, each move waited for by both players before
+ * the next is made.  Games share nothing but the server, so as long as
+ * the server serves unrelated games in parallel the moves made per
+ * second should grow with the number of games, up to the number of
+ * cores.  The rate is reported for 1, 2, 4, ... games, up to a maximum.
+ *
+ * Usage: move_scaling_bench -p <port> [-h <host>] [-g <max games>] [-d <seconds>]
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "bench.h"
+
+// the nine moves of a game that ends in a draw
+static const char *moves[] = {"1", "2", "3", "5", "4", "6", "8", "7", "9"};
+#define NMOVES (sizeof(moves) / sizeof(moves[0]))
+
+static atomic_int running;
+static atomic_long moves_made;
+static atomic_long failures;
+
+typedef struct game_thread {
+  pthread_t tid;
+  int games;
+  int index;
+} GAME_THREAD;
+
+/*
+ * Log a player in, to have everything it reads acknowledged at once.
+ */
+static int login_quickack(BENCH_CLIENT *c, const char *name) {
+  if (login(c, name, 0) == -1) {
+    perror("login");
+    return -1;
+  }
+  c->quickack = 1;
+  return 0;
+}
+
+/*
+ * Play one full game between two logged-in clients.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int play_game(BENCH_CLIENT *a, BENCH_CLIENT *b, const char *bname) {
+  int aid, bid;
+  if (start_game(a, b, bname, &aid, &bid) == -1) {
+    return -1;
+  }
+  for (size_t i = 0; i < NMOVES; i++) {
+    BENCH_CLIENT *mover = i % 2 == 0 ? a : b;
+    BENCH_CLIENT *other = i % 2 == 0 ? b : a;
+    if (send_packet(mover, JEUX_MOVE_PKT, i % 2 == 0 ? aid : bid, 0, moves[i]) == -1 ||
+        expect_packet(mover, JEUX_ACK_PKT) == -1 || expect_packet(other, JEUX_MOVED_PKT) == -1) {
+      return -1;
+    }
+    atomic_fetch_add_explicit(&moves_made, 1, memory_order_relaxed);
+  }
+  if (expect_packet(a, JEUX_ENDED_PKT) == -1 || expect_packet(b, JEUX_ENDED_PKT) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+static void *game_thread(void *arg) {
+  GAME_THREAD *t = arg;
+  BENCH_CLIENT a, b;
+  char aname[48], bname[48];
+  snprintf(aname, sizeof(aname), "scale-a%d-%d-%d", t->games, t->index, getpid());
+  snprintf(bname, sizeof(bname), "scale-b%d-%d-%d", t->games, t->index, getpid());
+  if (login_quickack(&a, aname) == -1 || login_quickack(&b, bname) == -1) {
+    atomic_fetch_add(&failures, 1);
+    return NULL;
+  }
+  while (atomic_load_explicit(&running, memory_order_relaxed)) {
+    if (play_game(&a, &b, bname) == -1) {
+      atomic_fetch_add(&failures, 1);
+      break;
+    }
+  }
+  close(a.fd);
+  close(b.fd);
+  return NULL;
+}
+
+/*
+ * Play some number of games at once for a while.
+ *
+ * @return the moves made per second.
+ */
+static double run_games(int ngames, double duration) {
+  GAME_THREAD *threads = calloc(ngames, sizeof(GAME_THREAD));
+  if (threads == NULL) {
+    return -1;
+  }
+  atomic_store(&running, 1);
+  atomic_store(&moves_made, 0);
+  double start = now();
+  for (int i = 0; i < ngames; i++) {
+    threads[i].games = ngames;
+    threads[i].index = i;
+    pthread_create(&threads[i].tid, NULL, game_thread, &threads[i]);
+  }
+  struct timespec ts = {.tv_sec = (time_t)duration,
+                        .tv_nsec = (long)((duration - (time_t)duration) * 1e9)};
+  nanosleep(&ts, NULL);
+  atomic_store(&running, 0);
+  long n = atomic_load(&moves_made);
+  double elapsed = now() - start;
+  for (int i = 0; i < ngames; i++) {
+    pthread_join(threads[i].tid, NULL);
+  }
+  free(threads);
+  return n / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  int max_games = sysconf(_SC_NPROCESSORS_ONLN);
+  double duration = 3;
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:g:d:")) != -1) {
+    switch (opt) {
+      case 'h':
+        target.host = optarg;
+        break;
+      case 'p':
+        target.port = atoi(optarg);
+        break;
+      case 'g':
+        max_games = atoi(optarg);
+        break;
+      case 'd':
+        duration = atof(optarg);
+        break;
+      default:
+        target.port = 0;
+        break;
+    }
+  }
+  if (target.port <= 0 || max_games <= 0 || duration <= 0) {
+    fprintf(stderr, "Usage: %s -p <port> [-h <host>] [-g <max games>] [-d <seconds>]\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  double base = 0;
+  printf("%-8s %12s %8s\n", "games", "moves/s", "vs 1");
+  for (int ngames = 1; ngames <= max_games; ngames *= 2) {
+    double rate = run_games(ngames, duration);
+    if (rate < 0 || atomic_load(&failures) > 0) {
+      fprintf(stderr, "%d games at once failed\n", ngames);
+      exit(EXIT_FAILURE);
+    }
+    if (ngames == 1) {
+      base = rate;
+    }
+    printf("%-8d %12.0f %7.1fx\n", ngames, rate, rate / base);
+    // the players log out between runs
+    sleep(1);
+  }
+  return 0;
+}
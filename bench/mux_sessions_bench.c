@@ -0,0 +1,196 @@
+/*
+ * Cost of many logged-in players to the Jeux server, with one connection
+ * per player and with every player as a session of one multiplexed
+ * connection.
+ *
+ * First, one connection per player is opened and logged in; then, after
+ * those have been closed, a single connection logs in with the
+ * multiplexed framing and opens a session per player.  Once everyone is
+ * logged in, the server's threads, open descriptors and resident memory
+ * are read from /proc, and reported as the growth over an idle server.
+ *
+ * Usage: mux_sessions_bench -p <port> -P <server pid> [-h <host>] [-n <players>]
+ */
+#include <dirent.h>
+
+#include "bench.h"
+
+static int server_pid = 0;
+
+typedef struct usage {
+  long threads;
+  long fds;
+  long rss_kb;
+} USAGE;
+
+/*
+ * Read the server's threads, open descriptors and resident memory.
+ */
+static int read_usage(USAGE *u) {
+  char path[64], line[256];
+  snprintf(path, sizeof(path), "/proc/%d/status", server_pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  memset(u, 0, sizeof(*u));
+  while (fgets(line, sizeof(line), f) != NULL) {
+    sscanf(line, "Threads: %ld", &u->threads);
+    sscanf(line, "VmRSS: %ld", &u->rss_kb);
+  }
+  fclose(f);
+  snprintf(path, sizeof(path), "/proc/%d/fd", server_pid);
+  DIR *d = opendir(path);
+  if (d == NULL) {
+    perror(path);
+    return -1;
+  }
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    u->fds += e->d_name[0] != '.';
+  }
+  closedir(d);
+  return 0;
+}
+
+/*
+ * Read a varint of a multiplexed header.
+ */
+static int get_varint(int fd, unsigned int *v) {
+  unsigned char b;
+  int shift = 0;
+  *v = 0;
+  do {
+    if (read_fully(fd, &b, 1) == -1) {
+      return -1;
+    }
+    *v |= (unsigned int)(b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  return 0;
+}
+
+/*
+ * Log players in with one connection each.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int separate_connections(int *fds, int n) {
+  for (int i = 0; i < n; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "conn%d-%d", i, getpid());
+    BENCH_CLIENT c;
+    if (login(&c, name, 0) == -1) {
+      fprintf(stderr, "login %d failed\n", i);
+      return -1;
+    }
+    fds[i] = c.fd;
+  }
+  return 0;
+}
+
+/*
+ * Log players in as the sessions of one multiplexed connection.  The
+ * LOGINs of all the sessions are written at once, and then every ACK is
+ * waited for.
+ *
+ * @return the connection, or -1 on failure.
+ */
+static int multiplexed_connection(int n) {
+  char name[32];
+  snprintf(name, sizeof(name), "mux-%d", getpid());
+  BENCH_CLIENT c;
+  if (login(&c, name, CAP_COMPACT | CAP_MUX) == -1 || c.caps != (CAP_COMPACT | CAP_MUX)) {
+    fprintf(stderr, "multiplexed login failed\n");
+    return -1;
+  }
+  int fd = c.fd;
+  unsigned char *buf = malloc((size_t)n * 48);
+  if (buf == NULL) {
+    return -1;
+  }
+  size_t len = 0;
+  for (int i = 1; i < n; i++) {
+    int namelen = snprintf(name, sizeof(name), "mux%d-%d", i, getpid());
+    buf[len++] = JEUX_LOGIN_PKT;
+    buf[len++] = 0;
+    len += put_varint(buf + len, i);
+    len += put_varint(buf + len, namelen);
+    memcpy(buf + len, name, namelen);
+    len += namelen;
+  }
+  int ret = write_fully(fd, buf, len);
+  free(buf);
+  for (int i = 1; ret == 0 && i < n; i++) {
+    unsigned char fixed[2];
+    unsigned int session, size;
+    if (read_fully(fd, fixed, 2) == -1 || get_varint(fd, &session) == -1 ||
+        get_varint(fd, &size) == -1 || (fixed[0] & 0x1f) != JEUX_ACK_PKT || size != 0) {
+      fprintf(stderr, "session login failed\n");
+      ret = -1;
+    }
+  }
+  if (ret == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void report(const char *mode, int conns, const USAGE *idle, const USAGE *u) {
+  printf("%-12s %8d %8ld %8ld %10ld\n", mode, conns, u->threads - idle->threads,
+         u->fds - idle->fds, u->rss_kb - idle->rss_kb);
+}
+
+int main(int argc, char *argv[]) {
+  int nplayers = 1000;
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:P:n:")) != -1) {
+    switch (opt) {
+      case 'h':
+        target.host = optarg;
+        break;
+      case 'p':
+        target.port = atoi(optarg);
+        break;
+      case 'P':
+        server_pid = atoi(optarg);
+        break;
+      case 'n':
+        nplayers = atoi(optarg);
+        break;
+      default:
+        target.port = 0;
+        break;
+    }
+  }
+  if (target.port <= 0 || server_pid <= 0 || nplayers <= 1 || nplayers >= 4096) {
+    fprintf(stderr, "Usage: %s -p <port> -P <server pid> [-h <host>] [-n <players, below 4096>]\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  USAGE idle, u;
+  int *fds = calloc(nplayers, sizeof(int));
+  if (fds == NULL || read_usage(&idle) == -1) {
+    exit(EXIT_FAILURE);
+  }
+  printf("%-12s %8s %8s %8s %10s\n", "mode", "conns", "+threads", "+fds", "+rss (kB)");
+  if (separate_connections(fds, nplayers) == -1 || read_usage(&u) == -1) {
+    exit(EXIT_FAILURE);
+  }
+  report("separate", nplayers, &idle, &u);
+  for (int i = 0; i < nplayers; i++) {
+    close(fds[i]);
+  }
+  // let the server log them all out before measuring again
+  sleep(1);
+  int fd = multiplexed_connection(nplayers);
+  if (fd < 0 || read_usage(&u) == -1) {
+    exit(EXIT_FAILURE);
+  }
+  report("multiplexed", 1, &idle, &u);
+  close(fd);
+  free(fds);
+  return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * Request throughput of one connection to the Jeux server, with requests
+ * sent one at a time and pipelined.
+ *
+ * A bot logs in with the correlated compact framing and keeps a window
+ * of requests in flight: it invites an opponent and, when the ACK for an
+ * invitation arrives, revokes it, each request under a correlation ID of
+ * its own.  An answer is matched to its request by that ID alone, and
+ * frees a place in the window for the next one.  The opponent only has
+ * its notifications drained.  Requests answered per second are reported
+ * for each window size, the first of which (1) is a client that waits
+ * for every answer.
+ *
+ * Usage: pipeline_bench -p <port> | -u <socket path> [-h <host>] [-n <requests>]
+ */
+#include "bench.h"
+
+// correlation IDs are varints of at most 16 bits, and 0 is never used
+#define MAX_CORRELATION 0xffff
+
+/*
+ * A connection in the correlated framing, with bytes read ahead.
+ */
+typedef struct bench_conn {
+  int fd;
+  char buf[65536];
+  size_t head;
+  size_t tail;
+} BENCH_CONN;
+
+typedef struct reply {
+  int type;
+  int id;
+  int correlation;
+} REPLY;
+
+/*
+ * Frame a request in the correlated compact framing.
+ *
+ * @return the number of bytes written to buf.
+ */
+static size_t frame_request(unsigned char *buf, int type, int id, int role, int correlation,
+                            const char *payload) {
+  size_t len = payload != NULL ? strlen(payload) : 0;
+  size_t i = 0;
+  buf[i++] = type | (role << 6);
+  buf[i++] = id;
+  i += put_varint(buf + i, correlation);
+  i += put_varint(buf + i, len);
+  memcpy(buf + i, payload, len);
+  return i + len;
+}
+
+/*
+ * Parse a packet out of the bytes read ahead, discarding its payload.
+ *
+ * @return 1 if one was parsed, 0 if more bytes are needed.
+ */
+static int parse_reply(BENCH_CONN *c, REPLY *r) {
+  const unsigned char *p = (const unsigned char *)c->buf + c->head;
+  size_t have = c->tail - c->head, i = 2;
+  unsigned int fields[2] = {0, 0};
+  if (have < 4) {
+    return 0;
+  }
+  for (int field = 0; field < 2; field++) {
+    int shift = 0;
+    do {
+      if (i == have) {
+        return 0;
+      }
+      fields[field] |= (unsigned int)(p[i] & 0x7f) << shift;
+      shift += 7;
+    } while (p[i++] & 0x80);
+  }
+  if (have < i + fields[1]) {
+    return 0;
+  }
+  r->type = p[0] & 0x1f;
+  r->id = p[1];
+  r->correlation = fields[0];
+  c->head += i + fields[1];
+  return 1;
+}
+
+/*
+ * Read whatever is available (blocking for it if block is set).
+ *
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int fill(BENCH_CONN *c, int block) {
+  if (c->head == c->tail) {
+    c->head = c->tail = 0;
+  } else if (c->head > sizeof(c->buf) / 2) {
+    memmove(c->buf, c->buf + c->head, c->tail - c->head);
+    c->tail -= c->head;
+    c->head = 0;
+  }
+  ssize_t n = recv(c->fd, c->buf + c->tail, sizeof(c->buf) - c->tail, block ? 0 : MSG_DONTWAIT);
+  if (n < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  if (n <= 0) {
+    return -1;
+  }
+  c->tail += n;
+  return 0;
+}
+
+/*
+ * Log in asking for the correlated framing.  The LOGIN and its ACK are
+ * in the standard framing.
+ */
+static int login_correlated(BENCH_CONN *c, const char *name) {
+  memset(c, 0, sizeof(*c));
+  BENCH_CLIENT client;
+  if (login(&client, name, CAP_COMPACT | CAP_CORRELATION) == -1) {
+    return -1;
+  }
+  c->fd = client.fd;
+  if (client.caps != (CAP_COMPACT | CAP_CORRELATION)) {
+    fprintf(stderr, "server did not accept the correlated framing\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Make and revoke ninvites invitations, with up to window requests in
+ * flight.  Whether a correlation ID is that of a revoke is remembered,
+ * since an ACK tells nothing else about the request it answers.
+ *
+ * @return the requests answered per second, or -1 on failure.
+ */
+static double run_window(BENCH_CONN *a, BENCH_CONN *b, const char *bname, int window,
+                         int ninvites) {
+  static int revoking[MAX_CORRELATION + 1];
+  unsigned char out[64 * 1024];
+  int next = 1, inflight = 0, invited = 0, answered = 0;
+  double start = now();
+  while (answered < 2 * ninvites) {
+    // top the window up with invitations, in one write
+    size_t len = 0;
+    while (inflight < window && invited < ninvites && len + 64 < sizeof(out)) {
+      revoking[next] = 0;
+      len += frame_request(out + len, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, next, bname);
+      next = next == MAX_CORRELATION ? 1 : next + 1;
+      inflight++;
+      invited++;
+    }
+    if (len > 0 && write(a->fd, out, len) != (ssize_t)len) {
+      return -1;
+    }
+    if (fill(a, 1) == -1) {
+      return -1;
+    }
+    // every answer frees its place; an invitation's is taken by its revoke
+    len = 0;
+    REPLY r;
+    while (parse_reply(a, &r)) {
+      if (r.type == JEUX_NACK_PKT) {
+        fprintf(stderr, "request %d was refused\n", r.correlation);
+        return -1;
+      }
+      if (r.type != JEUX_ACK_PKT) {
+        continue;
+      }
+      answered++;
+      if (revoking[r.correlation] == 0) {
+        revoking[next] = 1;
+        len += frame_request(out + len, JEUX_REVOKE_PKT, r.id, 0, next, NULL);
+        next = next == MAX_CORRELATION ? 1 : next + 1;
+      } else {
+        inflight--;
+      }
+    }
+    if (len > 0 && write(a->fd, out, len) != (ssize_t)len) {
+      return -1;
+    }
+    // keep the opponent's notifications from backing up
+    if (fill(b, 0) == -1) {
+      return -1;
+    }
+    b->head = b->tail;
+  }
+  return answered / (now() - start);
+}
+
+int main(int argc, char *argv[]) {
+  int nrequests = 100000;
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:u:n:")) != -1) {
+    switch (opt) {
+      case 'h':
+        target.host = optarg;
+        break;
+      case 'p':
+        target.port = atoi(optarg);
+        break;
+      case 'u':
+        target.path = optarg;
+        break;
+      case 'n':
+        nrequests = atoi(optarg);
+        break;
+      default:
+        nrequests = 0;
+        break;
+    }
+  }
+  if ((target.port <= 0 && target.path == NULL) || nrequests <= 0) {
+    fprintf(stderr, "Usage: %s -p <port> | -u <socket path> [-h <host>] [-n <requests>]\n",
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  static BENCH_CONN a, b;
+  char aname[32], bname[32];
+  snprintf(aname, sizeof(aname), "pipe-a-%d", getpid());
+  snprintf(bname, sizeof(bname), "pipe-b-%d", getpid());
+  if (login_correlated(&a, aname) == -1 || login_correlated(&b, bname) == -1) {
+    fprintf(stderr, "login failed\n");
+    exit(EXIT_FAILURE);
+  }
+  int windows[] = {1, 4, 16, 64, 256};
+  double base = 0;
+  printf("%-8s %12s %8s\n", "window", "requests/s", "vs 1");
+  for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+    // half the requests are invitations, and each is revoked
+    double rate = run_window(&a, &b, bname, windows[i], nrequests / 2);
+    if (rate < 0) {
+      fprintf(stderr, "window of %d failed\n", windows[i]);
+      exit(EXIT_FAILURE);
+    }
+    if (i == 0) {
+      base = rate;
+    }
+    printf("%-8d %12.0f %7.1fx\n", windows[i], rate, rate / base);
+  }
+  close(a.fd);
+  close(b.fd);
+  return 0;
+}
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Compare what many logged-in players cost the server with a connection
+# each and as sessions of one multiplexed connection.
+#
+# Usage: bench/session_scaling.sh [port] [players] [extra server options...]
+# Run `make bench` first.
+
+DEFAULT_SETTING=1000
+. "$(dirname "$0")/common.sh"
+PLAYERS=$SETTING
+
+start_server -p "$PORT" -C "$PLAYERS" "$@"
+bin/mux_sessions_bench -p "$PORT" -P "$SERVER_PID" -n "$PLAYERS"
+stop_server
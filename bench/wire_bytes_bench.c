@@ -0,0 +1,108 @@
+/*
+ * Bytes-on-wire comparison of the packet framings of the Jeux server.
+ *
+ * For each framing (the standard one, compact, and compact with
+ * timestamps), and for the compact one with MOVED deltas instead of
+ * full boards, two clients log in asking for it and play one full game
+ * against each other: an invitation, its acceptance, and the nine moves
+ * of a drawn game, until both have been told that the game has ended.
+ * Every byte the clients write and read is counted, and the totals are
+ * reported side by side.
+ *
+ * Usage: wire_bytes_bench -p <port> | -u <socket path> [-h <host>]
+ */
+#include "bench.h"
+
+// the nine moves of a game that ends in a draw
+static const char *moves[] = {"1", "2", "3", "5", "4", "6", "8", "7", "9"};
+#define NMOVES (sizeof(moves) / sizeof(moves[0]))
+
+/*
+ * Play one full game between two clients asking for some capabilities,
+ * adding up the bytes both of them wrote and read.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int play_game(int caps, size_t *sent, size_t *received) {
+  BENCH_CLIENT a, b;
+  char aname[32], bname[32];
+  snprintf(aname, sizeof(aname), "wire-a%d-%d", caps, getpid());
+  snprintf(bname, sizeof(bname), "wire-b%d-%d", caps, getpid());
+  if (login(&a, aname, caps) == -1 || login(&b, bname, caps) == -1) {
+    fprintf(stderr, "login failed\n");
+    return -1;
+  }
+  if (a.caps != caps) {
+    fprintf(stderr, "server accepted capabilities %#x, not %#x\n", a.caps, caps);
+    return -1;
+  }
+  int aid, bid;
+  if (start_game(&a, &b, bname, &aid, &bid) == -1) {
+    return -1;
+  }
+  for (size_t i = 0; i < NMOVES; i++) {
+    BENCH_CLIENT *mover = i % 2 == 0 ? &a : &b;
+    BENCH_CLIENT *other = i % 2 == 0 ? &b : &a;
+    if (send_packet(mover, JEUX_MOVE_PKT, i % 2 == 0 ? aid : bid, 0, moves[i]) == -1 ||
+        expect_packet(mover, JEUX_ACK_PKT) == -1 || expect_packet(other, JEUX_MOVED_PKT) == -1) {
+      return -1;
+    }
+  }
+  if (expect_packet(&a, JEUX_ENDED_PKT) == -1 || expect_packet(&b, JEUX_ENDED_PKT) == -1) {
+    return -1;
+  }
+  *sent = a.sent + b.sent;
+  *received = a.received + b.received;
+  close(a.fd);
+  close(b.fd);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:u:")) != -1) {
+    switch (opt) {
+      case 'h':
+        target.host = optarg;
+        break;
+      case 'p':
+        target.port = atoi(optarg);
+        break;
+      case 'u':
+        target.path = optarg;
+        break;
+      default:
+        target.port = 0;
+        target.path = NULL;
+        break;
+    }
+  }
+  if (target.port <= 0 && target.path == NULL) {
+    fprintf(stderr, "Usage: %s -p <port> | -u <socket path> [-h <host>]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  struct {
+    const char *name;
+    int caps;
+  } framings[] = {
+    {"v1", 0},
+    {"v2", CAP_COMPACT},
+    {"v2+timestamps", CAP_COMPACT | CAP_TIMESTAMPS},
+    {"v2+deltas", CAP_COMPACT | CAP_DELTA},
+  };
+  size_t v1_total = 0;
+  printf("%-14s %8s %8s %8s %8s\n", "framing", "sent", "received", "total", "vs v1");
+  for (size_t i = 0; i < sizeof(framings) / sizeof(framings[0]); i++) {
+    size_t sent, received;
+    if (play_game(framings[i].caps, &sent, &received) == -1) {
+      fprintf(stderr, "game with %s framing failed\n", framings[i].name);
+      exit(EXIT_FAILURE);
+    }
+    if (i == 0) {
+      v1_total = sent + received;
+    }
+    printf("%-14s %8zu %8zu %8zu %7.1f%%\n", framings[i].name, sent, received, sent + received,
+           100.0 * (sent + received) / v1_total);
+  }
+  return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+/*
+ * Sharded accepting.  Instead of one listening socket drained by the
+ * main thread, each acceptor thread opens its own SO_REUSEPORT listener
+ * on the server port and accepts on it.  The kernel spreads incoming
+ * connections across the listeners, so a burst of reconnects is accepted
+ * by several threads in parallel.  Accepted connections are passed to
+ * the same handler the main thread would use.
+ *
+ * Clients on the same host may also connect through a Unix domain
+ * socket, which has an acceptor thread of its own.
+ */
+
+/*
+ * Function called by an acceptor thread for every accepted connection.
+ */
+typedef void (ACCEPT_HANDLER)(int connfd);
+
+/*
+ * Open the listeners and start the acceptor threads.  The calling thread
+ * should block the shutdown signals before calling this, so that they
+ * are delivered to it rather than to an acceptor.
+ *
+ * @param port  The port on which to listen.
+ * @param nacceptors  The number of listeners and acceptor threads.
+ * @param pin  If nonzero, acceptor i is pinned to CPU i (modulo the number
+ * of online CPUs).
+ * @param handler  Called with each accepted connection.
+ * @return 0 if every acceptor was started, otherwise -1.
+ */
+int acc_start(int port, int nacceptors, int pin, ACCEPT_HANDLER *handler);
+
+/*
+ * Listen on a Unix domain stream socket, alongside or instead of the
+ * TCP listeners, and start a thread accepting on it.  Clients on the
+ * same host then skip the TCP/IP stack.  The calling thread should
+ * block the shutdown signals, as for acc_start().
+ *
+ * @param path  The path of the socket.  A socket already there is
+ * removed; anything else there is an error.
+ * @param handler  Called with each accepted connection.
+ * @return 0 if the acceptor was started, otherwise -1.
+ */
+int acc_start_local(const char *path, ACCEPT_HANDLER *handler);
+
+/*
+ * Stop accepting: shut down every listener, wait for the acceptor
+ * threads to finish and close the listeners.
+ */
+void acc_fini(void);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+/*
+ * Admission control.  Every accepted connection is submitted to the
+ * admission controller before anything else is done with it.  While
+ * fewer clients than the capacity are admitted, a connection is admitted
+ * at once and handed on to be serviced.  Once the server is full, a
+ * connection may wait in a short queue for a slot to be released, but
+ * only until its deadline; a connection that cannot wait, or whose
+ * deadline passes, is sent a NACK and closed.  No thread ever blocks
+ * waiting for admission, so an overloaded server sheds load instead of
+ * accumulating parked threads and descriptors.
+ *
+ * An admitted connection holds its slot until its client is
+ * unregistered, or until it is refused before it has been registered.
+ */
+
+/*
+ * Function to which admitted connections are handed.  It is called
+ * without any admission lock held, by the thread that submitted the
+ * connection or, for a connection that had to wait, by the thread that
+ * released the slot it was admitted to.
+ */
+typedef void (ADMIT_HANDLER)(int connfd);
+
+/*
+ * Start admission control.  Until this is called, every connection is
+ * admitted and releases are ignored.
+ *
+ * @param capacity  The number of connections that may be admitted at once.
+ * @param nwaiting  The number of connections that may wait for a slot.
+ * @param wait_ms  How long a connection may wait, in milliseconds.  The
+ * wait is measured by the timer wheel, which must be running.
+ * @param handler  The function to which admitted connections are handed.
+ * @return 0 if admission control was started, otherwise -1.
+ */
+int adm_init(int capacity, int nwaiting, int wait_ms, ADMIT_HANDLER *handler);
+
+/*
+ * Submit an accepted connection for admission.  It is either admitted
+ * and handed to the handler, queued, or rejected, without blocking.
+ *
+ * @param connfd  The file descriptor of the accepted connection.
+ * @return 0 if the connection was admitted or queued, -1 if it was
+ * rejected (and closed).
+ */
+int adm_submit(int connfd);
+
+/*
+ * Count a connection as admitted without asking, whatever the capacity,
+ * for a session that was already admitted by another server process.
+ */
+void adm_admit(void);
+
+/*
+ * Release the slot of an admitted connection.  If a connection is
+ * waiting, it is admitted to the slot and handed to the handler on the
+ * calling thread, so the caller must not hold locks the handler takes.
+ */
+void adm_release(void);
+
+/*
+ * Reject every waiting connection, and every connection submitted from
+ * now on, when the server is shutting down.
+ */
+void adm_shutdown(void);
+
+/*
+ * Send a NACK on a connection that is being refused, and close it.
+ *
+ * @param connfd  The file descriptor of the connection.
+ */
+void adm_refuse(int connfd);
+
+#endif
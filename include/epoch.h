@@ -0,0 +1,50 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation, for structures that are read without locks.
+ * A reader brackets its use of such a structure with epoch_enter() and
+ * epoch_exit(), which never block.  A writer, which still excludes other
+ * writers by whatever lock it likes, unlinks an object so that no new
+ * reader can reach it and hands it to epoch_retire() instead of freeing
+ * it.  The object is reclaimed once every reader that was inside a
+ * section when it was retired has left, which is known when the global
+ * epoch has moved on twice.
+ */
+
+/*
+ * Function that frees a retired object.  It is called without any lock
+ * held, by a thread that retires an object or waits in
+ * epoch_synchronize(), and must not itself retire anything.
+ */
+typedef void (EPOCH_RECLAIM)(void *object);
+
+/*
+ * Enter a read-side section.  Nothing retired after this is reclaimed
+ * until the calling thread leaves it.  Sections may be nested, and must
+ * be short: they hold up reclamation for everyone.
+ */
+void epoch_enter(void);
+
+/*
+ * Leave a read-side section entered with epoch_enter().
+ */
+void epoch_exit(void);
+
+/*
+ * Retire an object that no reader can reach any more, to be reclaimed
+ * once the readers that might still be looking at it are done.  Must not
+ * be called inside a read-side section.
+ *
+ * @param object  The object.
+ * @param reclaim  The function that frees it.
+ */
+void epoch_retire(void *object, EPOCH_RECLAIM *reclaim);
+
+/*
+ * Wait until everything retired so far has been reclaimed.  Must not be
+ * called inside a read-side section.
+ */
+void epoch_synchronize(void);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stddef.h>
+
+#include "client.h"
+
+/*
+ * The event loop is an alternative to running one service thread per
+ * connection.  A small, fixed number of loop threads each own an epoll
+ * instance and multiplex all of the client sockets assigned to them.
+ * Sockets are put in non-blocking mode and packets are parsed
+ * incrementally as bytes arrive, so that a slow or idle client never
+ * ties up a thread.  Complete packets are handed to the same dispatch
+ * function used by jeux_client_service(), so the protocol behavior is
+ * the same in both modes.
+ */
+
+/*
+ * A connection as it is handed from one server process to the next.
+ */
+typedef struct evl_session {
+  int fd;
+  CLIENT *client;
+  // the login state kept by the loop
+  int logged_in;
+  // the start of a packet that has only partly been read, or NULL
+  char *input;
+  size_t input_len;
+} EVL_SESSION;
+
+/*
+ * Start the event loop threads.
+ *
+ * @param nthreads  The number of loop threads to start.  If zero, one
+ * thread per online CPU is started.
+ * @return 0 if the loops were started, otherwise -1.
+ */
+int evl_start(int nthreads);
+
+/*
+ * Hand a newly accepted connection to one of the loop threads.
+ * The connection is registered with the client registry and from then
+ * on is serviced entirely by the loop thread it was assigned to.
+ * If registration fails, the connection is closed.
+ *
+ * @param connfd  The file descriptor of the accepted connection.
+ * @return 0 if the connection was taken over by a loop, otherwise -1.
+ */
+int evl_add_connection(int connfd);
+
+/*
+ * Stop the loop threads without touching their connections, so that no
+ * packet is dispatched until evl_resume() is called.  Each loop finishes
+ * the packets it has read before it stops, so a connection is left
+ * holding at most the start of a packet.
+ */
+void evl_pause(void);
+
+/*
+ * Restart the loop threads after evl_pause().
+ *
+ * @return 0 if the loops were restarted, otherwise -1.
+ */
+int evl_resume(void);
+
+/*
+ * Describe every connection, while the loops are paused, so that they
+ * can be handed to another process.
+ *
+ * @param sessionsp  Set to a malloc'ed array of sessions, whose inputs
+ * are malloc'ed too.
+ * @return the number of sessions, or -1 if memory ran out.
+ */
+int evl_sessions(EVL_SESSION **sessionsp);
+
+/*
+ * Take over a connection handed over by another process, whose client
+ * has already been registered (and restored) in this one.  It is
+ * serviced as if it had been accepted here.
+ *
+ * @param s  The session, as described by evl_sessions() in the other
+ * process, with the file descriptor it was received on here.
+ * @return 0 if the connection was taken over by a loop, otherwise -1.
+ */
+int evl_add_session(EVL_SESSION *s);
+
+/*
+ * Stop the loop threads and free their resources.  This should only
+ * be called once every client has been unregistered.
+ */
+void evl_fini(void);
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef GAME_CLOCK_H
+#define GAME_CLOCK_H
+
+#include <stdio.h>
+
+#include "game.h"
+#include "invitation.h"
+#include "timer_wheel.h"
+
+/*
+ * Chess clocks for timed games.  Each player of a timed game has a store
+ * of time that runs down while it is their move, and is topped up by the
+ * increment each time they move.  A player whose time runs out has lost
+ * on time ("their flag has fallen").
+ *
+ * Only the clock of the player to move is running, so a clock needs a
+ * single alarm, set for when that player's flag falls, and moved each
+ * time a move is made.  The alarms of all games are timers in the shared
+ * timer wheel, embedded in the clocks, so the cost of a clock is a few
+ * words and an O(1) timer operation per move however many games are in
+ * progress.  Elapsed time is measured with the monotonic clock; the
+ * wheel's coarser ticks only decide when to look.
+ *
+ * A clock belongs to its INVITATION.  Whenever its alarm is set, it holds
+ * a reference to the invitation, which the alarm callback inherits and
+ * must drop.  A clock is only used with the invitation operations lock
+ * of the client module held, so it has no lock of its own.
+ */
+
+/* A time control: the time each player starts with, and the time added
+ * after each of their moves. */
+typedef struct time_control {
+  long base_ms;
+  long increment_ms;
+} TIME_CONTROL;
+
+typedef struct game_clock {
+  // the alarm; the flag-fall callback is passed this, so it comes first
+  TW_TIMER alarm;
+  INVITATION *inv;
+  TIME_CONTROL tc;
+  // time left for FIRST_PLAYER_ROLE and SECOND_PLAYER_ROLE
+  long remaining_ms[2];
+  // the player whose clock is running, or NULL_ROLE if stopped
+  GAME_ROLE to_move;
+  // when the running clock was started
+  long started_ms;
+} GAME_CLOCK;
+
+/*
+ * Look up the time control selected by the ID field of an INVITE packet.
+ *
+ * @param preset  The preset number.  0 means an untimed game.
+ * @param tc  Set to the time control, if the game is timed.
+ * @return 1 if the preset is a time control, 0 if it means an untimed
+ * game, or -1 if there is no such preset.
+ */
+int clock_preset(int preset, TIME_CONTROL *tc);
+
+/*
+ * Create a stopped clock for a game.
+ *
+ * @param inv  The invitation for the game.  The clock does not hold a
+ * reference to it until it is started.
+ * @param tc  The time control.
+ * @param flag_fall  The function called (on the timer thread) when the
+ * alarm goes off.  It should confirm with clock_flag_fallen() that the
+ * flag really has fallen, since a move may have been made in the
+ * meantime, and call clock_rearm() if not.
+ * @return the new clock, or NULL if memory ran out.
+ */
+GAME_CLOCK *clock_create(INVITATION *inv, const TIME_CONTROL *tc, TW_CALLBACK *flag_fall);
+
+/*
+ * Free a clock.  Its alarm must not be set, which is the case once its
+ * invitation's last reference has gone.
+ */
+void clock_free(GAME_CLOCK *clock);
+
+/*
+ * Start the first player's clock, when the game starts.
+ */
+void clock_start(GAME_CLOCK *clock);
+
+/*
+ * End the turn of the player to move: charge them the time they took,
+ * add the increment, and start their opponent's clock.  The caller
+ * should first have checked with clock_flag_fallen() that the player
+ * still had time.
+ */
+void clock_press(GAME_CLOCK *clock);
+
+/*
+ * Check whether the flag of the player to move has fallen.
+ *
+ * @return the role of that player if it has, otherwise NULL_ROLE.
+ */
+GAME_ROLE clock_flag_fallen(GAME_CLOCK *clock);
+
+/*
+ * Set the alarm again for when the running clock runs out, after it has
+ * gone off early.
+ */
+void clock_rearm(GAME_CLOCK *clock);
+
+/*
+ * Stop the clock when the game ends, cancelling its alarm.  This may
+ * drop the reference the alarm held to the invitation, so the caller
+ * must hold a reference of its own.
+ */
+void clock_stop(GAME_CLOCK *clock);
+
+/*
+ * Write the state of a clock, as it stands, for clock_restore() to read
+ * back in another process.
+ */
+void clock_save(GAME_CLOCK *clock, FILE *out);
+
+/*
+ * Read the state of a clock written by clock_save(), and set it running
+ * again if it was running.  The time the player to move had used is
+ * carried over, but the time spent between saving and restoring is not
+ * charged to anyone.
+ *
+ * @param inv  The invitation for the game, which must have been accepted
+ * if the clock was running.
+ * @param flag_fall  As for clock_create().
+ * @return the clock, or NULL if it could not be read or created.
+ */
+GAME_CLOCK *clock_restore(INVITATION *inv, TW_CALLBACK *flag_fall, FILE *in);
+
+#endif
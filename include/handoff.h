@@ -0,0 +1,63 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <pthread.h>
+
+/*
+ * Hot restart.  A server started with a handoff path listens on a Unix
+ * socket at that path for the server that is to replace it.  A new
+ * server started with the same path connects to it and takes over: the
+ * old server stops servicing its connections between packets, passes its
+ * listening socket and every client connection across the Unix socket
+ * (as SCM_RIGHTS), along with a snapshot of the players, clients,
+ * invitations, games and clocks, and exits once the new server has
+ * rebuilt them.  Clients keep their connections, logins and games, and
+ * see nothing but a pause in the replies.  If the new server fails
+ * before it has the sessions, the old one carries on.
+ *
+ * Only the epoll mode can hand over, since it is the only one in which
+ * every connection is owned by a loop that can be stopped between
+ * packets.  Connections still waiting for admission are turned away.
+ */
+
+/*
+ * Take over from a server listening for its successor at a path, if
+ * there is one.  The event loops, outbound queue writers, timer wheel
+ * and admission control must have been started.
+ *
+ * @param path  The handoff path.
+ * @param listenfdp  Set to the listening socket that was handed over,
+ * or to -1 if no server was listening at the path.
+ * @return 0 if the sessions were taken over (or there was no server to
+ * take them from), -1 if taking over failed, in which case the old
+ * server keeps them and this one should exit.
+ */
+int ho_take_over(const char *path, int *listenfdp);
+
+/*
+ * Listen for a successor at a path.  When one connects, the signal is
+ * sent to the thread, which should then call ho_hand_over().  It keeps
+ * being sent until it has been acted on.
+ *
+ * @param path  The handoff path.  A socket already there is removed;
+ * anything else there is an error.
+ * @param thread  The thread that is to hand over.
+ * @param signum  The signal that tells it to.
+ * @return 0 if the server is listening, otherwise -1.
+ */
+int ho_listen(const char *path, pthread_t thread, int signum);
+
+/*
+ * Hand every session to the successor that has connected, pausing all
+ * servicing of connections while it is done.  Once the connections have
+ * been sent, this waits for as long as the successor takes to reply or
+ * to go away.
+ *
+ * @param listenfd  The listening socket, which is handed over too.
+ * @return 0 if the successor has the sessions, in which case the caller
+ * should exit without touching them, or -1 if handing over failed and
+ * servicing has resumed.
+ */
+int ho_hand_over(int listenfd);
+
+#endif
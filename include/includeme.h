@@ -18,7 +18,54 @@
 #include "debug.h"
 #include "jeux_globals.h"
 #include "protocol.h"
+#include "protocol_ext.h"
+#include "outq.h"
+#include "timer_wheel.h"
+#include "game_clock.h"
 #include "server.h"
 #include "csapp.h"
-extern JEUX_PACKET_HEADER *create_header(int type, int id, int role, int size);
+extern void init_header(JEUX_PACKET_HEADER *hdr, int type, int id, int role, int size);
+extern int unlink_stale_socket(const char *path);
+extern void jeux_serve_connection(int connfd);
+extern int client_send_packets(CLIENT *client, PROTO_PACKET *pkts, int npkts);
+extern int client_send_switch(CLIENT *client, PROTO_PACKET *pkts, int npkts, const PROTO_CODEC *codec);
+extern const PROTO_CODEC *client_get_codec(CLIENT *client);
+extern void client_close_output(CLIENT *client);
+extern void client_cork(void);
+extern void client_uncork(void);
+extern void client_set_idle_timeout(long ms);
+extern void client_touch(CLIENT *client);
+extern void client_disarm_idle(CLIENT *client);
+extern int client_make_timed_invitation(CLIENT *source, CLIENT *target, GAME_ROLE source_role, GAME_ROLE target_role, const TIME_CONTROL *tc);
+extern void inv_set_clock(INVITATION *inv, GAME_CLOCK *clock);
+extern GAME_CLOCK *inv_get_clock(INVITATION *inv);
+extern void inv_lock(INVITATION *inv);
+extern void inv_unlock(INVITATION *inv);
+extern INVITATION *client_get_invitation(CLIENT *client, int id);
+extern char *client_save_output(CLIENT *client, size_t *lenp);
+extern int client_restore_output(CLIENT *client, const char *bytes, size_t len);
+extern void client_save_games(CLIENT **clients, int nclients, FILE *out);
+extern int client_restore_games(CLIENT **clients, int nclients, FILE *in);
+extern void game_save(GAME *game, FILE *out);
+extern int game_restore(GAME *game, FILE *in);
+extern char *game_unparse_state_version(GAME *game, int *versionp);
+extern int game_get_version(GAME *game);
+extern void client_set_caps(CLIENT *client, int caps);
+extern int client_get_caps(CLIENT *client);
+extern char *client_get_game_state(CLIENT *client, int id);
+extern void player_set_rating(PLAYER *player, int rating);
+extern PLAYER **preg_all_players(PLAYER_REGISTRY *preg);
+// the most sessions one multiplexed connection may carry, numbered from 1
+#define CLIENT_MAX_SESSIONS 4096
+extern CLIENT *client_create_session(CLIENT_REGISTRY *creg, CLIENT *conn, int session);
+extern int client_session_id(CLIENT *client);
+extern CLIENT *client_get_session(CLIENT *conn, int session);
+extern CLIENT *client_remove_session(CLIENT *conn, int session);
+extern int client_list_sessions(CLIENT *conn, CLIENT ***sessionsp);
+extern int client_send_session_nack(CLIENT *conn, int session, int correlation);
+extern void client_set_correlation(CLIENT *client, int correlation);
+extern CLIENT *creg_register_session(CLIENT_REGISTRY *cr, CLIENT *conn, int session);
+extern int creg_add_name(CLIENT_REGISTRY *cr, CLIENT *client, char *name);
+extern void creg_remove_name(CLIENT_REGISTRY *cr, CLIENT *client, char *name);
+extern int jeux_dispatch_packet(CLIENT *client, int connfd, JEUX_PACKET_HEADER *hdr, char *payload, int *logged_in);
 #endif
\ No newline at end of file
@@ -2,9 +2,46 @@
 
 #define OPTION_PROCESSING_H
 
+#include "outq.h"
+
 #define PORT_OPTION 0x1
+#define MODE_OPTION 0x2
+#define THREADS_OPTION 0x4
+#define WORKERS_OPTION 0x8
+#define QUEUE_OPTION 0x10
+#define ACCEPTORS_OPTION 0x20
+#define PIN_OPTION 0x40
+#define POLICY_OPTION 0x80
+#define HIGH_MARK_OPTION 0x100
+#define LOW_MARK_OPTION 0x200
+#define IDLE_OPTION 0x400
+#define KEEPALIVE_OPTION 0x800
+#define CAPACITY_OPTION 0x1000
+#define ADMIT_QUEUE_OPTION 0x2000
+#define HANDOFF_OPTION 0x4000
+#define LOCAL_OPTION 0x8000
+
+/* How connections are serviced once they have been accepted. */
+#define SERVER_MODE_THREAD 0  // a pool of service workers, one connection each
+#define SERVER_MODE_EPOLL 1   // a fixed set of epoll event-loop threads
+#define SERVER_MODE_URING 2   // event-loop threads doing I/O through io_uring
+
 extern int options;
 extern int PORT;
+extern int SERVER_MODE;
+extern int LOOP_THREADS;
+extern int POOL_WORKERS;
+extern int POOL_QUEUE;
+extern int ACCEPT_THREADS;
+extern int PIN_ACCEPTORS;
+extern OUTQ_LIMITS OUTQ_MARKS;
+extern int IDLE_TIMEOUT;
+extern int KEEPALIVE;
+extern int CLIENT_CAPACITY;
+extern int ADMIT_WAITING;
+extern int ADMIT_WAIT_MS;
+extern char *HANDOFF_PATH;
+extern char *LOCAL_PATH;
 extern int option_processor(int argc, char* argv[]);
 
-#endif 
\ No newline at end of file
+#endif 
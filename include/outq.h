@@ -0,0 +1,180 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include "protocol_ext.h"
+
+/*
+ * Outbound queues decouple the threads that produce packets for a
+ * client from the client's socket.  Sending through a client's OUTQ
+ * never blocks: if nothing is queued ahead, the producer makes one
+ * non-blocking attempt to send its packets, and whatever does not fit in
+ * the socket is serialized into an OUTQ_BUF and left for the writer
+ * threads, which drain queues as their sockets become writable.
+ * Buffers are reference counted, so the same bytes can be queued to
+ * several clients without copying them.
+ *
+ * Packets are delivered in the order in which they were queued.
+ *
+ * A queue that grows past its high water mark (in bytes or in packets)
+ * belongs to a client that is not keeping up, and is dealt with by the
+ * configured policy until it drains below its low water mark.  Under the
+ * coalesce and pause policies a queue that grows to twice its high mark
+ * anyway is dropped.
+ */
+
+/* What to do with a client whose queue passes its high water mark. */
+#define OUTQ_POLICY_DROP 0      // drop the connection
+#define OUTQ_POLICY_COALESCE 1  // replace queued MOVED packets by the latest
+#define OUTQ_POLICY_PAUSE 2     // stop queueing notifications
+
+typedef struct outq_limits {
+  size_t high_bytes;
+  size_t high_pkts;
+  size_t low_bytes;
+  size_t low_pkts;
+  int policy;
+} OUTQ_LIMITS;
+
+/*
+ * Serialized packets (header and payload, back to back), ready to be
+ * written to a socket.
+ */
+typedef struct outq_buf OUTQ_BUF;
+
+/*
+ * The outbound queue of one connection.
+ */
+typedef struct outq OUTQ;
+
+/*
+ * Start the writer threads.
+ *
+ * @param nwriters  The number of writer threads.
+ * @param limits  The water marks and slow-consumer policy of every queue.
+ * @return 0 if the writers were started, otherwise -1.
+ */
+int outq_start(int nwriters, const OUTQ_LIMITS *limits);
+
+/*
+ * Stop the writer threads.  This should only be called once every
+ * queue has been closed.
+ */
+void outq_fini(void);
+
+/*
+ * Stop the writer threads without touching the queues, so that nothing
+ * more is sent until outq_resume() is called.  Queues waiting for their
+ * sockets stay registered and are picked up again on resuming.
+ */
+void outq_pause(void);
+
+/*
+ * Restart the writer threads after outq_pause().
+ *
+ * @return 0 if the writers were restarted, otherwise -1.
+ */
+int outq_resume(void);
+
+/*
+ * Create the outbound queue of a connection.
+ *
+ * @param fd  The socket of the connection.  The queue keeps its own
+ * duplicate of the descriptor, so a descriptor number reused after the
+ * connection is closed can never receive its packets.
+ * @return the new queue, with one reference for the caller, or NULL if
+ * the writer threads have not been started (in which case packets should
+ * be sent directly) or on error.
+ */
+OUTQ *outq_create(int fd);
+
+/*
+ * Tell whether the writer threads have been started, in which case every
+ * connection must have a queue: the sockets of connections serviced by
+ * the event loops are non-blocking, and are never to be written to
+ * directly.
+ */
+int outq_started(void);
+
+/*
+ * Close a queue when its connection is finished.  Anything still queued
+ * is discarded, the duplicate descriptor is closed and later pushes fail.
+ * The queue itself stays valid until its last reference is released.
+ */
+void outq_close(OUTQ *q);
+
+/*
+ * Release a reference to a queue, freeing it when none remain.
+ */
+void outq_unref(OUTQ *q);
+
+/*
+ * Serialize packets into a buffer with a reference count of one.
+ *
+ * @param codec  The framing of the headers.
+ * @param pkts  The packets, with header fields in network byte order.
+ * @param npkts  The number of packets.
+ * @return the buffer, or NULL if memory could not be allocated.
+ */
+OUTQ_BUF *outq_buf_create(const PROTO_CODEC *codec, PROTO_PACKET *pkts, int npkts);
+
+/*
+ * Increase or decrease the reference count of a buffer.  The buffer is
+ * freed when its count reaches zero.
+ */
+void outq_buf_ref(OUTQ_BUF *buf);
+void outq_buf_unref(OUTQ_BUF *buf);
+
+/*
+ * Append a buffer to a queue.  The queue takes its own reference to the
+ * buffer, and the caller keeps theirs.
+ *
+ * @return 0 if the buffer was queued (or sent, or skipped because
+ * notifications are paused), -1 if the queue has been closed or its
+ * connection has failed or been dropped.
+ */
+int outq_push(OUTQ *q, OUTQ_BUF *buf);
+
+/*
+ * Send packets through a queue.  If nothing is queued ahead of them,
+ * they are written straight from the caller's storage, and only what
+ * the socket does not take is copied into a buffer and queued, so the
+ * usual case makes no allocation at all.
+ *
+ * @return 0 if the packets were sent (or queued, or skipped because
+ * notifications are paused), -1 if the queue has been closed or its
+ * connection has failed or been dropped.
+ */
+int outq_send(OUTQ *q, PROTO_PACKET *pkts, int npkts);
+
+/*
+ * Send packets through a queue as outq_send() does, and then frame
+ * everything sent after them with another codec.  No packet sent by
+ * another thread can come between the two.
+ *
+ * @param npkts  The number of packets, which may be zero.
+ * @param codec  The codec for the packets that follow.
+ * @return 0 if the packets were sent (or queued), -1 if the queue has
+ * been closed or its connection has failed or been dropped.
+ */
+int outq_send_switch(OUTQ *q, PROTO_PACKET *pkts, int npkts, const PROTO_CODEC *codec);
+
+/*
+ * Copy what is queued on a connection and not yet sent.  The writers
+ * must be paused, and nothing else may be sending to the connection.
+ *
+ * @param lenp  Set to the number of bytes copied.
+ * @return the malloc'ed bytes, or NULL if there are none (or memory ran
+ * out, in which case *lenp is nonzero).
+ */
+char *outq_save(OUTQ *q, size_t *lenp);
+
+/*
+ * Queue bytes saved by outq_save() in another process, ahead of anything
+ * else sent to the connection.  They may end in the middle of a packet,
+ * so they are never coalesced or skipped.
+ *
+ * @return 0 if the bytes were queued (or sent), otherwise -1.
+ */
+int outq_restore(OUTQ *q, const char *bytes, size_t len);
+
+#endif
@@ -0,0 +1,277 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Extensions to the protocol layer that are not part of the standard
+ * protocol.h interface.
+ */
+
+/*
+ * A PROTO_CODEC is one framing of packet headers on the wire.  Handlers
+ * only ever see JEUX_PACKET_HEADER, in network byte order; the codec of
+ * a connection turns that into the bytes that are sent, and the bytes
+ * that arrive back into it.
+ *
+ * The standard framing (v1) sends the 16-byte header as it is.  The
+ * compact framing (v2) packs it into as few as three bytes:
+ *
+ *   byte 0     type (bits 0-4), timestamp flag (bit 5), role (bits 6-7)
+ *   byte 1     id
+ *   1-3 bytes  payload size, as a little-endian base-128 varint
+ *   8 bytes    seconds and nanoseconds, in network byte order, only if
+ *              the timestamp flag is set
+ *
+ * A client asks for the compact framing by setting capability bits in
+ * the role field of its LOGIN.  The server answers with the bits it has
+ * accepted in the role field of the ACK, which is still sent in the
+ * standard framing; every packet after it, in either direction, is
+ * framed with the codec for those capabilities.  Clients that set no
+ * bits see no change at all.
+ *
+ * The multiplexed framing carries many sessions over one connection.
+ * It is the compact framing without timestamps, with the number of the
+ * session a packet belongs to after its id:
+ *
+ *   byte 0     type (bits 0-4), role (bits 6-7)
+ *   byte 1     id
+ *   1-3 bytes  session, as a little-endian base-128 varint
+ *   1-3 bytes  payload size, as a varint
+ *
+ * Since the fields of JEUX_PACKET_HEADER cannot change, the session of a
+ * header on such a connection is kept in its timestamp_sec field (see
+ * PROTO_SESSION()), in network byte order.
+ *
+ * The correlated framings let a client pipeline requests.  They add a
+ * correlation ID, another varint of 1-3 bytes, to the compact framing
+ * without timestamps (after the id) or to the multiplexed one (after the
+ * session).  A client gives each request an ID of its own, and the ACK
+ * or NACK that answers the request carries the same ID; every other
+ * packet carries 0.  The ID of a header is kept in its timestamp_nsec
+ * field (see PROTO_CORRELATION()).
+ */
+typedef struct proto_codec {
+  const char *name;
+  // capability bits that select this codec
+  int caps;
+  /*
+   * Tell how long a header is from its first bytes.
+   *
+   * @return the length of the header, if the have bytes at buf tell it,
+   * otherwise a number greater than have (at least the length of the
+   * shortest header); or 0 if the bytes cannot start a header.
+   */
+  size_t (*header_size)(const char *buf, size_t have);
+  /*
+   * Decode a complete header of len bytes, as measured by header_size().
+   *
+   * @return 0 if the header was decoded, -1 if it is malformed.
+   */
+  int (*decode)(const char *buf, size_t len, JEUX_PACKET_HEADER *hdr);
+  /*
+   * Encode a header into buf, which must hold PROTO_HEADER_MAX bytes.
+   *
+   * @return the number of bytes written.
+   */
+  size_t (*encode)(const JEUX_PACKET_HEADER *hdr, char *buf);
+} PROTO_CODEC;
+
+// the longest header any codec produces
+#define PROTO_HEADER_MAX sizeof(JEUX_PACKET_HEADER)
+
+// capability bits of a LOGIN (and of the ACK that answers it)
+#define PROTO_CAP_COMPACT 0x1
+#define PROTO_CAP_TIMESTAMPS 0x2    // only together with PROTO_CAP_COMPACT
+#define PROTO_CAP_DELTA 0x4         // MOVED carries the move, not the board
+#define PROTO_CAP_MUX 0x8           // only together with PROTO_CAP_COMPACT
+#define PROTO_CAP_CORRELATION 0x10  // only together with PROTO_CAP_COMPACT
+
+// the session of a header on a multiplexed connection
+#define PROTO_SESSION(hdr) ntohl((hdr)->timestamp_sec)
+#define PROTO_SESSION_MAX 0xffff
+
+// the correlation ID of a header on a correlated connection
+#define PROTO_CORRELATION(hdr) ntohl((hdr)->timestamp_nsec)
+#define PROTO_CORRELATION_MAX 0xffff
+
+/*
+ * Request for the full state of a game, by the ID of its invitation.  It
+ * is answered by an ACK whose payload is the version of the state (the
+ * number of moves made) on a line of its own, followed by the board as
+ * a MOVED would show it.  A client that receives MOVED deltas asks for
+ * this when it has missed a version, or whenever it wants the board.
+ */
+#define JEUX_STATE_PKT 18
+
+extern const PROTO_CODEC proto_codec_v1;
+extern const PROTO_CODEC proto_codec_v2;
+extern const PROTO_CODEC proto_codec_v2_ts;
+extern const PROTO_CODEC proto_codec_mux;
+extern const PROTO_CODEC proto_codec_v2_corr;
+extern const PROTO_CODEC proto_codec_mux_corr;
+
+/*
+ * Choose the codec for the capabilities a client asked for.  Bits the
+ * server does not know, and timestamps, sessions or correlation IDs
+ * without the compact framing, are ignored.  Multiplexed and correlated
+ * headers have no timestamps.
+ *
+ * @param caps  The role field of the client's LOGIN.
+ * @return the codec; its caps field holds the bits that were accepted.
+ */
+const PROTO_CODEC *proto_codec_for(int caps);
+
+/*
+ * One packet of a batch passed to proto_send_packets().
+ */
+typedef struct proto_packet {
+  JEUX_PACKET_HEADER *hdr;  // multi-byte fields in network byte order
+  void *data;               // the payload, or NULL if there is none
+} PROTO_PACKET;
+
+/*
+ * Send several packets, back to back, with as few system calls as
+ * possible.  The headers and payloads are gathered into one iovec array
+ * and written with writev(2); a partial write resumes from the iovec and
+ * offset at which it stopped.
+ *
+ * @param fd  The file descriptor on which the packets are to be sent.
+ * @param pkts  The packets, in the order in which they are to be sent.
+ * @param npkts  The number of packets.
+ * @return  0 if every packet was sent, -1 otherwise.
+ */
+int proto_send_packets(int fd, PROTO_PACKET *pkts, int npkts);
+
+/*
+ * Send several packets like proto_send_packets(), with their headers
+ * framed by a codec.
+ *
+ * @param codec  The codec of the connection.
+ */
+int proto_send_packets_codec(int fd, const PROTO_CODEC *codec, PROTO_PACKET *pkts, int npkts);
+
+/*
+ * Size of the receive ring of a PROTO_RECV_BUF (must be a power of two).
+ */
+#define PROTO_RECV_BUF_SIZE 8192
+
+/*
+ * A PROTO_RECV_BUF is a per-connection receive ring.  Each read(2) pulls
+ * in as many bytes as the socket has available (up to the free space of
+ * the ring), and packets are then parsed out of the ring until it runs
+ * dry, so a client that pipelines several packets costs one system call
+ * for all of them rather than two per packet.  It is the ring-buffer
+ * counterpart of the rio_t reader in csapp.c.
+ */
+typedef struct proto_recv_buf {
+  int fd;
+  // framing of the headers, which may be changed between packets
+  const PROTO_CODEC *codec;
+  // free-running offsets: bytes [head, tail) are buffered and unparsed
+  size_t head;
+  size_t tail;
+  // payload of the last packet, reused from packet to packet
+  char *payload;
+  size_t payload_cap;
+  char ring[PROTO_RECV_BUF_SIZE];
+} PROTO_RECV_BUF;
+
+/*
+ * Initialize a receive ring for a file descriptor, with the standard
+ * framing.
+ */
+void proto_recv_buf_init(PROTO_RECV_BUF *rb, int fd);
+
+/*
+ * Free the payload buffer of a receive ring.
+ */
+void proto_recv_buf_fini(PROTO_RECV_BUF *rb);
+
+/*
+ * Receive a packet through a receive ring, blocking until one is
+ * available.  This behaves like proto_recv_packet(), except that any
+ * bytes read beyond the end of the packet are kept in the ring for the
+ * next call.
+ *
+ * @param rb  The receive ring of the connection.
+ * @param hdr  Pointer to caller-supplied storage for the fixed-size
+ *   packet header.
+ * @param payloadp  Pointer to a variable into which to store a pointer to
+ *   any payload received, or NULL if there is none.  The payload is
+ *   NUL-terminated and belongs to the ring: it must not be freed, and it
+ *   is only valid until the next packet is received.
+ * @return  0 in case of successful reception, -1 otherwise (including
+ *   when a header is malformed).
+ */
+int proto_recv_packet_buffered(PROTO_RECV_BUF *rb, JEUX_PACKET_HEADER *hdr, char **payloadp);
+
+/*
+ * Tell whether proto_recv_packet_buffered() would return without reading,
+ * because a whole packet (or a malformed header) is already in the ring.
+ */
+int proto_recv_buf_ready(PROTO_RECV_BUF *rb);
+
+/*
+ * A PROTO_ASSEMBLER accumulates a packet from bytes that arrive in
+ * arbitrary pieces, as happens when reading from a non-blocking socket.
+ * It is used by the event loops, which cannot block waiting for the
+ * rest of a packet the way proto_recv_packet() does.
+ */
+typedef struct proto_assembler {
+  // framing of the headers, or NULL for the standard one; it may be
+  // changed between packets
+  const PROTO_CODEC *codec;
+  // the header as it arrived, and once it is complete, decoded
+  char raw[PROTO_HEADER_MAX];
+  size_t hdr_have;
+  size_t hdr_len;
+  JEUX_PACKET_HEADER hdr;
+  // payload buffer, reused from packet to packet
+  char *payload;
+  size_t payload_cap;
+  size_t payload_have;
+} PROTO_ASSEMBLER;
+
+/*
+ * Consume bytes into a partially assembled packet.
+ *
+ * @param pa  The assembler.
+ * @param buf  The bytes that have arrived.
+ * @param len  The number of bytes in buf.
+ * @param done  Set to 1 if a complete packet is now available, in which
+ * case proto_assembler_take() must be called before feeding more bytes,
+ * or to -1 if a malformed header arrived, in which case the connection
+ * cannot be read any further.
+ * @return the number of bytes consumed from buf.
+ */
+size_t proto_assemble(PROTO_ASSEMBLER *pa, const char *buf, size_t len, int *done);
+
+/*
+ * Take the completed packet out of an assembler and reset it for the
+ * next packet.  The header is copied into hdr and the NUL-terminated
+ * payload (or NULL if there is none) is returned.  The payload belongs
+ * to the assembler and is only valid until more bytes are fed to it.
+ */
+char *proto_assembler_take(PROTO_ASSEMBLER *pa, JEUX_PACKET_HEADER *hdr);
+
+/*
+ * Copy the bytes of a packet that has only partly been assembled, so
+ * that feeding them to a fresh assembler with the same codec puts it in
+ * the same state.
+ *
+ * @param pa  The assembler, which must not be holding a completed packet.
+ * @param lenp  Set to the number of bytes copied.
+ * @return the malloc'ed bytes, or NULL if there are none (or memory ran
+ * out, in which case *lenp is nonzero).
+ */
+char *proto_assembler_save(PROTO_ASSEMBLER *pa, size_t *lenp);
+
+/*
+ * Free the buffers of an assembler.
+ */
+void proto_assembler_fini(PROTO_ASSEMBLER *pa);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/*
+ * Server-wide event counters.  They are updated with relaxed atomic
+ * increments from any thread, and written out when the server receives
+ * SIGUSR1, so that policies can be tuned against a running server.
+ */
+typedef enum {
+  STAT_SLOW_DROPPED,        // connections dropped for not reading
+  STAT_SLOW_COALESCING,     // times a queue started coalescing MOVED
+  STAT_SLOW_COALESCED,      // queued MOVED packets replaced by a newer one
+  STAT_SLOW_PAUSED,         // times a queue paused notifications
+  STAT_SLOW_SKIPPED,        // notifications not queued while paused
+  STAT_IDLE_REAPED,         // connections shut down for being idle
+  STAT_ADMIT_REJECTED,      // connections refused because the server was full
+  STAT_ADMIT_QUEUED,        // connections that waited for admission
+  STAT_ADMIT_EXPIRED,       // waiting connections refused at their deadline
+  STAT_COUNTERS             // number of counters (not a counter)
+} STAT_COUNTER;
+
+/*
+ * Add to a counter.
+ */
+void stats_add(STAT_COUNTER counter, long n);
+
+/*
+ * Add one to a counter.
+ */
+void stats_inc(STAT_COUNTER counter);
+
+/*
+ * Read the current value of a counter.
+ */
+long stats_get(STAT_COUNTER counter);
+
+/*
+ * Write every counter, one "name value" pair per line.
+ */
+void stats_dump(FILE *out);
+
+#endif
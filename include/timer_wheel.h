@@ -0,0 +1,112 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/*
+ * A hierarchical timer wheel.  Time is counted in ticks by one timer
+ * thread.  A pending timer sits in one slot of one of several wheels,
+ * each coarser than the last, and is cascaded down to the finer wheels
+ * as its expiry approaches, so arming and cancelling a timer are O(1)
+ * list operations whatever its delay, and advancing the clock by a tick
+ * touches only the timers that are due (plus, occasionally, one slot of
+ * a coarser wheel).
+ *
+ * Timers are embedded in the objects they belong to, so arming one never
+ * allocates.  Callbacks run on the timer thread, without any lock held,
+ * and may re-arm their own timer.
+ */
+
+typedef struct tw_timer TW_TIMER;
+
+/*
+ * Function called on the timer thread when a timer expires.
+ */
+typedef void (TW_CALLBACK)(TW_TIMER *timer);
+
+struct tw_timer {
+  TW_TIMER *next;
+  // the pointer that points at this timer, if it is pending
+  TW_TIMER **pprev;
+  uint64_t expires;
+  TW_CALLBACK *callback;
+};
+
+/*
+ * Start the timer thread.
+ *
+ * @param tick_ms  The length of a tick, in milliseconds.
+ * @return 0 if the thread was started, otherwise -1.
+ */
+int tw_start(int tick_ms);
+
+/*
+ * Stop the timer thread.  Timers that are still pending never fire.
+ */
+void tw_fini(void);
+
+/*
+ * Stop the timer thread for a while.  The clock stands still and no
+ * timer fires until tw_resume() is called, but timers may still be armed
+ * and cancelled.
+ */
+void tw_pause(void);
+
+/*
+ * Restart the timer thread after tw_pause(), with the same tick.
+ *
+ * @return 0 if the thread was restarted, otherwise -1.
+ */
+int tw_resume(void);
+
+/*
+ * Get the number of ticks since the timer thread was started.  This is a
+ * single atomic load, cheap enough to call for every packet.
+ */
+uint64_t tw_now(void);
+
+/*
+ * Convert a duration to ticks, rounding up.
+ */
+uint64_t tw_ticks(long ms);
+
+/*
+ * Initialize a timer, which is not pending.
+ *
+ * @param timer  The timer.
+ * @param callback  The function to call when the timer expires.
+ */
+void tw_init(TW_TIMER *timer, TW_CALLBACK *callback);
+
+/*
+ * Arm a timer to expire after a number of ticks (at least one).  If the
+ * timer is already pending, it is moved.  Delays longer than the wheels
+ * can hold are shortened to the longest one they can.
+ *
+ * @param timer  The timer.
+ * @param ticks  The delay, in ticks.
+ * @return 1 if the timer was already pending, otherwise 0.
+ */
+int tw_arm(TW_TIMER *timer, uint64_t ticks);
+
+/*
+ * Cancel a timer.  If its callback is running, wait for it to return,
+ * so that once this returns the callback is not running and (unless it
+ * is armed again) never will be.  This must not be called from the
+ * timer's own callback.
+ *
+ * @param timer  The timer.
+ */
+void tw_cancel(TW_TIMER *timer);
+
+/*
+ * Cancel a timer if it is pending, without waiting for a callback that
+ * is already running.  This may be called while holding locks that the
+ * callback takes.
+ *
+ * @param timer  The timer.
+ * @return 1 if the timer was pending (and now never fires), otherwise 0.
+ */
+int tw_try_cancel(TW_TIMER *timer);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include "protocol_ext.h"
+
+/*
+ * The io_uring backend is a variant of the event loop in which all
+ * socket I/O is done through an io_uring instance owned by each loop
+ * thread.  Every connection has a multishot receive armed on it that
+ * fills buffers from a ring of provided buffers, so receiving needs no
+ * syscall per packet.  Packets sent to a connection are queued as linked
+ * header+payload sends, and the sends produced while a loop processes a
+ * batch of completions are submitted together with a single
+ * io_uring_enter(2), across all of the connections of that loop.
+ *
+ * The backend probes the kernel when it starts.  If io_uring, provided
+ * buffer rings or multishot receives are not available, uring_start()
+ * fails and the server falls back to the epoll event loop.
+ */
+
+/*
+ * Value returned by uring_send_packets() for file descriptors that are not
+ * serviced by the io_uring backend.
+ */
+#define URING_NOT_OWNED 1
+
+/*
+ * Start the io_uring loop threads.
+ *
+ * @param nthreads  The number of loop threads to start.  If zero, one
+ * thread per online CPU is started.
+ * @return 0 if the loops were started, otherwise -1 (for example, if the
+ * kernel lacks the required io_uring support).
+ */
+int uring_start(int nthreads);
+
+/*
+ * Hand a newly accepted connection to one of the io_uring loops.  The
+ * connection is registered with the client registry; if registration
+ * fails, the connection is closed.
+ *
+ * @param connfd  The file descriptor of the accepted connection.
+ * @return 0 if the connection was taken over by a loop, otherwise -1.
+ */
+int uring_add_connection(int connfd);
+
+/*
+ * Queue packets for transmission on a connection serviced by the
+ * io_uring backend.  The headers and payloads are copied, so the caller's
+ * storage may be reused as soon as this function returns.  All of the
+ * packets are queued under one lock and go out in the same submission.
+ *
+ * @param fd  The file descriptor on which the packets are to be sent.
+ * @param codec  The framing of the headers.
+ * @param pkts  The packets, with header fields in network byte order.
+ * @param npkts  The number of packets.
+ * @return 0 if the packets were queued, -1 if the connection is closing,
+ * or URING_NOT_OWNED if fd is not serviced by the io_uring backend.
+ */
+int uring_send_packets(int fd, const PROTO_CODEC *codec, PROTO_PACKET *pkts, int npkts);
+
+/*
+ * Stop the io_uring loop threads and free their resources.  This should
+ * only be called once every client has been unregistered.
+ */
+void uring_fini(void);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+/*
+ * The worker pool services connections in thread mode.  Instead of
+ * creating a thread for every accepted connection, a fixed number of
+ * service workers is started up front, and accepted connections are
+ * handed to them through a bounded lock-free queue.  Each worker runs
+ * the usual service loop for one connection at a time.  When the queue
+ * is full, a new connection is rejected with a NACK and closed instead
+ * of piling up more threads.
+ */
+
+/*
+ * Start the service workers.
+ *
+ * @param nworkers  The number of workers to start.
+ * @param capacity  The maximum number of accepted connections that may
+ * wait for a worker.  This is rounded up to a power of two (at least 2).
+ * @return 0 if the pool was started, otherwise -1.
+ */
+int pool_start(int nworkers, int capacity);
+
+/*
+ * Hand an accepted connection to the pool.  If the queue is full the
+ * connection is sent a NACK and closed.
+ *
+ * @param connfd  The file descriptor of the accepted connection.
+ * @return 0 if the connection was queued, -1 if it was rejected.
+ */
+int pool_submit(int connfd);
+
+/*
+ * Stop the workers once the queue has drained and wait for them to
+ * finish.  Connections still waiting in the queue are refused by the
+ * client registry (it has been shut down) and closed by the workers.
+ */
+void pool_fini(void);
+
+#endif
@@ -0,0 +1,235 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+
+#include "includeme.h"
+#include "acceptor.h"
+
+typedef struct acceptor {
+  pthread_t tid;
+  int listenfd;
+  int cpu;  // CPU to pin the thread to, or -1
+  int started;
+  char name[32];
+  ACCEPT_HANDLER *handler;
+} ACCEPTOR;
+
+static ACCEPTOR *acceptors = NULL;
+static int nacc = 0;
+static atomic_int stopping;
+
+// the acceptor of the Unix domain socket, if there is one
+static ACCEPTOR local = {
+  .listenfd = -1,
+  .cpu = -1,
+};
+static char *local_path = NULL;
+
+/*
+ * Like open_listenfd(), but the socket joins the SO_REUSEPORT group of
+ * the port, so several of them can be bound at once.
+ *
+ * @return the listening socket, or -1 on error.
+ */
+static int open_reuseport_listenfd(int port) {
+  int optval = 1;
+  int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listenfd < 0) {
+    return -1;
+  }
+  if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ||
+      setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+    close(listenfd);
+    return -1;
+  }
+  struct sockaddr_in serveraddr;
+  memset(&serveraddr, 0, sizeof(serveraddr));
+  serveraddr.sin_family = AF_INET;
+  serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  serveraddr.sin_port = htons((unsigned short)port);
+  if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0 ||
+      listen(listenfd, LISTENQ) < 0) {
+    close(listenfd);
+    return -1;
+  }
+  return listenfd;
+}
+
+static void *acc_thread(void *arg) {
+  ACCEPTOR *acc = arg;
+  if (acc->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(acc->cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+      warn("%s: cannot pin to CPU %d: %s", acc->name, acc->cpu, strerror(err));
+    }
+  }
+  while (1) {
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen = sizeof(clientaddr);
+    int connfd = accept(acc->listenfd, (SA *)&clientaddr, &clientlen);
+    if (atomic_load(&stopping)) {
+      if (connfd >= 0) {
+        Close(connfd);
+      }
+      break;
+    }
+    if (connfd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        error("%s: accept: %s", acc->name, strerror(errno));
+        if (errno == EMFILE || errno == ENFILE) {
+          // wait for descriptors to be released instead of spinning
+          usleep(10000);
+        }
+      }
+      continue;
+    }
+    debug("%s: this socket is connected: %d", acc->name, connfd);
+    acc->handler(connfd);
+  }
+  return NULL;
+}
+
+/*
+ * Open the listeners and start the acceptor threads.  The calling thread
+ * should block the shutdown signals before calling this, so that they
+ * are delivered to it rather than to an acceptor.
+ *
+ * @param port  The port on which to listen.
+ * @param nacceptors  The number of listeners and acceptor threads.
+ * @param pin  If nonzero, acceptor i is pinned to CPU i (modulo the number
+ * of online CPUs).
+ * @param handler  Called with each accepted connection.
+ * @return 0 if every acceptor was started, otherwise -1.
+ */
+int acc_start(int port, int nacceptors, int pin, ACCEPT_HANDLER *handler) {
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpus <= 0) {
+    ncpus = 1;
+  }
+  acceptors = calloc(nacceptors, sizeof(ACCEPTOR));
+  if (acceptors == NULL) {
+    return -1;
+  }
+  atomic_store(&stopping, 0);
+  nacc = nacceptors;
+  for (int i = 0; i < nacc; i++) {
+    acceptors[i].listenfd = -1;
+    acceptors[i].handler = handler;
+    snprintf(acceptors[i].name, sizeof(acceptors[i].name), "acceptor %d", i);
+  }
+  // bind every listener before any accepting starts, so that a failure
+  // leaves nothing running
+  for (int i = 0; i < nacc; i++) {
+    acceptors[i].listenfd = open_reuseport_listenfd(port);
+    acceptors[i].cpu = pin ? (int)(i % ncpus) : -1;
+    if (acceptors[i].listenfd < 0) {
+      error("acceptor %d: cannot listen on port %d: %s", i, port, strerror(errno));
+      acc_fini();
+      return -1;
+    }
+  }
+  for (int i = 0; i < nacc; i++) {
+    if (pthread_create(&acceptors[i].tid, NULL, acc_thread, &acceptors[i]) != 0) {
+      error("pthread_create");
+      acc_fini();
+      return -1;
+    }
+    acceptors[i].started = 1;
+  }
+  info("Started %d acceptor threads on port %d%s", nacc, port,
+       pin ? " (pinned)" : "");
+  return 0;
+}
+
+/*
+ * Listen on a Unix domain stream socket, alongside or instead of the
+ * TCP listeners, and start a thread accepting on it.  Clients on the
+ * same host then skip the TCP/IP stack.  The calling thread should
+ * block the shutdown signals, as for acc_start().
+ *
+ * @param path  The path of the socket.  Anything already there is removed.
+ * @param handler  Called with each accepted connection.
+ * @return 0 if the acceptor was started, otherwise -1.
+ */
+int acc_start_local(const char *path, ACCEPT_HANDLER *handler) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    error("socket path is too long: %s", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  local.listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (local.listenfd < 0) {
+    error("socket: %s", strerror(errno));
+    return -1;
+  }
+  if (unlink_stale_socket(path) == -1) {
+    close(local.listenfd);
+    local.listenfd = -1;
+    return -1;
+  }
+  if (bind(local.listenfd, (SA *)&addr, sizeof(addr)) < 0 ||
+      listen(local.listenfd, LISTENQ) < 0) {
+    error("cannot listen on %s: %s", path, strerror(errno));
+    close(local.listenfd);
+    local.listenfd = -1;
+    return -1;
+  }
+  local_path = strdup(path);
+  local.handler = handler;
+  snprintf(local.name, sizeof(local.name), "local acceptor");
+  atomic_store(&stopping, 0);
+  if (pthread_create(&local.tid, NULL, acc_thread, &local) != 0) {
+    error("pthread_create");
+    acc_fini();
+    return -1;
+  }
+  local.started = 1;
+  info("Listening on %s", path);
+  return 0;
+}
+
+/*
+ * Stop accepting: shut down every listener, wait for the acceptor
+ * threads to finish and close the listeners.
+ */
+void acc_fini(void) {
+  atomic_store(&stopping, 1);
+  for (int i = 0; i < nacc; i++) {
+    // shutdown() makes a blocked accept() return
+    if (acceptors[i].listenfd >= 0) {
+      shutdown(acceptors[i].listenfd, SHUT_RDWR);
+    }
+  }
+  if (local.listenfd >= 0) {
+    shutdown(local.listenfd, SHUT_RDWR);
+  }
+  if (local.started) {
+    pthread_join(local.tid, NULL);
+    local.started = 0;
+  }
+  if (local.listenfd >= 0) {
+    close(local.listenfd);
+    local.listenfd = -1;
+    unlink(local_path);
+  }
+  free(local_path);
+  local_path = NULL;
+  for (int i = 0; i < nacc; i++) {
+    if (acceptors[i].started) {
+      pthread_join(acceptors[i].tid, NULL);
+    }
+    if (acceptors[i].listenfd >= 0) {
+      close(acceptors[i].listenfd);
+    }
+  }
+  free(acceptors);
+  acceptors = NULL;
+  nacc = 0;
+}
@@ -0,0 +1,196 @@
+#include "includeme.h"
+#include "admission.h"
+#include "stats.h"
+
+/*
+ * A connection waiting for a slot.  All connections wait equally long,
+ * so the queue is in order of deadline, and the only deadline that needs
+ * watching is that of the connection at its head.
+ */
+typedef struct adm_waiter {
+  int connfd;
+  uint64_t deadline;
+} ADM_WAITER;
+
+typedef struct admission {
+  pthread_mutex_t lock;
+  int enabled;
+  int closed;
+  int capacity;
+  int admitted;
+  uint64_t wait_ticks;
+  ADMIT_HANDLER *handler;
+  // ring of waiting connections
+  ADM_WAITER *waiting;
+  int nwaiting;
+  int head;
+  int count;
+  // goes off at the deadline of the connection at the head of the queue
+  TW_TIMER expiry;
+} ADMISSION;
+
+static ADMISSION adm = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int adm_pop(void) {
+  int connfd = adm.waiting[adm.head].connfd;
+  adm.head = (adm.head + 1) % adm.nwaiting;
+  adm.count--;
+  return connfd;
+}
+
+/*
+ * Refuse the waiting connections whose deadline has passed, and watch
+ * the deadline of the next one.
+ */
+static void adm_expire(TW_TIMER *timer) {
+  int expired[adm.nwaiting];
+  int nexpired = 0;
+  pthread_mutex_lock(&adm.lock);
+  uint64_t now = tw_now();
+  while (adm.count > 0 && adm.waiting[adm.head].deadline <= now) {
+    expired[nexpired++] = adm_pop();
+  }
+  if (adm.count > 0) {
+    tw_arm(&adm.expiry, adm.waiting[adm.head].deadline - now);
+  }
+  pthread_mutex_unlock(&adm.lock);
+  for (int i = 0; i < nexpired; i++) {
+    debug("connection %d waited too long for admission", expired[i]);
+    stats_inc(STAT_ADMIT_EXPIRED);
+    adm_refuse(expired[i]);
+  }
+}
+
+/*
+ * Start admission control.  Until this is called, every connection is
+ * admitted and releases are ignored.
+ *
+ * @param capacity  The number of connections that may be admitted at once.
+ * @param nwaiting  The number of connections that may wait for a slot.
+ * @param wait_ms  How long a connection may wait, in milliseconds.  The
+ * wait is measured by the timer wheel, which must be running.
+ * @param handler  The function to which admitted connections are handed.
+ * @return 0 if admission control was started, otherwise -1.
+ */
+int adm_init(int capacity, int nwaiting, int wait_ms, ADMIT_HANDLER *handler) {
+  if (nwaiting > 0) {
+    adm.waiting = calloc(nwaiting, sizeof(ADM_WAITER));
+    if (adm.waiting == NULL) {
+      return -1;
+    }
+  }
+  adm.nwaiting = nwaiting;
+  adm.capacity = capacity;
+  adm.wait_ticks = tw_ticks(wait_ms);
+  adm.handler = handler;
+  tw_init(&adm.expiry, adm_expire);
+  adm.enabled = 1;
+  info("Admitting %d clients, with %d more waiting up to %d ms", capacity, nwaiting, wait_ms);
+  return 0;
+}
+
+/*
+ * Submit an accepted connection for admission.  It is either admitted
+ * and handed to the handler, queued, or rejected, without blocking.
+ *
+ * @param connfd  The file descriptor of the accepted connection.
+ * @return 0 if the connection was admitted or queued, -1 if it was
+ * rejected (and closed).
+ */
+int adm_submit(int connfd) {
+  pthread_mutex_lock(&adm.lock);
+  if (!adm.enabled) {
+    pthread_mutex_unlock(&adm.lock);
+    adm.handler(connfd);
+    return 0;
+  }
+  if (!adm.closed && adm.admitted < adm.capacity) {
+    adm.admitted++;
+    pthread_mutex_unlock(&adm.lock);
+    adm.handler(connfd);
+    return 0;
+  }
+  if (!adm.closed && adm.count < adm.nwaiting) {
+    ADM_WAITER *w = &adm.waiting[(adm.head + adm.count) % adm.nwaiting];
+    w->connfd = connfd;
+    w->deadline = tw_now() + adm.wait_ticks;
+    if (adm.count++ == 0) {
+      tw_arm(&adm.expiry, adm.wait_ticks);
+    }
+    pthread_mutex_unlock(&adm.lock);
+    debug("connection %d waiting for admission", connfd);
+    stats_inc(STAT_ADMIT_QUEUED);
+    return 0;
+  }
+  pthread_mutex_unlock(&adm.lock);
+  debug("server full, rejecting connection %d", connfd);
+  stats_inc(STAT_ADMIT_REJECTED);
+  adm_refuse(connfd);
+  return -1;
+}
+
+/*
+ * Count a connection as admitted without asking, whatever the capacity,
+ * for a session that was already admitted by another server process.
+ */
+void adm_admit(void) {
+  pthread_mutex_lock(&adm.lock);
+  adm.admitted++;
+  pthread_mutex_unlock(&adm.lock);
+}
+
+/*
+ * Release the slot of an admitted connection.  If a connection is
+ * waiting, it is admitted to the slot and handed to the handler on the
+ * calling thread, so the caller must not hold locks the handler takes.
+ */
+void adm_release(void) {
+  pthread_mutex_lock(&adm.lock);
+  if (!adm.enabled) {
+    pthread_mutex_unlock(&adm.lock);
+    return;
+  }
+  if (adm.count == 0) {
+    adm.admitted--;
+    pthread_mutex_unlock(&adm.lock);
+    return;
+  }
+  // the slot passes straight to the connection that has waited longest;
+  // the expiry alarm finds the queue shorter when it goes off
+  int connfd = adm_pop();
+  pthread_mutex_unlock(&adm.lock);
+  debug("connection %d admitted after waiting", connfd);
+  adm.handler(connfd);
+}
+
+/*
+ * Reject every waiting connection, and every connection submitted from
+ * now on, when the server is shutting down.
+ */
+void adm_shutdown(void) {
+  pthread_mutex_lock(&adm.lock);
+  adm.closed = 1;
+  int refused[adm.count > 0 ? adm.count : 1];
+  int nrefused = 0;
+  while (adm.count > 0) {
+    refused[nrefused++] = adm_pop();
+  }
+  pthread_mutex_unlock(&adm.lock);
+  for (int i = 0; i < nrefused; i++) {
+    adm_refuse(refused[i]);
+  }
+}
+
+/*
+ * Send a NACK on a connection that is being refused, and close it.
+ *
+ * @param connfd  The file descriptor of the connection.
+ */
+void adm_refuse(int connfd) {
+  JEUX_PACKET_HEADER hdr;
+  init_header(&hdr, JEUX_NACK_PKT, 0, 0, 0);
+  proto_send_packet(connfd, &hdr, NULL);
+  Close(connfd);
+}
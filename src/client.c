@@ -1,4 +1,8 @@
+#include <stdatomic.h>
+#include <stdint.h>
+
 #include "includeme.h"
+#include "stats.h"
 
 /*
  * A CLIENT represents the state of a network client connected to the
@@ -22,23 +26,21 @@ typedef struct invitation_node {
 
 // however many functions need their own semmy
 #define CLIENT_SEM_FUNCTIONS 10
-#define CLIENT_LOGIN_SEM 0
-#define CLIENT_LOGOUT_SEM 1
-#define CLIENT_INVITE_SEM 2
 // #define CLIENT_USE_NETWORK_SEM 3
 #define CLIENT_ID_NUM 4
 #define CLIENT_REF 5
-#define CLIENT_INVITE_OP_SEM 6
 #define CLIENT_GET_INVITE_ID_SEM 7
-#define CLIENT_UPDATE_ELO 8
 
-// semaphores for all invitation functions
+// semaphores for functions that are run one at a time
 sem_t semaphores[CLIENT_SEM_FUNCTIONS];
 int is_sem_init = 0;
+static pthread_once_t sem_once = PTHREAD_ONCE_INIT;
 
 typedef enum client_state {
   CLIENT_LOGGED_OUT,
   CLIENT_LOGGED_IN,
+  // giving up its invitations; no new ones can be added to its list
+  CLIENT_LOGGING_OUT,
 } CLIENT_STATE;
 
 /*
@@ -51,36 +53,146 @@ typedef struct client {
   pthread_mutex_t lock;
   CLIENT_REGISTRY *cr;
   int fd;
-  int ref_count;
+  atomic_int ref_count;
   PLAYER *player;
   CLIENT_STATE logged_in;
   int *available_ids;
   int id_usage;
   int current_id_size;
   INVITATION_NODE *invite_head;
+  // packets to this client are queued here, or NULL to send directly
+  OUTQ *outq;
+  // framing of packets to and from the client, changed under the lock
+  const PROTO_CODEC *codec;
+  // the capabilities accepted at login
+  int caps;
+  // the capabilities (PROTO_CAP_MUX, PROTO_CAP_CORRELATION) that have
+  // the headers of packets to the client stamped before they are sent
+  atomic_int stamp;
+  // the correlation ID of the request being handled, for its ACK or NACK
+  atomic_int correlation;
+  // for a session of a multiplexed connection, the client of the
+  // connection, which its packets are sent through, and its number
+  struct client *conn;
+  int session;
+  // for the client of a multiplexed connection, its sessions, indexed by
+  // number and changed under the lock
+  struct client **sessions;
+  int sessions_cap;
+  // fires to check whether the client has been idle for too long
+  TW_TIMER idle_timer;
+  // the tick at which the last packet was received from the client
+  _Atomic uint64_t last_active;
 } CLIENT;
 
 /*
- * Create a new CLIENT object with a specified file descriptor with which
- * to communicate with the client.  The returned CLIENT has a reference
- * count of one and is in the logged-out state.
+ * Locking of invitations and games.  No lock covers all of them: an
+ * operation on an invitation, or on the game it contains, holds the lock
+ * of that INVITATION (inv_lock()) from when it checks the invitation's
+ * state until it is done, so that the operations on one game happen one
+ * at a time while unrelated games are played in parallel.  Locks are
+ * taken in this order:
  *
- * @param creg  The client registry in which to create the client.
- * @param fd  File descriptor of a socket to be used for communicating
- * with the client.
- * @return  The newly created CLIENT objectlo, if creation is successful,
- * otherwise NULL.
+ *   1. the lock of one INVITATION (never of two at once);
+ *   2. the locks of the source and target CLIENTs, one at a time, or,
+ *      where an invitation goes into or out of both lists at once, both,
+ *      the one at the lower address first;
+ *   3. locks that are held while taking no other: a GAME's, a PLAYER's
+ *      (two are taken in address order) and an output queue's.
+ *
+ * Reference counts are atomic and take no lock, so objects may be
+ * referenced and released with any of these held.  Taking a reference
+ * is relaxed, since its taker already holds one.  Releasing one is a
+ * release, and the thread that drops the last reference issues an
+ * acquire fence before tearing the object down, so that it sees every
+ * other holder's writes.
+ *
+ * Because a client's lock is dropped before an invitation's lock is
+ * taken, an invitation found in a list is referenced first and then
+ * checked again, by its state, once locked.  Packets sent by an
+ * operation are corked until the invitation has been unlocked, so no
+ * network write is made while it is held.  The last reference to an
+ * INVITATION is never dropped with a client's lock held.
  */
-CLIENT *client_create(CLIENT_REGISTRY *creg, int fd) {
-  if (is_sem_init == 0) {
-    info("Initializing semaphores");
-    for (int i = 0; i < CLIENT_SEM_FUNCTIONS; i++) {
-      if (sem_init(&semaphores[i], 0, 1) != 0) {
-        error("did not init sem correctly");
-        return NULL;
-      }
+
+// how many ticks a client may stay silent, or 0 if idle clients are kept
+static uint64_t idle_ticks = 0;
+
+/*
+ * Check an idle timer.  The timer is not moved for every packet the
+ * client sends; instead, when it fires early it is armed again for
+ * whatever is left of the timeout since the last packet.  A client that
+ * really has been idle for the whole timeout has its socket shut down,
+ * as creg_shutdown_all() does, and is unregistered by whatever services
+ * its connection once that sees the EOF.
+ */
+static void client_idle_expired(TW_TIMER *timer) {
+  CLIENT *client = (CLIENT *)((char *)timer - offsetof(CLIENT, idle_timer));
+  uint64_t idle = tw_now() - atomic_load_explicit(&client->last_active, memory_order_relaxed);
+  if (idle < idle_ticks) {
+    tw_arm(timer, idle_ticks - idle);
+    return;
+  }
+  info("Reaping client on fd %d after %lu idle ticks", client->fd, (unsigned long)idle);
+  stats_inc(STAT_IDLE_REAPED);
+  shutdown(client->fd, SHUT_RD);
+}
+
+/*
+ * Reap clients that send nothing for a while.  This only applies to
+ * clients created afterwards, and needs the timer wheel to be running.
+ *
+ * @param ms  How long a client may stay idle, in milliseconds.
+ */
+void client_set_idle_timeout(long ms) {
+  idle_ticks = tw_ticks(ms);
+}
+
+/*
+ * Note that a packet has been received from a client.
+ */
+void client_touch(CLIENT *client) {
+  if (idle_ticks > 0) {
+    atomic_store_explicit(&client->last_active, tw_now(), memory_order_relaxed);
+  }
+}
+
+/*
+ * Stop watching a client for idleness.  Once this returns, the client's
+ * socket will not be shut down by the reaper, so its descriptor may be
+ * closed.
+ */
+void client_disarm_idle(CLIENT *client) {
+  if (idle_ticks > 0) {
+    tw_cancel(&client->idle_timer);
+  }
+}
+
+/*
+ * Initialize the semaphores, before the first client is created.
+ */
+static void client_init_semaphores(void) {
+  info("Initializing semaphores");
+  for (int i = 0; i < CLIENT_SEM_FUNCTIONS; i++) {
+    if (sem_init(&semaphores[i], 0, 1) != 0) {
+      error("did not init sem correctly");
+      return;
     }
   }
+  is_sem_init = 1;
+}
+
+/*
+ * Allocate and initialize the parts of a CLIENT that every client has.
+ * The returned CLIENT has no references yet, and no way of sending.
+ */
+static CLIENT *client_new(CLIENT_REGISTRY *creg, int fd) {
+  // clients are created on many threads, and a semaphore must not be
+  // initialized again while it is being waited on
+  pthread_once(&sem_once, client_init_semaphores);
+  if (is_sem_init == 0) {
+    return NULL;
+  }
 
   CLIENT *client = calloc(1, sizeof(CLIENT));
   debug("Creating new client on fd: %d", fd);
@@ -106,17 +218,174 @@ CLIENT *client_create(CLIENT_REGISTRY *creg, int fd) {
   // info("Initializing client");
   client->fd = fd;
   client->logged_in = CLIENT_LOGGED_OUT;
-  client->ref_count = 0;
+  atomic_init(&client->ref_count, 0);
   client->id_usage = 0;
   client->cr = creg;
   client->player = NULL;
   client->invite_head = NULL;
+  client->codec = &proto_codec_v1;
+  return client;
+}
+
+/*
+ * Create a new CLIENT object with a specified file descriptor with which
+ * to communicate with the client.  The returned CLIENT has a reference
+ * count of one and is in the logged-out state.
+ *
+ * @param creg  The client registry in which to create the client.
+ * @param fd  File descriptor of a socket to be used for communicating
+ * with the client.
+ * @return  The newly created CLIENT objectlo, if creation is successful,
+ * otherwise NULL.
+ */
+CLIENT *client_create(CLIENT_REGISTRY *creg, int fd) {
+  CLIENT *client = client_new(creg, fd);
+  if (client == NULL) {
+    return NULL;
+  }
+  client->outq = outq_create(fd);
+  if (client->outq == NULL && outq_started()) {
+    // a sender would have to wait on the socket itself
+    error("Failed to create outbound queue for fd %d", fd);
+    pthread_mutex_destroy(&client->lock);
+    free(client->available_ids);
+    free(client);
+    return NULL;
+  }
+  if (idle_ticks > 0) {
+    atomic_init(&client->last_active, tw_now());
+    tw_init(&client->idle_timer, client_idle_expired);
+    tw_arm(&client->idle_timer, idle_ticks);
+  }
   client_ref(client, "client_create");
   return client;
 }
 
+/*
+ * Create a CLIENT for a session of a multiplexed connection, and add it
+ * to the sessions of the connection's own client.  It shares the
+ * connection's socket, outbound queue and framing, and is not watched
+ * for idleness on its own.  The returned CLIENT has a reference count of
+ * one and is in the logged-out state.
+ *
+ * @param creg  The client registry in which to create the client.
+ * @param conn  The client of the connection.
+ * @param session  The number of the session, from 1 up to (but not
+ * including) CLIENT_MAX_SESSIONS.
+ * @return  The newly created CLIENT, or NULL if the number is out of
+ * range or already taken, or on error.
+ */
+CLIENT *client_create_session(CLIENT_REGISTRY *creg, CLIENT *conn, int session) {
+  if (session <= 0 || session >= CLIENT_MAX_SESSIONS) {
+    return NULL;
+  }
+  pthread_mutex_lock(&conn->lock);
+  if (session >= conn->sessions_cap) {
+    int cap = conn->sessions_cap ? conn->sessions_cap : 16;
+    while (cap <= session) {
+      cap *= 2;
+    }
+    CLIENT **sessions = realloc(conn->sessions, cap * sizeof(CLIENT *));
+    if (sessions == NULL) {
+      pthread_mutex_unlock(&conn->lock);
+      return NULL;
+    }
+    memset(sessions + conn->sessions_cap, 0, (cap - conn->sessions_cap) * sizeof(CLIENT *));
+    conn->sessions = sessions;
+    conn->sessions_cap = cap;
+  }
+  CLIENT *client = conn->sessions[session] == NULL ? client_new(creg, conn->fd) : NULL;
+  if (client != NULL) {
+    client->conn = conn;
+    client->session = session;
+    client->codec = conn->codec;
+    client->caps = conn->caps;
+    atomic_init(&client->stamp, atomic_load_explicit(&conn->stamp, memory_order_relaxed));
+    conn->sessions[session] = client;
+    // the session keeps the connection's client alive
+    client_ref(conn, "session of connection");
+    client_ref(client, "client_create_session");
+  }
+  pthread_mutex_unlock(&conn->lock);
+  return client;
+}
+
+/*
+ * Get the number of a client's session.
+ *
+ * @return the number, or 0 if the client is that of a connection.
+ */
+int client_session_id(CLIENT *client) {
+  return client->session;
+}
+
+/*
+ * Find a session of a multiplexed connection by number.  The reference
+ * count is NOT incremented; the session stays valid until it is removed.
+ *
+ * @return the CLIENT of the session, or NULL if there is no such session.
+ */
+CLIENT *client_get_session(CLIENT *conn, int session) {
+  pthread_mutex_lock(&conn->lock);
+  CLIENT *client = session > 0 && session < conn->sessions_cap ? conn->sessions[session] : NULL;
+  pthread_mutex_unlock(&conn->lock);
+  return client;
+}
+
+/*
+ * Remove a session from its connection, when it ends.  It should then
+ * be unregistered.
+ *
+ * @param session  The number of the session, or 0 for any one of them.
+ * @return the CLIENT of the session that was removed, or NULL if there
+ * was none.
+ */
+CLIENT *client_remove_session(CLIENT *conn, int session) {
+  CLIENT *client = NULL;
+  pthread_mutex_lock(&conn->lock);
+  for (int i = session > 0 ? session : 1; i < conn->sessions_cap; i++) {
+    if (conn->sessions[i] != NULL) {
+      client = conn->sessions[i];
+      conn->sessions[i] = NULL;
+      break;
+    }
+    if (session > 0) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&conn->lock);
+  return client;
+}
+
+/*
+ * List the sessions of a multiplexed connection, in order of number.
+ * Nothing may be servicing the connection.
+ *
+ * @param sessionsp  Set to a malloc'ed array of their CLIENTs, which
+ * are not referenced on its behalf.
+ * @return the number of sessions, or -1 if memory ran out.
+ */
+int client_list_sessions(CLIENT *conn, CLIENT ***sessionsp) {
+  pthread_mutex_lock(&conn->lock);
+  int n = 0;
+  for (int i = 1; i < conn->sessions_cap; i++) {
+    n += conn->sessions[i] != NULL;
+  }
+  CLIENT **sessions = calloc(n + 1, sizeof(CLIENT *));
+  if (sessions != NULL) {
+    n = 0;
+    for (int i = 1; i < conn->sessions_cap; i++) {
+      if (conn->sessions[i] != NULL) {
+        sessions[n++] = conn->sessions[i];
+      }
+    }
+  }
+  pthread_mutex_unlock(&conn->lock);
+  *sessionsp = sessions;
+  return sessions != NULL ? n : -1;
+}
+
 int post_player_results(CLIENT *client, CLIENT *opponent, GAME_ROLE client_role, GAME_ROLE winner) {
-  sem_wait(&semaphores[CLIENT_UPDATE_ELO]);
   // post results
   PLAYER *player1 = NULL;
   PLAYER *player2 = NULL;
@@ -130,18 +399,18 @@ int post_player_results(CLIENT *client, CLIENT *opponent, GAME_ROLE client_role,
   }
   if (player1 == NULL || player2 == NULL) {
     error("Failed to get players");
-    sem_post(&semaphores[CLIENT_UPDATE_ELO]);
     return -1;
   }
   
   player_post_result(player1, player2, winner);
-  sem_post(&semaphores[CLIENT_UPDATE_ELO]);
   return 0;
 }
 
-int get_available_id(CLIENT *client) {
-  // sem_wait(&semaphores[CLIENT_ID_NUM]);
-  pthread_mutex_lock(&client->lock);
+/*
+ * Take the lowest ID that is not in use for one of a client's invitations.
+ * The caller must hold the client's lock.
+ */
+static int get_available_id(CLIENT *client) {
   int id = -1;
   if (client->id_usage >= client->current_id_size) {
     client->current_id_size *= 2;
@@ -166,22 +435,20 @@ int get_available_id(CLIENT *client) {
     client->id_usage++;
     break;
   }
-  // sem_post(&semaphores[CLIENT_ID_NUM]);
-  pthread_mutex_unlock(&client->lock);
   return id;
 }
 
-void purge_id(CLIENT *client, int id) {
-  // sem_wait(&semaphores[CLIENT_ID_NUM]);
-  pthread_mutex_lock(&client->lock);
+/*
+ * Give back an ID taken by get_available_id().  The caller must hold the
+ * client's lock.
+ */
+static void purge_id(CLIENT *client, int id) {
   if (id >= client->current_id_size) {
     error("id is out of bounds");
     return;
   }
   client->available_ids[id] = id;
   client->id_usage--;
-  pthread_mutex_unlock(&client->lock);
-  // sem_post(&semaphores[CLIENT_ID_NUM]);
 }
 
 int client_get_invitation_id(CLIENT *client, INVITATION *inv) {
@@ -203,6 +470,13 @@ int client_get_invitation_id(CLIENT *client, INVITATION *inv) {
   return -1;
 }
 
+/*
+ * Find one of a client's invitations by its ID.  The reference count of
+ * the INVITATION is incremented, so that it stays valid once the
+ * client's lock has been released; the caller must inv_unref() it.
+ *
+ * @return the INVITATION, or NULL if the client has none with that ID.
+ */
 INVITATION *client_get_invitation(CLIENT *client, int id) {
   pthread_mutex_lock(&client->lock);
   INVITATION_NODE *node = client->invite_head;
@@ -213,7 +487,7 @@ INVITATION *client_get_invitation(CLIENT *client, int id) {
   }
   while (node != NULL) {
     if (node->id == id) {
-      INVITATION *inv = node->invitation;
+      INVITATION *inv = inv_ref(node->invitation, "invitation looked up");
       pthread_mutex_unlock(&client->lock);
       return inv;
     }
@@ -234,11 +508,10 @@ INVITATION *client_get_invitation(CLIENT *client, int id) {
  * @return  The same CLIENT that was passed as a parameter.
  */
 CLIENT *client_ref(CLIENT *client, char *why) {
-  pthread_mutex_lock(&client->lock);
+  int count = atomic_fetch_add_explicit(&client->ref_count, 1, memory_order_relaxed);
   debug("Increase reference count on client %p (%d -> %d) for %s", client,
-        client->ref_count, client->ref_count + 1, why);
-  client->ref_count++;
-  pthread_mutex_unlock(&client->lock);
+        count, count + 1, why);
+  (void)count;
   return client;
 }
 
@@ -253,16 +526,22 @@ CLIENT *client_ref(CLIENT *client, char *why) {
  * the reference counting.
  */
 void client_unref(CLIENT *client, char *why) {
-  pthread_mutex_lock(&client->lock);
+  int count = atomic_fetch_sub_explicit(&client->ref_count, 1, memory_order_release);
   debug("Decrease reference count on client %p (%d -> %d) for %s", client,
-        client->ref_count, client->ref_count-1, why);
-  client->ref_count--;
-  pthread_mutex_unlock(&client->lock);
-  if (client->ref_count == 0) {
+        count, count - 1, why);
+  if (count == 1) {
+    atomic_thread_fence(memory_order_acquire);
     if (client->logged_in == CLIENT_LOGGED_IN) {
       client_logout(client);
     }
     free(client->available_ids);
+    free(client->sessions);
+    if (client->outq != NULL) {
+      outq_unref(client->outq);
+    }
+    if (client->conn != NULL) {
+      client_unref(client->conn, "session ended");
+    }
     pthread_mutex_destroy(&client->lock);
     // for (int i = 0; i < CLIENT_SEM_FUNCTIONS; i++) {
     //   sem_destroy(&semaphores[i]);
@@ -287,42 +566,40 @@ void client_unref(CLIENT *client, char *why) {
  * @return 0 if the login operation is successful, otherwise -1.
  */
 int client_login(CLIENT *client, PLAYER *player) {
-  sem_wait(&semaphores[CLIENT_LOGIN_SEM]);
+  char *name = player_get_name(player);
+  pthread_mutex_lock(&client->lock);
   // check if client is already logged in
   if (client->logged_in != CLIENT_LOGGED_OUT) {
+    pthread_mutex_unlock(&client->lock);
     error("client is already logged in");
     return -1;
   }
-
-  // check if player is already logged in
-  PLAYER **players = creg_all_players(client->cr);
-  PLAYER **players_copy = players;
-  char *name = player_get_name(player);
-  int logged_in = 0;
-  while (*players != NULL) {
-    if (strcmp(player_get_name(*players), name) == 0) {
-      debug("player already logged in");
-      logged_in = 1;
-    }
-    player_unref(*players, "searching if player is already logged in");
-    players++;
-  }
-  free(players_copy);
-  if (logged_in) {
-    error("Player is currently logged in");
-    sem_post(&semaphores[CLIENT_LOGIN_SEM]);
-    return -1;
-  }
-  // player is not logged in, so log in
-  pthread_mutex_lock(&client->lock);
+  // nobody can find the client to invite it until it is in the name index,
+  // so it may count as logged in already; readers of the index expect to
+  // find the player set
   client->player = player;
   player_ref(player, "Player is now referenced by client after login");
-  pthread_mutex_unlock(&client->lock);
   client->logged_in = CLIENT_LOGGED_IN;
-  sem_post(&semaphores[CLIENT_LOGIN_SEM]);
+  pthread_mutex_unlock(&client->lock);
+  // claim the name: of the clients logging in as one player at once, the
+  // one whose entry goes in first wins
+  if (creg_add_name(client->cr, client, name) == -1) {
+    error("Player %s is currently logged in", name);
+    pthread_mutex_lock(&client->lock);
+    client->player = NULL;
+    client->logged_in = CLIENT_LOGGED_OUT;
+    pthread_mutex_unlock(&client->lock);
+    player_unref(player, "Player not logged in after all");
+    return -1;
+  }
   return 0;
 }
 
+// an operation on an invitation, run by client_inv_op() with it locked
+typedef int CLIENT_INV_OP(CLIENT *client, INVITATION *inv, int id, void *arg);
+static int client_inv_op(CLIENT *client, int id, CLIENT_INV_OP *op, void *arg);
+static int client_abandon_locked(CLIENT *client, INVITATION *inv, int id, void *arg);
+
 /*
  * Log out this CLIENT.  If the client was not logged in, then it is
  * an error.  The reference to the PLAYER that the CLIENT was logged
@@ -336,36 +613,40 @@ int client_login(CLIENT *client, PLAYER *player) {
  * logged out, otherwise -1.
  */
 int client_logout(CLIENT *client) {
+  pthread_mutex_lock(&client->lock);
   // check if not logged in
   if (client->logged_in != CLIENT_LOGGED_IN) {
+    pthread_mutex_unlock(&client->lock);
     debug("client is not logged in");
     return -1;
   }
   info("Client [%s] is logging out", player_get_name(client->player));
-  // lock semaphore
-  sem_wait(&semaphores[CLIENT_LOGOUT_SEM]);
-  // revoke or decline invitations
-  INVITATION_NODE *node = client->invite_head;
-  while (node != NULL) {
-    // resign or decline all games
-    INVITATION *inv = node->invitation;
-    GAME* game = inv_get_game(inv);
-    INVITATION_NODE *next = node->next;
-    if (game != NULL) {
-      client_resign_game(client, node->id);
-    } else {
-      if (inv_get_source(inv) == client) {
-        client_revoke_invitation(client, node->id);
-      } else {
-        client_decline_invitation(client, node->id);
-      }
-    }
-    node = next;
+  // from here on no invitation can be added to the list, so the IDs in
+  // it now are all that have to be given up
+  client->logged_in = CLIENT_LOGGING_OUT;
+  int nids = 0;
+  for (INVITATION_NODE *node = client->invite_head; node != NULL; node = node->next) {
+    nids++;
+  }
+  int *ids = calloc(nids + 1, sizeof(int));
+  nids = 0;
+  for (INVITATION_NODE *node = client->invite_head; ids != NULL && node != NULL;
+       node = node->next) {
+    ids[nids++] = node->id;
   }
+  pthread_mutex_unlock(&client->lock);
+  creg_remove_name(client->cr, client, player_get_name(client->player));
+  if (ids == NULL) {
+    error("Failed to list invitations of client logging out");
+  }
+  // revoke or decline invitations, and resign games; any the opponent
+  // has closed meanwhile are no longer found
+  for (int i = 0; i < nids; i++) {
+    client_inv_op(client, ids[i], client_abandon_locked, NULL);
+  }
+  free(ids);
   player_unref(client->player, "client logging out of player -> removing player reference");
-  // unlock semaphore
   client->logged_in = CLIENT_LOGGED_OUT;
-  sem_post(&semaphores[CLIENT_LOGOUT_SEM]);
   return 0;
 }
 
@@ -396,6 +677,228 @@ PLAYER *client_get_player(CLIENT *client) {
  */
 int client_get_fd(CLIENT *client) { return client->fd; }
 
+/*
+ * Packets held for one client while the calling thread is corked.  The
+ * held headers and payloads are copied back to back into one byte buffer
+ * (each header aligned for its fields), and the packet descriptors are
+ * filled in when the thread is uncorked, after the buffer has stopped
+ * moving.  Targets are reused from one cork to the next and keep their
+ * storage, so once a thread has warmed up, holding packets allocates
+ * nothing.
+ */
+typedef struct cork_target {
+  CLIENT *client;
+  PROTO_PACKET *pkts;
+  int npkts;
+  int cap;
+  char *bytes;
+  size_t len;
+  size_t size;
+} CORK_TARGET;
+
+/*
+ * The cork of a thread: how deeply client_cork() calls are nested, and
+ * the packets held so far, grouped by client in order of first use.
+ */
+typedef struct cork {
+  int depth;
+  CORK_TARGET *targets;
+  int ntargets;
+  int cap;
+} CORK;
+
+static __thread CORK cork;
+
+// headers copied on the stack when packets are stamped
+#define CLIENT_STAMP_BATCH 8
+
+#define CORK_ALIGN(n) (((n) + _Alignof(JEUX_PACKET_HEADER) - 1) & ~(_Alignof(JEUX_PACKET_HEADER) - 1))
+
+/*
+ * Find the packets held for a client, if there are any.
+ */
+static CORK_TARGET *cork_target(CLIENT *client) {
+  for (int i = 0; i < cork.ntargets; i++) {
+    if (cork.targets[i].client == client) {
+      return &cork.targets[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Hold a copy of packets for a client until the thread is uncorked.
+ *
+ * @return 0 if the packets are held, -1 if memory ran out.
+ */
+static int cork_hold(CLIENT *client, PROTO_PACKET *pkts, int npkts) {
+  CORK_TARGET *t = cork_target(client);
+  if (t == NULL) {
+    if (cork.ntargets == cork.cap) {
+      int cap = cork.cap ? 2 * cork.cap : 4;
+      CORK_TARGET *targets = realloc(cork.targets, cap * sizeof(CORK_TARGET));
+      if (targets == NULL) {
+        return -1;
+      }
+      memset(targets + cork.cap, 0, (cap - cork.cap) * sizeof(CORK_TARGET));
+      cork.targets = targets;
+      cork.cap = cap;
+    }
+    t = &cork.targets[cork.ntargets++];
+    t->client = client;
+    // keep the client alive until its packets have been sent
+    client_ref(client, "cork");
+  }
+  if (t->npkts + npkts > t->cap) {
+    int cap = t->cap ? t->cap : 4;
+    while (cap < t->npkts + npkts) {
+      cap *= 2;
+    }
+    PROTO_PACKET *held = realloc(t->pkts, cap * sizeof(PROTO_PACKET));
+    if (held == NULL) {
+      return -1;
+    }
+    t->pkts = held;
+    t->cap = cap;
+  }
+  size_t need = t->len;
+  for (int i = 0; i < npkts; i++) {
+    need = CORK_ALIGN(need) + sizeof(JEUX_PACKET_HEADER) + ntohs(pkts[i].hdr->size);
+  }
+  if (need > t->size) {
+    size_t size = t->size ? t->size : 256;
+    while (size < need) {
+      size *= 2;
+    }
+    char *bytes = realloc(t->bytes, size);
+    if (bytes == NULL) {
+      return -1;
+    }
+    t->bytes = bytes;
+    t->size = size;
+  }
+  for (int i = 0; i < npkts; i++) {
+    size_t size = ntohs(pkts[i].hdr->size);
+    t->len = CORK_ALIGN(t->len);
+    memcpy(t->bytes + t->len, pkts[i].hdr, sizeof(JEUX_PACKET_HEADER));
+    t->len += sizeof(JEUX_PACKET_HEADER);
+    if (size > 0) {
+      memcpy(t->bytes + t->len, pkts[i].data, size);
+      t->len += size;
+    }
+    t->npkts++;
+  }
+  return 0;
+}
+
+/*
+ * Send packets to a client as they are, or hold them if the calling
+ * thread is corked.
+ */
+static int client_send_raw(CLIENT *client, PROTO_PACKET *pkts, int npkts) {
+  if (cork.depth > 0) {
+    return cork_hold(client, pkts, npkts);
+  }
+  if (client->outq != NULL) {
+    return outq_send(client->outq, pkts, npkts);
+  }
+  pthread_mutex_lock(&client->lock);
+  int ret = proto_send_packets_codec(client->fd, client->codec, pkts, npkts);
+  pthread_mutex_unlock(&client->lock);
+  return ret;
+}
+
+/*
+ * Send packets with their headers stamped: with the number of a session,
+ * for a multiplexed connection, and with the correlation ID of the
+ * request they answer in any ACK or NACK among them, for a correlated
+ * one.  They go through the client of the connection.  The headers are
+ * copied, so that the caller's are left as they were.  Packets held by a
+ * corked thread are held for the connection, so that those of all its
+ * sessions leave together.
+ */
+static int client_send_stamped(CLIENT *conn, int session, int correlation, PROTO_PACKET *pkts,
+                               int npkts) {
+  JEUX_PACKET_HEADER local_hdrs[CLIENT_STAMP_BATCH];
+  PROTO_PACKET local_pkts[CLIENT_STAMP_BATCH];
+  JEUX_PACKET_HEADER *hdrs = local_hdrs;
+  PROTO_PACKET *stamped = local_pkts;
+  if (npkts > CLIENT_STAMP_BATCH) {
+    hdrs = malloc(npkts * (sizeof(JEUX_PACKET_HEADER) + sizeof(PROTO_PACKET)));
+    if (hdrs == NULL) {
+      return -1;
+    }
+    stamped = (PROTO_PACKET *)(hdrs + npkts);
+  }
+  for (int i = 0; i < npkts; i++) {
+    hdrs[i] = *pkts[i].hdr;
+    int response = hdrs[i].type == JEUX_ACK_PKT || hdrs[i].type == JEUX_NACK_PKT;
+    hdrs[i].timestamp_sec = htonl(session);
+    hdrs[i].timestamp_nsec = htonl(response ? correlation : 0);
+    stamped[i].hdr = &hdrs[i];
+    stamped[i].data = pkts[i].data;
+  }
+  int ret = client_send_raw(conn, stamped, npkts);
+  if (hdrs != local_hdrs) {
+    free(hdrs);
+  }
+  return ret;
+}
+
+/*
+ * Start a batching scope on the calling thread.  Until the matching
+ * client_uncork(), packets sent to any client from this thread are held
+ * rather than sent.  Scopes may be nested; only the outermost one sends.
+ */
+void client_cork(void) {
+  cork.depth++;
+}
+
+/*
+ * Send the packets held for each client to it with a single
+ * client_send_packets(), so that everything one request produced for a
+ * connection leaves as one write (and, if it fits, one segment), in the
+ * order it was sent.
+ */
+static void cork_flush(void) {
+  // sent from within a scope, the packets are not to be held again
+  int depth = cork.depth;
+  cork.depth = 0;
+  for (int i = 0; i < cork.ntargets; i++) {
+    CORK_TARGET *t = &cork.targets[i];
+    size_t off = 0;
+    for (int j = 0; j < t->npkts; j++) {
+      off = CORK_ALIGN(off);
+      JEUX_PACKET_HEADER *hdr = (JEUX_PACKET_HEADER *)(t->bytes + off);
+      off += sizeof(JEUX_PACKET_HEADER);
+      t->pkts[j].hdr = hdr;
+      t->pkts[j].data = hdr->size ? t->bytes + off : NULL;
+      off += ntohs(hdr->size);
+    }
+    if (client_send_raw(t->client, t->pkts, t->npkts) == -1) {
+      debug("Failed to send %d held packets", t->npkts);
+    }
+    client_unref(t->client, "uncork");
+    // keep the storage for the next cork
+    t->client = NULL;
+    t->npkts = 0;
+    t->len = 0;
+  }
+  cork.ntargets = 0;
+  cork.depth = depth;
+}
+
+/*
+ * End a batching scope.  When the outermost scope ends, the packets held
+ * are sent, as cork_flush() does.
+ */
+void client_uncork(void) {
+  if (--cork.depth > 0) {
+    return;
+  }
+  cork_flush();
+}
+
 /*
  * Send a packet to a client.  Exclusive access to the network connection
  * is obtained for the duration of this operation, to prevent concurrent
@@ -409,51 +912,205 @@ int client_get_fd(CLIENT *client) { return client->fd; }
  * @return 0 if transmission succeeds, -1 otherwise.
  */
 int client_send_packet(CLIENT *player, JEUX_PACKET_HEADER *pkt, void *data) {
-  pthread_mutex_lock(&player->lock);
-  int ret = proto_send_packet(player->fd, pkt, data);
-  pthread_mutex_unlock(&player->lock);
-  return ret;
+  PROTO_PACKET p = {.hdr = pkt, .data = data};
+  return client_send_packets(player, &p, 1);
 }
 
 /*
- * Send an ACK packet to a client.  This is a convenience function that
- * streamlines a common case.
+ * Send several packets to a client in one operation.  No other packet
+ * can be interleaved with the batch.  If the client has an outbound
+ * queue, the packets go through it and this returns without waiting
+ * for the client's socket.  If the calling thread is corked, the packets
+ * are held until it is uncorked.
  *
- * @param client  The CLIENT who should be sent the packet.
- * @param data  Pointer to the optional data payload for this packet,
- * or NULL if there is to be no payload.
- * @param datalen  Length of the data payload, or 0 if there is none.
- * @return 0 if transmission succeeds, -1 otherwise.
+ * @param client  The CLIENT who should be sent the packets.
+ * @param pkts  The packets to be sent, in order.
+ * @param npkts  The number of packets.
+ * @return 0 if transmission succeeds (or the packets were queued),
+ * -1 otherwise.
  */
-int client_send_ack(CLIENT *client, void *data, size_t datalen) {
+int client_send_packets(CLIENT *client, PROTO_PACKET *pkts, int npkts) {
+  if (atomic_load_explicit(&client->stamp, memory_order_relaxed)) {
+    return client_send_stamped(client->conn != NULL ? client->conn : client, client->session,
+                               atomic_load_explicit(&client->correlation, memory_order_relaxed),
+                               pkts, npkts);
+  }
+  return client_send_raw(client, pkts, npkts);
+}
+
+/*
+ * Send packets to a client, and then switch the framing of everything
+ * sent to it afterwards, and of everything received from it after the
+ * packet being handled, to another codec.  No packet sent by another
+ * thread can come between the two.  If the calling thread is corked, the
+ * packets it holds are sent first, and these are not held.
+ *
+ * @param client  The CLIENT whose framing is to change.
+ * @param pkts  The packets to be sent in the old framing.
+ * @param npkts  The number of packets, which may be zero.
+ * @param codec  The codec for everything that follows.
+ * @return 0 if transmission succeeds (or the packets were queued),
+ * -1 otherwise.
+ */
+int client_send_switch(CLIENT *client, PROTO_PACKET *pkts, int npkts, const PROTO_CODEC *codec) {
+  if (client->conn != NULL) {
+    // a session always has the framing of its connection
+    return npkts > 0 ? client_send_packets(client, pkts, npkts) : 0;
+  }
+  if (cork.depth > 0) {
+    // what is held is in the old framing, and what the client sends next
+    // has to be read in the new one at once, so nothing waits for the
+    // cork: a switch is made once per connection at most
+    cork_flush();
+  }
+  int ret = 0;
   pthread_mutex_lock(&client->lock);
-  JEUX_PACKET_HEADER *pkt = create_header(JEUX_ACK_PKT, 0, 0, datalen);
-  int ret = proto_send_packet(client->fd, pkt, data);
-  free(pkt);
+  if (client->outq != NULL) {
+    ret = outq_send_switch(client->outq, pkts, npkts, codec);
+  } else if (npkts > 0) {
+    ret = proto_send_packets_codec(client->fd, client->codec, pkts, npkts);
+  }
+  if (client->codec != codec) {
+    debug("client on fd %d now uses %s framing", client->fd, codec->name);
+  }
+  client->codec = codec;
+  atomic_store_explicit(&client->stamp, codec->caps & (PROTO_CAP_MUX | PROTO_CAP_CORRELATION),
+                        memory_order_relaxed);
   pthread_mutex_unlock(&client->lock);
   return ret;
 }
 
 /*
- * Send an NACK packet to a client.  This is a convenience function that
- * streamlines a common case.
- *
- * @param client  The CLIENT who should be sent the packet.
- * @return 0 if transmission succeeds, -1 otherwise.
+ * Set the capabilities a client was granted at login.  The framing they
+ * select is switched separately, by client_send_switch().
  */
-int client_send_nack(CLIENT *client) {
+void client_set_caps(CLIENT *client, int caps) {
   pthread_mutex_lock(&client->lock);
-  JEUX_PACKET_HEADER *pkt = create_header(JEUX_NACK_PKT, 0, 0, 0);
-  int ret = proto_send_packet(client->fd, pkt, NULL);
-  free(pkt);
+  client->caps = caps;
   pthread_mutex_unlock(&client->lock);
-  return ret;
 }
 
 /*
- * Add an INVITATION to the list of outstanding invitations for a
- * specified CLIENT.  A reference to the INVITATION is retained by
- * the CLIENT and the reference count of the INVITATION is
+ * Get the capabilities a client was granted at login.
+ */
+int client_get_caps(CLIENT *client) {
+  pthread_mutex_lock(&client->lock);
+  int caps = client->caps;
+  pthread_mutex_unlock(&client->lock);
+  return caps;
+}
+
+/*
+ * Get the codec that frames packets to and from a client.
+ */
+const PROTO_CODEC *client_get_codec(CLIENT *client) {
+  pthread_mutex_lock(&client->lock);
+  const PROTO_CODEC *codec = client->codec;
+  pthread_mutex_unlock(&client->lock);
+  return codec;
+}
+
+/*
+ * Stop sending to a client whose connection is finished.  Packets still
+ * waiting in its outbound queue are discarded.
+ */
+void client_close_output(CLIENT *client) {
+  if (client->outq != NULL) {
+    outq_close(client->outq);
+  }
+}
+
+/*
+ * Copy what has been sent to a client but has not yet left its outbound
+ * queue, so that another server process can send it instead.  Nothing
+ * may be sending to the client, and the queue writers must be paused.
+ *
+ * @param lenp  Set to the number of bytes copied.
+ * @return the malloc'ed bytes, or NULL if there are none (or memory ran
+ * out, in which case *lenp is nonzero).
+ */
+char *client_save_output(CLIENT *client, size_t *lenp) {
+  *lenp = 0;
+  if (client->outq == NULL) {
+    return NULL;
+  }
+  return outq_save(client->outq, lenp);
+}
+
+/*
+ * Send a client the bytes saved by client_save_output() in another server
+ * process, before anything else is sent to it.
+ *
+ * @return 0 if the bytes were sent (or queued), -1 otherwise.
+ */
+int client_restore_output(CLIENT *client, const char *bytes, size_t len) {
+  if (client->outq != NULL) {
+    return outq_restore(client->outq, bytes, len);
+  }
+  pthread_mutex_lock(&client->lock);
+  ssize_t n = rio_writen(client->fd, (void *)bytes, len);
+  pthread_mutex_unlock(&client->lock);
+  return n == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * Send an ACK packet to a client.  This is a convenience function that
+ * streamlines a common case.
+ *
+ * @param client  The CLIENT who should be sent the packet.
+ * @param data  Pointer to the optional data payload for this packet,
+ * or NULL if there is to be no payload.
+ * @param datalen  Length of the data payload, or 0 if there is none.
+ * @return 0 if transmission succeeds, -1 otherwise.
+ */
+int client_send_ack(CLIENT *client, void *data, size_t datalen) {
+  JEUX_PACKET_HEADER pkt;
+  init_header(&pkt, JEUX_ACK_PKT, 0, 0, datalen);
+  return client_send_packet(client, &pkt, data);
+}
+
+/*
+ * Send an NACK packet to a client.  This is a convenience function that
+ * streamlines a common case.
+ *
+ * @param client  The CLIENT who should be sent the packet.
+ * @return 0 if transmission succeeds, -1 otherwise.
+ */
+int client_send_nack(CLIENT *client) {
+  JEUX_PACKET_HEADER pkt;
+  init_header(&pkt, JEUX_NACK_PKT, 0, 0, 0);
+  return client_send_packet(client, &pkt, NULL);
+}
+
+/*
+ * Send a NACK under the number of a session of a multiplexed connection
+ * that has no CLIENT, because it could not be opened.
+ *
+ * @param conn  The client of the connection.
+ * @param session  The number of the session.
+ * @param correlation  The correlation ID of the request, or 0.
+ * @return 0 if transmission succeeds, -1 otherwise.
+ */
+int client_send_session_nack(CLIENT *conn, int session, int correlation) {
+  JEUX_PACKET_HEADER hdr;
+  init_header(&hdr, JEUX_NACK_PKT, 0, 0, 0);
+  PROTO_PACKET pkt = {.hdr = &hdr, .data = NULL};
+  return client_send_stamped(conn, session, correlation, &pkt, 1);
+}
+
+/*
+ * Note the correlation ID of the request from a client that is about to
+ * be handled.  On a correlated connection, the ACK or NACK sent to the
+ * client in answer carries it.
+ */
+void client_set_correlation(CLIENT *client, int correlation) {
+  atomic_store_explicit(&client->correlation, correlation, memory_order_relaxed);
+}
+
+/*
+ * Add an INVITATION to the list of outstanding invitations for a
+ * specified CLIENT.  A reference to the INVITATION is retained by
+ * the CLIENT and the reference count of the INVITATION is
  * incremented.  The invitation is assigned an integer ID,
  * which the client subsequently uses to identify the invitation.
  *
@@ -463,62 +1120,234 @@ int client_send_nack(CLIENT *client) {
  * was successfully added, otherwise -1.
  */
 int client_add_invitation(CLIENT *client, INVITATION *inv) {
-  sem_wait(&semaphores[CLIENT_INVITE_SEM]);
   INVITATION_NODE *node = calloc(1, sizeof(INVITATION_NODE));
+  if (node == NULL) {
+    return -1;
+  }
+  node->invitation = inv_ref(inv, "add invitation to client (client_add_invitation function)");
+  pthread_mutex_lock(&client->lock);
   // always assign the lowest available ID
-  node->id = get_available_id(client);
-  node->invitation = inv;
-  inv_ref(inv, "add invitation to client (client_add_invitation function)");
+  int id = node->id = get_available_id(client);
   node->next = client->invite_head;
-  pthread_mutex_lock(&client->lock);
   client->invite_head = node;
   pthread_mutex_unlock(&client->lock);
-  sem_post(&semaphores[CLIENT_INVITE_SEM]);
-  return node->id;
+  return id;
 }
 
 /*
- * Remove an invitation from the list of outstanding invitations
- * for a specified CLIENT.  The reference count of the invitation is
- * decremented to account for the discarded reference.
+ * Take an INVITATION out of a client's list and give back its ID.  The
+ * caller must hold the client's lock, and drop the list's reference to
+ * the invitation once it has released it.
  *
- * @param client  The client from which the invitation is to be removed.
- * @param inv  The invitation that is to be removed.
- * @return the CLIENT's id for the INVITATION, if it was successfully
- * removed, otherwise -1.
+ * @return the client's ID for the invitation, or -1 if it was not in the list.
  */
-int client_remove_invitation(CLIENT *client, INVITATION *inv) {
-  sem_wait(&semaphores[CLIENT_INVITE_SEM]);
-  INVITATION_NODE *node = client->invite_head;
-
-  if (node == NULL) {
-    sem_post(&semaphores[CLIENT_INVITE_SEM]);
-    return -1;
-  }
+static int client_unlink_invitation(CLIENT *client, INVITATION *inv) {
   INVITATION_NODE *prev = NULL;
-  while (node != NULL) {
+  for (INVITATION_NODE *node = client->invite_head; node != NULL; node = node->next) {
     if (node->invitation == inv) {
       if (prev == NULL) {
         client->invite_head = node->next;
       } else {
         prev->next = node->next;
       }
-      inv_unref(
-          inv,
-          "remove invitation from client (client_remove_invitation function)");
       int id = node->id;
       purge_id(client, id);
       free(node);
-      sem_post(&semaphores[CLIENT_INVITE_SEM]);
       return id;
     }
     prev = node;
-    node = node->next;
   }
-  sem_post(&semaphores[CLIENT_INVITE_SEM]);
   return -1;
 }
 
+/*
+ * Remove an invitation from the list of outstanding invitations
+ * for a specified CLIENT.  The reference count of the invitation is
+ * decremented to account for the discarded reference.
+ *
+ * @param client  The client from which the invitation is to be removed.
+ * @param inv  The invitation that is to be removed.
+ * @return the CLIENT's id for the INVITATION, if it was successfully
+ * removed, otherwise -1.
+ */
+int client_remove_invitation(CLIENT *client, INVITATION *inv) {
+  pthread_mutex_lock(&client->lock);
+  int id = client_unlink_invitation(client, inv);
+  pthread_mutex_unlock(&client->lock);
+  if (id != -1) {
+    inv_unref(inv, "remove invitation from client (client_remove_invitation function)");
+  }
+  return id;
+}
+
+/*
+ * Lock the source and target of an invitation together, the one at the
+ * lower address first.
+ */
+static void client_lock_pair(CLIENT *source, CLIENT *target) {
+  CLIENT *first = (uintptr_t)source < (uintptr_t)target ? source : target;
+  CLIENT *second = first == source ? target : source;
+  pthread_mutex_lock(&first->lock);
+  if (second != first) {
+    pthread_mutex_lock(&second->lock);
+  }
+}
+
+static void client_unlock_pair(CLIENT *source, CLIENT *target) {
+  pthread_mutex_unlock(&source->lock);
+  if (target != source) {
+    pthread_mutex_unlock(&target->lock);
+  }
+}
+
+/*
+ * Add a new INVITATION to the lists of both its source and its target at
+ * once, so that it is never in only one of them.  Nothing is added if
+ * either client has begun logging out, since it would never give the
+ * invitation up.
+ *
+ * @param inv  The INVITATION, which must be locked.
+ * @param source_idp  Set to the source's ID for the invitation.
+ * @param target_idp  Set to the target's ID for the invitation.
+ * @return 0 if the invitation was added, otherwise -1.
+ */
+static int client_add_pair(INVITATION *inv, int *source_idp, int *target_idp) {
+  CLIENT *source = inv_get_source(inv);
+  CLIENT *target = inv_get_target(inv);
+  INVITATION_NODE *snode = calloc(1, sizeof(INVITATION_NODE));
+  INVITATION_NODE *tnode = calloc(1, sizeof(INVITATION_NODE));
+  if (snode == NULL || tnode == NULL) {
+    free(snode);
+    free(tnode);
+    return -1;
+  }
+  client_lock_pair(source, target);
+  if (source->logged_in != CLIENT_LOGGED_IN || target->logged_in != CLIENT_LOGGED_IN) {
+    client_unlock_pair(source, target);
+    free(snode);
+    free(tnode);
+    error("Source or target of invitation is not logged in");
+    return -1;
+  }
+  *source_idp = snode->id = get_available_id(source);
+  *target_idp = tnode->id = get_available_id(target);
+  snode->invitation = inv_ref(inv, "add invitation to source");
+  tnode->invitation = inv_ref(inv, "add invitation to target");
+  snode->next = source->invite_head;
+  source->invite_head = snode;
+  tnode->next = target->invite_head;
+  target->invite_head = tnode;
+  client_unlock_pair(source, target);
+  return 0;
+}
+
+/*
+ * Remove a closed INVITATION from the lists of both its source and its
+ * target at once.
+ *
+ * @param inv  The INVITATION, which must be locked.
+ */
+static void client_remove_pair(INVITATION *inv) {
+  CLIENT *source = inv_get_source(inv);
+  CLIENT *target = inv_get_target(inv);
+  client_lock_pair(source, target);
+  int source_id = client_unlink_invitation(source, inv);
+  int target_id = client_unlink_invitation(target, inv);
+  client_unlock_pair(source, target);
+  // the caller's own reference keeps the invitation from being freed here
+  if (source_id == -1) {
+    error("Failed to remove invitation from source");
+  } else {
+    inv_unref(inv, "remove invitation from source");
+  }
+  if (target_id == -1) {
+    error("Failed to remove invitation from target");
+  } else {
+    inv_unref(inv, "remove invitation from target");
+  }
+}
+
+/*
+ * Run an operation on one of a client's invitations with the invitation
+ * locked.  Packets the operation sends are held until it has been
+ * unlocked.
+ *
+ * @param client  The CLIENT doing the operation.
+ * @param id  The ID assigned by the CLIENT to the INVITATION.
+ * @param op  The operation.
+ * @param arg  Passed to the operation.
+ * @return what the operation returns, or -1 if the client has no
+ * invitation with that ID.
+ */
+static int client_inv_op(CLIENT *client, int id, CLIENT_INV_OP *op, void *arg) {
+  INVITATION *inv = client_get_invitation(client, id);
+  if (inv == NULL) {
+    return -1;
+  }
+  client_cork();
+  inv_lock(inv);
+  int ret = op(client, inv, id, arg);
+  inv_unlock(inv);
+  client_uncork();
+  inv_unref(inv, "invitation operation done");
+  return ret;
+}
+
+/*
+ * End a timed game whose player to move has run out of time.  The game
+ * is resigned on that player's behalf, an ENDED packet is sent to each
+ * player, the result is posted, and the invitation is removed from the
+ * lists of both the source and the target.  The caller must hold the
+ * invitation's lock, and the invitation must still be in both lists.
+ *
+ * @param inv  The INVITATION containing the game.
+ * @param loser  The role of the player whose flag has fallen.
+ */
+static void client_end_on_time(INVITATION *inv, GAME_ROLE loser) {
+  warn("Flag fell for role %d (client end on time)", loser);
+  clock_stop(inv_get_clock(inv));
+  CLIENT *source = inv_get_source(inv);
+  CLIENT *target = inv_get_target(inv);
+  GAME_ROLE winner = loser == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+  if (inv_close(inv, loser) == -1) {
+    error("Failed to close invitation (client end on time)");
+    return;
+  }
+  JEUX_PACKET_HEADER ended;
+  init_header(&ended, JEUX_ENDED_PKT, client_get_invitation_id(source, inv), winner, 0);
+  if (client_send_packet(source, &ended, NULL) == -1) {
+    error("Failed to send ended packet to source");
+  }
+  init_header(&ended, JEUX_ENDED_PKT, client_get_invitation_id(target, inv), winner, 0);
+  if (client_send_packet(target, &ended, NULL) == -1) {
+    error("Failed to send ended packet to target");
+  }
+  post_player_results(source, target, inv_get_source_role(inv), winner);
+  info("Removing invitation from source and target (client end on time)");
+  client_remove_pair(inv);
+}
+
+/*
+ * Called on the timer thread when the alarm of a game clock goes off.
+ * The alarm's reference to the invitation is handed to this function.
+ */
+static void client_flag_fall(TW_TIMER *timer) {
+  GAME_CLOCK *clock = (GAME_CLOCK *)timer;
+  INVITATION *inv = clock->inv;
+  client_cork();
+  inv_lock(inv);
+  GAME_ROLE loser = clock_flag_fallen(clock);
+  if (loser != NULL_ROLE) {
+    client_end_on_time(inv, loser);
+  } else {
+    // a move was made, or the game ended, since the alarm was taken
+    clock_rearm(clock);
+  }
+  inv_unlock(inv);
+  client_uncork();
+  inv_unref(inv, "clock alarm went off");
+}
+
 /*
  * Make a new invitation from a specified "source" CLIENT to a specified
  * target CLIENT.  The invitation represents an offer to the target to
@@ -538,39 +1367,82 @@ int client_remove_invitation(CLIENT *client, INVITATION *inv) {
  */
 int client_make_invitation(CLIENT *source, CLIENT *target,
                            GAME_ROLE source_role, GAME_ROLE target_role) {
-  sem_wait(&semaphores[CLIENT_INVITE_OP_SEM]);
+  return client_make_timed_invitation(source, target, source_role, target_role, NULL);
+}
+
+/*
+ * Make a new invitation, as client_make_invitation() does, to a game
+ * that may be played with a time control.  The players' clocks start
+ * when the invitation is accepted.  A player whose time runs out loses
+ * the game, which is ended as if they had resigned, except that both
+ * players are sent ENDED.
+ *
+ * @param tc  The time control, or NULL for an untimed game.
+ * @return the ID assigned by the source to the INVITATION, if the operation
+ * is successful, otherwise -1.
+ */
+int client_make_timed_invitation(CLIENT *source, CLIENT *target,
+                                 GAME_ROLE source_role, GAME_ROLE target_role,
+                                 const TIME_CONTROL *tc) {
   INVITATION *invite = inv_create(source, target, source_role, target_role);
   if (invite == NULL) {
     error("invitation creation failed");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
     return -1;
   }
-  int source_id = client_add_invitation(source, invite);
-  if (source_id == -1) {
-    inv_unref(invite, "invitation add failed");
-    error("invitation add failed");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
-    return -1;
+  if (tc != NULL) {
+    GAME_CLOCK *clock = clock_create(invite, tc, client_flag_fall);
+    if (clock == NULL) {
+      inv_unref(invite, "clock creation failed");
+      return -1;
+    }
+    inv_set_clock(invite, clock);
   }
-  int target_id = client_add_invitation(target, invite);
-  if (target_id == -1) {
+  // nothing else is done with the invitation until the target has been
+  // told of it
+  client_cork();
+  inv_lock(invite);
+  int source_id, target_id;
+  if (client_add_pair(invite, &source_id, &target_id) == -1) {
+    inv_unlock(invite);
+    client_uncork();
+    inv_unref(invite, "invitation add failed");
     error("invitation add failed");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
     return -1;
   }
   // send invited packet
   char *playername = player_get_name(source->player);
-  JEUX_PACKET_HEADER *pkt = create_header(JEUX_INVITED_PKT, target_id,
-                                          target_role, strlen(playername));
-  if (client_send_packet(target, pkt, playername) == -1) {
+  JEUX_PACKET_HEADER pkt;
+  init_header(&pkt, JEUX_INVITED_PKT, target_id, target_role, strlen(playername));
+  if (client_send_packet(target, &pkt, playername) == -1) {
     error("Failed to send invited packet");
   }
-  free(pkt);
+  inv_unlock(invite);
+  client_uncork();
   inv_unref(invite, "Invitation made (client_make_invitation function)");
-  sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
   return source_id;
 }
 
+static int client_revoke_locked(CLIENT *client, INVITATION *inv, int id, void *arg) {
+  if (inv_close(inv, NULL_ROLE) == -1) {
+    error("Cannot close invitation");
+    return -1;
+  }
+  // get target
+  CLIENT *target = inv_get_target(inv);
+  // get target inv id
+  int target_id = client_get_invitation_id(target, inv);
+  // send revoked packet
+  JEUX_PACKET_HEADER pkt;
+  init_header(&pkt, JEUX_REVOKED_PKT, target_id, 0, 0);
+  if (client_send_packet(target, &pkt, NULL) == -1) {
+    error("Failed to send revoked packet");
+  }
+  // remove from both lists
+  debug("Removing invitation from source and target (client_revoke_invitation function)");
+  client_remove_pair(inv);
+  return 0;
+}
+
 /*
  * Revoke an invitation for which the specified CLIENT is the source.
  * The invitation is removed from the lists of invitations of its source
@@ -589,40 +1461,27 @@ int client_make_invitation(CLIENT *source, CLIENT *target,
  * @return 0 if the invitation is successfully revoked, otherwise -1.
  */
 int client_revoke_invitation(CLIENT *client, int id) {
-  sem_wait(&semaphores[CLIENT_INVITE_OP_SEM]);
-  INVITATION *inv = client_get_invitation(client, id);
+  return client_inv_op(client, id, client_revoke_locked, NULL);
+}
+
+static int client_decline_locked(CLIENT *client, INVITATION *inv, int id, void *arg) {
   if (inv_close(inv, NULL_ROLE) == -1) {
     error("Cannot close invitation");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
     return -1;
   }
-  // get target
-  CLIENT *target = inv_get_target(inv);
-  // get target inv id
-  int target_id = client_get_invitation_id(target, inv);
+  // get source
+  CLIENT *source = inv_get_source(inv);
+  // get source inv id
+  int source_id = client_get_invitation_id(source, inv);
   // send revoked packet
-  JEUX_PACKET_HEADER *pkt = create_header(JEUX_REVOKED_PKT, target_id, 0, 0);
-  if (client_send_packet(target, pkt, NULL) == -1) {
-    free(pkt);
-    error("Failed to send revoked packet");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
-    return -1;
+  JEUX_PACKET_HEADER pkt;
+  init_header(&pkt, JEUX_DECLINED_PKT, source_id, 0, 0);
+  if (client_send_packet(source, &pkt, NULL) == -1) {
+    error("Failed to send declined packet");
   }
-  free(pkt);
   // remove from both lists
-  debug("Removing invitation from source and target (client_revoke_invitation function)");
-  if (client_remove_invitation(client, inv) == -1) {
-    error("Failed to remove invitation from source");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
-    return -1;
-  }
-  if (client_remove_invitation(target, inv) == -1) {
-    error("Failed to remove invitation from target");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
-    return -1;
-  }
-
-  sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
+  info("Removing invitation from source and target (client_decline_invitation function)");
+  client_remove_pair(inv);
   return 0;
 }
 
@@ -644,72 +1503,18 @@ int client_revoke_invitation(CLIENT *client, int id) {
  * @return 0 if the invitation is successfully declined, otherwise -1.
  */
 int client_decline_invitation(CLIENT *client, int id) {
-  sem_wait(&semaphores[CLIENT_INVITE_OP_SEM]);
-  INVITATION *inv = client_get_invitation(client, id);
-  if (inv_close(inv, NULL_ROLE) == -1) {
-    error("Cannot close invitation");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
-    return -1;
-  }
-  // get source
-  CLIENT *source = inv_get_source(inv);
-  // get source inv id
-  int source_id = client_get_invitation_id(source, inv);
-  // send revoked packet
-  JEUX_PACKET_HEADER *pkt = create_header(JEUX_DECLINED_PKT, source_id, 0, 0);
-  if (client_send_packet(source, pkt, NULL) == -1) {
-    error("Failed to send declined packet");
-  }
-  free(pkt);
-  // remove from both lists
-  info("Removing invitation from source and target (client_decline_invitation function)");
-  if (client_remove_invitation(client, inv) == -1) {
-    error("Failed to remove invitation from target");
-  }
-  if (client_remove_invitation(source, inv) == -1) {
-    error("Failed to remove invitation from source");
-  }
-
-  sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
-  return 0;
+  return client_inv_op(client, id, client_decline_locked, NULL);
 }
 
-/*
- * Accept an INVITATION previously made with the specified CLIENT as
- * the target.  A new GAME is created and a reference to it is saved
- * in the INVITATION.  If the invitation is successfully accepted,
- * the source is sent an ACCEPTED packet containing the source's ID
- * of the accepted INVITATION.  If the source is to play the role of
- * the first player, then the payload of the ACCEPTED packet contains
- * a string describing the initial game state.  A reference to the
- * new GAME (with its reference count incremented) is returned to the
- * caller.
- *
- * @param client  The CLIENT that is the target of the INVITATION to be
- * accepted.
- * @param id  The ID assigned by the target to the INVITATION.
- * @param strp  Pointer to a variable into which will be stored either
- * NULL, if the accepting client is not the first player to move,
- * or a malloc'ed string that describes the initial game state,
- * if the accepting client is the first player to move.
- * If non-NULL, this string should be used as the payload of the `ACK`
- * message to be sent to the accepting client.  The caller must free
- * the string after use.
- * @return 0 if the INVITATION is successfully accepted, otherwise -1.
- */
-int client_accept_invitation(CLIENT *client, int id, char **strp) {
-  sem_wait(&semaphores[CLIENT_INVITE_OP_SEM]);
-  INVITATION *inv = client_get_invitation(client, id);
-
+static int client_accept_locked(CLIENT *client, INVITATION *inv, int id, void *arg) {
+  char **strp = arg;
   if (inv_get_target(inv) != client) {
     error("Source cannot accept invitation");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
     return -1;
   }
 
   if (inv_accept(inv) == -1) {
     error("Cannot accept invitation");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
     return -1;
   }
   // get current game state
@@ -733,43 +1538,52 @@ int client_accept_invitation(CLIENT *client, int id, char **strp) {
     source_game_state = NULL;
   }
   // send accepted packet
-  JEUX_PACKET_HEADER *pkt =
-      create_header(JEUX_ACCEPTED_PKT, source_id, 0, source_length);
-  if (client_send_packet(source, pkt, source_game_state) == -1) {
+  JEUX_PACKET_HEADER pkt;
+  init_header(&pkt, JEUX_ACCEPTED_PKT, source_id, 0, source_length);
+  if (client_send_packet(source, &pkt, source_game_state) == -1) {
     error("Failed to send accepted packet");
     free(game_state);
-    free(pkt);
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
     return -1;
   }
-  free(pkt);
   if (source_game_state != NULL) {
     free(source_game_state);
   }
+  if (inv_get_clock(inv) != NULL) {
+    clock_start(inv_get_clock(inv));
+  }
   // game state is not freed if in strp, (caller responsibility)
   // otherwise it is freed
-  sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
   return 0;
 }
 
 /*
- * Resign a game in progress.  This function may be called by a CLIENT
- * that is either source or the target of the INVITATION containing the
- * GAME that is to be resigned.  It is an error if the INVITATION containing
- * the GAME is not in the ACCEPTED state.  If the game is successfully
- * resigned, the INVITATION is set to the CLOSED state, it is removed
- * from the lists of both the source and target, and a RESIGNED packet
- * containing the opponent's ID for the INVITATION is sent to the opponent
- * of the CLIENT that has resigned.
+ * Accept an INVITATION previously made with the specified CLIENT as
+ * the target.  A new GAME is created and a reference to it is saved
+ * in the INVITATION.  If the invitation is successfully accepted,
+ * the source is sent an ACCEPTED packet containing the source's ID
+ * of the accepted INVITATION.  If the source is to play the role of
+ * the first player, then the payload of the ACCEPTED packet contains
+ * a string describing the initial game state.  A reference to the
+ * new GAME (with its reference count incremented) is returned to the
+ * caller.
  *
- * @param client  The CLIENT that is resigning.
- * @param id  The ID assigned by the CLIENT to the INVITATION that contains
- * the GAME to be resigned.
- * @return 0 if the game is successfully resigned, otherwise -1.
+ * @param client  The CLIENT that is the target of the INVITATION to be
+ * accepted.
+ * @param id  The ID assigned by the target to the INVITATION.
+ * @param strp  Pointer to a variable into which will be stored either
+ * NULL, if the accepting client is not the first player to move,
+ * or a malloc'ed string that describes the initial game state,
+ * if the accepting client is the first player to move.
+ * If non-NULL, this string should be used as the payload of the `ACK`
+ * message to be sent to the accepting client.  The caller must free
+ * the string after use.
+ * @return 0 if the INVITATION is successfully accepted, otherwise -1.
  */
-int client_resign_game(CLIENT *client, int id) {
-  sem_wait(&semaphores[CLIENT_INVITE_OP_SEM]);
-  INVITATION *inv = client_get_invitation(client, id);
+int client_accept_invitation(CLIENT *client, int id, char **strp) {
+  return client_inv_op(client, id, client_accept_locked, strp);
+}
+
+static int client_resign_locked(CLIENT *client, INVITATION *inv, int id, void *arg) {
   GAME_ROLE role = NULL_ROLE;
   GAME_ROLE opp_role = NULL_ROLE;
   CLIENT *opponent = NULL;
@@ -783,81 +1597,100 @@ int client_resign_game(CLIENT *client, int id) {
     opp_role = inv_get_source_role(inv);
   } else {
     error("Client is not source or target of invitation");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
     return -1;
   }
   // cannot resign a game that is in the open state, and not accepted state
 
   if (inv_close(inv, role) == -1) {
     error("Failed to close invitation (client resign game)");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
     return -1;
   }
+  if (inv_get_clock(inv) != NULL) {
+    clock_stop(inv_get_clock(inv));
+  }
   // get opponent inv id
   int opponent_id = client_get_invitation_id(opponent, inv);
   // send resigned packet
-  JEUX_PACKET_HEADER *pkt = create_header(JEUX_RESIGNED_PKT, opponent_id, 0, 0);
-  if (client_send_packet(opponent, pkt, NULL)) {
+  JEUX_PACKET_HEADER pkt;
+  init_header(&pkt, JEUX_RESIGNED_PKT, opponent_id, 0, 0);
+  int ret = 0;
+  if (client_send_packet(opponent, &pkt, NULL)) {
     error("Failed to send resigned packet");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
-    return -1;
+    ret = -1;
   }
-  free(pkt);
 
   // update results from resigning
   if (post_player_results(client, opponent, role, opp_role) == -1) {
     error("Failed to post player results");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
-    return -1;
+    ret = -1;
   }
 
   // remove from both lists
   info("Removing invitation from source and target (client resign game)");
-  if (client_remove_invitation(client, inv) == -1) {
-    error("Failed to remove invitation from source");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
-    return -1;
+  client_remove_pair(inv);
+  return ret;
+}
+
+/*
+ * Resign a game in progress.  This function may be called by a CLIENT
+ * that is either source or the target of the INVITATION containing the
+ * GAME that is to be resigned.  It is an error if the INVITATION containing
+ * the GAME is not in the ACCEPTED state.  If the game is successfully
+ * resigned, the INVITATION is set to the CLOSED state, it is removed
+ * from the lists of both the source and target, and a RESIGNED packet
+ * containing the opponent's ID for the INVITATION is sent to the opponent
+ * of the CLIENT that has resigned.
+ *
+ * @param client  The CLIENT that is resigning.
+ * @param id  The ID assigned by the CLIENT to the INVITATION that contains
+ * the GAME to be resigned.
+ * @return 0 if the game is successfully resigned, otherwise -1.
+ */
+int client_resign_game(CLIENT *client, int id) {
+  return client_inv_op(client, id, client_resign_locked, NULL);
+}
+
+/*
+ * Give up an invitation of a client that is logging out: its game is
+ * resigned if it has one, and otherwise it is revoked or declined.
+ */
+static int client_abandon_locked(CLIENT *client, INVITATION *inv, int id, void *arg) {
+  if (inv_get_game(inv) != NULL) {
+    return client_resign_locked(client, inv, id, arg);
   }
-  if (client_remove_invitation(opponent, inv) == -1) {
-    error("Failed to remove invitation from target");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
-    return -1;
+  if (inv_get_source(inv) == client) {
+    return client_revoke_locked(client, inv, id, arg);
   }
-
-  sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
-  return 0;
+  return client_decline_locked(client, inv, id, arg);
 }
 
 /*
- * Make a move in a game currently in progress, in which the specified
- * CLIENT is a participant.  The GAME in which the move is to be made is
- * specified by passing the ID assigned by the CLIENT to the INVITATION
- * that contains the game.  The move to be made is specified as a string
- * that describes the move in a game-dependent format.  It is an error
- * if the ID does not refer to an INVITATION containing a GAME in progress,
- * if the move cannot be parsed, or if the move is not legal in the current
- * GAME state.  If the move is successfully made, then a MOVED packet is
- * sent to the opponent of the CLIENT making the move.  In addition, if
- * the move that has been made results in the game being over, then an
- * ENDED packet containing the appropriate game ID and the game result
- * is sent to each of the players participating in the game, and the
- * INVITATION containing the now-terminated game is removed from the lists
- * of both the source and target.  The result of the game is posted in
- * order to update both players' ratings.
+ * Describe a move that has just been made as a MOVED delta: the version
+ * of the state the move produced, a space, and the move as
+ * game_unparse_move() gives it.
  *
- * @param client  The CLIENT that is making the move.
- * @param id  The ID assigned by the CLIENT to the GAME in which the move
- * is to be made.
- * @param move  A string that describes the move to be made.
- * @return 0 if the move was made successfully, -1 otherwise.
+ * @return the description, in malloc'ed storage, or NULL on error.
  */
-int client_make_move(CLIENT *client, int id, char *move) {
-  sem_wait(&semaphores[CLIENT_INVITE_OP_SEM]);
-  INVITATION *inv = client_get_invitation(client, id);
+static char *client_move_delta(GAME *game, GAME_MOVE *move) {
+  char *str = game_unparse_move(move);
+  if (str == NULL) {
+    return NULL;
+  }
+  // room for the version, the space and the NUL
+  size_t len = strlen(str) + 13;
+  char *delta = malloc(len);
+  if (delta != NULL) {
+    snprintf(delta, len, "%d %s", game_get_version(game), str);
+  }
+  free(str);
+  return delta;
+}
+
+static int client_move_locked(CLIENT *client, INVITATION *inv, int id, void *arg) {
+  char *move = arg;
   GAME *game = inv_get_game(inv);
   if (game == NULL) {
     error("Cannot make move in game that does not exist");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
     return -1;
   }
   GAME_ROLE role = NULL_ROLE;
@@ -870,7 +1703,14 @@ int client_make_move(CLIENT *client, int id, char *move) {
     opponent = inv_get_source(inv);
   } else {
     error("Client is not source or target of invitation");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
+    return -1;
+  }
+  GAME_CLOCK *clock = inv_get_clock(inv);
+  GAME_ROLE flagged = clock != NULL ? clock_flag_fallen(clock) : NULL_ROLE;
+  if (flagged != NULL_ROLE) {
+    // time ran out before the move arrived, though the alarm has not
+    // gone off yet
+    client_end_on_time(inv, flagged);
     return -1;
   }
   debug("MOVE: %s", move);
@@ -878,70 +1718,276 @@ int client_make_move(CLIENT *client, int id, char *move) {
   if (game_move == NULL) {
     error("Failed to parse move");
     free(game_move);
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
     return -1;
   }
   if (game_apply_move(game, game_move) == -1) {
     error("Failed to apply move");
     free(game_move);
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
     return -1;
   }
+  // get game state string, or just the move for an opponent that keeps
+  // the board itself
+  char *state = client_get_caps(opponent) & PROTO_CAP_DELTA ? client_move_delta(game, game_move)
+                                                            : game_unparse_state(game);
   free(game_move);
-  // get game state string
-  char *state = game_unparse_state(game);
-  // get opponent inv id
-  int opponent_id = client_get_invitation_id(opponent, inv);
-  // send moved packet
-  JEUX_PACKET_HEADER *pkt =
-      create_header(JEUX_MOVED_PKT, opponent_id, 0, strlen(state));
-  if (client_send_packet(opponent, pkt, state) == -1) {
-    error("Failed to send moved packet");
-    free(pkt);
-    free(state);
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
+  if (state == NULL) {
+    error("Failed to describe move");
     return -1;
   }
-  free(pkt);
-  free(state);
-  // check if game is over
+  // get opponent inv id
+  int opponent_id = client_get_invitation_id(opponent, inv);
+  // send moved packet, together with the ended packet if the game is over
+  JEUX_PACKET_HEADER pkt;
+  init_header(&pkt, JEUX_MOVED_PKT, opponent_id, 0, strlen(state));
   if (!game_is_over(game)) {
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
+    if (clock != NULL) {
+      clock_press(clock);
+    }
+    if (client_send_packet(opponent, &pkt, state) == -1) {
+      error("Failed to send moved packet");
+      free(state);
+      return -1;
+    }
+    free(state);
     return 0;
   }
   warn("Detected GAME OVER (client make move)");
+  if (clock != NULL) {
+    clock_stop(clock);
+  }
   // get winner
   GAME_ROLE winner = game_get_winner(game);
-  // send ended packet
-  pkt = create_header(JEUX_ENDED_PKT, opponent_id, winner, 0);
-  if (client_send_packet(opponent, pkt, NULL) == -1) {
-    error("Failed to send ended packet");
-    free(pkt);
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
+  JEUX_PACKET_HEADER ended;
+  init_header(&ended, JEUX_ENDED_PKT, opponent_id, winner, 0);
+  PROTO_PACKET pkts[] = {{.hdr = &pkt, .data = state}, {.hdr = &ended, .data = NULL}};
+  if (client_send_packets(opponent, pkts, 2) == -1) {
+    error("Failed to send moved and ended packets");
+    free(state);
     return -1;
   }
-  pkt->id = id;
-  if (client_send_packet(client, pkt, NULL) == -1) {
+  free(state);
+  ended.id = id;
+  if (client_send_packet(client, &ended, NULL) == -1) {
     error("Failed to send ended packet");
-    free(pkt);
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
     return -1;
   }
-  free(pkt);
   // post results
   post_player_results(client, opponent, role, winner);
   // remove invite from both lists
   info("Removing invitation from source and target (client make move)");
-  if (client_remove_invitation(client, inv) == -1) {
-    error("Failed to remove invitation from source");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
+  client_remove_pair(inv);
+  return 0;
+}
+
+
+/*
+ * Make a move in a game currently in progress, in which the specified
+ * CLIENT is a participant.  The GAME in which the move is to be made is
+ * specified by passing the ID assigned by the CLIENT to the INVITATION
+ * that contains the game.  The move to be made is specified as a string
+ * that describes the move in a game-dependent format.  It is an error
+ * if the ID does not refer to an INVITATION containing a GAME in progress,
+ * if the move cannot be parsed, or if the move is not legal in the current
+ * GAME state.  If the move is successfully made, then a MOVED packet is
+ * sent to the opponent of the CLIENT making the move.  In addition, if
+ * the move that has been made results in the game being over, then an
+ * ENDED packet containing the appropriate game ID and the game result
+ * is sent to each of the players participating in the game, and the
+ * INVITATION containing the now-terminated game is removed from the lists
+ * of both the source and target.  The result of the game is posted in
+ * order to update both players' ratings.
+ *
+ * @param client  The CLIENT that is making the move.
+ * @param id  The ID assigned by the CLIENT to the GAME in which the move
+ * is to be made.
+ * @param move  A string that describes the move to be made.
+ * @return 0 if the move was made successfully, -1 otherwise.
+ */
+int client_make_move(CLIENT *client, int id, char *move) {
+  return client_inv_op(client, id, client_move_locked, move);
+}
+
+/*
+ * Get a reference to the game of an invitation, which stays once the
+ * game ends and the invitation goes.
+ */
+static int client_game_locked(CLIENT *client, INVITATION *inv, int id, void *arg) {
+  GAME *game = inv_get_game(inv);
+  if (game == NULL) {
     return -1;
   }
-  if (client_remove_invitation(opponent, inv) == -1) {
-    error("Failed to remove invitation from target");
-    sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
+  *(GAME **)arg = game_ref(game, "state requested");
+  return 0;
+}
+
+/*
+ * Get the full state of a game in which a client is a participant, as
+ * the reply to a STATE request: the version of the state on a line of
+ * its own, followed by the board as game_unparse_state() gives it.
+ *
+ * @param client  The CLIENT asking for the state.
+ * @param id  The ID assigned by the CLIENT to the GAME.
+ * @return the state, in malloc'ed storage, or NULL if the ID does not
+ * refer to a game in which the client is a participant.
+ */
+char *client_get_game_state(CLIENT *client, int id) {
+  GAME *game = NULL;
+  if (client_inv_op(client, id, client_game_locked, &game) == -1) {
+    error("Cannot get the state of a game that does not exist");
+    return NULL;
+  }
+  int version;
+  char *board = game_unparse_state_version(game, &version);
+  game_unref(game, "state described");
+  if (board == NULL) {
+    return NULL;
+  }
+  size_t len = strlen(board) + 13;
+  char *state = malloc(len);
+  if (state != NULL) {
+    snprintf(state, len, "%d\n%s", version, board);
+  }
+  free(board);
+  return state;
+}
+
+/*
+ * Add an INVITATION to a client's list under the ID it had in another
+ * server process, rather than the lowest one available.
+ *
+ * @return 0 if the invitation was added, otherwise -1.
+ */
+static int client_claim_invitation(CLIENT *client, INVITATION *inv, int id) {
+  INVITATION_NODE *node = calloc(1, sizeof(INVITATION_NODE));
+  if (node == NULL) {
+    return -1;
+  }
+  pthread_mutex_lock(&client->lock);
+  while (id >= client->current_id_size) {
+    int *ids = realloc(client->available_ids, 2 * client->current_id_size * sizeof(int));
+    if (ids == NULL) {
+      pthread_mutex_unlock(&client->lock);
+      free(node);
+      return -1;
+    }
+    for (int i = client->current_id_size; i < 2 * client->current_id_size; i++) {
+      ids[i] = i;
+    }
+    client->available_ids = ids;
+    client->current_id_size *= 2;
+  }
+  client->available_ids[id] = -1;
+  client->id_usage++;
+  node->id = id;
+  node->invitation = inv_ref(inv, "restored invitation");
+  node->next = client->invite_head;
+  client->invite_head = node;
+  pthread_mutex_unlock(&client->lock);
+  return 0;
+}
+
+static int client_index(CLIENT **clients, int nclients, CLIENT *client) {
+  for (int i = 0; i < nclients; i++) {
+    if (clients[i] == client) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Write every outstanding invitation, with its game and clocks, for
+ * client_restore_games() to read back in another server process.  Each
+ * invitation is written once, naming its source and target by their
+ * positions in an array of clients.  The caller must have stopped every
+ * thread that could change an invitation, the timer thread included, as
+ * a handoff does.
+ *
+ * @param clients  Every registered client.
+ * @param nclients  The number of clients.
+ * @param out  The stream to which the invitations are written.
+ */
+void client_save_games(CLIENT **clients, int nclients, FILE *out) {
+  int ninvitations = 0;
+  for (int i = 0; i < nclients; i++) {
+    for (INVITATION_NODE *node = clients[i]->invite_head; node != NULL; node = node->next) {
+      ninvitations += inv_get_source(node->invitation) == clients[i];
+    }
+  }
+  fprintf(out, "invitations %d\n", ninvitations);
+  for (int i = 0; i < nclients; i++) {
+    for (INVITATION_NODE *node = clients[i]->invite_head; node != NULL; node = node->next) {
+      INVITATION *inv = node->invitation;
+      if (inv_get_source(inv) != clients[i]) {
+        continue;
+      }
+      CLIENT *target = inv_get_target(inv);
+      GAME *game = inv_get_game(inv);
+      GAME_CLOCK *clock = inv_get_clock(inv);
+      fprintf(out, "inv %d %d %d %d %d %d %d %d\n", i,
+              client_index(clients, nclients, target), node->id,
+              client_get_invitation_id(target, inv), inv_get_source_role(inv),
+              inv_get_target_role(inv), game != NULL, clock != NULL);
+      if (game != NULL) {
+        game_save(game, out);
+      }
+      if (clock != NULL) {
+        clock_save(clock, out);
+      }
+    }
+  }
+}
+
+/*
+ * Read the invitations written by client_save_games() and put them back
+ * in the lists of their clients, under the same IDs.  Games in progress
+ * resume where they were, and their clocks start running again.
+ *
+ * @param clients  The clients, in the same order as when they were saved.
+ * @param nclients  The number of clients.
+ * @param in  The stream from which the invitations are read.
+ * @return 0 if every invitation was restored, otherwise -1.
+ */
+int client_restore_games(CLIENT **clients, int nclients, FILE *in) {
+  int ninvitations;
+  if (fscanf(in, " invitations %d", &ninvitations) != 1) {
     return -1;
   }
-  sem_post(&semaphores[CLIENT_INVITE_OP_SEM]);
+  for (int n = 0; n < ninvitations; n++) {
+    int source, target, source_id, target_id, source_role, target_role, accepted, timed;
+    if (fscanf(in, " inv %d %d %d %d %d %d %d %d", &source, &target, &source_id, &target_id,
+               &source_role, &target_role, &accepted, &timed) != 8 ||
+        source < 0 || source >= nclients || target < 0 || target >= nclients ||
+        source_id < 0 || target_id < 0) {
+      return -1;
+    }
+    INVITATION *inv = inv_create(clients[source], clients[target], source_role, target_role);
+    if (inv == NULL) {
+      return -1;
+    }
+    // a clock that has already run out must wait until its game is back
+    inv_lock(inv);
+    int ret = 0;
+    if (accepted && (inv_accept(inv) == -1 || game_restore(inv_get_game(inv), in) == -1)) {
+      ret = -1;
+    }
+    if (ret == 0 && timed) {
+      GAME_CLOCK *clock = clock_restore(inv, client_flag_fall, in);
+      if (clock == NULL) {
+        ret = -1;
+      } else {
+        inv_set_clock(inv, clock);
+      }
+    }
+    if (ret == 0 && (client_claim_invitation(clients[source], inv, source_id) == -1 ||
+                     client_claim_invitation(clients[target], inv, target_id) == -1)) {
+      ret = -1;
+    }
+    inv_unlock(inv);
+    inv_unref(inv, "invitation restored");
+    if (ret == -1) {
+      return -1;
+    }
+  }
   return 0;
 }
@@ -1,17 +1,255 @@
+#include <stdatomic.h>
+#include <stdint.h>
+
 #include "includeme.h"
 #include "debug.h"
+#include "admission.h"
+#include "epoch.h"
+
+// the registry's tables are each split into this many shards, which are
+// locked separately
+#define CREG_SHARD_BITS 4
+#define CREG_SHARDS (1 << CREG_SHARD_BITS)
+// how many buckets a shard starts with; it doubles them whenever it holds
+// more entries than that
+#define CREG_MIN_BUCKETS 8
+
+/*
+ * An entry of one of the registry's tables: a registered client, found by
+ * its address, or a logged-in client, found by the name of its player.
+ * An entry of the name index holds a reference to its client, so that a
+ * reader who finds it can take one of its own.
+ */
+typedef struct creg_node {
+  _Atomic(struct creg_node *) next;
+  CLIENT *client;
+  uint32_t hash;
+  // empty in the table of registered clients
+  char name[];
+} CREG_NODE;
+
+typedef struct creg_buckets {
+  size_t n;
+  _Atomic(CREG_NODE *) heads[];
+} CREG_BUCKETS;
+
+/*
+ * A shard of a table, which is a hash table of its own.  The low bits of
+ * an entry's hash pick its shard, and the others its bucket there.
+ *
+ * Only writers take the lock.  Readers walk the buckets without it,
+ * inside an epoch read-side section, so a writer publishes each change
+ * with a single release store: a new entry is linked in complete, a
+ * removed one is unlinked with its own link left intact for readers
+ * standing on it, and a shard that grows gets a new set of buckets with
+ * copies of its entries.  What is unlinked is retired to the epoch
+ * reclaimer rather than freed.
+ */
+typedef struct creg_shard {
+  pthread_mutex_t lock;
+  _Atomic(CREG_BUCKETS *) buckets;
+  size_t length;
+} CREG_SHARD;
 
+typedef struct creg_table {
+  CREG_SHARD shards[CREG_SHARDS];
+} CREG_TABLE;
 
 typedef struct client_registry {
-  pthread_mutex_t mutex;  
+  // every registered client, by address
+  CREG_TABLE clients;
+  // the clients that are logged in, by name
+  CREG_TABLE names;
   sem_t sem;
-  int length;
+  atomic_int length;
   // reject new clients after shutdown
-  int no;
-  CLIENT* clients[MAX_CLIENTS];
-  sem_t login_queue;
+  atomic_int no;
 } CLIENT_REGISTRY;
 
+static uint32_t hash_client(CLIENT *client) {
+  uint64_t h = (uintptr_t)client * 0x9E3779B97F4A7C15ull;
+  return h >> 32;
+}
+
+// FNV-1a
+static uint32_t hash_name(const char *name) {
+  uint32_t h = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++) {
+    h = (h ^ *p) * 16777619u;
+  }
+  return h;
+}
+
+static CREG_SHARD *table_shard(CREG_TABLE *table, uint32_t hash) {
+  return &table->shards[hash & (CREG_SHARDS - 1)];
+}
+
+static _Atomic(CREG_NODE *) *bucket_of(CREG_BUCKETS *buckets, uint32_t hash) {
+  return &buckets->heads[(hash >> CREG_SHARD_BITS) & (buckets->n - 1)];
+}
+
+static CREG_BUCKETS *buckets_new(size_t n) {
+  CREG_BUCKETS *buckets = calloc(1, sizeof(CREG_BUCKETS) + n * sizeof(CREG_NODE *));
+  if (buckets != NULL) {
+    buckets->n = n;
+  }
+  return buckets;
+}
+
+/*
+ * Free a set of buckets together with the entries on them, but not the
+ * references to clients, which have passed to copies.
+ */
+static void buckets_free(void *arg) {
+  CREG_BUCKETS *buckets = arg;
+  for (size_t b = 0; b < buckets->n; b++) {
+    CREG_NODE *node = atomic_load_explicit(&buckets->heads[b], memory_order_relaxed);
+    while (node != NULL) {
+      CREG_NODE *next = atomic_load_explicit(&node->next, memory_order_relaxed);
+      free(node);
+      node = next;
+    }
+  }
+  free(buckets);
+}
+
+// reclaims an entry of the name index
+static void name_node_free(void *arg) {
+  CREG_NODE *node = arg;
+  client_unref(node->client, "left the name index");
+  free(node);
+}
+
+static int table_init(CREG_TABLE *table) {
+  for (int i = 0; i < CREG_SHARDS; i++) {
+    CREG_SHARD *s = &table->shards[i];
+    CREG_BUCKETS *buckets = buckets_new(CREG_MIN_BUCKETS);
+    if (buckets == NULL || pthread_mutex_init(&s->lock, NULL) != 0) {
+      free(buckets);
+      while (--i >= 0) {
+        pthread_mutex_destroy(&table->shards[i].lock);
+        free(atomic_load(&table->shards[i].buckets));
+      }
+      return -1;
+    }
+    atomic_init(&s->buckets, buckets);
+    s->length = 0;
+  }
+  return 0;
+}
+
+/*
+ * Finalize an empty table.  Whatever has been retired from it must have
+ * been reclaimed already.
+ */
+static void table_fini(CREG_TABLE *table) {
+  for (int i = 0; i < CREG_SHARDS; i++) {
+    CREG_SHARD *s = &table->shards[i];
+    buckets_free(atomic_load(&s->buckets));
+    pthread_mutex_destroy(&s->lock);
+  }
+}
+
+/*
+ * Find where an entry is, or would be, in a locked shard: by name if one
+ * is given, otherwise by client.
+ *
+ * @return the link that points to the entry, which points to NULL if
+ * there is no such entry.
+ */
+static _Atomic(CREG_NODE *) *shard_find(CREG_SHARD *s, uint32_t hash, CLIENT *client,
+                                        const char *name) {
+  CREG_BUCKETS *buckets = atomic_load_explicit(&s->buckets, memory_order_relaxed);
+  _Atomic(CREG_NODE *) *link = bucket_of(buckets, hash);
+  CREG_NODE *node;
+  while ((node = atomic_load_explicit(link, memory_order_relaxed)) != NULL) {
+    if (node->hash == hash &&
+        (name != NULL ? strcmp(node->name, name) == 0 : node->client == client)) {
+      break;
+    }
+    link = &node->next;
+  }
+  return link;
+}
+
+/*
+ * Find an entry of the name index without locking its shard.  The caller
+ * must be inside an epoch read-side section, and the entry is only good
+ * until it leaves.
+ */
+static CREG_NODE *shard_lookup(CREG_SHARD *s, uint32_t hash, const char *name) {
+  CREG_BUCKETS *buckets = atomic_load_explicit(&s->buckets, memory_order_acquire);
+  CREG_NODE *node = atomic_load_explicit(bucket_of(buckets, hash), memory_order_acquire);
+  while (node != NULL && (node->hash != hash || strcmp(node->name, name) != 0)) {
+    node = atomic_load_explicit(&node->next, memory_order_acquire);
+  }
+  return node;
+}
+
+/*
+ * Double the buckets of a locked shard, with copies of its entries.  If
+ * memory runs out the chains just get longer.
+ *
+ * @return the old buckets, to be retired once the shard is unlocked, or
+ * NULL if they are still in use.
+ */
+static CREG_BUCKETS *shard_grow(CREG_SHARD *s) {
+  CREG_BUCKETS *old = atomic_load_explicit(&s->buckets, memory_order_relaxed);
+  CREG_BUCKETS *buckets = buckets_new(2 * old->n);
+  if (buckets == NULL) {
+    return NULL;
+  }
+  for (size_t b = 0; b < old->n; b++) {
+    CREG_NODE *node = atomic_load_explicit(&old->heads[b], memory_order_relaxed);
+    for (; node != NULL; node = atomic_load_explicit(&node->next, memory_order_relaxed)) {
+      size_t size = sizeof(CREG_NODE) + strlen(node->name) + 1;
+      CREG_NODE *copy = malloc(size);
+      if (copy == NULL) {
+        buckets_free(buckets);
+        return NULL;
+      }
+      memcpy(copy, node, size);
+      _Atomic(CREG_NODE *) *head = bucket_of(buckets, copy->hash);
+      atomic_init(&copy->next, atomic_load_explicit(head, memory_order_relaxed));
+      atomic_init(head, copy);
+    }
+  }
+  atomic_store_explicit(&s->buckets, buckets, memory_order_release);
+  return old;
+}
+
+/*
+ * Link a complete entry into a locked shard.
+ *
+ * @return buckets the shard has outgrown, to be retired once it is
+ * unlocked, or NULL.
+ */
+static CREG_BUCKETS *shard_insert(CREG_SHARD *s, CREG_NODE *node) {
+  CREG_BUCKETS *old = NULL;
+  if (s->length >= atomic_load_explicit(&s->buckets, memory_order_relaxed)->n) {
+    old = shard_grow(s);
+  }
+  _Atomic(CREG_NODE *) *head =
+      bucket_of(atomic_load_explicit(&s->buckets, memory_order_relaxed), node->hash);
+  atomic_init(&node->next, atomic_load_explicit(head, memory_order_relaxed));
+  atomic_store_explicit(head, node, memory_order_release);
+  s->length++;
+  return old;
+}
+
+/*
+ * Unlink the entry a link of a locked shard points to.
+ *
+ * @return the entry, which readers may still be looking at.
+ */
+static CREG_NODE *shard_unlink(CREG_SHARD *s, _Atomic(CREG_NODE *) *link) {
+  CREG_NODE *node = atomic_load_explicit(link, memory_order_relaxed);
+  atomic_store_explicit(link, atomic_load_explicit(&node->next, memory_order_relaxed),
+                        memory_order_release);
+  s->length--;
+  return node;
+}
+
 /*
  * Initialize a new client registry.
  *
@@ -23,28 +261,23 @@ CLIENT_REGISTRY *creg_init() {
   if (cr == NULL) {
     return NULL;
   }
-  int result = pthread_mutex_init(&cr->mutex, NULL);
-  if (result != 0) {
+  if (sem_init(&cr->sem, 0, 0) != 0) {
     free(cr);
     return NULL;
   }
-  if (sem_init(&cr->sem, 0, 0) != 0) {
-    pthread_mutex_destroy(&cr->mutex);
+  if (table_init(&cr->clients) != 0) {
+    sem_destroy(&cr->sem);
     free(cr);
     return NULL;
   }
-  if (sem_init(&cr->login_queue, 0, MAX_CLIENTS) != 0) {
-    pthread_mutex_destroy(&cr->mutex);
+  if (table_init(&cr->names) != 0) {
+    table_fini(&cr->clients);
     sem_destroy(&cr->sem);
     free(cr);
     return NULL;
   }
-  cr->length = 0;
-  // initialize clients to NULL
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    cr->clients[i] = NULL;
-  }
-  cr->no = 0;
+  atomic_init(&cr->length, 0);
+  atomic_init(&cr->no, 0);
   info("Client registry initialized");
   return cr;
 }
@@ -59,13 +292,49 @@ CLIENT_REGISTRY *creg_init() {
  */
 void creg_fini(CLIENT_REGISTRY *cr) {
   debug("creg is fini :'(");
+  // let go of the clients that left the name index last
+  epoch_synchronize();
   sem_destroy(&cr->sem);
-  sem_destroy(&cr->login_queue);
-  pthread_mutex_destroy(&cr->mutex);
+  table_fini(&cr->clients);
+  table_fini(&cr->names);
   free(cr);
   return;
 }
 
+/*
+ * Add a newly created client to the table of registered clients, unless
+ * the registry has been shut down.  That is checked with the client's
+ * shard locked, so creg_shutdown_all(), which locks every shard after
+ * shutting the registry, cannot miss a client that gets in.
+ *
+ * @return 0 if the client was added, otherwise -1.
+ */
+static int creg_add(CLIENT_REGISTRY *cr, CLIENT *client) {
+  CREG_NODE *node = malloc(sizeof(CREG_NODE) + 1);
+  if (node == NULL) {
+    return -1;
+  }
+  node->client = client;
+  node->hash = hash_client(client);
+  node->name[0] = '\0';
+  CREG_SHARD *s = table_shard(&cr->clients, node->hash);
+  pthread_mutex_lock(&s->lock);
+  if (atomic_load(&cr->no)) {
+    pthread_mutex_unlock(&s->lock);
+    free(node);
+    return -1;
+  }
+  CREG_BUCKETS *old = shard_insert(s, node);
+  int length = atomic_fetch_add(&cr->length, 1);
+  debug("Increment Registry Length (%d -> %d)", length, length + 1);
+  (void)length;
+  pthread_mutex_unlock(&s->lock);
+  if (old != NULL) {
+    epoch_retire(old, buckets_free);
+  }
+  return 0;
+}
+
 /*
  * Register a client file descriptor.
  * If successful, returns a reference to the the newly registered CLIENT,
@@ -80,26 +349,52 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd) {
   if (cr == NULL) {
     return NULL;
   }
-  if (cr->length >= MAX_CLIENTS) {
-    return NULL;
-  }
-  if (cr->no == 1) {
+  if (atomic_load(&cr->no)) {
     debug("No new clients allowed ☝️☝️☝️");
+    // the connection was admitted, but will never be unregistered
+    adm_release();
     return NULL;
   }
-  // wait for login queue
-  sem_wait(&cr->login_queue);
-  // add client to registry
-  pthread_mutex_lock(&cr->mutex);
-  // error("Banning login again (sem_post: %d)", cr->length);
-  // create client
   CLIENT *client = client_create(cr, fd);
-  // add client to registry
-  cr->clients[cr->length] = client;
-  debug("Increment Registry Length (%d -> %d)", cr->length, cr->length+1);
-  cr->length++;
-  // unlock mutex
-  pthread_mutex_unlock(&cr->mutex);
+  if (client == NULL) {
+    adm_release();
+    return NULL;
+  }
+  if (creg_add(cr, client) == -1) {
+    // shut down meanwhile
+    client_disarm_idle(client);
+    client_close_output(client);
+    client_unref(client, "not registered");
+    adm_release();
+    return NULL;
+  }
+  return client;
+}
+
+/*
+ * Register a session of a multiplexed connection, whose client is
+ * already registered.  Sessions share the admission of their connection,
+ * so they are never refused for lack of room, and do not release it.
+ *
+ * @param cr  The client registry.
+ * @param conn  The client of the connection.
+ * @param session  The number of the session.
+ * @return a reference to the newly registered CLIENT, if registration
+ * is successful, otherwise NULL.
+ */
+CLIENT *creg_register_session(CLIENT_REGISTRY *cr, CLIENT *conn, int session) {
+  if (atomic_load(&cr->no)) {
+    return NULL;
+  }
+  CLIENT *client = client_create_session(cr, conn, session);
+  if (client != NULL && creg_add(cr, client) == -1) {
+    client_remove_session(conn, session);
+    client_unref(client, "not registered");
+    return NULL;
+  }
+  if (client != NULL) {
+    debug("Registered session %d", session);
+  }
   return client;
 }
 
@@ -117,37 +412,104 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd) {
  * @return 0  if unregistration succeeds, otherwise -1.
  */
 int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client) {
-  // loop through cr until you find client
   if (cr == NULL || client == NULL) {
     return -1;
   }
-  pthread_mutex_lock(&cr->mutex);
-  for (int i = 0; i < cr->length; i++) {
-    if (cr->clients[i] == client) {
-      // remove client from registry
-      cr->clients[i] = NULL;
-      // move all clients after it up one
-      for (int j = i; j < cr->length - 1; j++) {
-        cr->clients[j] = cr->clients[j + 1];
-      }
-      client_logout(client);
-      client_unref(client, "unregister");
-      debug("Decrement Registry Length (%d -> %d)", cr->length, cr->length-1);
-      cr->length--;
-      sem_post(&cr->login_queue); // someone logged out you can login now
-      error("Allowed to login again (sem_post: %d)", cr->length);
-      // unlock mutex
-      if (cr->length == 0) {
-        info("No more clients, releasing sem");
-        // decrease reference count of client
-        sem_post(&cr->sem);
-      }
-      pthread_mutex_unlock(&cr->mutex);
-      return 0;
-    }
+  // the sessions of a multiplexed connection end with it
+  CLIENT *session;
+  while ((session = client_remove_session(client, 0)) != NULL) {
+    creg_unregister(cr, session);
+  }
+  int admitted = client_session_id(client) == 0;
+  uint32_t hash = hash_client(client);
+  CREG_SHARD *s = table_shard(&cr->clients, hash);
+  pthread_mutex_lock(&s->lock);
+  _Atomic(CREG_NODE *) *link = shard_find(s, hash, client, NULL);
+  CREG_NODE *node = atomic_load_explicit(link, memory_order_relaxed);
+  if (node != NULL) {
+    shard_unlink(s, link);
+  }
+  pthread_mutex_unlock(&s->lock);
+  if (node == NULL) {
+    return -1;
+  }
+  epoch_retire(node, free);
+  client_logout(client);
+  client_disarm_idle(client);
+  client_close_output(client);
+  client_unref(client, "unregister");
+  int length = atomic_fetch_sub(&cr->length, 1);
+  debug("Decrement Registry Length (%d -> %d)", length, length - 1);
+  if (length == 1) {
+    info("No more clients, releasing sem");
+    sem_post(&cr->sem);
+  }
+  // someone logged out, so a waiting connection can come in
+  if (admitted) {
+    adm_release();
+  }
+  return 0;
+}
+
+/*
+ * Enter a client that is logging in into the index of logged-in clients
+ * by name, unless some other client is already there under that name.
+ *
+ * @param cr  The client registry.
+ * @param client  The CLIENT that is logging in.
+ * @param name  The name of the player it is logging in as.
+ * @return 0 if the client was entered, otherwise -1.
+ */
+int creg_add_name(CLIENT_REGISTRY *cr, CLIENT *client, char *name) {
+  size_t len = strlen(name) + 1;
+  CREG_NODE *node = malloc(sizeof(CREG_NODE) + len);
+  if (node == NULL) {
+    return -1;
+  }
+  node->client = client;
+  node->hash = hash_name(name);
+  memcpy(node->name, name, len);
+  CREG_SHARD *s = table_shard(&cr->names, node->hash);
+  pthread_mutex_lock(&s->lock);
+  if (atomic_load_explicit(shard_find(s, node->hash, NULL, name), memory_order_relaxed) != NULL) {
+    pthread_mutex_unlock(&s->lock);
+    free(node);
+    return -1;
+  }
+  client_ref(client, "entered in the name index");
+  CREG_BUCKETS *old = shard_insert(s, node);
+  pthread_mutex_unlock(&s->lock);
+  if (old != NULL) {
+    epoch_retire(old, buckets_free);
+  }
+  return 0;
+}
+
+/*
+ * Take a client that is logging out out of the index of logged-in
+ * clients by name.  Nothing is done if someone else is there under the
+ * name.
+ *
+ * @param cr  The client registry.
+ * @param client  The CLIENT that is logging out.
+ * @param name  The name of the player it was logged in as.
+ */
+void creg_remove_name(CLIENT_REGISTRY *cr, CLIENT *client, char *name) {
+  uint32_t hash = hash_name(name);
+  CREG_SHARD *s = table_shard(&cr->names, hash);
+  pthread_mutex_lock(&s->lock);
+  _Atomic(CREG_NODE *) *link = shard_find(s, hash, NULL, name);
+  CREG_NODE *node = atomic_load_explicit(link, memory_order_relaxed);
+  if (node != NULL && node->client == client) {
+    shard_unlink(s, link);
+  } else {
+    node = NULL;
+  }
+  pthread_mutex_unlock(&s->lock);
+  if (node != NULL) {
+    // readers that found the client may still be taking references
+    epoch_retire(node, name_node_free);
   }
-  pthread_mutex_unlock(&cr->mutex);
-  return -1;
 }
 
 /*
@@ -164,29 +526,16 @@ CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user) {
   if (cr == NULL) {
     return NULL;
   }
-  pthread_mutex_lock(&cr->mutex);
-  // loop through cr until you find client
-  for (int i = 0; i < cr->length; i++) {
-    // skip NULL clients
-    if (cr->clients[i] == NULL) {
-      continue;
-    }
-    // skip clients that aren't logged in
-    PLAYER* player = client_get_player(cr->clients[i]);
-    if (player == NULL) {
-      continue;
-    }
-    // compare usernames
-    if (strcmp(player_get_name(player), user) == 0) {
-      // increase reference count of client
-      client_ref(cr->clients[i], "lookup");
-      warn("client found: %d, %s", i, player_get_name(player));
-      pthread_mutex_unlock(&cr->mutex);
-      return cr->clients[i];
-    }
+  uint32_t hash = hash_name(user);
+  epoch_enter();
+  CREG_NODE *node = shard_lookup(table_shard(&cr->names, hash), hash, user);
+  // the entry's reference keeps the client alive until the section ends
+  CLIENT *client = node != NULL ? client_ref(node->client, "lookup") : NULL;
+  epoch_exit();
+  if (client != NULL) {
+    debug("client found: %s", user);
   }
-  pthread_mutex_unlock(&cr->mutex);
-  return NULL;
+  return client;
 }
 
 /*
@@ -201,33 +550,43 @@ CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user) {
  * @return the list of players as a NULL-terminated array of pointers.
  */
 PLAYER **creg_all_players(CLIENT_REGISTRY *cr) {
-  // lock mutex
-  pthread_mutex_lock(&cr->mutex);
-
-  // create array of players
-  PLAYER **players = calloc((cr->length + 1), sizeof(PLAYER*));
+  size_t length = 0, capacity = 16;
+  PLAYER **players = malloc(capacity * sizeof(PLAYER *));
   if (players == NULL) {
     return NULL;
   }
-  int length = 0;
-  // loop through cr until you find a logged in player
-  for (int i = 0; i < cr->length; i++) {
-    if (cr->clients[i] == NULL) {
-      continue;
-    }
-    PLAYER* player_logged_in = client_get_player(cr->clients[i]);
-    if (player_logged_in != NULL) {
-      // increase reference count of player
-      player_ref(player_logged_in, "all_players array function");
-      info("set player %s to index %d", player_get_name(player_logged_in), i);
-      players[length++] = player_logged_in;
+  // logins and logouts go on meanwhile; each shard is seen as it was at
+  // some moment while it was walked
+  epoch_enter();
+  for (int i = 0; i < CREG_SHARDS; i++) {
+    CREG_BUCKETS *buckets = atomic_load_explicit(&cr->names.shards[i].buckets,
+                                                 memory_order_acquire);
+    for (size_t b = 0; b < buckets->n; b++) {
+      CREG_NODE *node = atomic_load_explicit(&buckets->heads[b], memory_order_acquire);
+      for (; node != NULL; node = atomic_load_explicit(&node->next, memory_order_acquire)) {
+        if (length + 1 == capacity) {
+          PLAYER **grown = realloc(players, 2 * capacity * sizeof(PLAYER *));
+          if (grown == NULL) {
+            epoch_exit();
+            while (length > 0) {
+              player_unref(players[--length], "all_players array function");
+            }
+            free(players);
+            return NULL;
+          }
+          players = grown;
+          capacity *= 2;
+        }
+        // the player was set before the client was entered, and the
+        // player registry keeps it even once the client has logged out
+        players[length++] = player_ref(client_get_player(node->client),
+                                       "all_players array function");
+      }
     }
   }
-  players = realloc(players, sizeof(PLAYER*) * (length + 1));
-  debug("length: %d", length);
+  epoch_exit();
+  debug("length: %zu", length);
   players[length] = NULL;
-  // unlock mutex
-  pthread_mutex_unlock(&cr->mutex);
   return players;
 }
 
@@ -240,19 +599,11 @@ PLAYER **creg_all_players(CLIENT_REGISTRY *cr) {
  * @param cr  The client registry.
  */
 void creg_wait_for_empty(CLIENT_REGISTRY *cr) {
-    // Wait for the mutex lock
-    
     // If there are clients registered, wait on the semaphore
-    debug("waiting on %d clients", cr->length);
-    if (cr->length > 0) {
-      // int* sem_value = malloc(sizeof(int));
-      // sem_getvalue(&cr->sem, sem_value);
-      // info("waiting for empty: sem: %d", *sem_value);
-      // free(sem_value);
+    debug("waiting on %d clients", atomic_load(&cr->length));
+    if (atomic_load(&cr->length) > 0) {
       sem_wait(&cr->sem);
     }
-    
-    // Unlock the mutex
 }
 
 /*
@@ -266,13 +617,18 @@ void creg_wait_for_empty(CLIENT_REGISTRY *cr) {
  * @param cr  The client registry.
  */
 void creg_shutdown_all(CLIENT_REGISTRY *cr) {
-  pthread_mutex_lock(&cr->mutex);
-  cr->no = 1;
-  for (int i=0; i<cr->length; i++) {
-    if (cr->clients[i] != NULL) {
-      shutdown(client_get_fd(cr->clients[i]), SHUT_RD);
+  atomic_store(&cr->no, 1);
+  for (int i = 0; i < CREG_SHARDS; i++) {
+    CREG_SHARD *s = &cr->clients.shards[i];
+    pthread_mutex_lock(&s->lock);
+    CREG_BUCKETS *buckets = atomic_load_explicit(&s->buckets, memory_order_relaxed);
+    for (size_t b = 0; b < buckets->n; b++) {
+      CREG_NODE *node = atomic_load_explicit(&buckets->heads[b], memory_order_relaxed);
+      for (; node != NULL; node = atomic_load_explicit(&node->next, memory_order_relaxed)) {
+        shutdown(client_get_fd(node->client), SHUT_RD);
+      }
     }
+    pthread_mutex_unlock(&s->lock);
   }
-  pthread_mutex_unlock(&cr->mutex);
   return;
 }
@@ -0,0 +1,172 @@
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "includeme.h"
+#include "epoch.h"
+
+// set in a thread's state while it is inside a read-side section
+#define EPOCH_ACTIVE 1ul
+
+/*
+ * What a thread that has ever entered a read-side section publishes to
+ * writers: while it is inside one, the epoch it entered at and
+ * EPOCH_ACTIVE, otherwise zero.  Records are never freed; the record of
+ * a thread that has exited is taken over by the next new thread.
+ */
+typedef struct epoch_thread {
+  struct epoch_thread *next;
+  atomic_ulong state;
+  atomic_int in_use;
+  // how deeply the thread's sections are nested (only it looks at this)
+  int depth;
+} EPOCH_THREAD;
+
+/*
+ * A retired object waiting for its readers to leave.
+ */
+typedef struct epoch_garbage {
+  struct epoch_garbage *next;
+  void *object;
+  EPOCH_RECLAIM *reclaim;
+} EPOCH_GARBAGE;
+
+static atomic_ulong global_epoch;
+static _Atomic(EPOCH_THREAD *) threads;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static __thread EPOCH_THREAD *self;
+
+// objects retired at epoch e wait in limbo[e % 3], and are reclaimed
+// when the epoch reaches e + 2
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static EPOCH_GARBAGE *limbo[3];
+
+static void epoch_thread_exit(void *arg) {
+  EPOCH_THREAD *t = arg;
+  atomic_store(&t->state, 0);
+  atomic_store(&t->in_use, 0);
+}
+
+static void epoch_make_key(void) {
+  pthread_key_create(&thread_key, epoch_thread_exit);
+}
+
+/*
+ * Give the calling thread a record, reusing one given up by a thread
+ * that has exited if there is one.
+ */
+static EPOCH_THREAD *epoch_register(void) {
+  pthread_once(&thread_key_once, epoch_make_key);
+  EPOCH_THREAD *t;
+  for (t = atomic_load(&threads); t != NULL; t = t->next) {
+    int unused = 0;
+    if (atomic_compare_exchange_strong(&t->in_use, &unused, 1)) {
+      break;
+    }
+  }
+  if (t == NULL) {
+    t = calloc(1, sizeof(EPOCH_THREAD));
+    if (t == NULL) {
+      // there is no way to refuse a reader, and nothing else to do
+      error("epoch thread record: out of memory");
+      abort();
+    }
+    atomic_init(&t->state, 0);
+    atomic_init(&t->in_use, 1);
+    t->next = atomic_load(&threads);
+    while (!atomic_compare_exchange_weak(&threads, &t->next, t)) {
+    }
+  }
+  t->depth = 0;
+  pthread_setspecific(thread_key, t);
+  self = t;
+  return t;
+}
+
+void epoch_enter(void) {
+  EPOCH_THREAD *t = self != NULL ? self : epoch_register();
+  if (t->depth++ > 0) {
+    return;
+  }
+  // the epoch may move on before the state is seen, in which case a
+  // writer could take the thread for inactive; enter at the new one
+  unsigned long epoch;
+  do {
+    epoch = atomic_load(&global_epoch);
+    atomic_store(&t->state, (epoch << 1) | EPOCH_ACTIVE);
+  } while (atomic_load(&global_epoch) != epoch);
+}
+
+void epoch_exit(void) {
+  EPOCH_THREAD *t = self;
+  if (--t->depth == 0) {
+    atomic_store_explicit(&t->state, 0, memory_order_release);
+  }
+}
+
+/*
+ * Move the epoch on if every thread inside a section has entered at the
+ * current one.  The limbo lock must be held.
+ *
+ * @return the objects that can now be reclaimed, or NULL if the epoch
+ * could not be moved on.
+ */
+static EPOCH_GARBAGE *epoch_advance(void) {
+  unsigned long epoch = atomic_load(&global_epoch);
+  for (EPOCH_THREAD *t = atomic_load(&threads); t != NULL; t = t->next) {
+    unsigned long state = atomic_load(&t->state);
+    if ((state & EPOCH_ACTIVE) && (state >> 1) != epoch) {
+      return NULL;
+    }
+  }
+  atomic_store(&global_epoch, epoch + 1);
+  // retired two epochs before the new one
+  EPOCH_GARBAGE *ready = limbo[(epoch + 2) % 3];
+  limbo[(epoch + 2) % 3] = NULL;
+  return ready;
+}
+
+static void epoch_reclaim(EPOCH_GARBAGE *garbage) {
+  while (garbage != NULL) {
+    EPOCH_GARBAGE *next = garbage->next;
+    garbage->reclaim(garbage->object);
+    free(garbage);
+    garbage = next;
+  }
+}
+
+void epoch_retire(void *object, EPOCH_RECLAIM *reclaim) {
+  EPOCH_GARBAGE *garbage = malloc(sizeof(EPOCH_GARBAGE));
+  if (garbage == NULL) {
+    // nowhere to keep it, so wait out the readers here instead
+    epoch_synchronize();
+    reclaim(object);
+    return;
+  }
+  garbage->object = object;
+  garbage->reclaim = reclaim;
+  pthread_mutex_lock(&limbo_lock);
+  EPOCH_GARBAGE **list = &limbo[atomic_load(&global_epoch) % 3];
+  garbage->next = *list;
+  *list = garbage;
+  EPOCH_GARBAGE *ready = epoch_advance();
+  pthread_mutex_unlock(&limbo_lock);
+  epoch_reclaim(ready);
+}
+
+void epoch_synchronize(void) {
+  // three moves reclaim all three lists
+  for (int moved = 0; moved < 3;) {
+    pthread_mutex_lock(&limbo_lock);
+    unsigned long epoch = atomic_load(&global_epoch);
+    EPOCH_GARBAGE *ready = epoch_advance();
+    int advanced = atomic_load(&global_epoch) != epoch;
+    pthread_mutex_unlock(&limbo_lock);
+    epoch_reclaim(ready);
+    if (advanced) {
+      moved++;
+    } else {
+      sched_yield();
+    }
+  }
+}
@@ -0,0 +1,358 @@
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "includeme.h"
+#include "event_loop.h"
+
+#define EVL_MAX_EVENTS 64
+// reads of a connection per wakeup, so that one client that keeps its
+// socket full cannot starve the others on its loop
+#define EVL_MAX_READS 4
+
+/*
+ * State kept for each connection serviced by an event loop.  Packets
+ * are assembled incrementally as bytes arrive, since a non-blocking read
+ * may return only part of a packet.  A connection is only ever touched
+ * by the loop thread that owns it.
+ */
+typedef struct evl_conn {
+  // the loop's list of its connections
+  struct evl_conn *next;
+  struct evl_conn *prev;
+  int fd;
+  CLIENT *client;
+  int logged_in;
+  PROTO_ASSEMBLER pa;
+} EVL_CONN;
+
+typedef struct event_loop {
+  pthread_t tid;
+  int epfd;
+  // eventfd used to wake the loop when it is time to stop
+  int wakefd;
+  // the connections the loop owns, so they can be handed over
+  pthread_mutex_t lock;
+  EVL_CONN *conns;
+} EVENT_LOOP;
+
+static EVENT_LOOP *loops = NULL;
+static int nloops = 0;
+// round-robin assignment of new connections to loops
+static unsigned int next_loop = 0;
+static pthread_mutex_t next_loop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Close a connection that has reached EOF (or failed), unregistering
+ * its client exactly as the end of jeux_client_service() does.
+ */
+static void evl_conn_close(EVENT_LOOP *loop, EVL_CONN *conn) {
+  debug("event loop closing connection %d", conn->fd);
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  pthread_mutex_lock(&loop->lock);
+  if (conn->prev != NULL) {
+    conn->prev->next = conn->next;
+  } else {
+    loop->conns = conn->next;
+  }
+  if (conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  }
+  pthread_mutex_unlock(&loop->lock);
+  client_logout(conn->client);
+  creg_unregister(client_registry, conn->client);
+  Close(conn->fd);
+  proto_assembler_fini(&conn->pa);
+  free(conn);
+}
+
+/*
+ * Read what is available on a connection, up to EVL_MAX_READS buffers,
+ * and dispatch every packet that has been completed.  The connection is
+ * level-triggered, so anything left is read on the next wakeup.
+ *
+ * @return 0 if the connection is still open, -1 if it has been closed.
+ */
+static int evl_conn_readable(EVENT_LOOP *loop, EVL_CONN *conn) {
+  char buf[4096];
+  for (int reads = 0; reads < EVL_MAX_READS; reads++) {
+    ssize_t n = read(conn->fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) {
+      reads--;
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    if (n <= 0) {
+      info("read eof");
+      evl_conn_close(loop, conn);
+      return -1;
+    }
+    // the replies to every request in what was read leave together, and
+    // before the connection can be closed
+    client_cork();
+    size_t off = 0;
+    while (off < (size_t)n) {
+      int done = 0;
+      off += proto_assemble(&conn->pa, buf + off, n - off, &done);
+      if (done == -1) {
+        client_uncork();
+        evl_conn_close(loop, conn);
+        return -1;
+      }
+      if (!done) {
+        continue;
+      }
+      JEUX_PACKET_HEADER hdr;
+      char *payload = proto_assembler_take(&conn->pa, &hdr);
+      int ret = jeux_dispatch_packet(conn->client, conn->fd, &hdr, payload,
+                                     &conn->logged_in);
+      if (ret == -1) {
+        client_uncork();
+        evl_conn_close(loop, conn);
+        return -1;
+      }
+      // a LOGIN may have switched the framing of what follows
+      conn->pa.codec = client_get_codec(conn->client);
+    }
+    client_uncork();
+  }
+  return 0;
+}
+
+static void *evl_thread(void *arg) {
+  EVENT_LOOP *loop = arg;
+  struct epoll_event events[EVL_MAX_EVENTS];
+  int cont = 1;
+  while (cont) {
+    int n = epoll_wait(loop->epfd, events, EVL_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error("epoll_wait: %s", strerror(errno));
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        // wakeup on the eventfd means the loop is being stopped
+        cont = 0;
+        continue;
+      }
+      evl_conn_readable(loop, events[i].data.ptr);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Start the event loop threads.
+ *
+ * @param nthreads  The number of loop threads to start.  If zero, one
+ * thread per online CPU is started.
+ * @return 0 if the loops were started, otherwise -1.
+ */
+int evl_start(int nthreads) {
+  if (nthreads <= 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0) {
+      nthreads = 1;
+    }
+  }
+  loops = calloc(nthreads, sizeof(EVENT_LOOP));
+  if (loops == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < nthreads; i++) {
+    EVENT_LOOP *loop = &loops[i];
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop->epfd < 0 || loop->wakefd < 0) {
+      error("event loop %d: %s", i, strerror(errno));
+      return -1;
+    }
+    pthread_mutex_init(&loop->lock, NULL);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+    if (pthread_create(&loop->tid, NULL, evl_thread, loop) != 0) {
+      error("pthread_create");
+      return -1;
+    }
+    nloops++;
+  }
+  info("Started %d event loop threads", nloops);
+  return 0;
+}
+
+/*
+ * Give a connection whose client has been registered to one of the
+ * loop threads.  If this fails, the client is unregistered and the
+ * connection is closed.
+ *
+ * @param input  The start of a packet that has already been read, or
+ * NULL.
+ */
+static int evl_attach(int connfd, CLIENT *client, int logged_in, const char *input,
+                      size_t input_len) {
+  EVL_CONN *conn = calloc(1, sizeof(EVL_CONN));
+  if (conn == NULL) {
+    creg_unregister(client_registry, client);
+    Close(connfd);
+    return -1;
+  }
+  conn->fd = connfd;
+  conn->client = client;
+  conn->logged_in = logged_in;
+  conn->pa.codec = client_get_codec(client);
+  if (input_len > 0) {
+    int done;
+    proto_assemble(&conn->pa, input, input_len, &done);
+  }
+  int flags = fcntl(connfd, F_GETFL, 0);
+  fcntl(connfd, F_SETFL, flags | O_NONBLOCK);
+
+  pthread_mutex_lock(&next_loop_lock);
+  EVENT_LOOP *loop = &loops[next_loop++ % nloops];
+  pthread_mutex_unlock(&next_loop_lock);
+
+  pthread_mutex_lock(&loop->lock);
+  conn->next = loop->conns;
+  if (loop->conns != NULL) {
+    loop->conns->prev = conn;
+  }
+  loop->conns = conn;
+  pthread_mutex_unlock(&loop->lock);
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn};
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &ev) == -1) {
+    error("epoll_ctl: %s", strerror(errno));
+    evl_conn_close(loop, conn);
+    return -1;
+  }
+  debug("connection %d assigned to event loop %ld", connfd, loop - loops);
+  return 0;
+}
+
+/*
+ * Hand a newly accepted connection to one of the loop threads.
+ * The connection is registered with the client registry and from then
+ * on is serviced entirely by the loop thread it was assigned to.
+ * If registration fails, the connection is closed.
+ *
+ * @param connfd  The file descriptor of the accepted connection.
+ * @return 0 if the connection was taken over by a loop, otherwise -1.
+ */
+int evl_add_connection(int connfd) {
+  CLIENT *client = creg_register(client_registry, connfd);
+  if (client == NULL) {
+    debug("client == NULL");
+    Close(connfd);
+    return -1;
+  }
+  return evl_attach(connfd, client, 0, NULL, 0);
+}
+
+/*
+ * Stop the loop threads without touching their connections, so that no
+ * packet is dispatched until evl_resume() is called.  Each loop finishes
+ * the packets it has read before it stops, so a connection is left
+ * holding at most the start of a packet.
+ */
+void evl_pause(void) {
+  uint64_t one = 1;
+  for (int i = 0; i < nloops; i++) {
+    if (write(loops[i].wakefd, &one, sizeof(one)) < 0) {
+      error("event loop wakeup: %s", strerror(errno));
+    }
+  }
+  for (int i = 0; i < nloops; i++) {
+    pthread_join(loops[i].tid, NULL);
+    // reset the eventfd, so the restarted loop does not stop at once
+    if (read(loops[i].wakefd, &one, sizeof(one)) < 0) {
+      error("event loop wakeup: %s", strerror(errno));
+    }
+  }
+}
+
+/*
+ * Restart the loop threads after evl_pause().
+ *
+ * @return 0 if the loops were restarted, otherwise -1.
+ */
+int evl_resume(void) {
+  for (int i = 0; i < nloops; i++) {
+    if (pthread_create(&loops[i].tid, NULL, evl_thread, &loops[i]) != 0) {
+      error("pthread_create");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Describe every connection, while the loops are paused, so that they
+ * can be handed to another process.
+ *
+ * @param sessionsp  Set to a malloc'ed array of sessions, whose inputs
+ * are malloc'ed too.
+ * @return the number of sessions, or -1 if memory ran out.
+ */
+int evl_sessions(EVL_SESSION **sessionsp) {
+  int n = 0;
+  for (int i = 0; i < nloops; i++) {
+    for (EVL_CONN *conn = loops[i].conns; conn != NULL; conn = conn->next) {
+      n++;
+    }
+  }
+  EVL_SESSION *sessions = calloc(n + 1, sizeof(EVL_SESSION));
+  if (sessions == NULL) {
+    return -1;
+  }
+  n = 0;
+  for (int i = 0; i < nloops; i++) {
+    for (EVL_CONN *conn = loops[i].conns; conn != NULL; conn = conn->next) {
+      EVL_SESSION *s = &sessions[n++];
+      s->fd = conn->fd;
+      s->client = conn->client;
+      s->logged_in = conn->logged_in;
+      s->input = proto_assembler_save(&conn->pa, &s->input_len);
+    }
+  }
+  *sessionsp = sessions;
+  return n;
+}
+
+/*
+ * Take over a connection handed over by another process, whose client
+ * has already been registered (and restored) in this one.  It is
+ * serviced as if it had been accepted here.
+ *
+ * @param s  The session, as described by evl_sessions() in the other
+ * process, with the file descriptor it was received on here.
+ * @return 0 if the connection was taken over by a loop, otherwise -1.
+ */
+int evl_add_session(EVL_SESSION *s) {
+  return evl_attach(s->fd, s->client, s->logged_in, s->input, s->input_len);
+}
+
+/*
+ * Stop the loop threads and free their resources.  This should only
+ * be called once every client has been unregistered.
+ */
+void evl_fini(void) {
+  uint64_t one = 1;
+  for (int i = 0; i < nloops; i++) {
+    if (write(loops[i].wakefd, &one, sizeof(one)) < 0) {
+      error("event loop wakeup: %s", strerror(errno));
+    }
+  }
+  for (int i = 0; i < nloops; i++) {
+    pthread_join(loops[i].tid, NULL);
+    close(loops[i].wakefd);
+    close(loops[i].epfd);
+    pthread_mutex_destroy(&loops[i].lock);
+  }
+  free(loops);
+  loops = NULL;
+  nloops = 0;
+}
@@ -1,3 +1,5 @@
+#include <stdatomic.h>
+
 #include "includeme.h"
 
 /*
@@ -16,7 +18,9 @@
  */
 typedef struct game {
     int rows[9];
-    int ref_count;
+    // the number of moves made so far, which versions the state
+    int version;
+    atomic_int ref_count;
     int is_over;
     GAME_ROLE current_player;
     GAME_ROLE winner;
@@ -54,7 +58,7 @@ GAME *game_create(void) {
         free(game);
         return NULL;
     }
-    game->ref_count = 0;
+    atomic_init(&game->ref_count, 0);
     game->is_over = 0;
     game_ref(game, "game_create");
     return game;
@@ -70,11 +74,10 @@ GAME *game_create(void) {
  * @return  The same GAME object that was passed as a parameter.
  */
 GAME *game_ref(GAME *game, char *why) {
-    pthread_mutex_lock(&game->mutex);
+    int count = atomic_fetch_add_explicit(&game->ref_count, 1, memory_order_relaxed);
     debug("Increase reference count on GAME %p (%d -> %d) for %s",
-          game, game->ref_count, game->ref_count + 1, why);
-    game->ref_count++;
-    pthread_mutex_unlock(&game->mutex);
+          game, count, count + 1, why);
+    (void)count;
     return game;
 }
 
@@ -89,17 +92,14 @@ GAME *game_ref(GAME *game, char *why) {
  * the reference counting.
  */
 void game_unref(GAME *game, char *why) {
-  pthread_mutex_lock(&game->mutex);
+  int count = atomic_fetch_sub_explicit(&game->ref_count, 1, memory_order_release);
   debug("Decrease reference count on GAME %p (%d -> %d) for %s", game,
-        game->ref_count, game->ref_count-1, why);
-  game->ref_count--;
-  if (game->ref_count == 0) {
-    pthread_mutex_unlock(&game->mutex);
+        count, count - 1, why);
+  if (count == 1) {
+    atomic_thread_fence(memory_order_acquire);
     pthread_mutex_destroy(&game->mutex);
     free(game);
-    return;
   }
-  pthread_mutex_unlock(&game->mutex);
 } 
 
 /*
@@ -125,6 +125,7 @@ int game_apply_move(GAME *game, GAME_MOVE *move) {
         return -1;
     }
     game->rows[move->move] = move->role;
+    game->version++;
     game->current_player = (game->current_player == FIRST_PLAYER_ROLE) ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
     // check if the game is over
     pthread_mutex_unlock(&game->mutex);
@@ -152,6 +153,83 @@ int game_resign(GAME *game, GAME_ROLE role) {
     return 0;
 }
 
+/*
+ * Write the state of a GAME, for game_restore() to read back in another
+ * server process.
+ *
+ * @param game  The GAME to be saved.
+ * @param out  The stream to which the state is written.
+ */
+void game_save(GAME *game, FILE *out) {
+  pthread_mutex_lock(&game->mutex);
+  fprintf(out, "game");
+  for (int i = 0; i < 9; i++) {
+    fprintf(out, " %d", game->rows[i]);
+  }
+  fprintf(out, " %d %d %d %d\n", game->current_player, game->winner, game->is_over, game->version);
+  pthread_mutex_unlock(&game->mutex);
+}
+
+/*
+ * Put a GAME in the state written by game_save().
+ *
+ * @param game  The GAME to be restored, normally one just created.
+ * @param in  The stream from which the state is read.
+ * @return 0 if the state was read, otherwise -1.
+ */
+int game_restore(GAME *game, FILE *in) {
+  int rows[9], current_player, winner, is_over, version;
+  if (fscanf(in, " game") == EOF) {
+    return -1;
+  }
+  for (int i = 0; i < 9; i++) {
+    if (fscanf(in, " %d", &rows[i]) != 1) {
+      return -1;
+    }
+  }
+  if (fscanf(in, " %d %d %d %d", &current_player, &winner, &is_over, &version) != 4) {
+    return -1;
+  }
+  pthread_mutex_lock(&game->mutex);
+  memcpy(game->rows, rows, sizeof(rows));
+  game->current_player = current_player;
+  game->winner = winner;
+  game->is_over = is_over;
+  game->version = version;
+  pthread_mutex_unlock(&game->mutex);
+  return 0;
+}
+
+// three rows of "a|b|c\n" around two floors of "-----\n", then "X to move\n"
+#define GAME_STATE_LEN (3 * 6 + 2 * 6 + 10)
+
+/*
+ * Render a board in the format of game_unparse_state().  The board is a
+ * copy taken under the game's mutex, so the string is built without it.
+ */
+static char *game_render(const int *rows, GAME_ROLE current_player) {
+    static const char marks[] = {' ', 'X', 'O'};
+    char *game_state = malloc(GAME_STATE_LEN + 1);
+    if (game_state == NULL) {
+        return NULL;
+    }
+    char *p = game_state;
+    for (int row = 0; row < 3; row++) {
+        if (row > 0) {
+            memcpy(p, "-----\n", 6);
+            p += 6;
+        }
+        for (int col = 0; col < 3; col++) {
+            *p++ = marks[rows[3 * row + col]];
+            *p++ = col < 2 ? '|' : '\n';
+        }
+    }
+    // X/0 to move
+    *p++ = current_player == FIRST_PLAYER_ROLE ? 'X' : 'O';
+    strcpy(p, " to move\n");
+    return game_state;
+}
+
 /*
  * Get a string that describes the current GAME state, in a format
  * appropriate for human users.  The returned string is in malloc'ed
@@ -168,96 +246,40 @@ char *game_unparse_state(GAME *game) {
 //  | | 
 // -----
 //  | | 
-    char* game_state = calloc(1, sizeof(char) * 50);
-    int current_place = 0;
-    pthread_mutex_lock(&game->mutex);
-    // row 1
-    for (int i = 0; i < 3; i++) {
-        if (game->rows[i] == 0) {
-            game_state[current_place] = ' ';
-        } else if (game->rows[i] == 1) {
-            game_state[current_place] = 'X';
-        } else {
-            game_state[current_place] = 'O';
-        }
-        current_place++;
-        if (i != 2) {
-            game_state[current_place] = '|';
-            current_place++;
-        }
-    }
-    game_state[current_place] = '\n'; 
-    current_place++;
-
-    // create the floor
-    for (int i = 0; i < 5; i++) {
-        game_state[current_place] = '-';
-        current_place++;
-    }
-    game_state[current_place] = '\n';
-    current_place++;
-
-    // row 2
-    for (int i = 3; i < 6; i++) {
-        if (game->rows[i] == 0) {
-            game_state[current_place] = ' ';
-        } else if (game->rows[i] == 1) {
-            game_state[current_place] = 'X';
-        } else {
-            game_state[current_place] = 'O';
-        }
-        current_place++;
-        if (i != 5) {
-            game_state[current_place] = '|';
-            current_place++;
-        }
-    }
-    game_state[current_place] = '\n';
-    current_place++;
+    return game_unparse_state_version(game, NULL);
+}
 
-    // create the floor
-    for (int i = 0; i < 5; i++) {
-        game_state[current_place] = '-';
-        current_place++;
+/*
+ * Get the description of the current GAME state, as game_unparse_state()
+ * does, together with the version of the state it describes.
+ *
+ * @param game  The GAME for which the state description is to be
+ * obtained.
+ * @param versionp  Set to the number of moves made in the state, unless
+ * it is NULL.
+ * @return  A string that describes the current GAME state.
+ */
+char *game_unparse_state_version(GAME *game, int *versionp) {
+    int rows[9];
+    pthread_mutex_lock(&game->mutex);
+    memcpy(rows, game->rows, sizeof(rows));
+    GAME_ROLE current_player = game->current_player;
+    if (versionp != NULL) {
+        *versionp = game->version;
     }
-    game_state[current_place] = '\n';
-    current_place++;
+    pthread_mutex_unlock(&game->mutex);
+    return game_render(rows, current_player);
+}
 
-    // row 3
-    for (int i = 6; i < 9; i++) {
-        if (game->rows[i] == 0) {
-            game_state[current_place] = ' ';
-        } else if (game->rows[i] == 1) {
-            game_state[current_place] = 'X';
-        } else {
-            game_state[current_place] = 'O';
-        }
-        current_place++;
-        if (i != 8) {
-            game_state[current_place] = '|';
-            current_place++;
-        }
-    }
-    game_state[current_place] = '\n';
-    current_place++;
-    // X/0 to move
-    if (game->current_player == 1) {
-        game_state[current_place] = 'X';
-    } else {
-        game_state[current_place] = 'O';
-    }
+/*
+ * Get the version of the current GAME state: the number of moves that
+ * have been made in the game.
+ */
+int game_get_version(GAME *game) {
+    pthread_mutex_lock(&game->mutex);
+    int version = game->version;
     pthread_mutex_unlock(&game->mutex);
-    current_place++;
-    char* to_move = " to move\n";
-    for (int i = 0; i < strlen(to_move); i++) {
-        game_state[current_place] = to_move[i];
-        current_place++;
-    }
-    // end 
-    game_state[current_place] = '\0';
-    current_place++;
-    game_state = realloc(game_state, sizeof(char) * current_place);
-    return game_state;
+    return version;
 }
 
 /*
@@ -0,0 +1,200 @@
+#include <time.h>
+
+#include "includeme.h"
+#include "game_clock.h"
+
+/*
+ * The time controls that can be chosen with the ID field of an INVITE
+ * packet.  Preset 0 is an untimed game.
+ */
+static const TIME_CONTROL presets[] = {
+  [1] = {15 * 1000, 0},          // 15 seconds
+  [2] = {30 * 1000, 0},          // 30 seconds
+  [3] = {60 * 1000, 0},          // 1 minute
+  [4] = {60 * 1000, 1000},       // 1 minute + 1 second
+  [5] = {3 * 60 * 1000, 2000},   // 3 minutes + 2 seconds
+  [6] = {5 * 60 * 1000, 0},      // 5 minutes
+  [7] = {10 * 60 * 1000, 5000},  // 10 minutes + 5 seconds
+};
+
+#define NPRESETS ((int)(sizeof(presets) / sizeof(presets[0])))
+
+static long clock_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/*
+ * Set the alarm for when the running clock runs out.  An alarm that was
+ * not already set takes a reference to the invitation.
+ */
+static void clock_arm(GAME_CLOCK *clock) {
+  long left = clock->remaining_ms[clock->to_move - FIRST_PLAYER_ROLE] -
+              (clock_now_ms() - clock->started_ms);
+  if (tw_arm(&clock->alarm, tw_ticks(left > 0 ? left : 0)) == 0) {
+    inv_ref(clock->inv, "clock alarm");
+  }
+}
+
+/*
+ * Look up the time control selected by the ID field of an INVITE packet.
+ *
+ * @param preset  The preset number.  0 means an untimed game.
+ * @param tc  Set to the time control, if the game is timed.
+ * @return 1 if the preset is a time control, 0 if it means an untimed
+ * game, or -1 if there is no such preset.
+ */
+int clock_preset(int preset, TIME_CONTROL *tc) {
+  if (preset == 0) {
+    return 0;
+  }
+  if (preset < 0 || preset >= NPRESETS) {
+    return -1;
+  }
+  *tc = presets[preset];
+  return 1;
+}
+
+/*
+ * Create a stopped clock for a game.
+ *
+ * @param inv  The invitation for the game.  The clock does not hold a
+ * reference to it until it is started.
+ * @param tc  The time control.
+ * @param flag_fall  The function called (on the timer thread) when the
+ * alarm goes off.  It should confirm with clock_flag_fallen() that the
+ * flag really has fallen, since a move may have been made in the
+ * meantime, and call clock_rearm() if not.
+ * @return the new clock, or NULL if memory ran out.
+ */
+GAME_CLOCK *clock_create(INVITATION *inv, const TIME_CONTROL *tc, TW_CALLBACK *flag_fall) {
+  GAME_CLOCK *clock = calloc(1, sizeof(GAME_CLOCK));
+  if (clock == NULL) {
+    return NULL;
+  }
+  tw_init(&clock->alarm, flag_fall);
+  clock->inv = inv;
+  clock->tc = *tc;
+  clock->remaining_ms[0] = tc->base_ms;
+  clock->remaining_ms[1] = tc->base_ms;
+  clock->to_move = NULL_ROLE;
+  return clock;
+}
+
+/*
+ * Free a clock.  Its alarm must not be set, which is the case once its
+ * invitation's last reference has gone.
+ */
+void clock_free(GAME_CLOCK *clock) {
+  free(clock);
+}
+
+/*
+ * Start the first player's clock, when the game starts.
+ */
+void clock_start(GAME_CLOCK *clock) {
+  clock->to_move = FIRST_PLAYER_ROLE;
+  clock->started_ms = clock_now_ms();
+  clock_arm(clock);
+}
+
+/*
+ * End the turn of the player to move: charge them the time they took,
+ * add the increment, and start their opponent's clock.  The caller
+ * should first have checked with clock_flag_fallen() that the player
+ * still had time.
+ */
+void clock_press(GAME_CLOCK *clock) {
+  if (clock->to_move == NULL_ROLE) {
+    return;
+  }
+  long now = clock_now_ms();
+  long *mover = &clock->remaining_ms[clock->to_move - FIRST_PLAYER_ROLE];
+  *mover -= now - clock->started_ms;
+  *mover += clock->tc.increment_ms;
+  clock->to_move = clock->to_move == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+  clock->started_ms = now;
+  clock_arm(clock);
+}
+
+/*
+ * Check whether the flag of the player to move has fallen.
+ *
+ * @return the role of that player if it has, otherwise NULL_ROLE.
+ */
+GAME_ROLE clock_flag_fallen(GAME_CLOCK *clock) {
+  if (clock->to_move == NULL_ROLE) {
+    return NULL_ROLE;
+  }
+  long used = clock_now_ms() - clock->started_ms;
+  if (used < clock->remaining_ms[clock->to_move - FIRST_PLAYER_ROLE]) {
+    return NULL_ROLE;
+  }
+  return clock->to_move;
+}
+
+/*
+ * Set the alarm again for when the running clock runs out, after it has
+ * gone off early.
+ */
+void clock_rearm(GAME_CLOCK *clock) {
+  if (clock->to_move != NULL_ROLE) {
+    clock_arm(clock);
+  }
+}
+
+/*
+ * Stop the clock when the game ends, cancelling its alarm.  This may
+ * drop the reference the alarm held to the invitation, so the caller
+ * must hold a reference of its own.
+ */
+void clock_stop(GAME_CLOCK *clock) {
+  clock->to_move = NULL_ROLE;
+  if (tw_try_cancel(&clock->alarm)) {
+    inv_unref(clock->inv, "clock stopped");
+  }
+}
+
+/*
+ * Write the state of a clock, as it stands, for clock_restore() to read
+ * back in another process.
+ */
+void clock_save(GAME_CLOCK *clock, FILE *out) {
+  long used = clock->to_move == NULL_ROLE ? 0 : clock_now_ms() - clock->started_ms;
+  fprintf(out, "clock %ld %ld %ld %ld %d %ld\n", clock->tc.base_ms, clock->tc.increment_ms,
+          clock->remaining_ms[0], clock->remaining_ms[1], clock->to_move, used);
+}
+
+/*
+ * Read the state of a clock written by clock_save(), and set it running
+ * again if it was running.  The time the player to move had used is
+ * carried over, but the time spent between saving and restoring is not
+ * charged to anyone.
+ *
+ * @param inv  The invitation for the game, which must have been accepted
+ * if the clock was running.
+ * @param flag_fall  As for clock_create().
+ * @return the clock, or NULL if it could not be read or created.
+ */
+GAME_CLOCK *clock_restore(INVITATION *inv, TW_CALLBACK *flag_fall, FILE *in) {
+  TIME_CONTROL tc;
+  long remaining[2], used;
+  int to_move;
+  if (fscanf(in, " clock %ld %ld %ld %ld %d %ld", &tc.base_ms, &tc.increment_ms,
+             &remaining[0], &remaining[1], &to_move, &used) != 6) {
+    return NULL;
+  }
+  GAME_CLOCK *clock = clock_create(inv, &tc, flag_fall);
+  if (clock == NULL) {
+    return NULL;
+  }
+  clock->remaining_ms[0] = remaining[0];
+  clock->remaining_ms[1] = remaining[1];
+  if (to_move != NULL_ROLE) {
+    clock->to_move = to_move;
+    clock->started_ms = clock_now_ms() - used;
+    clock_arm(clock);
+  }
+  return clock;
+}
@@ -0,0 +1,650 @@
+#define _GNU_SOURCE
+#include <semaphore.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "includeme.h"
+#include "handoff.h"
+#include "event_loop.h"
+#include "admission.h"
+
+#define HO_MAGIC "jeux-handoff"
+#define HO_VERSION 4
+// descriptors passed in one message (the kernel takes at most 253)
+#define HO_FD_BATCH 64
+// snapshot bytes passed in one message
+#define HO_CHUNK 16384
+// sent by the successor once it has rebuilt every session
+#define HO_ACK 'A'
+
+/*
+ * The first message from the old server: how many descriptors follow
+ * (the listening socket, then one per session), and how many bytes of
+ * snapshot follow them.
+ */
+typedef struct ho_header {
+  uint32_t nfds;
+  uint32_t len;
+} HO_HEADER;
+
+/*
+ * A session being taken over, with what had been sent to its client but
+ * had not yet left the old server.
+ */
+typedef struct ho_session {
+  EVL_SESSION s;
+  char *output;
+  size_t output_len;
+} HO_SESSION;
+
+typedef struct handoff {
+  // the socket successors connect to, and the successor that has
+  int listenfd;
+  int successor;
+  // the thread that hands over, and how it is told to
+  pthread_t thread;
+  int signum;
+  // posted when the thread starts to hand over, and when it has failed
+  sem_t taken;
+  sem_t failed;
+} HANDOFF;
+
+static HANDOFF ho = {
+  .listenfd = -1,
+  .successor = -1,
+};
+
+static int ho_address(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    error("handoff path is too long: %s", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+/*
+ * Pass descriptors, a batch to a message.  Each message carries the
+ * number of descriptors in its batch.
+ */
+static int ho_send_fds(int sock, int *fds, int nfds) {
+  for (int i = 0; i < nfds; i += HO_FD_BATCH) {
+    uint32_t count = nfds - i < HO_FD_BATCH ? nfds - i : HO_FD_BATCH;
+    char control[CMSG_SPACE(HO_FD_BATCH * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &count, .iov_len = sizeof(count)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control,
+                         .msg_controllen = CMSG_SPACE(count * sizeof(int))};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds + i, count * sizeof(int));
+    ssize_t n;
+    while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+      ;
+    }
+    if (n != sizeof(count)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int ho_recv_fds(int sock, int *fds, int nfds) {
+  int have = 0;
+  while (have < nfds) {
+    uint32_t count;
+    char control[CMSG_SPACE(HO_FD_BATCH * sizeof(int))];
+    struct iovec iov = {.iov_base = &count, .iov_len = sizeof(count)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+      ;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof(count) || (msg.msg_flags & MSG_CTRUNC) || cmsg == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(count * sizeof(int)) || count > (uint32_t)(nfds - have)) {
+      return -1;
+    }
+    memcpy(fds + have, CMSG_DATA(cmsg), count * sizeof(int));
+    have += count;
+  }
+  return 0;
+}
+
+static int ho_send_bytes(int sock, const void *buf, size_t len) {
+  for (size_t off = 0; off < len; off += HO_CHUNK) {
+    size_t chunk = len - off < HO_CHUNK ? len - off : HO_CHUNK;
+    ssize_t n;
+    while ((n = send(sock, (char *)buf + off, chunk, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+      ;
+    }
+    if (n != (ssize_t)chunk) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int ho_recv_bytes(int sock, void *buf, size_t len) {
+  for (size_t off = 0; off < len; off += HO_CHUNK) {
+    size_t chunk = len - off < HO_CHUNK ? len - off : HO_CHUNK;
+    ssize_t n;
+    while ((n = recv(sock, (char *)buf + off, chunk, 0)) < 0 && errno == EINTR) {
+      ;
+    }
+    if (n != (ssize_t)chunk) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Wait for the successor's ACK, however long it takes to rebuild the
+ * sessions.  Once it has their descriptors it may service them at any
+ * time, so only its going away without an ACK means it will not.
+ *
+ * @return 0 if the ACK arrived, -1 if the successor closed its end first.
+ */
+static int ho_wait_ack(int sock) {
+  char ack = 0;
+  return ho_recv_bytes(sock, &ack, 1) == 0 && ack == HO_ACK ? 0 : -1;
+}
+
+/*
+ * Write the snapshot: every player with their rating, every session
+ * with its login, framing, unfinished input and output and the sessions
+ * multiplexed over it, and then every invitation.  Sessions are written
+ * in the order of their descriptors.
+ *
+ * @return 0 if the snapshot was written, -1 if memory ran out.
+ */
+static int ho_save(EVL_SESSION *sessions, int nsessions, char **snapshotp, size_t *lenp) {
+  FILE *out = open_memstream(snapshotp, lenp);
+  if (out == NULL) {
+    return -1;
+  }
+  int ret = 0;
+  fprintf(out, "%s %d\n", HO_MAGIC, HO_VERSION);
+  PLAYER **players = preg_all_players(player_registry);
+  if (players == NULL) {
+    ret = -1;
+  } else {
+    int nplayers = 0;
+    while (players[nplayers] != NULL) {
+      nplayers++;
+    }
+    fprintf(out, "players %d\n", nplayers);
+    for (int i = 0; i < nplayers; i++) {
+      char *name = player_get_name(players[i]);
+      fprintf(out, "%d %zu %s\n", player_get_rating(players[i]), strlen(name), name);
+      player_unref(players[i], "player saved for handoff");
+    }
+    free(players);
+  }
+  // the clients of the connections, each followed by its sessions
+  int nclients = nsessions;
+  CLIENT ***muxed = calloc(nsessions + 1, sizeof(CLIENT **));
+  int *nmuxed = calloc(nsessions + 1, sizeof(int));
+  for (int i = 0; muxed != NULL && nmuxed != NULL && i < nsessions; i++) {
+    nmuxed[i] = client_list_sessions(sessions[i].client, &muxed[i]);
+    if (nmuxed[i] == -1) {
+      nmuxed[i] = 0;
+      ret = -1;
+    }
+    nclients += nmuxed[i];
+  }
+  CLIENT **clients = calloc(nclients + 1, sizeof(CLIENT *));
+  if (clients == NULL || muxed == NULL || nmuxed == NULL) {
+    ret = -1;
+  } else {
+    fprintf(out, "clients %d\n", nsessions);
+    int n = 0;
+    for (int i = 0; i < nsessions; i++) {
+      EVL_SESSION *s = &sessions[i];
+      PLAYER *player = client_get_player(s->client);
+      char *name = player != NULL ? player_get_name(player) : "";
+      size_t output_len;
+      char *output = client_save_output(s->client, &output_len);
+      if ((s->input == NULL && s->input_len > 0) || (output == NULL && output_len > 0)) {
+        ret = -1;
+      }
+      fprintf(out, "%d %d %zu %s %zu %zu %d\n", s->logged_in, client_get_caps(s->client),
+              strlen(name), name, s->input == NULL ? 0 : s->input_len,
+              output == NULL ? 0 : output_len, nmuxed[i]);
+      if (s->input != NULL) {
+        fwrite(s->input, 1, s->input_len, out);
+      }
+      if (output != NULL) {
+        fwrite(output, 1, output_len, out);
+      }
+      free(output);
+      clients[n++] = s->client;
+      for (int j = 0; j < nmuxed[i]; j++) {
+        CLIENT *session = muxed[i][j];
+        player = client_get_player(session);
+        name = player != NULL ? player_get_name(player) : "";
+        fprintf(out, "%d %d %zu %s\n", client_session_id(session), client_get_caps(session),
+                strlen(name), name);
+        clients[n++] = session;
+      }
+    }
+    client_save_games(clients, n, out);
+  }
+  for (int i = 0; muxed != NULL && i < nsessions; i++) {
+    free(muxed[i]);
+  }
+  free(muxed);
+  free(nmuxed);
+  free(clients);
+  fprintf(out, "end\n");
+  if (fclose(out) != 0) {
+    ret = -1;
+  }
+  return ret;
+}
+
+/*
+ * Read a length-prefixed string, as written by ho_save(), into malloc'ed
+ * storage.
+ */
+static char *ho_read_string(FILE *in, size_t len) {
+  char *str = malloc(len + 1);
+  if (str == NULL || fgetc(in) != ' ' || fread(str, 1, len, in) != len) {
+    free(str);
+    return NULL;
+  }
+  str[len] = '\0';
+  return str;
+}
+
+/*
+ * Log a restored client in again as the player it was logged in as, if
+ * it was.
+ *
+ * @return 0 on success, otherwise -1.
+ */
+static int ho_login(CLIENT *client, const char *name) {
+  if (*name == '\0') {
+    return 0;
+  }
+  PLAYER *player = preg_register(player_registry, (char *)name);
+  int ret = player != NULL ? client_login(client, player) : -1;
+  if (player != NULL) {
+    player_unref(player, "client restored from handoff");
+  }
+  return ret;
+}
+
+/*
+ * Rebuild the sessions multiplexed over a connection whose client has
+ * been restored, appending their clients to an array.
+ *
+ * @return 0 if they were rebuilt, otherwise -1.
+ */
+static int ho_restore_sessions(FILE *in, CLIENT *conn, int nmuxed, CLIENT ***clientsp,
+                               int *nclientsp) {
+  CLIENT **clients = realloc(*clientsp, (*nclientsp + nmuxed + 1) * sizeof(CLIENT *));
+  if (clients == NULL) {
+    return -1;
+  }
+  *clientsp = clients;
+  for (int i = 0; i < nmuxed; i++) {
+    int session, caps;
+    size_t len;
+    if (fscanf(in, " %d %d %zu", &session, &caps, &len) != 3) {
+      return -1;
+    }
+    char *name = ho_read_string(in, len);
+    CLIENT *client = name != NULL ? creg_register_session(client_registry, conn, session) : NULL;
+    if (client == NULL) {
+      free(name);
+      return -1;
+    }
+    clients[(*nclientsp)++] = client;
+    client_set_caps(client, caps);
+    int ret = ho_login(client, name);
+    free(name);
+    if (ret == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Rebuild the players, clients and invitations from a snapshot.  Each
+ * client is registered on the descriptor it was received on, and counts
+ * as admitted, and the sessions multiplexed over it are registered too.
+ *
+ * @return 0 if everything was rebuilt, otherwise -1.
+ */
+static int ho_restore(FILE *in, int *fds, int nfds, HO_SESSION *sessions) {
+  int version, nplayers, nclients;
+  if (fscanf(in, HO_MAGIC " %d", &version) != 1 || version != HO_VERSION) {
+    error("handoff snapshot has the wrong version");
+    return -1;
+  }
+  if (fscanf(in, " players %d", &nplayers) != 1) {
+    return -1;
+  }
+  for (int i = 0; i < nplayers; i++) {
+    int rating;
+    size_t len;
+    if (fscanf(in, " %d %zu", &rating, &len) != 2) {
+      return -1;
+    }
+    char *name = ho_read_string(in, len);
+    PLAYER *player = name != NULL ? preg_register(player_registry, name) : NULL;
+    free(name);
+    if (player == NULL) {
+      return -1;
+    }
+    player_set_rating(player, rating);
+    player_unref(player, "player restored from handoff");
+  }
+  if (fscanf(in, " clients %d", &nclients) != 1 || nclients != nfds - 1) {
+    return -1;
+  }
+  CLIENT **clients = NULL;
+  int nrestored = 0;
+  for (int i = 0; i < nclients; i++) {
+    HO_SESSION *hs = &sessions[i];
+    int logged_in, caps, nmuxed;
+    size_t len;
+    if (fscanf(in, " %d %d %zu", &logged_in, &caps, &len) != 3) {
+      free(clients);
+      return -1;
+    }
+    char *name = ho_read_string(in, len);
+    if (name == NULL ||
+        fscanf(in, " %zu %zu %d", &hs->s.input_len, &hs->output_len, &nmuxed) != 3 ||
+        fgetc(in) != '\n') {
+      free(name);
+      free(clients);
+      return -1;
+    }
+    hs->s.input = hs->s.input_len > 0 ? malloc(hs->s.input_len) : NULL;
+    hs->output = hs->output_len > 0 ? malloc(hs->output_len) : NULL;
+    if ((hs->s.input_len > 0 &&
+         (hs->s.input == NULL || fread(hs->s.input, 1, hs->s.input_len, in) != hs->s.input_len)) ||
+        (hs->output_len > 0 &&
+         (hs->output == NULL || fread(hs->output, 1, hs->output_len, in) != hs->output_len))) {
+      free(name);
+      free(clients);
+      return -1;
+    }
+    // the old server admitted it, so it is not turned away now
+    adm_admit();
+    hs->s.fd = fds[i + 1];
+    hs->s.logged_in = logged_in;
+    debug("session on fd %d: %zu bytes of input, %zu of output", hs->s.fd, hs->s.input_len,
+          hs->output_len);
+    hs->s.client = creg_register(client_registry, hs->s.fd);
+    CLIENT **grown = realloc(clients, (nrestored + 1) * sizeof(CLIENT *));
+    if (hs->s.client == NULL || grown == NULL) {
+      free(name);
+      free(grown != NULL ? grown : clients);
+      return -1;
+    }
+    clients = grown;
+    clients[nrestored++] = hs->s.client;
+    // the session keeps the framing and capabilities it negotiated at login
+    client_set_caps(hs->s.client, caps);
+    client_send_switch(hs->s.client, NULL, 0, proto_codec_for(caps));
+    int ret = ho_login(hs->s.client, name);
+    free(name);
+    if (ret == -1 ||
+        ho_restore_sessions(in, hs->s.client, nmuxed, &clients, &nrestored) == -1) {
+      free(clients);
+      return -1;
+    }
+  }
+  int ret = client_restore_games(clients, nrestored, in);
+  free(clients);
+  char end[4];
+  if (ret == -1 || fscanf(in, " %3s", end) != 1 || strcmp(end, "end") != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Take over from a server listening for its successor at a path, if
+ * there is one.  The event loops, outbound queue writers, timer wheel
+ * and admission control must have been started.
+ *
+ * @param path  The handoff path.
+ * @param listenfdp  Set to the listening socket that was handed over,
+ * or to -1 if no server was listening at the path.
+ * @return 0 if the sessions were taken over (or there was no server to
+ * take them from), -1 if taking over failed, in which case the old
+ * server keeps them and this one should exit.
+ */
+int ho_take_over(const char *path, int *listenfdp) {
+  *listenfdp = -1;
+  struct sockaddr_un addr;
+  if (ho_address(path, &addr) == -1) {
+    return -1;
+  }
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    error("handoff socket: %s", strerror(errno));
+    return -1;
+  }
+  if (connect(sock, (SA *)&addr, sizeof(addr)) == -1) {
+    int err = errno;
+    close(sock);
+    if (err == ENOENT || err == ECONNREFUSED) {
+      info("No server to take over from at %s", path);
+      return 0;
+    }
+    error("handoff connect: %s", strerror(err));
+    return -1;
+  }
+  info("Taking over from the server at %s", path);
+  HO_HEADER hdr;
+  if (ho_recv_bytes(sock, &hdr, sizeof(hdr)) == -1 || hdr.nfds < 1) {
+    error("handoff: no header");
+    close(sock);
+    return -1;
+  }
+  int *fds = calloc(hdr.nfds, sizeof(int));
+  HO_SESSION *sessions = calloc(hdr.nfds, sizeof(HO_SESSION));
+  char *snapshot = malloc(hdr.len);
+  FILE *in = NULL;
+  int ret = -1;
+  if (fds == NULL || sessions == NULL || snapshot == NULL ||
+      ho_recv_fds(sock, fds, hdr.nfds) == -1 || ho_recv_bytes(sock, snapshot, hdr.len) == -1 ||
+      (in = fmemopen(snapshot, hdr.len, "r")) == NULL) {
+    error("handoff: failed to receive the sessions");
+  } else {
+    // nothing may reach the clients until the old server has let go,
+    // and the restored output has gone out first
+    tw_pause();
+    ret = ho_restore(in, fds, hdr.nfds, sessions);
+    char ack = HO_ACK;
+    if (ret == 0 && ho_send_bytes(sock, &ack, 1) == -1) {
+      ret = -1;
+    }
+    if (ret == 0) {
+      for (uint32_t i = 0; i < hdr.nfds - 1; i++) {
+        HO_SESSION *hs = &sessions[i];
+        if (hs->output_len > 0 && client_restore_output(hs->s.client, hs->output, hs->output_len) == -1) {
+          warn("handoff: failed to send pending output on fd %d", hs->s.fd);
+        }
+        evl_add_session(&hs->s);
+      }
+      *listenfdp = fds[0];
+      info("Took over %u sessions", hdr.nfds - 1);
+      tw_resume();
+    } else {
+      error("handoff: failed to rebuild the sessions");
+    }
+  }
+  if (in != NULL) {
+    fclose(in);
+  }
+  for (uint32_t i = 0; sessions != NULL && i < hdr.nfds; i++) {
+    free(sessions[i].s.input);
+    free(sessions[i].output);
+  }
+  free(sessions);
+  free(snapshot);
+  free(fds);
+  close(sock);
+  return ret;
+}
+
+/*
+ * Wait for successors.  The signal may arrive just before the thread
+ * that is to act on it blocks, so it is sent again until it is acted on.
+ */
+static void *ho_thread(void *arg) {
+  while (1) {
+    int fd = accept4(ho.listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error("handoff accept: %s", strerror(errno));
+      return NULL;
+    }
+    info("Successor connected, handing over");
+    ho.successor = fd;
+    struct timespec ts;
+    do {
+      pthread_kill(ho.thread, ho.signum);
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 100 * 1000000L;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_nsec -= 1000000000L;
+        ts.tv_sec++;
+      }
+    } while (sem_timedwait(&ho.taken, &ts) == -1);
+    // handing over only returns if it failed, and then the next
+    // successor is waited for
+    while (sem_wait(&ho.failed) == -1) {
+      ;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Listen for a successor at a path.  When one connects, the signal is
+ * sent to the thread, which should then call ho_hand_over().  It keeps
+ * being sent until it has been acted on.
+ *
+ * @param path  The handoff path.  A socket already there is removed;
+ * anything else there is an error.
+ * @param thread  The thread that is to hand over.
+ * @param signum  The signal that tells it to.
+ * @return 0 if the server is listening, otherwise -1.
+ */
+int ho_listen(const char *path, pthread_t thread, int signum) {
+  struct sockaddr_un addr;
+  if (ho_address(path, &addr) == -1) {
+    return -1;
+  }
+  ho.listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (ho.listenfd < 0) {
+    error("handoff socket: %s", strerror(errno));
+    return -1;
+  }
+  if (unlink_stale_socket(path) == -1) {
+    close(ho.listenfd);
+    ho.listenfd = -1;
+    return -1;
+  }
+  if (bind(ho.listenfd, (SA *)&addr, sizeof(addr)) == -1 || listen(ho.listenfd, 1) == -1) {
+    error("handoff listen on %s: %s", path, strerror(errno));
+    close(ho.listenfd);
+    ho.listenfd = -1;
+    return -1;
+  }
+  ho.thread = thread;
+  ho.signum = signum;
+  sem_init(&ho.taken, 0, 0);
+  sem_init(&ho.failed, 0, 0);
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, ho_thread, NULL) != 0) {
+    error("pthread_create");
+    return -1;
+  }
+  pthread_detach(tid);
+  info("Listening for a successor at %s", path);
+  return 0;
+}
+
+/*
+ * Hand every session to the successor that has connected, pausing all
+ * servicing of connections while it is done.  Once the connections have
+ * been sent, this waits for as long as the successor takes to reply or
+ * to go away.
+ *
+ * @param listenfd  The listening socket, which is handed over too.
+ * @return 0 if the successor has the sessions, in which case the caller
+ * should exit without touching them, or -1 if handing over failed and
+ * servicing has resumed.
+ */
+int ho_hand_over(int listenfd) {
+  if (ho.successor < 0) {
+    return -1;
+  }
+  sem_post(&ho.taken);
+  // the loops first, so no request is in progress; then the timers, which
+  // can end games; then the writers, so what is queued stays queued
+  evl_pause();
+  tw_pause();
+  outq_pause();
+  EVL_SESSION *sessions = NULL;
+  int nsessions = evl_sessions(&sessions);
+  int *fds = calloc(nsessions + 1, sizeof(int));
+  char *snapshot = NULL;
+  size_t len = 0;
+  int ret = -1;
+  if (nsessions >= 0 && fds != NULL && ho_save(sessions, nsessions, &snapshot, &len) == 0) {
+    fds[0] = listenfd;
+    for (int i = 0; i < nsessions; i++) {
+      fds[i + 1] = sessions[i].fd;
+    }
+    HO_HEADER hdr = {.nfds = nsessions + 1, .len = len};
+    if (ho_send_bytes(ho.successor, &hdr, sizeof(hdr)) == 0) {
+      if (ho_send_fds(ho.successor, fds, hdr.nfds) == -1 ||
+          ho_send_bytes(ho.successor, snapshot, len) == -1) {
+        // the successor cannot rebuild the sessions; make sure it sees so
+        shutdown(ho.successor, SHUT_WR);
+      }
+      ret = ho_wait_ack(ho.successor);
+    }
+  }
+  for (int i = 0; i < nsessions; i++) {
+    free(sessions[i].input);
+  }
+  free(sessions);
+  free(snapshot);
+  free(fds);
+  if (ret == 0) {
+    info("Successor has taken over %d sessions", nsessions);
+    return 0;
+  }
+  error("Handing over failed, resuming service");
+  close(ho.successor);
+  ho.successor = -1;
+  outq_resume();
+  tw_resume();
+  evl_resume();
+  sem_post(&ho.failed);
+  return -1;
+}
@@ -1,12 +1,14 @@
+#include <sys/stat.h>
+
 #include "includeme.h"
 
 /*
- Function to create a brand new header for a packet
- Caller is responsible for freeing the header
+ Function to fill in a brand new header for a packet
+ The header lives in the caller's storage (usually the stack), so nothing
+ is allocated and nothing needs to be freed
  */
-JEUX_PACKET_HEADER *create_header(int type, int id, int role, int size) {
-  JEUX_PACKET_HEADER *hdr_send = calloc(1, sizeof(JEUX_PACKET_HEADER));
-  // create a header
+void init_header(JEUX_PACKET_HEADER *hdr_send, int type, int id, int role, int size) {
+  // fill in the header
   // -------------------------------//
   // uint8_t type;		              // Type of the packet
   // uint8_t id;		            	  // Invitation ID
@@ -15,15 +17,44 @@ JEUX_PACKET_HEADER *create_header(int type, int id, int role, int size) {
   // uint32_t timestamp_sec;        // Seconds field of time packet was
   // sent uint32_t timestamp_nsec;  // Nanoseconds field of time
   // ------------------------------ //
+  memset(hdr_send, 0, sizeof(JEUX_PACKET_HEADER));
   hdr_send->type = type;
   hdr_send->id = id;
   hdr_send->role = role;
   hdr_send->size = htons(size);
   // get time and put it in header
+  // the coarse clock is the kernel's cached tick, read from the vDSO
+  // without touching the clocksource, which is plenty for a timestamp
   struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
   hdr_send->timestamp_nsec = htonl(ts.tv_nsec);
   hdr_send->timestamp_sec = htonl(ts.tv_sec);
-  // send packet
-  return hdr_send;
-}
\ No newline at end of file
+}
+
+/*
+ * Remove a socket left at a path by an earlier server, so that a new one
+ * can be bound there.  Anything other than a socket is left alone.
+ *
+ * @param path  The path to be bound.
+ * @return 0 if the path is free, -1 if something else is there (or it
+ * could not be removed).
+ */
+int unlink_stale_socket(const char *path) {
+  struct stat st;
+  if (lstat(path, &st) == -1) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    error("cannot check %s: %s", path, strerror(errno));
+    return -1;
+  }
+  if (!S_ISSOCK(st.st_mode)) {
+    error("%s exists and is not a socket", path);
+    return -1;
+  }
+  if (unlink(path) == -1) {
+    error("cannot remove %s: %s", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
@@ -1,3 +1,5 @@
+#include <stdatomic.h>
+
 #include "includeme.h"
 /*
  * An INVITATION records the status of an offer, made by one CLIENT
@@ -28,13 +30,16 @@
  */
 typedef struct invitation {
   INVITATION_STATE state;
-  int ref_count;
+  atomic_int ref_count;
   CLIENT *source;
   CLIENT *target;
   GAME *game;
   GAME_ROLE source_role;
   GAME_ROLE target_role;
-  pthread_mutex_t lock;
+  // the clocks of a timed game, or NULL
+  GAME_CLOCK *clock;
+  // held by an operation on the invitation or its game, see client.c
+  pthread_mutex_t op_lock;
 } INVITATION;
 
 /*
@@ -58,7 +63,7 @@ INVITATION *inv_create(CLIENT *source, CLIENT *target,
       return NULL;
     }
     inv->state = INV_OPEN_STATE;
-    inv->ref_count = 0;
+    atomic_init(&inv->ref_count, 0);
     inv_ref(inv, "newly created invite 😄✌️");
     inv->source = source;
     client_ref(source, "source of invite");
@@ -67,8 +72,9 @@ INVITATION *inv_create(CLIENT *source, CLIENT *target,
     inv->source_role = source_role;
     inv->target_role = target_role;
 
-    int result = pthread_mutex_init(&inv->lock, NULL);
-    if (result != 0) {
+    if (pthread_mutex_init(&inv->op_lock, NULL) != 0) {
+      client_unref(source, "invite not created");
+      client_unref(target, "invite not created");
       free(inv);
       error("mutex init invite failed");
       return NULL;
@@ -86,11 +92,10 @@ INVITATION *inv_create(CLIENT *source, CLIENT *target,
  * @return  The same INVITATION object that was passed as a parameter.
  */
 INVITATION *inv_ref(INVITATION *inv, char *why) {
-  pthread_mutex_lock(&inv->lock);
+  int count = atomic_fetch_add_explicit(&inv->ref_count, 1, memory_order_relaxed);
   debug("Increase reference count on invitation %p (%d -> %d) for %s",
-        inv, inv->ref_count, inv->ref_count + 1, why);
-  inv->ref_count++;
-  pthread_mutex_unlock(&inv->lock);
+        inv, count, count + 1, why);
+  (void)count;
   return inv;
 }
 
@@ -106,24 +111,43 @@ INVITATION *inv_ref(INVITATION *inv, char *why) {
  *
  */
 void inv_unref(INVITATION *inv, char *why) {
-  pthread_mutex_lock(&inv->lock);
+  int count = atomic_fetch_sub_explicit(&inv->ref_count, 1, memory_order_release);
   debug("Decrease reference count on invitation %p (%d -> %d) for %s",
-        inv, inv->ref_count, inv->ref_count - 1, why);
-  inv->ref_count--;
-  if (inv->ref_count == 0) {
-    pthread_mutex_unlock(&inv->lock);
-    pthread_mutex_destroy(&inv->lock);
+        inv, count, count - 1, why);
+  if (count == 1) {
+    atomic_thread_fence(memory_order_acquire);
+    pthread_mutex_destroy(&inv->op_lock);
     if (inv->game != NULL) {
       game_unref(inv->game, "invite game");
     }
+    if (inv->clock != NULL) {
+      clock_free(inv->clock);
+    }
     // remove ref counts of source and target
     client_unref(inv->source, "remove reference of source of invite");
     client_unref(inv->target, "remove reference of target of invite");
     free(inv);
-    return;
   }
-  pthread_mutex_unlock(&inv->lock);
-  // return inv;
+}
+
+/*
+ * Lock an INVITATION for an operation on it or on its game.  Operations
+ * on one invitation are done one at a time, while those on others go on
+ * in parallel; client.c documents what may be locked while this is held.
+ *
+ * @param inv  The INVITATION to be locked.
+ */
+void inv_lock(INVITATION *inv) {
+  pthread_mutex_lock(&inv->op_lock);
+}
+
+/*
+ * Unlock an INVITATION locked by inv_lock().
+ *
+ * @param inv  The INVITATION to be unlocked.
+ */
+void inv_unlock(INVITATION *inv) {
+  pthread_mutex_unlock(&inv->op_lock);
 }
 
 /*
@@ -189,6 +213,28 @@ GAME *inv_get_game(INVITATION *inv) {
   return inv->game;
 }
 
+/*
+ * Give an INVITATION the clocks for a timed game.  The INVITATION takes
+ * ownership of the clock, which is freed along with it.
+ *
+ * @param inv  The INVITATION, which must still be OPEN.
+ * @param clock  The stopped clock.
+ */
+void inv_set_clock(INVITATION *inv, GAME_CLOCK *clock) {
+  inv->clock = clock;
+}
+
+/*
+ * Get the clock of an INVITATION for a timed game.
+ *
+ * @param inv  The INVITATION to be queried.
+ * @return the clock, or NULL if the game is untimed.
+ */
+GAME_CLOCK *inv_get_clock(INVITATION *inv) {
+  if (inv == NULL) return NULL;
+  return inv->clock;
+}
+
 /*
  * Accept an INVITATION, changing it from the OPEN to the
  * ACCEPTED state, and creating a new GAME.  If the INVITATION was
@@ -1,8 +1,22 @@
+#include <netinet/tcp.h>
+
 #include "includeme.h"
 #include "jeux_globals.h"
 
 // mine
 #include "option_processing.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "worker_pool.h"
+#include "acceptor.h"
+#include "outq.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "admission.h"
+#include "handoff.h"
+
+// the resolution of idle timeouts and game clock alarms
+#define TIMER_TICK_MS 100
 
 #ifdef DEBUG
 int _debug_packets_ = 1;
@@ -17,7 +31,11 @@ static void terminate(int status);
 
 // handle signals
 #define HANDLE_SIGHUP 0x1
+// a successor has connected to take over
+#define HANDLE_HANDOFF 0x2
 static int cont_running = 1;
+// set by SIGUSR1: write the event counters to stderr
+static volatile sig_atomic_t stats_requested = 0;
 volatile int signal_received = 0x0;
 struct sigaction sighandler;
 sigset_t mask;
@@ -35,6 +53,12 @@ void sighup_handler(int signum, siginfo_t* siginfo, void* context) {
       // }
       // terminate(EXIT_SUCCESS);
       break;
+    case SIGUSR1:
+      stats_requested = 1;
+      break;
+    case SIGUSR2:
+      signal_received |= HANDLE_HANDOFF;
+      break;
     case SIGINT:
       debug("SIGINT received");
       #ifdef DEBUG
@@ -59,6 +83,14 @@ void setup_signal_handler() {
     debug("sigaction: %d", SIGHUP);
     exit(EXIT_FAILURE);
   }
+  if (sigaction(SIGUSR1, &sighandler, NULL) == -1) {
+    debug("sigaction: %d", SIGUSR1);
+    exit(EXIT_FAILURE);
+  }
+  if (sigaction(SIGUSR2, &sighandler, NULL) == -1) {
+    debug("sigaction: %d", SIGUSR2);
+    exit(EXIT_FAILURE);
+  }
   #ifdef DEBUG
   if (sigaction(SIGINT, &sighandler, NULL) == -1) {
     debug("sigaction: %d", SIGHUP);
@@ -70,6 +102,10 @@ void setup_signal_handler() {
     debug("sigaddset: %d", SIGHUP);
     exit(EXIT_FAILURE);
   }
+  if (sigaddset(&mask, SIGUSR1) == -1) {
+    debug("sigaddset: %d", SIGUSR1);
+    exit(EXIT_FAILURE);
+  }
   #ifdef DEBUG
   if (sigaddset(&mask, SIGINT) == -1) {
     debug("sigaddset: %d", SIGHUP);
@@ -80,18 +116,75 @@ void setup_signal_handler() {
 
 /* END OF HW4 CODE SUBMISSION */
 
+/*
+ * Have the kernel probe a connection that has been silent for KEEPALIVE
+ * seconds, and fail it if three probes, KEEPALIVE / 3 seconds apart, go
+ * unanswered.  A peer that has vanished is then noticed in seconds
+ * rather than hours, and its connection is cleaned up like any other
+ * that fails.
+ */
+static void set_keepalive(int connfd) {
+  int on = 1;
+  int idle = KEEPALIVE;
+  int intvl = KEEPALIVE / 3 > 0 ? KEEPALIVE / 3 : 1;
+  int cnt = 3;
+  if (setsockopt(connfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == -1 ||
+      setsockopt(connfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) == -1 ||
+      setsockopt(connfd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) == -1 ||
+      setsockopt(connfd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)) == -1) {
+    debug("keepalive on connection %d: %s", connfd, strerror(errno));
+  }
+}
+
+/*
+ * Hand an admitted connection to whatever services connections in the
+ * selected mode.  Called by the admission controller.
+ */
+static void service_connection(int connfd) {
+  if (SERVER_MODE == SERVER_MODE_EPOLL) {
+    // the event loops own the connection from here on
+    evl_add_connection(connfd);
+  } else if (SERVER_MODE == SERVER_MODE_URING) {
+    uring_add_connection(connfd);
+  } else {
+    // a service worker picks it up, or it is rejected if the queue is full
+    pool_submit(connfd);
+  }
+}
+
+/*
+ * Deal with a connection that has just been accepted.  Called by the
+ * main thread, or by the acceptor threads.  Connections are serviced once
+ * the admission controller lets them in.
+ */
+static void accept_connection(int connfd) {
+  if (KEEPALIVE > 0) {
+    set_keepalive(connfd);
+  }
+  adm_submit(connfd);
+}
+
+/*
+ * Deal with a connection accepted on the Unix domain socket.  There is
+ * no TCP keepalive to set on it: a local peer that goes away closes its
+ * end, and the connection fails at once.
+ */
+static void accept_local_connection(int connfd) {
+  adm_submit(connfd);
+}
+
 
 /*
  * "Jeux" game server.
  *
- * Usage: jeux <port>
+ * Usage: jeux [-p <port>] [-u <socket path>] [-m thread|epoll|uring] [-t <loop threads>] [-w <workers>] [-q <queue>] [-a <acceptors> [-c]] [-s drop|coalesce|pause] [-W <bytes>,<packets>] [-L <bytes>,<packets>] [-i <idle seconds>] [-k <keepalive seconds>] [-C <clients>] [-Q <waiting>,<ms>] [-H <handoff path>]
  */
 int main(int argc, char* argv[]) {
   // Option processing should be performed here.
   // Option '-p <port>' is required in order to specify the port number
   // on which the server should listen.
   if (option_processor(argc, argv)) {
-    fprintf(stderr, "Usage: %s -p <port>\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-p <port>] [-u <socket path>] [-m thread|epoll|uring] [-t <loop threads>] [-w <workers>] [-q <queue>] [-a <acceptors> [-c]] [-s drop|coalesce|pause] [-W <bytes>,<packets>] [-L <bytes>,<packets>] [-i <idle seconds>] [-k <keepalive seconds>] [-C <clients>] [-Q <waiting>,<ms>] [-H <handoff path>]\n", argv[0]);
     exit(EXIT_FAILURE);
   }
   debug("pid: %d", getpid());
@@ -100,6 +193,48 @@ int main(int argc, char* argv[]) {
   // player_registry.
   client_registry = creg_init();
   player_registry = preg_init();
+  if (SERVER_MODE == SERVER_MODE_URING && uring_start(LOOP_THREADS) == -1) {
+    warn("io_uring backend unavailable, falling back to epoll");
+    SERVER_MODE = SERVER_MODE_EPOLL;
+  }
+  if (SERVER_MODE == SERVER_MODE_EPOLL && evl_start(LOOP_THREADS) == -1) {
+    error("Failed to start event loops");
+    exit(EXIT_FAILURE);
+  }
+  if (SERVER_MODE == SERVER_MODE_THREAD && pool_start(POOL_WORKERS, POOL_QUEUE) == -1) {
+    error("Failed to start service workers");
+    exit(EXIT_FAILURE);
+  }
+  // the io_uring backend queues its sends itself; the other modes get
+  // outbound queues, so that no sender waits on another client's socket
+  if (SERVER_MODE != SERVER_MODE_URING && outq_start(1, &OUTQ_MARKS) == -1) {
+    error("Failed to start outbound queue writers");
+    exit(EXIT_FAILURE);
+  }
+  if (tw_start(TIMER_TICK_MS) == -1) {
+    error("Failed to start the timer wheel");
+    exit(EXIT_FAILURE);
+  }
+  if (IDLE_TIMEOUT > 0) {
+    client_set_idle_timeout(IDLE_TIMEOUT * 1000L);
+  }
+  if (adm_init(CLIENT_CAPACITY, ADMIT_WAITING, ADMIT_WAIT_MS, service_connection) == -1) {
+    error("Failed to start admission control");
+    exit(EXIT_FAILURE);
+  }
+  // take the listener and the sessions over from a running server, if
+  // there is one, and wait to hand them on in turn
+  int listenfd = -1;
+  if (HANDOFF_PATH != NULL) {
+    if (ho_take_over(HANDOFF_PATH, &listenfd) == -1) {
+      error("Failed to take over from the running server");
+      exit(EXIT_FAILURE);
+    }
+    if (ho_listen(HANDOFF_PATH, pthread_self(), SIGUSR2) == -1) {
+      error("Failed to listen for a successor");
+      exit(EXIT_FAILURE);
+    }
+  }
 
   // TODO: Set up the server socket and enter a loop to accept connections
   // on this socket.  For each connection, a thread should be started to
@@ -107,37 +242,86 @@ int main(int argc, char* argv[]) {
   // a SIGHUP handler, so that receipt of SIGHUP will perform a clean
   // shutdown of the server.
 
+  // The acceptor threads inherit the blocked signals, so SIGHUP is
+  // delivered to this thread.
+  sigset_t oldmask;
+  sigprocmask(SIG_BLOCK, &mask, &oldmask);
+  if (LOCAL_PATH != NULL && acc_start_local(LOCAL_PATH, accept_local_connection) == -1) {
+    error("Failed to listen on %s", LOCAL_PATH);
+    exit(EXIT_FAILURE);
+  }
+  if (ACCEPT_THREADS > 0 || !(options & PORT_OPTION)) {
+    // there is nothing for this thread to accept, so it just waits
+    if (ACCEPT_THREADS > 0 &&
+        acc_start(PORT, ACCEPT_THREADS, PIN_ACCEPTORS, accept_connection) == -1) {
+      error("Failed to start acceptors");
+      acc_fini();
+      exit(EXIT_FAILURE);
+    }
+    while (!(signal_received & HANDLE_SIGHUP)) {
+      sigsuspend(&oldmask);
+      if (stats_requested) {
+        stats_requested = 0;
+        stats_dump(stderr);
+      }
+    }
+    debug("SIGHUP received");
+    terminate(EXIT_SUCCESS);
+  }
+  sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
   // textbook code
-  int* connfd;
+  int connfd;
   socklen_t clientlen;
   struct sockaddr_storage clientaddr; /* Enough space for any address */
 
-  int listenfd = Open_listenfd(PORT);
+  if (listenfd < 0) {
+    listenfd = Open_listenfd(PORT);
+  }
   // listen_socket = listenfd;
   // close_listen_socket = 1;
   while (cont_running) {
     debug("Waiting for client connection...");
 
     clientlen = sizeof(struct sockaddr_storage);
-    connfd = calloc(1, sizeof(int));
-    *connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
+    connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
 
     if (signal_received & HANDLE_SIGHUP) {
       debug("SIGHUP received");
       cont_running = 0;
-      free(connfd);
+      if (connfd >= 0) {
+        Close(connfd);
+      }
       Close(listenfd);
       terminate(EXIT_SUCCESS);
       break;
     }
 
-    debug("this socket is connected: %d", *connfd);
-    pthread_t tid;
-    // debug("Client connected");
-    if (pthread_create(&tid, NULL, jeux_client_service, connfd) != 0) {
-      error("pthread_create");
-      exit(EXIT_FAILURE);
+    if (stats_requested) {
+      stats_requested = 0;
+      stats_dump(stderr);
     }
+
+    if (signal_received & HANDLE_HANDOFF) {
+      signal_received &= ~HANDLE_HANDOFF;
+      if (connfd >= 0) {
+        accept_connection(connfd);
+        connfd = -1;
+      }
+      if (ho_hand_over(listenfd) == 0) {
+        // the successor has the connections, so they are left open; only
+        // those still waiting for admission are turned away
+        adm_shutdown();
+        exit(EXIT_SUCCESS);
+      }
+    }
+
+    if (connfd < 0) {
+      continue;
+    }
+
+    debug("this socket is connected: %d", connfd);
+    accept_connection(connfd);
   }
 
   // fprintf(stderr, "You have to finish implementing main() "
@@ -150,6 +334,10 @@ int main(int argc, char* argv[]) {
  * Function called to cleanly shut down the server.
  */
 void terminate(int status) {
+  // Stop the acceptor threads, if any.
+  acc_fini();
+  // Turn away connections still waiting to be admitted.
+  adm_shutdown();
   // Shutdown all client connections.
   // This will trigger the eventual termination of service threads.
   creg_shutdown_all(client_registry);
@@ -157,6 +345,19 @@ void terminate(int status) {
   debug("%ld: Waiting for service threads to terminate...", pthread_self());
   creg_wait_for_empty(client_registry);
   debug("%ld: All service threads terminated.", pthread_self());
+  if (SERVER_MODE == SERVER_MODE_EPOLL) {
+    evl_fini();
+  } else if (SERVER_MODE == SERVER_MODE_URING) {
+    uring_fini();
+  } else {
+    pool_fini();
+  }
+  if (SERVER_MODE != SERVER_MODE_URING) {
+    outq_fini();
+  }
+  // every client has been unregistered, resigning its games, so no idle
+  // timer or clock alarm is pending
+  tw_fini();
 
   // Finalize modules.
   creg_fini(client_registry);
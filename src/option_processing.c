@@ -1,4 +1,5 @@
 #include "option_processing.h"
+#include "client_registry.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,22 +8,204 @@
 
 int options = 0x0;
 int PORT = 0;
+int SERVER_MODE = SERVER_MODE_THREAD;
+// 0 means one loop thread per online CPU
+int LOOP_THREADS = 0;
+// how many clients are admitted at once
+int CLIENT_CAPACITY = MAX_CLIENTS;
+// how many more may wait for admission, and for how long (none, by default)
+int ADMIT_WAITING = 0;
+int ADMIT_WAIT_MS = 0;
+// enough service workers for every client that is admitted (unless set)
+int POOL_WORKERS = MAX_CLIENTS;
+int POOL_QUEUE = MAX_CLIENTS;
+// 0 means the main thread accepts on a single listener
+int ACCEPT_THREADS = 0;
+int PIN_ACCEPTORS = 0;
+// outbound queue water marks; a low mark of 0 means half the high mark
+OUTQ_LIMITS OUTQ_MARKS = {
+  .high_bytes = 256 * 1024,
+  .high_pkts = 1024,
+  .low_bytes = 0,
+  .low_pkts = 0,
+  .policy = OUTQ_POLICY_DROP,
+};
+// seconds a client may stay silent before it is disconnected; 0 means forever
+int IDLE_TIMEOUT = 0;
+// seconds of silence before TCP keepalive probes are sent; 0 means none
+int KEEPALIVE = 0;
+// Unix socket on which to hand over to a restarted server; NULL means none
+char *HANDOFF_PATH = NULL;
+// Unix domain socket on which to listen for local clients; NULL means none
+char *LOCAL_PATH = NULL;
+
+/*
+ * Parse a water mark given as "<bytes>,<packets>".
+ *
+ * @return 0 if the mark was parsed, otherwise 1.
+ */
+static int parse_mark(char *arg, size_t *bytes, size_t *pkts) {
+  char *ptr;
+  long b = strtol(arg, &ptr, 10);
+  if (*ptr != ',' || b <= 0) {
+    return 1;
+  }
+  long p = strtol(ptr + 1, &ptr, 10);
+  if (*ptr != '\0' || p <= 0) {
+    return 1;
+  }
+  *bytes = b;
+  *pkts = p;
+  return 0;
+}
 
 int option_processor(int argc, char* argv[]) {
   long opt;
   char *ptr;
-  while ((opt = getopt(argc, argv, "p")) != -1) {
+  while ((opt = getopt(argc, argv, "p:m:t:w:q:a:cs:W:L:i:k:C:Q:H:u:")) != -1) {
     switch (opt) {
       case 'p':
         options |= PORT_OPTION;
-        PORT = strtol(argv[optind], &ptr, 10);
+        PORT = strtol(optarg, &ptr, 10);
+        break;
+      case 'm':
+        options |= MODE_OPTION;
+        if (strcmp(optarg, "thread") == 0) {
+          SERVER_MODE = SERVER_MODE_THREAD;
+        } else if (strcmp(optarg, "epoll") == 0) {
+          SERVER_MODE = SERVER_MODE_EPOLL;
+        } else if (strcmp(optarg, "uring") == 0) {
+          SERVER_MODE = SERVER_MODE_URING;
+        } else {
+          return 1;
+        }
+        break;
+      case 't':
+        options |= THREADS_OPTION;
+        LOOP_THREADS = strtol(optarg, &ptr, 10);
+        if (*ptr != '\0' || LOOP_THREADS <= 0) {
+          return 1;
+        }
+        break;
+      case 'w':
+        options |= WORKERS_OPTION;
+        POOL_WORKERS = strtol(optarg, &ptr, 10);
+        if (*ptr != '\0' || POOL_WORKERS <= 0) {
+          return 1;
+        }
+        break;
+      case 'q':
+        options |= QUEUE_OPTION;
+        POOL_QUEUE = strtol(optarg, &ptr, 10);
+        if (*ptr != '\0' || POOL_QUEUE <= 0) {
+          return 1;
+        }
+        break;
+      case 'a':
+        options |= ACCEPTORS_OPTION;
+        ACCEPT_THREADS = strtol(optarg, &ptr, 10);
+        if (*ptr != '\0' || ACCEPT_THREADS <= 0) {
+          return 1;
+        }
+        break;
+      case 'c':
+        options |= PIN_OPTION;
+        PIN_ACCEPTORS = 1;
+        break;
+      case 's':
+        options |= POLICY_OPTION;
+        if (strcmp(optarg, "drop") == 0) {
+          OUTQ_MARKS.policy = OUTQ_POLICY_DROP;
+        } else if (strcmp(optarg, "coalesce") == 0) {
+          OUTQ_MARKS.policy = OUTQ_POLICY_COALESCE;
+        } else if (strcmp(optarg, "pause") == 0) {
+          OUTQ_MARKS.policy = OUTQ_POLICY_PAUSE;
+        } else {
+          return 1;
+        }
+        break;
+      case 'W':
+        options |= HIGH_MARK_OPTION;
+        if (parse_mark(optarg, &OUTQ_MARKS.high_bytes, &OUTQ_MARKS.high_pkts)) {
+          return 1;
+        }
+        break;
+      case 'L':
+        options |= LOW_MARK_OPTION;
+        if (parse_mark(optarg, &OUTQ_MARKS.low_bytes, &OUTQ_MARKS.low_pkts)) {
+          return 1;
+        }
+        break;
+      case 'i':
+        options |= IDLE_OPTION;
+        IDLE_TIMEOUT = strtol(optarg, &ptr, 10);
+        if (*ptr != '\0' || IDLE_TIMEOUT <= 0) {
+          return 1;
+        }
+        break;
+      case 'k':
+        options |= KEEPALIVE_OPTION;
+        KEEPALIVE = strtol(optarg, &ptr, 10);
+        if (*ptr != '\0' || KEEPALIVE <= 0) {
+          return 1;
+        }
+        break;
+      case 'C':
+        options |= CAPACITY_OPTION;
+        CLIENT_CAPACITY = strtol(optarg, &ptr, 10);
+        if (*ptr != '\0' || CLIENT_CAPACITY <= 0) {
+          return 1;
+        }
+        break;
+      case 'Q':
+        options |= ADMIT_QUEUE_OPTION;
+        ADMIT_WAITING = strtol(optarg, &ptr, 10);
+        if (*ptr != ',' || ADMIT_WAITING < 0) {
+          return 1;
+        }
+        ADMIT_WAIT_MS = strtol(ptr + 1, &ptr, 10);
+        if (*ptr != '\0' || ADMIT_WAIT_MS <= 0) {
+          return 1;
+        }
+        break;
+      case 'H':
+        options |= HANDOFF_OPTION;
+        HANDOFF_PATH = optarg;
+        break;
+      case 'u':
+        options |= LOCAL_OPTION;
+        LOCAL_PATH = optarg;
         break;
       default:
         return 1;
     }
   }
-  if (options & PORT_OPTION) {
+  if (!(options & WORKERS_OPTION)) {
+    POOL_WORKERS = CLIENT_CAPACITY;
+  }
+  if (!(options & QUEUE_OPTION)) {
+    POOL_QUEUE = CLIENT_CAPACITY;
+  }
+  if (!(options & LOW_MARK_OPTION)) {
+    OUTQ_MARKS.low_bytes = OUTQ_MARKS.high_bytes / 2;
+    OUTQ_MARKS.low_pkts = OUTQ_MARKS.high_pkts / 2;
+  }
+  if (OUTQ_MARKS.low_bytes > OUTQ_MARKS.high_bytes ||
+      OUTQ_MARKS.low_pkts > OUTQ_MARKS.high_pkts) {
+    return 1;
+  }
+  // only the event loops can be stopped between packets to hand over,
+  // and only the main thread's listener is handed over with them
+  if ((options & HANDOFF_OPTION) &&
+      (SERVER_MODE != SERVER_MODE_EPOLL || ACCEPT_THREADS > 0 || (options & LOCAL_OPTION))) {
+    return 1;
+  }
+  // the acceptors listen on the TCP port
+  if ((options & ACCEPTORS_OPTION) && !(options & PORT_OPTION)) {
+    return 1;
+  }
+  if (options & (PORT_OPTION | LOCAL_OPTION)) {
     return 0;
   }
   return 1;
-}
\ No newline at end of file
+}
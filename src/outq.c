@@ -0,0 +1,674 @@
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "includeme.h"
+#include "outq.h"
+#include "stats.h"
+
+#define OUTQ_MAX_EVENTS 64
+// buffers gathered into one sendmsg(2)
+#define OUTQ_IOV 64
+
+struct outq_buf {
+  atomic_int refs;
+  size_t len;
+  int npkts;
+  // type and id of the packet, if the buffer holds exactly one
+  int type;
+  int id;
+  // its session, if the connection is multiplexed (IDs are per session)
+  uint32_t session;
+  // nonzero if every packet is an asynchronous notification
+  int notify;
+  char bytes[];
+};
+
+/*
+ * One buffer waiting in a queue.  The offset is kept here rather than in
+ * the buffer, since the same buffer may be queued to several clients.
+ */
+typedef struct outq_entry {
+  struct outq_entry *next;
+  OUTQ_BUF *buf;
+  size_t off;
+} OUTQ_ENTRY;
+
+/*
+ * While a queue is armed, it is waiting in the writers' epoll set for its
+ * socket to become writable, and the registration holds a reference to
+ * it.  The registration is one-shot, so at most one writer handles a
+ * queue at a time.
+ */
+struct outq {
+  pthread_mutex_t lock;
+  atomic_int refs;
+  int fd;
+  // framing of the headers of packets queued from now on
+  const PROTO_CODEC *codec;
+  OUTQ_ENTRY *head;
+  OUTQ_ENTRY *tail;
+  int armed;
+  int registered;
+  int closed;
+  int failed;
+  // what is queued and not yet sent
+  size_t bytes;
+  size_t pkts;
+  // set while over the high water mark, until below the low water mark
+  int congested;
+};
+
+static int writer_epfd = -1;
+// eventfd used to wake the writers when it is time to stop
+static int writer_wakefd = -1;
+static pthread_t *writers = NULL;
+static int nwriters_started = 0;
+static OUTQ_LIMITS limits;
+
+/*
+ * Serialize packets into a buffer with a reference count of one.
+ *
+ * @param codec  The framing of the headers.
+ * @param pkts  The packets, with header fields in network byte order.
+ * @param npkts  The number of packets.
+ * @return the buffer, or NULL if memory could not be allocated.
+ */
+OUTQ_BUF *outq_buf_create(const PROTO_CODEC *codec, PROTO_PACKET *pkts, int npkts) {
+  size_t len = 0;
+  for (int i = 0; i < npkts; i++) {
+    len += PROTO_HEADER_MAX + ntohs(pkts[i].hdr->size);
+  }
+  OUTQ_BUF *buf = malloc(sizeof(OUTQ_BUF) + len);
+  if (buf == NULL) {
+    return NULL;
+  }
+  atomic_init(&buf->refs, 1);
+  buf->npkts = npkts;
+  buf->type = npkts == 1 ? pkts[0].hdr->type : JEUX_NO_PKT;
+  buf->id = npkts == 1 ? pkts[0].hdr->id : 0;
+  buf->session = (codec->caps & PROTO_CAP_MUX) ? PROTO_SESSION(pkts[0].hdr) : 0;
+  buf->notify = 1;
+  char *p = buf->bytes;
+  for (int i = 0; i < npkts; i++) {
+    JEUX_PACKET_HEADER *hdr = pkts[i].hdr;
+    info("WRITING PACKET: type=%d, size=%d, id=%d, role=%d", hdr->type, ntohs(hdr->size), hdr->id, hdr->role);
+    if (hdr->type < JEUX_INVITED_PKT) {
+      buf->notify = 0;
+    }
+    p += codec->encode(hdr, p);
+    if (ntohs(hdr->size) > 0) {
+      memcpy(p, pkts[i].data, ntohs(hdr->size));
+      p += ntohs(hdr->size);
+    }
+  }
+  // the headers may have come out shorter than the room left for them
+  buf->len = p - buf->bytes;
+  return buf;
+}
+
+void outq_buf_ref(OUTQ_BUF *buf) {
+  atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+}
+
+void outq_buf_unref(OUTQ_BUF *buf) {
+  if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1) {
+    free(buf);
+  }
+}
+
+/*
+ * Discard everything in a queue.  The caller must hold q->lock.
+ */
+static void outq_discard(OUTQ *q) {
+  OUTQ_ENTRY *e = q->head;
+  while (e != NULL) {
+    OUTQ_ENTRY *next = e->next;
+    outq_buf_unref(e->buf);
+    free(e);
+    e = next;
+  }
+  q->head = NULL;
+  q->tail = NULL;
+  q->bytes = 0;
+  q->pkts = 0;
+}
+
+/*
+ * Send as much of a queue as the socket will take without blocking.
+ * The caller must hold q->lock.
+ *
+ * @return 0 if the queue is now empty, 1 if the socket is full, or -1
+ * if the connection has failed (in which case the queue is discarded).
+ */
+static int outq_drain(OUTQ *q) {
+  while (q->head != NULL) {
+    struct iovec iov[OUTQ_IOV];
+    int iovcnt = 0;
+    for (OUTQ_ENTRY *e = q->head; e != NULL && iovcnt < OUTQ_IOV; e = e->next) {
+      iov[iovcnt].iov_base = e->buf->bytes + e->off;
+      iov[iovcnt++].iov_len = e->buf->len - e->off;
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t n = sendmsg(q->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 1;
+      }
+      debug("outbound queue on fd %d failed: %s", q->fd, strerror(errno));
+      q->failed = 1;
+      outq_discard(q);
+      return -1;
+    }
+    // release the buffers that were sent completely
+    q->bytes -= n;
+    while (q->head != NULL && (size_t)n >= q->head->buf->len - q->head->off) {
+      OUTQ_ENTRY *e = q->head;
+      n -= e->buf->len - e->off;
+      q->head = e->next;
+      q->pkts -= e->buf->npkts;
+      outq_buf_unref(e->buf);
+      free(e);
+    }
+    if (q->head == NULL) {
+      q->tail = NULL;
+    } else {
+      q->head->off += n;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Check a queue against its water marks after it has grown or drained,
+ * applying the slow-consumer policy.  The caller must hold q->lock.
+ *
+ * @return 0 if the connection may stay, -1 if it has been dropped.
+ */
+static int outq_check_marks(OUTQ *q) {
+  if (q->congested) {
+    if (q->bytes <= limits.low_bytes && q->pkts <= limits.low_pkts) {
+      debug("outbound queue on fd %d has drained", q->fd);
+      q->congested = 0;
+    }
+    if (q->bytes <= 2 * limits.high_bytes && q->pkts <= 2 * limits.high_pkts) {
+      return 0;
+    }
+  } else if (q->bytes <= limits.high_bytes && q->pkts <= limits.high_pkts) {
+    return 0;
+  } else if (limits.policy != OUTQ_POLICY_DROP) {
+    q->congested = 1;
+    if (limits.policy == OUTQ_POLICY_COALESCE) {
+      stats_inc(STAT_SLOW_COALESCING);
+    } else {
+      stats_inc(STAT_SLOW_PAUSED);
+    }
+    warn("client on fd %d is not reading (%zu bytes, %zu packets queued)", q->fd,
+         q->bytes, q->pkts);
+    return 0;
+  }
+  // shutting the socket down makes the service thread see the end of
+  // the connection and unregister the client
+  warn("dropping client on fd %d (%zu bytes, %zu packets queued)", q->fd, q->bytes,
+       q->pkts);
+  stats_inc(STAT_SLOW_DROPPED);
+  q->failed = 1;
+  outq_discard(q);
+  shutdown(q->fd, SHUT_RDWR);
+  return -1;
+}
+
+/*
+ * Remove the queued MOVED packets that a newer MOVED for the same game
+ * (the same invitation ID in the same session) makes obsolete.  A buffer
+ * that has been sent in part must stay.  The caller must hold q->lock.
+ */
+static void outq_coalesce(OUTQ *q, OUTQ_BUF *newer) {
+  OUTQ_ENTRY **link = &q->head;
+  OUTQ_ENTRY *prev = NULL;
+  while (*link != NULL) {
+    OUTQ_ENTRY *e = *link;
+    if (e->off == 0 && e->buf->type == JEUX_MOVED_PKT && e->buf->id == newer->id &&
+        e->buf->session == newer->session) {
+      *link = e->next;
+      q->bytes -= e->buf->len;
+      q->pkts -= e->buf->npkts;
+      stats_inc(STAT_SLOW_COALESCED);
+      outq_buf_unref(e->buf);
+      free(e);
+      continue;
+    }
+    prev = e;
+    link = &e->next;
+  }
+  q->tail = prev;
+}
+
+/*
+ * Hand a queue to the writers until its socket becomes writable.
+ * The caller must hold q->lock.
+ */
+static void outq_arm(OUTQ *q) {
+  struct epoll_event ev = {.events = EPOLLOUT | EPOLLONESHOT, .data.ptr = q};
+  int op = q->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(writer_epfd, op, q->fd, &ev) == -1) {
+    error("outbound queue epoll_ctl: %s", strerror(errno));
+    q->failed = 1;
+    outq_discard(q);
+    return;
+  }
+  q->registered = 1;
+  q->armed = 1;
+  atomic_fetch_add_explicit(&q->refs, 1, memory_order_relaxed);
+}
+
+/*
+ * Close the duplicate descriptor of a queue that is not armed.
+ * The caller must hold q->lock.
+ */
+static void outq_close_fd(OUTQ *q) {
+  if (q->fd < 0) {
+    return;
+  }
+  if (q->registered) {
+    epoll_ctl(writer_epfd, EPOLL_CTL_DEL, q->fd, NULL);
+    q->registered = 0;
+  }
+  close(q->fd);
+  q->fd = -1;
+}
+
+static void *outq_writer(void *arg) {
+  struct epoll_event events[OUTQ_MAX_EVENTS];
+  int cont = 1;
+  while (cont) {
+    int n = epoll_wait(writer_epfd, events, OUTQ_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error("epoll_wait: %s", strerror(errno));
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      OUTQ *q = events[i].data.ptr;
+      if (q == NULL) {
+        // wakeup on the eventfd means the writers are being stopped
+        cont = 0;
+        continue;
+      }
+      pthread_mutex_lock(&q->lock);
+      q->armed = 0;
+      if (q->closed) {
+        outq_close_fd(q);
+      } else if (outq_drain(q) == 1) {
+        outq_arm(q);
+      }
+      if (q->congested) {
+        outq_check_marks(q);
+      }
+      pthread_mutex_unlock(&q->lock);
+      // the reference held by the registration that just fired
+      outq_unref(q);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Start the writer threads.
+ *
+ * @param nwriters  The number of writer threads.
+ * @param limits  The water marks and slow-consumer policy of every queue.
+ * @return 0 if the writers were started, otherwise -1.
+ */
+int outq_start(int nwriters, const OUTQ_LIMITS *lim) {
+  limits = *lim;
+  writer_epfd = epoll_create1(EPOLL_CLOEXEC);
+  writer_wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  writers = calloc(nwriters, sizeof(pthread_t));
+  if (writer_epfd < 0 || writer_wakefd < 0 || writers == NULL) {
+    error("outbound queue writers: %s", strerror(errno));
+    return -1;
+  }
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  epoll_ctl(writer_epfd, EPOLL_CTL_ADD, writer_wakefd, &ev);
+  for (int i = 0; i < nwriters; i++) {
+    if (pthread_create(&writers[i], NULL, outq_writer, NULL) != 0) {
+      error("pthread_create");
+      return -1;
+    }
+    nwriters_started++;
+  }
+  info("Started %d outbound queue writers", nwriters_started);
+  return 0;
+}
+
+/*
+ * Stop the writer threads.  This should only be called once every
+ * queue has been closed.
+ */
+void outq_fini(void) {
+  uint64_t one = 1;
+  if (writer_wakefd >= 0 && write(writer_wakefd, &one, sizeof(one)) < 0) {
+    error("outbound queue wakeup: %s", strerror(errno));
+  }
+  for (int i = 0; i < nwriters_started; i++) {
+    pthread_join(writers[i], NULL);
+  }
+  close(writer_wakefd);
+  close(writer_epfd);
+  writer_wakefd = -1;
+  writer_epfd = -1;
+  free(writers);
+  writers = NULL;
+  nwriters_started = 0;
+}
+
+/*
+ * Stop the writer threads without touching the queues, so that nothing
+ * more is sent until outq_resume() is called.  Queues waiting for their
+ * sockets stay registered and are picked up again on resuming.
+ */
+void outq_pause(void) {
+  uint64_t one = 1;
+  if (write(writer_wakefd, &one, sizeof(one)) < 0) {
+    error("outbound queue wakeup: %s", strerror(errno));
+  }
+  for (int i = 0; i < nwriters_started; i++) {
+    pthread_join(writers[i], NULL);
+  }
+  // reset the eventfd, so the restarted writers do not stop at once
+  if (read(writer_wakefd, &one, sizeof(one)) < 0) {
+    error("outbound queue wakeup: %s", strerror(errno));
+  }
+}
+
+/*
+ * Restart the writer threads after outq_pause().
+ *
+ * @return 0 if the writers were restarted, otherwise -1.
+ */
+int outq_resume(void) {
+  int nwriters = nwriters_started;
+  nwriters_started = 0;
+  for (int i = 0; i < nwriters; i++) {
+    if (pthread_create(&writers[i], NULL, outq_writer, NULL) != 0) {
+      error("pthread_create");
+      return -1;
+    }
+    nwriters_started++;
+  }
+  return 0;
+}
+
+/*
+ * Tell whether the writer threads have been started.
+ */
+int outq_started(void) {
+  return writer_epfd >= 0;
+}
+
+/*
+ * Create the outbound queue of a connection.
+ *
+ * @param fd  The socket of the connection.  The queue keeps its own
+ * duplicate of the descriptor, so a descriptor number reused after the
+ * connection is closed can never receive its packets.
+ * @return the new queue, with one reference for the caller, or NULL if
+ * the writer threads have not been started (in which case packets should
+ * be sent directly) or on error.
+ */
+OUTQ *outq_create(int fd) {
+  if (writer_epfd < 0) {
+    return NULL;
+  }
+  OUTQ *q = calloc(1, sizeof(OUTQ));
+  if (q == NULL) {
+    return NULL;
+  }
+  q->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (q->fd < 0) {
+    error("outbound queue dup: %s", strerror(errno));
+    free(q);
+    return NULL;
+  }
+  q->codec = &proto_codec_v1;
+  pthread_mutex_init(&q->lock, NULL);
+  atomic_init(&q->refs, 1);
+  return q;
+}
+
+/*
+ * Close a queue when its connection is finished.  Anything still queued
+ * is discarded, the duplicate descriptor is closed and later pushes fail.
+ * The queue itself stays valid until its last reference is released.
+ */
+void outq_close(OUTQ *q) {
+  pthread_mutex_lock(&q->lock);
+  q->closed = 1;
+  outq_discard(q);
+  if (q->armed) {
+    // make the registration fire, so the writer that handles it can
+    // close the descriptor and drop its reference
+    shutdown(q->fd, SHUT_RDWR);
+  } else {
+    outq_close_fd(q);
+  }
+  pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Release a reference to a queue, freeing it when none remain.
+ */
+void outq_unref(OUTQ *q) {
+  if (atomic_fetch_sub_explicit(&q->refs, 1, memory_order_acq_rel) != 1) {
+    return;
+  }
+  outq_close_fd(q);
+  outq_discard(q);
+  pthread_mutex_destroy(&q->lock);
+  free(q);
+}
+
+/*
+ * Append a buffer to a queue, of which the first off bytes have already
+ * been sent.  The caller must hold q->lock, and the queue must be open.
+ *
+ * @return 0 if the buffer was queued (or skipped because notifications
+ * are paused), -1 if the connection has failed or been dropped.
+ */
+static int outq_append(OUTQ *q, OUTQ_BUF *buf, size_t off) {
+  if (q->congested && buf->notify && limits.policy == OUTQ_POLICY_PAUSE) {
+    stats_inc(STAT_SLOW_SKIPPED);
+    return 0;
+  }
+  if (q->congested && buf->type == JEUX_MOVED_PKT &&
+      limits.policy == OUTQ_POLICY_COALESCE) {
+    outq_coalesce(q, buf);
+  }
+  OUTQ_ENTRY *e = malloc(sizeof(OUTQ_ENTRY));
+  if (e == NULL) {
+    return -1;
+  }
+  outq_buf_ref(buf);
+  e->next = NULL;
+  e->buf = buf;
+  e->off = off;
+  if (q->tail == NULL) {
+    q->head = e;
+  } else {
+    q->tail->next = e;
+  }
+  q->tail = e;
+  q->bytes += buf->len - off;
+  q->pkts += buf->npkts;
+  // if a writer already has the queue, it sends this in turn; otherwise
+  // try to send it right away and leave the rest to the writers
+  if (!q->armed && outq_drain(q) == 1) {
+    outq_arm(q);
+  }
+  if (!q->failed) {
+    outq_check_marks(q);
+  }
+  return q->failed ? -1 : 0;
+}
+
+/*
+ * Append a buffer to a queue.  The queue takes its own reference to the
+ * buffer, and the caller keeps theirs.
+ *
+ * @return 0 if the buffer was queued (or sent, or skipped because
+ * notifications are paused), -1 if the queue has been closed or its
+ * connection has failed or been dropped.
+ */
+int outq_push(OUTQ *q, OUTQ_BUF *buf) {
+  pthread_mutex_lock(&q->lock);
+  int ret = -1;
+  if (!q->closed && !q->failed) {
+    ret = outq_append(q, buf, 0);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ret;
+}
+
+/*
+ * Copy what is queued on a connection and not yet sent.  The writers
+ * must be paused, and nothing else may be sending to the connection.
+ *
+ * @param lenp  Set to the number of bytes copied.
+ * @return the malloc'ed bytes, or NULL if there are none (or memory ran
+ * out, in which case *lenp is nonzero).
+ */
+char *outq_save(OUTQ *q, size_t *lenp) {
+  pthread_mutex_lock(&q->lock);
+  *lenp = q->bytes;
+  char *bytes = q->bytes > 0 ? malloc(q->bytes) : NULL;
+  if (bytes != NULL) {
+    char *p = bytes;
+    for (OUTQ_ENTRY *e = q->head; e != NULL; e = e->next) {
+      memcpy(p, e->buf->bytes + e->off, e->buf->len - e->off);
+      p += e->buf->len - e->off;
+    }
+  }
+  pthread_mutex_unlock(&q->lock);
+  return bytes;
+}
+
+/*
+ * Queue bytes saved by outq_save() in another process, ahead of anything
+ * else sent to the connection.  They may end in the middle of a packet,
+ * so they are never coalesced or skipped.
+ *
+ * @return 0 if the bytes were queued (or sent), otherwise -1.
+ */
+int outq_restore(OUTQ *q, const char *bytes, size_t len) {
+  OUTQ_BUF *buf = malloc(sizeof(OUTQ_BUF) + len);
+  if (buf == NULL) {
+    return -1;
+  }
+  atomic_init(&buf->refs, 1);
+  buf->len = len;
+  buf->npkts = 0;
+  buf->type = JEUX_NO_PKT;
+  buf->id = 0;
+  buf->notify = 0;
+  memcpy(buf->bytes, bytes, len);
+  int ret = outq_push(q, buf);
+  outq_buf_unref(buf);
+  return ret;
+}
+
+/*
+ * Send packets through a queue.  The caller must hold q->lock, and the
+ * queue must be open.
+ */
+static int outq_send_locked(OUTQ *q, PROTO_PACKET *pkts, int npkts) {
+  size_t sent = 0;
+  if (q->head == NULL && !q->armed && !q->congested && 2 * npkts <= OUTQ_IOV) {
+    struct iovec iov[OUTQ_IOV];
+    char hdrs[OUTQ_IOV / 2][PROTO_HEADER_MAX];
+    int iovcnt = 0;
+    size_t total = 0;
+    for (int i = 0; i < npkts; i++) {
+      JEUX_PACKET_HEADER *hdr = pkts[i].hdr;
+      info("WRITING PACKET: type=%d, size=%d, id=%d, role=%d", hdr->type, ntohs(hdr->size), hdr->id, hdr->role);
+      iov[iovcnt].iov_base = hdrs[i];
+      iov[iovcnt].iov_len = q->codec->encode(hdr, hdrs[i]);
+      total += iov[iovcnt++].iov_len;
+      if (ntohs(hdr->size) > 0) {
+        iov[iovcnt].iov_base = pkts[i].data;
+        iov[iovcnt++].iov_len = ntohs(hdr->size);
+        total += ntohs(hdr->size);
+      }
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t n;
+    while ((n = sendmsg(q->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+      ;
+    }
+    if (n == (ssize_t)total) {
+      return 0;
+    }
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      debug("outbound queue on fd %d failed: %s", q->fd, strerror(errno));
+      q->failed = 1;
+      return -1;
+    }
+    sent = n > 0 ? n : 0;
+  }
+  // the rest is queued, still under the lock so nothing can overtake it
+  int ret = -1;
+  OUTQ_BUF *buf = outq_buf_create(q->codec, pkts, npkts);
+  if (buf != NULL) {
+    ret = outq_append(q, buf, sent);
+    outq_buf_unref(buf);
+  }
+  return ret;
+}
+
+/*
+ * Send packets through a queue.  If nothing is queued ahead of them,
+ * they are written straight from the caller's storage, and only what
+ * the socket does not take is copied into a buffer and queued, so the
+ * usual case makes no allocation at all.
+ *
+ * @return 0 if the packets were sent (or queued, or skipped because
+ * notifications are paused), -1 if the queue has been closed or its
+ * connection has failed or been dropped.
+ */
+int outq_send(OUTQ *q, PROTO_PACKET *pkts, int npkts) {
+  pthread_mutex_lock(&q->lock);
+  int ret = -1;
+  if (!q->closed && !q->failed) {
+    ret = outq_send_locked(q, pkts, npkts);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ret;
+}
+
+/*
+ * Send packets through a queue as outq_send() does, and then frame
+ * everything sent after them with another codec.  No packet sent by
+ * another thread can come between the two.
+ *
+ * @param npkts  The number of packets, which may be zero.
+ * @param codec  The codec for the packets that follow.
+ * @return 0 if the packets were sent (or queued), -1 if the queue has
+ * been closed or its connection has failed or been dropped.
+ */
+int outq_send_switch(OUTQ *q, PROTO_PACKET *pkts, int npkts, const PROTO_CODEC *codec) {
+  pthread_mutex_lock(&q->lock);
+  int ret = -1;
+  if (!q->closed && !q->failed) {
+    ret = npkts > 0 ? outq_send_locked(q, pkts, npkts) : 0;
+  }
+  q->codec = codec;
+  pthread_mutex_unlock(&q->lock);
+  return ret;
+}
@@ -1,5 +1,7 @@
 #include "includeme.h"
 
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 
 /*
@@ -23,7 +25,7 @@
  */
 typedef struct player {
   char* name;
-  int ref_count;
+  atomic_int ref_count;
   int rating;
   pthread_mutex_t mutex;  
 } PLAYER;
@@ -53,7 +55,7 @@ PLAYER *player_create(char *name) {
   }
   pthread_mutex_init(&player->mutex, NULL);
   player->name = strdup(name);
-  player->ref_count = 0;
+  atomic_init(&player->ref_count, 0);
   player->rating = PLAYER_INITIAL_RATING;
   player_ref(player, "instantiated player object");
   return player;
@@ -69,11 +71,10 @@ PLAYER *player_create(char *name) {
  * @return  The same PLAYER object that was passed as a parameter.
  */
 PLAYER *player_ref(PLAYER *player, char *why) {
-  pthread_mutex_lock(&player->mutex);
+  int count = atomic_fetch_add_explicit(&player->ref_count, 1, memory_order_relaxed);
   debug("Increase reference count on player %p [%s] (%d -> %d) for %s",
-        player, player->name, player->ref_count, player->ref_count + 1, why);
-  player->ref_count++;
-  pthread_mutex_unlock(&player->mutex);
+        player, player->name, count, count + 1, why);
+  (void)count;
   return player;
 }
 
@@ -89,19 +90,16 @@ PLAYER *player_ref(PLAYER *player, char *why) {
  *
  */
 void player_unref(PLAYER *player, char *why) {
-  pthread_mutex_lock(&player->mutex);
+  int count = atomic_fetch_sub_explicit(&player->ref_count, 1, memory_order_release);
   debug("Decrease reference count on player %p [%s] (%d -> %d) for %s",
-        player, player->name, player->ref_count, player->ref_count - 1, why);
-  player->ref_count--;
-  if (player->ref_count == 0) {
+        player, player->name, count, count - 1, why);
+  if (count == 1) {
+    atomic_thread_fence(memory_order_acquire);
     debug("Freeing player %p [%s]", player, player->name);
-    pthread_mutex_unlock(&player->mutex);
     pthread_mutex_destroy(&player->mutex);
     free(player->name);
     free(player);
-    return;
   }
-  pthread_mutex_unlock(&player->mutex);
 }
 
 /*
@@ -124,6 +122,19 @@ int player_get_rating(PLAYER *player) {
   return player->rating;
 }
 
+/*
+ * Set the rating of a player, when it is carried over from another
+ * server process.
+ *
+ * @param player  The PLAYER that is to be updated.
+ * @param rating  The rating.
+ */
+void player_set_rating(PLAYER *player, int rating) {
+  pthread_mutex_lock(&player->mutex);
+  player->rating = rating;
+  pthread_mutex_unlock(&player->mutex);
+}
+
 /*
  * Post the result of a game between two players.
  * To update ratings, we use a system of a type devised by Arpad Elo,
@@ -158,8 +169,12 @@ void player_post_result(PLAYER *player1, PLAYER *player2, int result) {
     return;
   }
 
-  pthread_mutex_lock(&player1->mutex);
-  pthread_mutex_lock(&player2->mutex);
+  // lower address first, so that results posted for the same two players
+  // from different games cannot deadlock
+  PLAYER *first = (uintptr_t)player1 < (uintptr_t)player2 ? player1 : player2;
+  PLAYER *second = first == player1 ? player2 : player1;
+  pthread_mutex_lock(&first->mutex);
+  pthread_mutex_lock(&second->mutex);
   // double E1;// E2; 
   double S1 = 0.0;
   double S2 = 0.0; 
@@ -193,8 +208,8 @@ void player_post_result(PLAYER *player1, PLAYER *player2, int result) {
   player1->rating = RP1;
   player2->rating = R3 - RP1;
 
-  pthread_mutex_unlock(&player1->mutex);
-  pthread_mutex_unlock(&player2->mutex);
+  pthread_mutex_unlock(&second->mutex);
+  pthread_mutex_unlock(&first->mutex);
   // sem_post(&post_result_sem);
   return;
 }
\ No newline at end of file
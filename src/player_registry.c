@@ -115,4 +115,29 @@ PLAYER *preg_register(PLAYER_REGISTRY *preg, char *name) {
   pthread_mutex_unlock(&preg->mutex);
   player_ref(player, "returning new player in preg_register");
   return player;
-}
\ No newline at end of file
+}
+/*
+ * Return a list of every registered player, logged in or not.  The
+ * result is returned as a malloc'ed array of PLAYER pointers, with a
+ * NULL pointer marking the end of the array.  It is the caller's
+ * responsibility to decrement the reference count of each of the
+ * entries and to free the array when it is no longer needed.
+ *
+ * @param preg  The player registry.
+ * @return the list of players as a NULL-terminated array of pointers,
+ * or NULL if memory ran out.
+ */
+PLAYER **preg_all_players(PLAYER_REGISTRY *preg) {
+  pthread_mutex_lock(&preg->mutex);
+  PLAYER **players = calloc(preg->length + 1, sizeof(PLAYER *));
+  if (players == NULL) {
+    pthread_mutex_unlock(&preg->mutex);
+    return NULL;
+  }
+  int length = 0;
+  for (PLAYER_NODE *current = preg->head; current != NULL; current = current->next) {
+    players[length++] = player_ref(current->player, "preg_all_players");
+  }
+  pthread_mutex_unlock(&preg->mutex);
+  return players;
+}
@@ -1,6 +1,16 @@
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 #include "includeme.h"
+#include "uring_loop.h"
+
+// iovecs on the stack; larger batches allocate their array
+#define PROTO_SEND_IOV 16
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 /*
  * Send a packet, which consists of a fixed-size header followed by an
@@ -16,64 +26,400 @@
  * All multi-byte fields in the packet are assumed to be in network byte order.
  */
 int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data) {
-  int bytes_sent = 0;
-  int bytes_to_send = sizeof(JEUX_PACKET_HEADER);
-  int bytes_left = bytes_to_send;
-  int bytes_written = 0;
+  PROTO_PACKET pkt = {.hdr = hdr, .data = data};
+  return proto_send_packets(fd, &pkt, 1);
+}
 
-  info("WRITING PACKET: type=%d, size=%d, id=%d, role=%d", hdr->type, ntohs(hdr->size), hdr->id, hdr->role);
+/*
+ * The standard framing: the header is sent exactly as it is laid out.
+ */
+static size_t proto_v1_header_size(const char *buf, size_t have) {
+  return sizeof(JEUX_PACKET_HEADER);
+}
 
-  while (bytes_sent < bytes_to_send) {
-    bytes_written = write(fd, ((void *)hdr) + bytes_sent, bytes_left);
-    if (bytes_written == 0) {
-      debug("Reached EOF (bytes written header)");
-      return -1;
+static int proto_v1_decode(const char *buf, size_t len, JEUX_PACKET_HEADER *hdr) {
+  memcpy(hdr, buf, sizeof(JEUX_PACKET_HEADER));
+  return 0;
+}
+
+static size_t proto_v1_encode(const JEUX_PACKET_HEADER *hdr, char *buf) {
+  memcpy(buf, hdr, sizeof(JEUX_PACKET_HEADER));
+  return sizeof(JEUX_PACKET_HEADER);
+}
+
+/*
+ * The compact framing, described in protocol_ext.h.
+ */
+#define PROTO_V2_TYPE_MASK 0x1f
+#define PROTO_V2_TIMESTAMP 0x20
+#define PROTO_V2_ROLE_SHIFT 6
+// two fixed bytes and the shortest size
+#define PROTO_V2_MIN_HEADER 3
+// a 16-bit size never takes more than three varint bytes
+#define PROTO_V2_MAX_SIZE_BYTES 3
+#define PROTO_V2_TIMESTAMP_BYTES 8
+
+static size_t proto_v2_header_size(const char *buf, size_t have) {
+  const unsigned char *p = (const unsigned char *)buf;
+  if (have < PROTO_V2_MIN_HEADER) {
+    return PROTO_V2_MIN_HEADER;
+  }
+  size_t ts = (p[0] & PROTO_V2_TIMESTAMP) ? PROTO_V2_TIMESTAMP_BYTES : 0;
+  for (size_t i = 2; i < have && i < 2 + PROTO_V2_MAX_SIZE_BYTES; i++) {
+    if (!(p[i] & 0x80)) {
+      return i + 1 + ts;
     }
-    if (bytes_written < 0) {
-      error("error writing packet header");
+  }
+  return have < 2 + PROTO_V2_MAX_SIZE_BYTES ? have + 1 : 0;
+}
+
+static int proto_v2_decode(const char *buf, size_t len, JEUX_PACKET_HEADER *hdr) {
+  const unsigned char *p = (const unsigned char *)buf;
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->type = p[0] & PROTO_V2_TYPE_MASK;
+  hdr->role = p[0] >> PROTO_V2_ROLE_SHIFT;
+  hdr->id = p[1];
+  uint32_t size = 0;
+  size_t i = 2;
+  int shift = 0;
+  do {
+    size |= (uint32_t)(p[i] & 0x7f) << shift;
+    shift += 7;
+  } while (p[i++] & 0x80);
+  if (size > UINT16_MAX) {
+    return -1;
+  }
+  hdr->size = htons(size);
+  if (p[0] & PROTO_V2_TIMESTAMP) {
+    memcpy(&hdr->timestamp_sec, p + i, sizeof(hdr->timestamp_sec));
+    memcpy(&hdr->timestamp_nsec, p + i + 4, sizeof(hdr->timestamp_nsec));
+    i += PROTO_V2_TIMESTAMP_BYTES;
+  }
+  return i == len ? 0 : -1;
+}
+
+static size_t proto_v2_encode_header(const JEUX_PACKET_HEADER *hdr, char *buf, int ts) {
+  unsigned char *p = (unsigned char *)buf;
+  p[0] = (hdr->type & PROTO_V2_TYPE_MASK) | (hdr->role << PROTO_V2_ROLE_SHIFT) |
+         (ts ? PROTO_V2_TIMESTAMP : 0);
+  p[1] = hdr->id;
+  size_t i = 2;
+  uint32_t size = ntohs(hdr->size);
+  while (size >= 0x80) {
+    p[i++] = (size & 0x7f) | 0x80;
+    size >>= 7;
+  }
+  p[i++] = size;
+  if (ts) {
+    memcpy(p + i, &hdr->timestamp_sec, sizeof(hdr->timestamp_sec));
+    memcpy(p + i + 4, &hdr->timestamp_nsec, sizeof(hdr->timestamp_nsec));
+    i += PROTO_V2_TIMESTAMP_BYTES;
+  }
+  return i;
+}
+
+static size_t proto_v2_encode(const JEUX_PACKET_HEADER *hdr, char *buf) {
+  return proto_v2_encode_header(hdr, buf, 0);
+}
+
+static size_t proto_v2_ts_encode(const JEUX_PACKET_HEADER *hdr, char *buf) {
+  return proto_v2_encode_header(hdr, buf, 1);
+}
+
+/*
+ * The multiplexed and correlated framings, described in protocol_ext.h:
+ * the compact header without timestamps, and with a session, a
+ * correlation ID or both between the id and the size.  Each of those
+ * fields, and the size, is a varint of at most three bytes.
+ */
+#define PROTO_EXT_SESSION 0x1
+#define PROTO_EXT_CORRELATION 0x2
+#define PROTO_EXT_FIELDS(ext) (1 + ((ext) & PROTO_EXT_SESSION ? 1 : 0) + ((ext) & PROTO_EXT_CORRELATION ? 1 : 0))
+
+static size_t proto_ext_header_size(const char *buf, size_t have, int ext) {
+  const unsigned char *p = (const unsigned char *)buf;
+  int nfields = PROTO_EXT_FIELDS(ext);
+  // two fixed bytes and the shortest of each varint
+  if (have < 2 + (size_t)nfields) {
+    return 2 + nfields;
+  }
+  size_t i = 2;
+  for (int field = 0; field < nfields; field++) {
+    size_t end = i + PROTO_V2_MAX_SIZE_BYTES;
+    while (i < have && i < end && (p[i] & 0x80)) {
+      i++;
+    }
+    if (i == end) {
+      return 0;
+    }
+    if (i == have) {
+      return have + 1;
+    }
+    i++;
+  }
+  return i;
+}
+
+static int proto_ext_decode(const char *buf, size_t len, JEUX_PACKET_HEADER *hdr, int ext) {
+  const unsigned char *p = (const unsigned char *)buf;
+  if (p[0] & PROTO_V2_TIMESTAMP) {
+    return -1;
+  }
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->type = p[0] & PROTO_V2_TYPE_MASK;
+  hdr->role = p[0] >> PROTO_V2_ROLE_SHIFT;
+  hdr->id = p[1];
+  // the session, the correlation ID and the size, as far as present
+  uint32_t fields[3] = {0, 0, 0};
+  size_t i = 2;
+  for (int field = 0; field < 3; field++) {
+    if ((field == 0 && !(ext & PROTO_EXT_SESSION)) ||
+        (field == 1 && !(ext & PROTO_EXT_CORRELATION))) {
+      continue;
+    }
+    int shift = 0;
+    do {
+      fields[field] |= (uint32_t)(p[i] & 0x7f) << shift;
+      shift += 7;
+    } while (p[i++] & 0x80);
+    if (fields[field] > UINT16_MAX) {
       return -1;
     }
-    bytes_sent += bytes_written;
-    bytes_left -= bytes_written;
-    // debug("written %d bytes out of %d", bytes_sent, bytes_to_send);
   }
-  int bytes_size = ntohs(hdr->size);
-  // warn("bytes_size: %d", bytes_size);
-  // convert size back to host byte order
+  hdr->timestamp_sec = htonl(fields[0]);
+  hdr->timestamp_nsec = htonl(fields[1]);
+  hdr->size = htons(fields[2]);
+  return i == len ? 0 : -1;
+}
 
-  bytes_sent = 0;
-  bytes_to_send = bytes_size;
-  bytes_left = bytes_to_send;
+static size_t proto_ext_encode(const JEUX_PACKET_HEADER *hdr, char *buf, int ext) {
+  unsigned char *p = (unsigned char *)buf;
+  p[0] = (hdr->type & PROTO_V2_TYPE_MASK) | (hdr->role << PROTO_V2_ROLE_SHIFT);
+  p[1] = hdr->id;
+  size_t i = 2;
+  uint32_t fields[3] = {PROTO_SESSION(hdr) & PROTO_SESSION_MAX,
+                        PROTO_CORRELATION(hdr) & PROTO_CORRELATION_MAX, ntohs(hdr->size)};
+  for (int field = 0; field < 3; field++) {
+    if ((field == 0 && !(ext & PROTO_EXT_SESSION)) ||
+        (field == 1 && !(ext & PROTO_EXT_CORRELATION))) {
+      continue;
+    }
+    uint32_t v = fields[field];
+    while (v >= 0x80) {
+      p[i++] = (v & 0x7f) | 0x80;
+      v >>= 7;
+    }
+    p[i++] = v;
+  }
+  return i;
+}
 
-  if (bytes_left == 0 && data == NULL) {
-    return 0;
+static size_t proto_mux_header_size(const char *buf, size_t have) {
+  return proto_ext_header_size(buf, have, PROTO_EXT_SESSION);
+}
+
+static int proto_mux_decode(const char *buf, size_t len, JEUX_PACKET_HEADER *hdr) {
+  return proto_ext_decode(buf, len, hdr, PROTO_EXT_SESSION);
+}
+
+static size_t proto_mux_encode(const JEUX_PACKET_HEADER *hdr, char *buf) {
+  return proto_ext_encode(hdr, buf, PROTO_EXT_SESSION);
+}
+
+static size_t proto_corr_header_size(const char *buf, size_t have) {
+  return proto_ext_header_size(buf, have, PROTO_EXT_CORRELATION);
+}
+
+static int proto_corr_decode(const char *buf, size_t len, JEUX_PACKET_HEADER *hdr) {
+  return proto_ext_decode(buf, len, hdr, PROTO_EXT_CORRELATION);
+}
+
+static size_t proto_corr_encode(const JEUX_PACKET_HEADER *hdr, char *buf) {
+  return proto_ext_encode(hdr, buf, PROTO_EXT_CORRELATION);
+}
+
+static size_t proto_mux_corr_header_size(const char *buf, size_t have) {
+  return proto_ext_header_size(buf, have, PROTO_EXT_SESSION | PROTO_EXT_CORRELATION);
+}
+
+static int proto_mux_corr_decode(const char *buf, size_t len, JEUX_PACKET_HEADER *hdr) {
+  return proto_ext_decode(buf, len, hdr, PROTO_EXT_SESSION | PROTO_EXT_CORRELATION);
+}
+
+static size_t proto_mux_corr_encode(const JEUX_PACKET_HEADER *hdr, char *buf) {
+  return proto_ext_encode(hdr, buf, PROTO_EXT_SESSION | PROTO_EXT_CORRELATION);
+}
+
+const PROTO_CODEC proto_codec_v1 = {
+  .name = "v1",
+  .caps = 0,
+  .header_size = proto_v1_header_size,
+  .decode = proto_v1_decode,
+  .encode = proto_v1_encode,
+};
+
+const PROTO_CODEC proto_codec_v2 = {
+  .name = "v2",
+  .caps = PROTO_CAP_COMPACT,
+  .header_size = proto_v2_header_size,
+  .decode = proto_v2_decode,
+  .encode = proto_v2_encode,
+};
+
+const PROTO_CODEC proto_codec_v2_ts = {
+  .name = "v2+timestamps",
+  .caps = PROTO_CAP_COMPACT | PROTO_CAP_TIMESTAMPS,
+  .header_size = proto_v2_header_size,
+  .decode = proto_v2_decode,
+  .encode = proto_v2_ts_encode,
+};
+
+const PROTO_CODEC proto_codec_mux = {
+  .name = "multiplexed",
+  .caps = PROTO_CAP_COMPACT | PROTO_CAP_MUX,
+  .header_size = proto_mux_header_size,
+  .decode = proto_mux_decode,
+  .encode = proto_mux_encode,
+};
+
+const PROTO_CODEC proto_codec_v2_corr = {
+  .name = "v2+correlation",
+  .caps = PROTO_CAP_COMPACT | PROTO_CAP_CORRELATION,
+  .header_size = proto_corr_header_size,
+  .decode = proto_corr_decode,
+  .encode = proto_corr_encode,
+};
+
+const PROTO_CODEC proto_codec_mux_corr = {
+  .name = "multiplexed+correlation",
+  .caps = PROTO_CAP_COMPACT | PROTO_CAP_MUX | PROTO_CAP_CORRELATION,
+  .header_size = proto_mux_corr_header_size,
+  .decode = proto_mux_corr_decode,
+  .encode = proto_mux_corr_encode,
+};
+
+/*
+ * Choose the codec for the capabilities a client asked for.  Bits the
+ * server does not know, and timestamps, sessions or correlation IDs
+ * without the compact framing, are ignored.  Multiplexed and correlated
+ * headers have no timestamps.
+ *
+ * @param caps  The role field of the client's LOGIN.
+ * @return the codec; its caps field holds the bits that were accepted.
+ */
+const PROTO_CODEC *proto_codec_for(int caps) {
+  if (!(caps & PROTO_CAP_COMPACT)) {
+    return &proto_codec_v1;
   }
+  if (caps & PROTO_CAP_MUX) {
+    return (caps & PROTO_CAP_CORRELATION) ? &proto_codec_mux_corr : &proto_codec_mux;
+  }
+  if (caps & PROTO_CAP_CORRELATION) {
+    return &proto_codec_v2_corr;
+  }
+  return (caps & PROTO_CAP_TIMESTAMPS) ? &proto_codec_v2_ts : &proto_codec_v2;
+}
 
-  if (bytes_left > 0 && data == NULL) {
-    error("data is null but bytes_left > 0");
-    return -1;
+/*
+ * Send several packets, back to back, with as few system calls as
+ * possible.  The headers and payloads are gathered into one iovec array
+ * and written with writev(2); a partial write resumes from the iovec and
+ * offset at which it stopped.
+ *
+ * @param fd  The file descriptor on which the packets are to be sent.
+ * @param pkts  The packets, in the order in which they are to be sent.
+ * @param npkts  The number of packets.
+ * @return  0 if every packet was sent, -1 otherwise.
+ */
+int proto_send_packets(int fd, PROTO_PACKET *pkts, int npkts) {
+  return proto_send_packets_codec(fd, &proto_codec_v1, pkts, npkts);
+}
+
+/*
+ * Send several packets like proto_send_packets(), with their headers
+ * framed by a codec.
+ *
+ * @param codec  The codec of the connection.
+ */
+int proto_send_packets_codec(int fd, const PROTO_CODEC *codec, PROTO_PACKET *pkts, int npkts) {
+  for (int i = 0; i < npkts; i++) {
+    JEUX_PACKET_HEADER *hdr = pkts[i].hdr;
+    info("WRITING PACKET: type=%d, size=%d, id=%d, role=%d", hdr->type, ntohs(hdr->size), hdr->id, hdr->role);
+    if (ntohs(hdr->size) > 0 && pkts[i].data == NULL) {
+      error("data is null but bytes_left > 0");
+      return -1;
+    }
+    if (ntohs(hdr->size) == 0 && pkts[i].data != NULL) {
+      error("data is not null but bytes_left == 0");
+      return -1;
+    }
   }
 
-  if (bytes_left == 0 && data != NULL) {
-    error("data is not null but bytes_left == 0");
-    return -1;
+  // connections serviced by the io_uring backend are sent through their ring
+  int ret = uring_send_packets(fd, codec, pkts, npkts);
+  if (ret != URING_NOT_OWNED) {
+    return ret;
   }
 
-  while (bytes_sent < bytes_to_send) {
-    debug("written %d bytes out of %d", bytes_sent, bytes_to_send);
-    bytes_written = write(fd, data + bytes_sent, bytes_left);
-    if (bytes_written < 0) {
-      error("error writing packet data");
+  // the encoded headers live after the iovecs
+  struct iovec local[PROTO_SEND_IOV];
+  char local_hdrs[PROTO_SEND_IOV / 2][PROTO_HEADER_MAX];
+  struct iovec *iov = local;
+  char (*hdrs)[PROTO_HEADER_MAX] = local_hdrs;
+  if (2 * npkts > PROTO_SEND_IOV) {
+    iov = malloc(2 * npkts * sizeof(struct iovec) + npkts * PROTO_HEADER_MAX);
+    if (iov == NULL) {
       return -1;
     }
+    hdrs = (char (*)[PROTO_HEADER_MAX])(iov + 2 * npkts);
+  }
+  int iovcnt = 0;
+  for (int i = 0; i < npkts; i++) {
+    iov[iovcnt].iov_base = hdrs[i];
+    iov[iovcnt++].iov_len = codec->encode(pkts[i].hdr, hdrs[i]);
+    if (ntohs(pkts[i].hdr->size) > 0) {
+      iov[iovcnt].iov_base = pkts[i].data;
+      iov[iovcnt++].iov_len = ntohs(pkts[i].hdr->size);
+    }
+  }
+
+  ret = 0;
+  struct iovec *next = iov;
+  int left = iovcnt;
+  while (left > 0) {
+    ssize_t bytes_written = writev(fd, next, left < IOV_MAX ? left : IOV_MAX);
+    if (bytes_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // sockets serviced by the event loops are non-blocking, and are
+      // only written by their outbound queues, which wait for EPOLLOUT;
+      // nothing here may wait on one
+      error("error writing packet");
+      ret = -1;
+      break;
+    }
     if (bytes_written == 0) {
-      debug("Reached EOF (bytes written payload)");
-      return -1;
+      debug("Reached EOF (bytes written)");
+      ret = -1;
+      break;
+    }
+    // skip the iovecs that were written completely, then trim the
+    // one that was written in part
+    while (left > 0 && (size_t)bytes_written >= next->iov_len) {
+      bytes_written -= next->iov_len;
+      next++;
+      left--;
+    }
+    if (left > 0) {
+      next->iov_base = (char *)next->iov_base + bytes_written;
+      next->iov_len -= bytes_written;
     }
-    bytes_sent += bytes_written;
-    bytes_left -= bytes_written;
   }
-  return 0;
+  if (iov != local) {
+    free(iov);
+  }
+  return ret;
 }
 
 /*
@@ -154,3 +500,329 @@ int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp) {
   info("payload read: %s", (char *) *payloadp);
   return 0;
 }
+
+/*
+ * Initialize a receive ring for a file descriptor, with the standard
+ * framing.
+ */
+void proto_recv_buf_init(PROTO_RECV_BUF *rb, int fd) {
+  rb->fd = fd;
+  rb->codec = &proto_codec_v1;
+  rb->head = 0;
+  rb->tail = 0;
+  rb->payload = NULL;
+  rb->payload_cap = 0;
+}
+
+/*
+ * Free the payload buffer of a receive ring.
+ */
+void proto_recv_buf_fini(PROTO_RECV_BUF *rb) {
+  free(rb->payload);
+  rb->payload = NULL;
+  rb->payload_cap = 0;
+}
+
+/*
+ * Make sure a reusable payload buffer can hold size bytes plus a NUL.
+ * Buffers only grow, so a connection allocates only when it receives a
+ * payload larger than any before it.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int proto_payload_reserve(char **payload, size_t *cap, size_t size) {
+  if (size + 1 <= *cap) {
+    return 0;
+  }
+  size_t newcap = *cap ? *cap : 64;
+  while (newcap < size + 1) {
+    newcap *= 2;
+  }
+  char *p = realloc(*payload, newcap);
+  if (p == NULL) {
+    error("cow licked incorrectly");
+    return -1;
+  }
+  *payload = p;
+  *cap = newcap;
+  return 0;
+}
+
+/*
+ * Read as much as is available into the free space of a receive ring.
+ * The free space may wrap around the end of the ring, so it is filled
+ * with a single readv(2) of up to two pieces.
+ *
+ * @return the number of bytes read, 0 on EOF, or -1 on error.
+ */
+static ssize_t proto_recv_buf_fill(PROTO_RECV_BUF *rb) {
+  size_t space = PROTO_RECV_BUF_SIZE - (rb->tail - rb->head);
+  size_t start = rb->tail & (PROTO_RECV_BUF_SIZE - 1);
+  size_t first = PROTO_RECV_BUF_SIZE - start;
+  struct iovec iov[2];
+  int iovcnt = 1;
+  iov[0].iov_base = rb->ring + start;
+  iov[0].iov_len = space < first ? space : first;
+  if (space > first) {
+    iov[1].iov_base = rb->ring;
+    iov[1].iov_len = space - first;
+    iovcnt = 2;
+  }
+  ssize_t n;
+  while ((n = readv(rb->fd, iov, iovcnt)) < 0 && errno == EINTR) {
+    ;
+  }
+  if (n > 0) {
+    rb->tail += n;
+  }
+  return n;
+}
+
+/*
+ * Copy up to len bytes out of the front of a receive ring, without
+ * consuming them.
+ *
+ * @return the number of bytes copied.
+ */
+static size_t proto_recv_buf_peek(PROTO_RECV_BUF *rb, void *dst, size_t len) {
+  size_t buffered = rb->tail - rb->head;
+  if (len > buffered) {
+    len = buffered;
+  }
+  size_t start = rb->head & (PROTO_RECV_BUF_SIZE - 1);
+  size_t first = PROTO_RECV_BUF_SIZE - start;
+  if (len <= first) {
+    memcpy(dst, rb->ring + start, len);
+  } else {
+    memcpy(dst, rb->ring + start, first);
+    memcpy((char *)dst + first, rb->ring, len - first);
+  }
+  return len;
+}
+
+/*
+ * Copy bytes out of the front of a receive ring and consume them.
+ * The caller must make sure that at least len bytes are buffered.
+ */
+static void proto_recv_buf_take(PROTO_RECV_BUF *rb, void *dst, size_t len) {
+  rb->head += proto_recv_buf_peek(rb, dst, len);
+}
+
+/*
+ * Receive a packet through a receive ring, blocking until one is
+ * available.  This behaves like proto_recv_packet(), except that any
+ * bytes read beyond the end of the packet are kept in the ring for the
+ * next call.
+ *
+ * @param rb  The receive ring of the connection.
+ * @param hdr  Pointer to caller-supplied storage for the fixed-size
+ *   packet header.
+ * @param payloadp  Pointer to a variable into which to store a pointer to
+ *   any payload received, or NULL if there is none.  The payload is
+ *   NUL-terminated and belongs to the ring: it must not be freed, and it
+ *   is only valid until the next packet is received.
+ * @return  0 in case of successful reception, -1 otherwise (including
+ *   when a header is malformed).
+ */
+int proto_recv_packet_buffered(PROTO_RECV_BUF *rb, JEUX_PACKET_HEADER *hdr, char **payloadp) {
+  *payloadp = NULL;
+  char raw[PROTO_HEADER_MAX];
+  size_t len;
+  while (1) {
+    size_t have = proto_recv_buf_peek(rb, raw, sizeof(raw));
+    len = rb->codec->header_size(raw, have);
+    if (len == 0 || have >= len) {
+      break;
+    }
+    ssize_t n = proto_recv_buf_fill(rb);
+    if (n < 0) {
+      error("nothing to read");
+      return -1;
+    }
+    if (n == 0) {
+      info("read eof");
+      return -1;
+    }
+  }
+  if (len == 0 || rb->codec->decode(raw, len, hdr) == -1) {
+    error("malformed packet header");
+    return -1;
+  }
+  rb->head += len;
+  info("READING PACKET: type=%d, size=%d, id=%d, role=%d", hdr->type, ntohs(hdr->size), hdr->id, hdr->role);
+
+  size_t size = ntohs(hdr->size);
+  if (size == 0) {
+    return 0;
+  }
+  if (proto_payload_reserve(&rb->payload, &rb->payload_cap, size) == -1) {
+    return -1;
+  }
+  char *payload = rb->payload;
+  // a payload larger than the ring is copied out a ringful at a time
+  size_t have = 0;
+  while (have < size) {
+    size_t buffered = rb->tail - rb->head;
+    if (buffered == 0) {
+      ssize_t n = proto_recv_buf_fill(rb);
+      if (n <= 0) {
+        error("error reading payload");
+        return -1;
+      }
+      continue;
+    }
+    size_t take = size - have < buffered ? size - have : buffered;
+    proto_recv_buf_take(rb, payload + have, take);
+    have += take;
+  }
+  payload[size] = '\0';
+  *payloadp = payload;
+  info("payload read: %s", payload);
+  return 0;
+}
+
+/*
+ * Tell whether proto_recv_packet_buffered() would return without reading,
+ * because a whole packet (or a malformed header) is already in the ring.
+ */
+int proto_recv_buf_ready(PROTO_RECV_BUF *rb) {
+  char raw[PROTO_HEADER_MAX];
+  size_t have = proto_recv_buf_peek(rb, raw, sizeof(raw));
+  size_t len = rb->codec->header_size(raw, have);
+  if (len == 0) {
+    return 1;
+  }
+  JEUX_PACKET_HEADER hdr;
+  if (have < len) {
+    return 0;
+  }
+  if (rb->codec->decode(raw, len, &hdr) == -1) {
+    return 1;
+  }
+  return rb->tail - rb->head >= len + ntohs(hdr.size);
+}
+
+/*
+ * Consume bytes into a partially assembled packet.
+ *
+ * @param pa  The assembler.
+ * @param buf  The bytes that have arrived.
+ * @param len  The number of bytes in buf.
+ * @param done  Set to 1 if a complete packet is now available, in which
+ * case proto_assembler_take() must be called before feeding more bytes,
+ * or to -1 if a malformed header arrived, in which case the connection
+ * cannot be read any further.
+ * @return the number of bytes consumed from buf.
+ */
+size_t proto_assemble(PROTO_ASSEMBLER *pa, const char *buf, size_t len, int *done) {
+  size_t used = 0;
+  *done = 0;
+  if (pa->hdr_len == 0) {
+    const PROTO_CODEC *codec = pa->codec != NULL ? pa->codec : &proto_codec_v1;
+    // take no more than the header is known to need, so that nothing
+    // beyond it is consumed
+    size_t need;
+    while ((need = codec->header_size(pa->raw, pa->hdr_have)) > pa->hdr_have) {
+      if (used == len) {
+        return used;
+      }
+      size_t take = (len - used) < need - pa->hdr_have ? (len - used) : need - pa->hdr_have;
+      memcpy(pa->raw + pa->hdr_have, buf + used, take);
+      pa->hdr_have += take;
+      used += take;
+    }
+    if (need == 0 || codec->decode(pa->raw, need, &pa->hdr) == -1) {
+      error("malformed packet header");
+      *done = -1;
+      return used;
+    }
+    pa->hdr_len = need;
+    info("READING PACKET: type=%d, size=%d, id=%d, role=%d", pa->hdr.type,
+         ntohs(pa->hdr.size), pa->hdr.id, pa->hdr.role);
+    if (ntohs(pa->hdr.size) == 0) {
+      *done = 1;
+      return used;
+    }
+    if (proto_payload_reserve(&pa->payload, &pa->payload_cap, ntohs(pa->hdr.size)) == -1) {
+      // the payload is consumed but dropped, and the packet is
+      // delivered without one
+      free(pa->payload);
+      pa->payload = NULL;
+      pa->payload_cap = 0;
+    }
+    pa->payload_have = 0;
+  }
+  size_t need = ntohs(pa->hdr.size) - pa->payload_have;
+  size_t take = (len - used) < need ? (len - used) : need;
+  if (pa->payload != NULL) {
+    memcpy(pa->payload + pa->payload_have, buf + used, take);
+  }
+  pa->payload_have += take;
+  used += take;
+  if (pa->payload_have == ntohs(pa->hdr.size)) {
+    if (pa->payload != NULL) {
+      pa->payload[pa->payload_have] = '\0';
+    }
+    *done = 1;
+  }
+  return used;
+}
+
+/*
+ * Take the completed packet out of an assembler and reset it for the
+ * next packet.  The header is copied into hdr and the NUL-terminated
+ * payload (or NULL if there is none) is returned.  The payload belongs
+ * to the assembler and is only valid until more bytes are fed to it.
+ */
+char *proto_assembler_take(PROTO_ASSEMBLER *pa, JEUX_PACKET_HEADER *hdr) {
+  char *payload = ntohs(pa->hdr.size) > 0 ? pa->payload : NULL;
+  *hdr = pa->hdr;
+  pa->hdr_have = 0;
+  pa->hdr_len = 0;
+  pa->payload_have = 0;
+  return payload;
+}
+
+/*
+ * Copy the bytes of a packet that has only partly been assembled, so
+ * that feeding them to a fresh assembler with the same codec puts it in
+ * the same state.
+ *
+ * @param pa  The assembler, which must not be holding a completed packet.
+ * @param lenp  Set to the number of bytes copied.
+ * @return the malloc'ed bytes, or NULL if there are none (or memory ran
+ * out, in which case *lenp is nonzero).
+ */
+char *proto_assembler_save(PROTO_ASSEMBLER *pa, size_t *lenp) {
+  size_t payload = pa->hdr_len > 0 ? pa->payload_have : 0;
+  *lenp = pa->hdr_have + payload;
+  if (*lenp == 0) {
+    return NULL;
+  }
+  char *bytes = malloc(*lenp);
+  if (bytes == NULL) {
+    return NULL;
+  }
+  memcpy(bytes, pa->raw, pa->hdr_have);
+  if (payload > 0) {
+    // a payload that could not be stored was dropped, but still counts
+    if (pa->payload != NULL) {
+      memcpy(bytes + pa->hdr_have, pa->payload, payload);
+    } else {
+      memset(bytes + pa->hdr_have, 0, payload);
+    }
+  }
+  return bytes;
+}
+
+/*
+ * Free the buffers of an assembler.
+ */
+void proto_assembler_fini(PROTO_ASSEMBLER *pa) {
+  free(pa->payload);
+  pa->payload = NULL;
+  pa->payload_cap = 0;
+  pa->hdr_have = 0;
+  pa->hdr_len = 0;
+  pa->payload_have = 0;
+}
@@ -57,9 +57,8 @@ int process_login(char* payload, int connfd, JEUX_PACKET_HEADER *hdr, CLIENT *cl
     client_send_nack(client);
     return -1;
   }
-  // calloc username
-  char *username = calloc(ntohs(hdr->size)+1, sizeof(char));
-  strncpy(username, (char*)payload, ntohs(hdr->size));
+  // the payload is NUL-terminated, and preg_register() copies the name
+  char *username = payload;
   // debug("username: %s", username);
 
   // check if payload is empty string
@@ -86,18 +85,34 @@ int process_login(char* payload, int connfd, JEUX_PACKET_HEADER *hdr, CLIENT *cl
   if (new_player == NULL) {
     debug("player registry is full");
     client_send_nack(client);
-    free(username);
     return -1;
   }
   // debug("player name: %s", player_get_name(new_player));
-  if (client_login(client, new_player) == -1)  {
+  int ret = client_login(client, new_player);
+  player_unref(new_player, "register new player");
+  if (ret == -1)  {
     error("Failed to log in client");
     client_send_nack(client);
+    return -1;
   }
-  player_unref(new_player, "register new player");
-  // send ack packet
-  client_send_ack(client, NULL, 0);
-  free(username);
+  // send ack packet, still in the standard framing; its role field holds
+  // the capabilities accepted from the LOGIN's, and those select the
+  // framing of every packet after it
+  const PROTO_CODEC *codec = proto_codec_for(hdr->role);
+  int caps = codec->caps;
+  if (client_session_id(client) > 0) {
+    // a session has the framing and capabilities of its connection, and
+    // the role field of a multiplexed header is too narrow to repeat them
+    codec = client_get_codec(client);
+    caps = 0;
+  } else {
+    caps |= hdr->role & PROTO_CAP_DELTA;
+    client_set_caps(client, caps);
+  }
+  JEUX_PACKET_HEADER ack;
+  init_header(&ack, JEUX_ACK_PKT, 0, caps, 0);
+  PROTO_PACKET pkt = {.hdr = &ack, .data = NULL};
+  client_send_switch(client, &pkt, 1, codec);
   return 1;
 }
 
@@ -177,13 +192,21 @@ int process_invite(char* payload, int connfd, CLIENT *client, JEUX_PACKET_HEADER
 
   // im blushing uwu
   info("sending invite to %s", payload);
+  // the id field picks a time control (0 for an untimed game)
+  TIME_CONTROL tc;
+  int timed = clock_preset(hdr->id, &tc);
+  if (timed == -1) {
+    debug("no time control preset %d", hdr->id);
+    client_send_nack(client);
+    return -1;
+  }
   // what role am i?
   int their_role = hdr->role;
   int invitation_id = -1;
   if (their_role == FIRST_PLAYER_ROLE) {
-    invitation_id = client_make_invitation(client, invitee, SECOND_PLAYER_ROLE,FIRST_PLAYER_ROLE);
+    invitation_id = client_make_timed_invitation(client, invitee, SECOND_PLAYER_ROLE,FIRST_PLAYER_ROLE, timed ? &tc : NULL);
   } else if (their_role == SECOND_PLAYER_ROLE) {
-    invitation_id = client_make_invitation(client, invitee, FIRST_PLAYER_ROLE,SECOND_PLAYER_ROLE);
+    invitation_id = client_make_timed_invitation(client, invitee, FIRST_PLAYER_ROLE,SECOND_PLAYER_ROLE, timed ? &tc : NULL);
   } else {
     debug("my_role is not 1 or 2");
     // free(username);
@@ -192,9 +215,9 @@ int process_invite(char* payload, int connfd, CLIENT *client, JEUX_PACKET_HEADER
   }
   // alright qt, i accept this packet uwu
   // create a header so i can send an ack packet with the invitation id
-  JEUX_PACKET_HEADER* send_hdr = create_header(JEUX_ACK_PKT, invitation_id, 0, 0);
-  client_send_packet(client, send_hdr, NULL);
-  free(send_hdr);
+  JEUX_PACKET_HEADER send_hdr;
+  init_header(&send_hdr, JEUX_ACK_PKT, invitation_id, 0, 0);
+  client_send_packet(client, &send_hdr, NULL);
   // free(username);
   return 0;
   // end
@@ -291,21 +314,17 @@ int process_move(char* payload, int connfd, CLIENT *client, JEUX_PACKET_HEADER *
   }
   int invitation_id = hdr->id;
   warn("invitation_id: %d", invitation_id);
-  // payload is move
-  // payload not gauranteed null terminated
-  char* move = calloc(ntohs(hdr->size)+1, sizeof(char));
-  strncpy(move, (char*)payload, ntohs(hdr->size));
+  // payload is move, NUL-terminated by the receive path
+  char *move = payload;
   // make move
   int move_result = client_make_move(client, invitation_id, move);
   if (move_result == -1) {
     debug("move_result == -1");
-    free(move);
     client_send_nack(client);
     return -1;
   }
   // send ack packet
   client_send_ack(client, NULL, 0);
-  free(move);
   return 0;
 }
 
@@ -331,6 +350,180 @@ int process_resign(char* payload, int connfd, CLIENT *client, JEUX_PACKET_HEADER
   return 0;
 }
 
+int process_state(char* payload, int connfd, CLIENT *client, JEUX_PACKET_HEADER *hdr) {
+  debug("RECIEVED PACKET (clientfd=%d, type=STATE) for client %p", connfd, client);
+  char *state = client_get_game_state(client, hdr->id);
+  if (state == NULL) {
+    debug("no game to describe");
+    client_send_nack(client);
+    return -1;
+  }
+  // send ack packet
+  client_send_ack(client, state, strlen(state));
+  free(state);
+  return 0;
+}
+
+/*
+ * Dispatch a packet to the handler for its type, on behalf of one client
+ * (that of a connection, or one of its sessions).
+ */
+static int jeux_dispatch(CLIENT *client, int connfd, JEUX_PACKET_HEADER *hdr, char *payload, int *logged_in) {
+  // on a correlated connection, the ACK or NACK carries the request's ID
+  if (client_get_codec(client)->caps & PROTO_CAP_CORRELATION) {
+    client_set_correlation(client, PROTO_CORRELATION(hdr));
+  }
+  client_cork();
+  // process stuff in header and payload
+  switch (hdr->type) {
+    case JEUX_LOGIN_PKT:
+      // a LOGIN that is refused leaves the connection as it was
+      if (process_login(payload, connfd, hdr, client) == 1) {
+        *logged_in = 1;
+      }
+      break;
+    case JEUX_USERS_PKT:
+      if (*logged_in == 0) {
+        debug("process_login_packet == 0");
+        client_send_nack(client);
+      } else {
+        process_users(NULL, connfd, client);
+      }
+      break;
+    case JEUX_INVITE_PKT:
+      if (*logged_in == 0) {
+        debug("process_login_packet == 0");
+        client_send_nack(client);
+      } else {
+        process_invite(payload, connfd, client, hdr);
+      }
+      break;
+    case JEUX_REVOKE_PKT:
+      if (*logged_in == 0) {
+        debug("process_login_packet == 0");
+        client_send_nack(client);
+      } else {
+        info("made it here :>)");
+        process_revoke(NULL, connfd, client, hdr); 
+      }
+      break;
+    case JEUX_ACCEPT_PKT:
+      if (*logged_in == 0) {
+        debug("process_login_packet == 0");
+        client_send_nack(client);
+      } else {
+        process_accept(NULL, connfd, client, hdr);
+      }
+      break;
+    case JEUX_DECLINE_PKT:
+      if (*logged_in == 0) {
+        debug("process_login_packet == 0");
+        client_send_nack(client);
+      } else {
+        process_decline(NULL, connfd, client, hdr);
+      }
+      break;
+    case JEUX_MOVE_PKT:
+      if (*logged_in == 0) {
+        debug("process_login_packet == 0");
+        client_send_nack(client);
+      } else {
+        process_move(payload, connfd, client, hdr);
+      }
+      break;
+    case JEUX_RESIGN_PKT:
+      if (*logged_in == 0) {
+        debug("process_login_packet == 0");
+        client_send_nack(client);
+      } else {
+        process_resign(NULL, connfd, client, hdr);
+      }
+      break;
+    case JEUX_STATE_PKT:
+      if (*logged_in == 0) {
+        debug("process_login_packet == 0");
+        client_send_nack(client);
+      } else {
+        process_state(NULL, connfd, client, hdr);
+      }
+      break;
+    case JEUX_NO_PKT:
+      client_logout(client);
+      client_uncork();
+      return -1;
+    default:
+      debug("default");
+      // if (process_login == 0) {
+      //   debug("process_login == 0");
+      // client_send_nack(client);
+      //   break;
+      // }
+      break;
+  }
+  client_uncork();
+  return 0;
+}
+
+/*
+ * Dispatch a packet addressed to a session of a multiplexed connection.
+ * The first packet for a number that is not in use opens a session under
+ * it, which, like a new connection, has to log in before anything else.
+ * A packet with no type ends the session, logging it out.
+ */
+static void jeux_dispatch_session(CLIENT *conn, int connfd, int session, JEUX_PACKET_HEADER *hdr,
+                                  char *payload) {
+  CLIENT *client = client_get_session(conn, session);
+  if (hdr->type == JEUX_NO_PKT) {
+    if (client != NULL) {
+      debug("session %d on fd %d has ended", session, connfd);
+      client_remove_session(conn, session);
+      creg_unregister(client_registry, client);
+    }
+    return;
+  }
+  if (client == NULL) {
+    client = creg_register_session(client_registry, conn, session);
+    if (client == NULL) {
+      // a session that cannot be opened is told so under its number
+      client_send_session_nack(conn, session, PROTO_CORRELATION(hdr));
+      return;
+    }
+    debug("session %d opened on fd %d", session, connfd);
+  }
+  int logged_in = client_get_player(client) != NULL;
+  jeux_dispatch(client, connfd, hdr, payload, &logged_in);
+}
+
+/*
+ * Dispatch a single packet received from a client to the appropriate
+ * handler.  This is shared by every server mode (thread-per-connection
+ * and the event loops), so that all of them behave identically.  On a
+ * multiplexed connection, packets for sessions other than the
+ * connection's own go to the CLIENT of their session.
+ *
+ * @param client  The CLIENT on whose connection the packet arrived.
+ * @param connfd  The file descriptor of that connection.
+ * @param hdr  The header of the received packet.
+ * @param payload  The NUL-terminated payload, or NULL if there is none.
+ * @param logged_in  Per-connection login state, updated by LOGIN packets.
+ * @return 0 if the connection should continue to be serviced, -1 if the
+ * session has ended and the client has been logged out.
+ *
+ * The packets a handler sends are held until it returns, and then sent
+ * with one write per client they are addressed to.
+ */
+int jeux_dispatch_packet(CLIENT *client, int connfd, JEUX_PACKET_HEADER *hdr, char *payload, int *logged_in) {
+  client_touch(client);
+  if (client_get_codec(client)->caps & PROTO_CAP_MUX) {
+    int session = PROTO_SESSION(hdr);
+    if (session != 0) {
+      jeux_dispatch_session(client, connfd, session, hdr, payload);
+      return 0;
+    }
+  }
+  return jeux_dispatch(client, connfd, hdr, payload, logged_in);
+}
+
 /*
  * Thread function for the thread that handles a particular client.
  *
@@ -353,124 +546,73 @@ int process_resign(char* payload, int connfd, CLIENT *client, JEUX_PACKET_HEADER
  */
 void *jeux_client_service(void *arg) {
   int connfd = *((int *)arg);
-  CLIENT *client = creg_register(client_registry, connfd);
   free(arg);
   pthread_detach(pthread_self());
+  jeux_serve_connection(connfd);
+  return NULL;
+}
+
+/*
+ * Run the service loop for one connection on the calling thread, until
+ * the connection shuts down.  This is the body of jeux_client_service(),
+ * and is also run by the workers of the worker pool.
+ *
+ * @param connfd  The file descriptor of the client connection, which is
+ * closed before this function returns.
+ */
+void jeux_serve_connection(int connfd) {
+  CLIENT *client = creg_register(client_registry, connfd);
   if (client == NULL) {
     debug("client == NULL");
     Close(connfd);
-    return NULL;
+    return;
   }
 
   debug("thread: %d", connfd);
+  // pipelined packets are parsed out of one read
+  PROTO_RECV_BUF rb;
+  proto_recv_buf_init(&rb, connfd);
   int process_login_packet = 0;
   int cont = 1;
+  int corked = 0;
   while (cont) {
     // make header
     // JEUX_PACKET_HEADER *hdr = calloc(1,sizeof(JEUX_PACKET_HEADER));
     JEUX_PACKET_HEADER full_header = {0}, *hdr = &full_header;
-    void *payload = NULL;
-    int ret = proto_recv_packet(connfd, hdr, &payload);
+    // the payload is NUL-terminated in the ring's buffer and only
+    // borrowed by the handlers
+    char *payload = NULL;
+    int ret = proto_recv_packet_buffered(&rb, hdr, &payload);
     if (ret == -1) {
       client_logout(client);
       cont = 0;
       break;
     }
-    // payload is not null terminated so we need to do this
-    if (payload != NULL) {
-      char* payload_str = calloc(ntohs(hdr->size)+1, sizeof(char));
-      strncpy(payload_str, (char*)payload, ntohs(hdr->size));
-      free(payload);
-      payload = payload_str;
-      debug("payload: %s", (char*)payload);
+    // the replies to requests that were pipelined into one read are held
+    // until the last of them has been handled, and then leave together
+    if (!corked) {
+      client_cork();
+      corked = 1;
     }
-    // process stuff in header and payload
-    switch (hdr->type) {
-      case JEUX_LOGIN_PKT:
-        process_login_packet = process_login(payload, connfd, hdr, client);
-        break;
-      case JEUX_USERS_PKT:
-        if (process_login_packet == 0) {
-          debug("process_login_packet == 0");
-          client_send_nack(client);
-        } else {
-          process_users(NULL, connfd, client);
-        }
-        break;
-      case JEUX_INVITE_PKT:
-        if (process_login_packet == 0) {
-          debug("process_login_packet == 0");
-          client_send_nack(client);
-        } else {
-          process_invite(payload, connfd, client, hdr);
-        }
-        break;
-      case JEUX_REVOKE_PKT:
-        if (process_login_packet == 0) {
-          debug("process_login_packet == 0");
-          client_send_nack(client);
-        } else {
-          info("made it here :>)");
-          process_revoke(NULL, connfd, client, hdr); 
-        }
-        break;
-      case JEUX_ACCEPT_PKT:
-        if (process_login_packet == 0) {
-          debug("process_login_packet == 0");
-          client_send_nack(client);
-        } else {
-          process_accept(NULL, connfd, client, hdr);
-        }
-        break;
-      case JEUX_DECLINE_PKT:
-        if (process_login_packet == 0) {
-          debug("process_login_packet == 0");
-          client_send_nack(client);
-        } else {
-          process_decline(NULL, connfd, client, hdr);
-        }
-        break;
-      case JEUX_MOVE_PKT:
-        if (process_login_packet == 0) {
-          debug("process_login_packet == 0");
-          client_send_nack(client);
-        } else {
-          process_move(payload, connfd, client, hdr);
-        }
-        break;
-      case JEUX_RESIGN_PKT:
-        if (process_login_packet == 0) {
-          debug("process_login_packet == 0");
-          client_send_nack(client);
-        } else {
-          process_resign(NULL, connfd, client, hdr);
-        }
-        break;
-      case JEUX_NO_PKT:
-        cont = 0;
-        client_logout(client);
-        break;
-      default:
-        debug("default");
-        // if (process_login == 0) {
-        //   debug("process_login == 0");
-        // client_send_nack(client);
-        //   break;
-        // }
-        break;
+    if (jeux_dispatch_packet(client, connfd, hdr, payload, &process_login_packet) == -1) {
+      cont = 0;
     }
-    if (payload != NULL) {
-      debug("payload: %s", (char *)payload);
-      free(payload);
-      payload = NULL;
+    // a LOGIN may have switched the framing of what follows
+    rb.codec = client_get_codec(client);
+    if (!cont || !proto_recv_buf_ready(&rb)) {
+      client_uncork();
+      corked = 0;
     }
     // free(hdr);
   }
+  if (corked) {
+    client_uncork();
+  }
+  proto_recv_buf_fini(&rb);
 
   // unregister client
   creg_unregister(client_registry, client);
 
   Close(connfd);
   debug("Connection closed by client");
-  return NULL;
 }
\ No newline at end of file
@@ -0,0 +1,48 @@
+#include <stdatomic.h>
+
+#include "stats.h"
+
+static atomic_long counters[STAT_COUNTERS];
+
+static const char *counter_names[STAT_COUNTERS] = {
+  [STAT_SLOW_DROPPED] = "slow_consumer_dropped",
+  [STAT_SLOW_COALESCING] = "slow_consumer_coalescing",
+  [STAT_SLOW_COALESCED] = "slow_consumer_coalesced_moves",
+  [STAT_SLOW_PAUSED] = "slow_consumer_paused",
+  [STAT_SLOW_SKIPPED] = "slow_consumer_skipped_notifications",
+  [STAT_IDLE_REAPED] = "idle_reaped",
+  [STAT_ADMIT_REJECTED] = "admission_rejected",
+  [STAT_ADMIT_QUEUED] = "admission_queued",
+  [STAT_ADMIT_EXPIRED] = "admission_expired",
+};
+
+/*
+ * Add to a counter.
+ */
+void stats_add(STAT_COUNTER counter, long n) {
+  atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+/*
+ * Add one to a counter.
+ */
+void stats_inc(STAT_COUNTER counter) {
+  stats_add(counter, 1);
+}
+
+/*
+ * Read the current value of a counter.
+ */
+long stats_get(STAT_COUNTER counter) {
+  return atomic_load_explicit(&counters[counter], memory_order_relaxed);
+}
+
+/*
+ * Write every counter, one "name value" pair per line.
+ */
+void stats_dump(FILE *out) {
+  for (int i = 0; i < STAT_COUNTERS; i++) {
+    fprintf(out, "%s %ld\n", counter_names[i], stats_get(i));
+  }
+  fflush(out);
+}
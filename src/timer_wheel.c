@@ -0,0 +1,270 @@
+#include <stdatomic.h>
+#include <time.h>
+
+#include "includeme.h"
+#include "timer_wheel.h"
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 4
+// the longest delay the wheels can hold, in ticks
+#define TW_MAX_DELAY ((1ULL << (TW_BITS * TW_LEVELS)) - 1)
+
+/*
+ * Slot i of level 0 holds the timers that expire at a tick whose low
+ * bits are i.  Slot i of level n holds the timers that expire in the
+ * tick range whose bits at level n are i, and is cascaded into the finer
+ * levels when the clock enters that range.
+ */
+typedef struct timer_wheel {
+  pthread_mutex_t lock;
+  // signalled when the thread is to stop, or a callback has returned
+  pthread_cond_t wake;
+  TW_TIMER *slots[TW_LEVELS][TW_SLOTS];
+  // the last tick that has been processed
+  _Atomic uint64_t now;
+  // the timer whose callback is running, if any
+  TW_TIMER *running;
+  int tick_ms;
+  int stopping;
+  int started;
+  pthread_t tid;
+} TIMER_WHEEL;
+
+static TIMER_WHEEL wheel = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void tw_unlink(TW_TIMER *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next != NULL) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+/*
+ * Put a timer in the slot for its expiry.  The caller must hold the lock.
+ */
+static void tw_place(TW_TIMER *timer) {
+  uint64_t now = atomic_load_explicit(&wheel.now, memory_order_relaxed);
+  uint64_t delta = timer->expires - now;
+  int level = 0;
+  while (level < TW_LEVELS - 1 && delta >= (1ULL << (TW_BITS * (level + 1)))) {
+    level++;
+  }
+  TW_TIMER **slot = &wheel.slots[level][(timer->expires >> (TW_BITS * level)) & TW_MASK];
+  timer->next = *slot;
+  if (*slot != NULL) {
+    (*slot)->pprev = &timer->next;
+  }
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+/*
+ * Advance the clock by one tick, cascading coarser slots as the clock
+ * enters their range, and run the timers that are due.  The caller must
+ * hold the lock, which is released while callbacks run.
+ */
+static void tw_tick(void) {
+  uint64_t now = atomic_load_explicit(&wheel.now, memory_order_relaxed) + 1;
+  atomic_store_explicit(&wheel.now, now, memory_order_relaxed);
+  for (int level = 1; level < TW_LEVELS; level++) {
+    if ((now & ((1ULL << (TW_BITS * level)) - 1)) != 0) {
+      break;
+    }
+    TW_TIMER **slot = &wheel.slots[level][(now >> (TW_BITS * level)) & TW_MASK];
+    TW_TIMER *timer = *slot;
+    *slot = NULL;
+    while (timer != NULL) {
+      TW_TIMER *next = timer->next;
+      tw_place(timer);
+      timer = next;
+    }
+  }
+  TW_TIMER **slot = &wheel.slots[0][now & TW_MASK];
+  while (*slot != NULL) {
+    TW_TIMER *timer = *slot;
+    tw_unlink(timer);
+    wheel.running = timer;
+    pthread_mutex_unlock(&wheel.lock);
+    timer->callback(timer);
+    pthread_mutex_lock(&wheel.lock);
+    wheel.running = NULL;
+    pthread_cond_broadcast(&wheel.wake);
+  }
+}
+
+static void *tw_thread(void *arg) {
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  pthread_mutex_lock(&wheel.lock);
+  while (!wheel.stopping) {
+    next.tv_nsec += wheel.tick_ms * 1000000L;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    while (!wheel.stopping &&
+           pthread_cond_timedwait(&wheel.wake, &wheel.lock, &next) != ETIMEDOUT) {
+      ;
+    }
+    if (!wheel.stopping) {
+      tw_tick();
+    }
+  }
+  pthread_mutex_unlock(&wheel.lock);
+  return NULL;
+}
+
+/*
+ * Start the timer thread.
+ *
+ * @param tick_ms  The length of a tick, in milliseconds.
+ * @return 0 if the thread was started, otherwise -1.
+ */
+int tw_start(int tick_ms) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wheel.wake, &attr);
+  pthread_condattr_destroy(&attr);
+  wheel.tick_ms = tick_ms;
+  wheel.stopping = 0;
+  if (pthread_create(&wheel.tid, NULL, tw_thread, NULL) != 0) {
+    error("pthread_create");
+    return -1;
+  }
+  wheel.started = 1;
+  info("Started timer wheel (%d ms ticks)", tick_ms);
+  return 0;
+}
+
+/*
+ * Stop the timer thread.  Timers that are still pending never fire.
+ */
+void tw_fini(void) {
+  if (!wheel.started) {
+    return;
+  }
+  pthread_mutex_lock(&wheel.lock);
+  wheel.stopping = 1;
+  pthread_cond_broadcast(&wheel.wake);
+  pthread_mutex_unlock(&wheel.lock);
+  pthread_join(wheel.tid, NULL);
+  pthread_cond_destroy(&wheel.wake);
+  wheel.started = 0;
+}
+
+/*
+ * Stop the timer thread for a while.  The clock stands still and no
+ * timer fires until tw_resume() is called, but timers may still be armed
+ * and cancelled.
+ */
+void tw_pause(void) {
+  tw_fini();
+}
+
+/*
+ * Restart the timer thread after tw_pause(), with the same tick.
+ *
+ * @return 0 if the thread was restarted, otherwise -1.
+ */
+int tw_resume(void) {
+  return tw_start(wheel.tick_ms);
+}
+
+/*
+ * Get the number of ticks since the timer thread was started.  This is a
+ * single atomic load, cheap enough to call for every packet.
+ */
+uint64_t tw_now(void) {
+  return atomic_load_explicit(&wheel.now, memory_order_relaxed);
+}
+
+/*
+ * Convert a duration to ticks, rounding up.
+ */
+uint64_t tw_ticks(long ms) {
+  return (ms + wheel.tick_ms - 1) / wheel.tick_ms;
+}
+
+/*
+ * Initialize a timer, which is not pending.
+ *
+ * @param timer  The timer.
+ * @param callback  The function to call when the timer expires.
+ */
+void tw_init(TW_TIMER *timer, TW_CALLBACK *callback) {
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires = 0;
+  timer->callback = callback;
+}
+
+/*
+ * Arm a timer to expire after a number of ticks (at least one).  If the
+ * timer is already pending, it is moved.  Delays longer than the wheels
+ * can hold are shortened to the longest one they can.
+ *
+ * @param timer  The timer.
+ * @param ticks  The delay, in ticks.
+ * @return 1 if the timer was already pending, otherwise 0.
+ */
+int tw_arm(TW_TIMER *timer, uint64_t ticks) {
+  if (ticks < 1) {
+    ticks = 1;
+  } else if (ticks > TW_MAX_DELAY) {
+    ticks = TW_MAX_DELAY;
+  }
+  pthread_mutex_lock(&wheel.lock);
+  int pending = timer->pprev != NULL;
+  if (pending) {
+    tw_unlink(timer);
+  }
+  timer->expires = atomic_load_explicit(&wheel.now, memory_order_relaxed) + ticks;
+  tw_place(timer);
+  pthread_mutex_unlock(&wheel.lock);
+  return pending;
+}
+
+/*
+ * Cancel a timer.  If its callback is running, wait for it to return,
+ * so that once this returns the callback is not running and (unless it
+ * is armed again) never will be.  This must not be called from the
+ * timer's own callback.
+ *
+ * @param timer  The timer.
+ */
+void tw_cancel(TW_TIMER *timer) {
+  pthread_mutex_lock(&wheel.lock);
+  while (wheel.running == timer) {
+    pthread_cond_wait(&wheel.wake, &wheel.lock);
+  }
+  // the callback may have armed it again before returning
+  if (timer->pprev != NULL) {
+    tw_unlink(timer);
+  }
+  pthread_mutex_unlock(&wheel.lock);
+}
+
+/*
+ * Cancel a timer if it is pending, without waiting for a callback that
+ * is already running.  This may be called while holding locks that the
+ * callback takes.
+ *
+ * @param timer  The timer.
+ * @return 1 if the timer was pending (and now never fires), otherwise 0.
+ */
+int tw_try_cancel(TW_TIMER *timer) {
+  pthread_mutex_lock(&wheel.lock);
+  int pending = timer->pprev != NULL;
+  if (pending) {
+    tw_unlink(timer);
+  }
+  pthread_mutex_unlock(&wheel.lock);
+  return pending;
+}
@@ -0,0 +1,858 @@
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "includeme.h"
+#include "uring_loop.h"
+
+#define URING_SQ_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+// provided receive buffers per loop (must be a power of two)
+#define URING_BUF_COUNT 512
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0
+
+/*
+ * The low bits of each SQE's user_data say what kind of operation it is;
+ * the rest is a pointer to the connection or send it belongs to.
+ */
+#define URING_TAG_RECV 0x1
+#define URING_TAG_SEND 0x2
+#define URING_TAG_CANCEL 0x3
+#define URING_TAG_STOP 0x4
+#define URING_TAG_MASK 0x7
+
+struct uring_loop;
+
+/*
+ * A packet queued for transmission.  The header and payload are sent by
+ * two linked SQEs, and the packet is freed once both have completed.
+ */
+typedef struct uring_send {
+  struct uring_send *next;
+  struct uring_conn *conn;
+  int remaining;
+  size_t size;
+  // the header, already framed for the connection
+  size_t hdr_len;
+  char hdr[PROTO_HEADER_MAX];
+  char payload[];
+} URING_SEND;
+
+/*
+ * State kept for each connection serviced by an io_uring loop.  The
+ * send queue and operation counts are protected by the lock of the loop
+ * that owns the connection, since packets may be sent to a connection
+ * from any thread.  A connection is freed only once it is closing and
+ * none of its operations are still in flight.
+ */
+typedef struct uring_conn {
+  int fd;
+  CLIENT *client;
+  int logged_in;
+  PROTO_ASSEMBLER pa;
+  struct uring_loop *loop;
+  URING_SEND *pending_head;
+  URING_SEND *pending_tail;
+  int inflight;
+  int recv_armed;
+  int closing;
+  int dirty;
+  struct uring_conn *next_dirty;
+} URING_CONN;
+
+typedef struct uring_loop {
+  pthread_t tid;
+  int ring_fd;
+  // protects the submission queue and the send state of connections
+  pthread_mutex_t lock;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  // tail of the SQEs filled in but not yet published to the kernel
+  unsigned sq_local_tail;
+  // SQEs published since the last io_uring_enter()
+  unsigned to_submit;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *buf_ring;
+  char *bufs;
+  unsigned short buf_tail;
+  // connections with packets waiting for their sends to be submitted
+  URING_CONN *dirty_head;
+} URING_LOOP;
+
+static URING_LOOP *loops = NULL;
+static int nloops = 0;
+static unsigned int next_loop = 0;
+static pthread_mutex_t next_loop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Map from file descriptor to the connection it belongs to, so that
+ * proto_send_packet() can route packets through the right ring.
+ */
+static URING_CONN **fd_table = NULL;
+static int fd_table_size = 0;
+static pthread_mutex_t fd_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the loop whose thread is running, so its own sends can be batched
+static __thread URING_LOOP *current_loop = NULL;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Get a free SQE.  The caller must hold loop->lock and fill in the SQE
+ * before calling uring_publish().
+ *
+ * @return the SQE, or NULL if the submission queue is full.
+ */
+static struct io_uring_sqe *uring_get_sqe(URING_LOOP *loop) {
+  unsigned head = atomic_load_explicit((_Atomic unsigned *)loop->sq_head, memory_order_acquire);
+  if (loop->sq_local_tail - head >= loop->sq_entries) {
+    return NULL;
+  }
+  unsigned idx = loop->sq_local_tail & loop->sq_mask;
+  struct io_uring_sqe *sqe = &loop->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  loop->sq_array[idx] = idx;
+  loop->sq_local_tail++;
+  return sqe;
+}
+
+static unsigned uring_sq_space(URING_LOOP *loop) {
+  unsigned head = atomic_load_explicit((_Atomic unsigned *)loop->sq_head, memory_order_acquire);
+  return loop->sq_entries - (loop->sq_local_tail - head);
+}
+
+/*
+ * Make the SQEs filled in so far visible to the kernel.  The caller must
+ * hold loop->lock.
+ */
+static void uring_publish(URING_LOOP *loop) {
+  unsigned tail = *loop->sq_tail;
+  if (tail == loop->sq_local_tail) {
+    return;
+  }
+  loop->to_submit += loop->sq_local_tail - tail;
+  atomic_store_explicit((_Atomic unsigned *)loop->sq_tail, loop->sq_local_tail, memory_order_release);
+}
+
+/*
+ * Get a free SQE, submitting what has been queued so far if the
+ * submission queue is full.  The caller must hold loop->lock.
+ */
+static struct io_uring_sqe *uring_get_sqe_wait(URING_LOOP *loop) {
+  struct io_uring_sqe *sqe;
+  while ((sqe = uring_get_sqe(loop)) == NULL) {
+    uring_publish(loop);
+    unsigned n = loop->to_submit;
+    loop->to_submit = 0;
+    if (uring_enter(loop->ring_fd, n, 0, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      error("io_uring_enter: %s", strerror(errno));
+      return NULL;
+    }
+  }
+  return sqe;
+}
+
+/*
+ * Arm a multishot receive on a connection.  The caller must hold
+ * loop->lock.
+ */
+static int uring_arm_recv(URING_LOOP *loop, URING_CONN *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe_wait(loop);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = (uintptr_t)conn | URING_TAG_RECV;
+  conn->recv_armed = 1;
+  return 0;
+}
+
+/*
+ * Give a receive buffer back to the kernel once its contents have been
+ * consumed.  Only the loop thread touches the buffer ring.
+ */
+static void uring_recycle_buf(URING_LOOP *loop, unsigned short bid) {
+  struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_BUF_COUNT - 1)];
+  buf->addr = (uintptr_t)(loop->bufs + (size_t)bid * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = bid;
+  loop->buf_tail++;
+  atomic_store_explicit((_Atomic unsigned short *)&loop->buf_ring->tail, loop->buf_tail, memory_order_release);
+}
+
+static void uring_free_pending(URING_CONN *conn) {
+  URING_SEND *send = conn->pending_head;
+  while (send != NULL) {
+    URING_SEND *next = send->next;
+    free(send);
+    send = next;
+  }
+  conn->pending_head = conn->pending_tail = NULL;
+}
+
+/*
+ * Free a connection if it is closing and nothing of it is in flight.
+ * The caller must hold loop->lock.
+ *
+ * @return 1 if the connection was freed, otherwise 0.
+ */
+static int uring_conn_release(URING_CONN *conn) {
+  if (!conn->closing || conn->inflight > 0 || conn->recv_armed || conn->dirty) {
+    return 0;
+  }
+  uring_free_pending(conn);
+  proto_assembler_fini(&conn->pa);
+  free(conn);
+  return 1;
+}
+
+/*
+ * Turn the queued packets of a connection into one chain of linked send
+ * SQEs.  Only one chain per connection is in flight at a time, which
+ * keeps packets in order even if a send has to be retried by the kernel.
+ * The caller must hold loop->lock.
+ */
+static void uring_submit_sends(URING_LOOP *loop, URING_CONN *conn) {
+  if (conn->inflight > 0 || conn->closing) {
+    return;
+  }
+  struct io_uring_sqe *last = NULL;
+  URING_SEND *send = conn->pending_head;
+  while (send != NULL) {
+    int need = send->size > 0 ? 2 : 1;
+    if (uring_sq_space(loop) < need) {
+      break;
+    }
+    URING_SEND *next = send->next;
+    send->remaining = need;
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)send->hdr;
+    sqe->len = send->hdr_len;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL | MSG_MORE;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (uintptr_t)send | URING_TAG_SEND;
+    last = sqe;
+    if (send->size > 0) {
+      sqe = uring_get_sqe(loop);
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = conn->fd;
+      sqe->addr = (uintptr_t)send->payload;
+      sqe->len = send->size;
+      sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL | MSG_MORE;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = (uintptr_t)send | URING_TAG_SEND;
+      last = sqe;
+    }
+    conn->inflight += need;
+    send = next;
+  }
+  if (last != NULL) {
+    // the chain ends with this connection's last queued packet; every
+    // send before it carries MSG_MORE, so the kernel does not push a
+    // segment out until the whole chain is in the socket
+    last->flags &= ~IOSQE_IO_LINK;
+    last->msg_flags &= ~MSG_MORE;
+  }
+  conn->pending_head = send;
+  if (send == NULL) {
+    conn->pending_tail = NULL;
+  }
+}
+
+static void uring_mark_dirty(URING_LOOP *loop, URING_CONN *conn) {
+  if (conn->dirty) {
+    return;
+  }
+  conn->dirty = 1;
+  conn->next_dirty = loop->dirty_head;
+  loop->dirty_head = conn;
+}
+
+/*
+ * Submit the sends of every connection that has packets waiting.
+ * The caller must hold loop->lock.
+ */
+static void uring_flush_dirty(URING_LOOP *loop) {
+  URING_CONN *conn = loop->dirty_head;
+  URING_CONN *still_dirty = NULL;
+  while (conn != NULL) {
+    URING_CONN *next = conn->next_dirty;
+    conn->dirty = 0;
+    if (conn->closing) {
+      uring_conn_release(conn);
+      conn = next;
+      continue;
+    }
+    uring_submit_sends(loop, conn);
+    if (conn->pending_head != NULL && conn->inflight == 0 && !conn->closing) {
+      // ran out of SQEs; try again on the next pass
+      conn->dirty = 1;
+      conn->next_dirty = still_dirty;
+      still_dirty = conn;
+    }
+    conn = next;
+  }
+  loop->dirty_head = still_dirty;
+  uring_publish(loop);
+}
+
+/*
+ * Queue packets for transmission on a connection serviced by the
+ * io_uring backend.  The headers and payloads are copied, so the caller's
+ * storage may be reused as soon as this function returns.  All of the
+ * packets are queued under one lock and go out in the same submission.
+ *
+ * @param fd  The file descriptor on which the packets are to be sent.
+ * @param codec  The framing of the headers.
+ * @param pkts  The packets, with header fields in network byte order.
+ * @param npkts  The number of packets.
+ * @return 0 if the packets were queued, -1 if the connection is closing,
+ * or URING_NOT_OWNED if fd is not serviced by the io_uring backend.
+ */
+int uring_send_packets(int fd, const PROTO_CODEC *codec, PROTO_PACKET *pkts, int npkts) {
+  if (fd_table == NULL || fd < 0 || fd >= fd_table_size) {
+    return URING_NOT_OWNED;
+  }
+  pthread_mutex_lock(&fd_table_lock);
+  URING_CONN *conn = fd_table[fd];
+  if (conn == NULL) {
+    pthread_mutex_unlock(&fd_table_lock);
+    return URING_NOT_OWNED;
+  }
+  URING_LOOP *loop = conn->loop;
+  pthread_mutex_lock(&loop->lock);
+  pthread_mutex_unlock(&fd_table_lock);
+  if (conn->closing) {
+    pthread_mutex_unlock(&loop->lock);
+    return -1;
+  }
+  for (int i = 0; i < npkts; i++) {
+    size_t size = ntohs(pkts[i].hdr->size);
+    URING_SEND *send = malloc(sizeof(URING_SEND) + size);
+    if (send == NULL) {
+      pthread_mutex_unlock(&loop->lock);
+      return -1;
+    }
+    send->next = NULL;
+    send->conn = conn;
+    send->size = size;
+    send->hdr_len = codec->encode(pkts[i].hdr, send->hdr);
+    if (size > 0) {
+      memcpy(send->payload, pkts[i].data, size);
+    }
+    if (conn->pending_tail == NULL) {
+      conn->pending_head = send;
+    } else {
+      conn->pending_tail->next = send;
+    }
+    conn->pending_tail = send;
+  }
+  if (current_loop == loop) {
+    // sent while handling a completion; submitted with the whole batch
+    uring_mark_dirty(loop, conn);
+    pthread_mutex_unlock(&loop->lock);
+    return 0;
+  }
+  uring_submit_sends(loop, conn);
+  if (conn->pending_head != NULL && conn->inflight == 0) {
+    uring_mark_dirty(loop, conn);
+  }
+  uring_publish(loop);
+  unsigned n = loop->to_submit;
+  loop->to_submit = 0;
+  pthread_mutex_unlock(&loop->lock);
+  if (n > 0 && uring_enter(loop->ring_fd, n, 0, 0) < 0) {
+    error("io_uring_enter: %s", strerror(errno));
+  }
+  return 0;
+}
+
+/*
+ * Close a connection whose receive has ended, unregistering its client
+ * exactly as the end of jeux_client_service() does.  The connection
+ * itself lives on until its in-flight operations have completed.
+ */
+static void uring_conn_close(URING_LOOP *loop, URING_CONN *conn) {
+  debug("io_uring loop closing connection %d", conn->fd);
+  pthread_mutex_lock(&fd_table_lock);
+  fd_table[conn->fd] = NULL;
+  pthread_mutex_unlock(&fd_table_lock);
+
+  pthread_mutex_lock(&loop->lock);
+  conn->closing = 1;
+  uring_free_pending(conn);
+  if (conn->recv_armed) {
+    struct io_uring_sqe *sqe = uring_get_sqe_wait(loop);
+    if (sqe != NULL) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = (uintptr_t)conn | URING_TAG_RECV;
+      sqe->user_data = URING_TAG_CANCEL;
+    }
+  }
+  pthread_mutex_unlock(&loop->lock);
+
+  client_logout(conn->client);
+  creg_unregister(client_registry, conn->client);
+  // in-flight operations hold their own reference to the socket
+  Close(conn->fd);
+}
+
+/*
+ * Feed received bytes to a connection and dispatch every packet that
+ * they complete.
+ *
+ * @return 0 if the connection is still open, -1 if it has been closed.
+ */
+static int uring_conn_input(URING_LOOP *loop, URING_CONN *conn, char *buf, size_t len) {
+  // the replies to every request in what was received leave together,
+  // and before the connection can be closed
+  client_cork();
+  size_t off = 0;
+  while (off < len) {
+    int done = 0;
+    off += proto_assemble(&conn->pa, buf + off, len - off, &done);
+    if (done == -1) {
+      client_uncork();
+      uring_conn_close(loop, conn);
+      return -1;
+    }
+    if (!done) {
+      continue;
+    }
+    JEUX_PACKET_HEADER hdr;
+    char *payload = proto_assembler_take(&conn->pa, &hdr);
+    int ret = jeux_dispatch_packet(conn->client, conn->fd, &hdr, payload, &conn->logged_in);
+    if (ret == -1) {
+      client_uncork();
+      uring_conn_close(loop, conn);
+      return -1;
+    }
+    // a LOGIN may have switched the framing of what follows
+    conn->pa.codec = client_get_codec(conn->client);
+  }
+  client_uncork();
+  return 0;
+}
+
+static void uring_handle_recv(URING_LOOP *loop, URING_CONN *conn, struct io_uring_cqe *cqe) {
+  int more = cqe->flags & IORING_CQE_F_MORE;
+  if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (!conn->closing) {
+      uring_conn_input(loop, conn, loop->bufs + (size_t)bid * URING_BUF_SIZE, cqe->res);
+    }
+    uring_recycle_buf(loop, bid);
+  }
+  if (more) {
+    return;
+  }
+  pthread_mutex_lock(&loop->lock);
+  conn->recv_armed = 0;
+  if (conn->closing) {
+    uring_conn_release(conn);
+    pthread_mutex_unlock(&loop->lock);
+    return;
+  }
+  if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+    // the multishot receive stopped but the connection is still open
+    uring_arm_recv(loop, conn);
+    pthread_mutex_unlock(&loop->lock);
+    return;
+  }
+  pthread_mutex_unlock(&loop->lock);
+  info("read eof");
+  uring_conn_close(loop, conn);
+  pthread_mutex_lock(&loop->lock);
+  uring_conn_release(conn);
+  pthread_mutex_unlock(&loop->lock);
+}
+
+static void uring_handle_send(URING_LOOP *loop, URING_SEND *send, struct io_uring_cqe *cqe) {
+  URING_CONN *conn = send->conn;
+  pthread_mutex_lock(&loop->lock);
+  conn->inflight--;
+  if (cqe->res < 0 && !conn->closing) {
+    // the rest of the chain is cancelled; treat the connection as broken
+    error("io_uring send on %d: %s", conn->fd, strerror(-cqe->res));
+    shutdown(conn->fd, SHUT_RDWR);
+  }
+  if (--send->remaining == 0) {
+    free(send);
+  }
+  if (conn->inflight == 0) {
+    if (uring_conn_release(conn)) {
+      pthread_mutex_unlock(&loop->lock);
+      return;
+    }
+    if (conn->pending_head != NULL) {
+      uring_mark_dirty(loop, conn);
+    }
+  }
+  pthread_mutex_unlock(&loop->lock);
+}
+
+static void *uring_thread(void *arg) {
+  URING_LOOP *loop = arg;
+  current_loop = loop;
+  int cont = 1;
+  while (cont) {
+    // submit everything produced by the last batch and wait for more
+    pthread_mutex_lock(&loop->lock);
+    uring_flush_dirty(loop);
+    unsigned n = loop->to_submit;
+    loop->to_submit = 0;
+    pthread_mutex_unlock(&loop->lock);
+    if (uring_enter(loop->ring_fd, n, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      error("io_uring_enter: %s", strerror(errno));
+      break;
+    }
+    unsigned head = *loop->cq_head;
+    while (head != atomic_load_explicit((_Atomic unsigned *)loop->cq_tail, memory_order_acquire)) {
+      struct io_uring_cqe cqe = loop->cqes[head & loop->cq_mask];
+      head++;
+      atomic_store_explicit((_Atomic unsigned *)loop->cq_head, head, memory_order_release);
+      void *ptr = (void *)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_TAG_MASK);
+      switch (cqe.user_data & URING_TAG_MASK) {
+        case URING_TAG_RECV:
+          uring_handle_recv(loop, ptr, &cqe);
+          break;
+        case URING_TAG_SEND:
+          uring_handle_send(loop, ptr, &cqe);
+          break;
+        case URING_TAG_STOP:
+          cont = 0;
+          break;
+        default:
+          break;
+      }
+    }
+  }
+  current_loop = NULL;
+  return NULL;
+}
+
+static void uring_loop_fini(URING_LOOP *loop) {
+  if (loop->buf_ring != NULL) {
+    struct io_uring_buf_reg reg = {.bgid = URING_BGID};
+    uring_register(loop->ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(loop->buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+  }
+  free(loop->bufs);
+  if (loop->sqes != NULL) {
+    munmap(loop->sqes, loop->sq_entries * sizeof(struct io_uring_sqe));
+  }
+  if (loop->cq_ring != NULL && loop->cq_ring != loop->sq_ring) {
+    munmap(loop->cq_ring, loop->cq_ring_size);
+  }
+  if (loop->sq_ring != NULL) {
+    munmap(loop->sq_ring, loop->sq_ring_size);
+  }
+  if (loop->ring_fd >= 0) {
+    close(loop->ring_fd);
+  }
+  pthread_mutex_destroy(&loop->lock);
+}
+
+/*
+ * Create the ring and provided buffers of one loop.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int uring_loop_init(URING_LOOP *loop) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = URING_CQ_ENTRIES;
+  pthread_mutex_init(&loop->lock, NULL);
+  loop->ring_fd = uring_setup(URING_SQ_ENTRIES, &p);
+  if (loop->ring_fd < 0) {
+    debug("io_uring_setup: %s", strerror(errno));
+    return -1;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+    debug("io_uring lacks required features");
+    return -1;
+  }
+  loop->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  loop->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (loop->cq_ring_size > loop->sq_ring_size) {
+    loop->sq_ring_size = loop->cq_ring_size;
+  }
+  loop->sq_ring = mmap(NULL, loop->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQ_RING);
+  if (loop->sq_ring == MAP_FAILED) {
+    loop->sq_ring = NULL;
+    return -1;
+  }
+  loop->cq_ring = loop->sq_ring;
+  loop->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQES);
+  if (loop->sqes == MAP_FAILED) {
+    loop->sqes = NULL;
+    return -1;
+  }
+  char *sq = loop->sq_ring;
+  loop->sq_head = (unsigned *)(sq + p.sq_off.head);
+  loop->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  loop->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  loop->sq_entries = *(unsigned *)(sq + p.sq_off.ring_entries);
+  loop->sq_array = (unsigned *)(sq + p.sq_off.array);
+  loop->sq_local_tail = *loop->sq_tail;
+  char *cq = loop->cq_ring;
+  loop->cq_head = (unsigned *)(cq + p.cq_off.head);
+  loop->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  loop->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  loop->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  // ring of buffers the kernel picks from for multishot receives
+  loop->buf_ring = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (loop->buf_ring == MAP_FAILED) {
+    loop->buf_ring = NULL;
+    return -1;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)loop->buf_ring;
+  reg.ring_entries = URING_BUF_COUNT;
+  reg.bgid = URING_BGID;
+  if (uring_register(loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    debug("IORING_REGISTER_PBUF_RING: %s", strerror(errno));
+    munmap(loop->buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    loop->buf_ring = NULL;
+    return -1;
+  }
+  loop->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+  if (loop->bufs == NULL) {
+    return -1;
+  }
+  loop->buf_tail = 0;
+  for (int i = 0; i < URING_BUF_COUNT; i++) {
+    uring_recycle_buf(loop, i);
+  }
+  return 0;
+}
+
+/*
+ * Check that the kernel really supports multishot receives with provided
+ * buffers, by receiving one byte over a socketpair.
+ *
+ * @return 0 if supported, otherwise -1.
+ */
+static int uring_probe(URING_LOOP *loop) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    return -1;
+  }
+  URING_CONN probe;
+  memset(&probe, 0, sizeof(probe));
+  probe.fd = sv[0];
+  int ok = 0;
+  int done = 0;
+  pthread_mutex_lock(&loop->lock);
+  uring_arm_recv(loop, &probe);
+  uring_publish(loop);
+  unsigned n = loop->to_submit;
+  loop->to_submit = 0;
+  pthread_mutex_unlock(&loop->lock);
+  if (uring_enter(loop->ring_fd, n, 0, 0) < 0 || write(sv[1], "j", 1) != 1) {
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  // the first completion should carry the byte and leave the receive armed;
+  // closing the peer then ends it
+  while (!done) {
+    if (uring_enter(loop->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+      break;
+    }
+    unsigned head = *loop->cq_head;
+    while (head != atomic_load_explicit((_Atomic unsigned *)loop->cq_tail, memory_order_acquire)) {
+      struct io_uring_cqe *cqe = &loop->cqes[head & loop->cq_mask];
+      if (cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE)) {
+        ok = 1;
+        uring_recycle_buf(loop, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        close(sv[1]);
+      } else {
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+          uring_recycle_buf(loop, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+          done = 1;
+        }
+      }
+      head++;
+      atomic_store_explicit((_Atomic unsigned *)loop->cq_head, head, memory_order_release);
+    }
+  }
+  if (!ok) {
+    close(sv[1]);
+  }
+  close(sv[0]);
+  return ok ? 0 : -1;
+}
+
+/*
+ * Start the io_uring loop threads.
+ *
+ * @param nthreads  The number of loop threads to start.  If zero, one
+ * thread per online CPU is started.
+ * @return 0 if the loops were started, otherwise -1 (for example, if the
+ * kernel lacks the required io_uring support).
+ */
+int uring_start(int nthreads) {
+  if (nthreads <= 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0) {
+      nthreads = 1;
+    }
+  }
+  loops = calloc(nthreads, sizeof(URING_LOOP));
+  if (loops == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < nthreads; i++) {
+    loops[i].ring_fd = -1;
+    if (uring_loop_init(&loops[i]) == -1 || (i == 0 && uring_probe(&loops[i]) == -1)) {
+      warn("io_uring is not usable on this kernel");
+      for (int j = 0; j <= i; j++) {
+        uring_loop_fini(&loops[j]);
+      }
+      free(loops);
+      loops = NULL;
+      return -1;
+    }
+  }
+  struct rlimit rl;
+  fd_table_size = 65536;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    fd_table_size = rl.rlim_cur;
+  }
+  fd_table = calloc(fd_table_size, sizeof(URING_CONN *));
+  if (fd_table == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&loops[i].tid, NULL, uring_thread, &loops[i]) != 0) {
+      error("pthread_create");
+      return -1;
+    }
+    nloops++;
+  }
+  info("Started %d io_uring loop threads", nloops);
+  return 0;
+}
+
+/*
+ * Hand a newly accepted connection to one of the io_uring loops.  The
+ * connection is registered with the client registry; if registration
+ * fails, the connection is closed.
+ *
+ * @param connfd  The file descriptor of the accepted connection.
+ * @return 0 if the connection was taken over by a loop, otherwise -1.
+ */
+int uring_add_connection(int connfd) {
+  if (connfd >= fd_table_size) {
+    error("fd %d is beyond the io_uring connection table", connfd);
+    Close(connfd);
+    return -1;
+  }
+  CLIENT *client = creg_register(client_registry, connfd);
+  if (client == NULL) {
+    debug("client == NULL");
+    Close(connfd);
+    return -1;
+  }
+  URING_CONN *conn = calloc(1, sizeof(URING_CONN));
+  if (conn == NULL) {
+    creg_unregister(client_registry, client);
+    Close(connfd);
+    return -1;
+  }
+  conn->fd = connfd;
+  conn->client = client;
+
+  pthread_mutex_lock(&next_loop_lock);
+  URING_LOOP *loop = &loops[next_loop++ % nloops];
+  pthread_mutex_unlock(&next_loop_lock);
+  conn->loop = loop;
+
+  pthread_mutex_lock(&fd_table_lock);
+  fd_table[connfd] = conn;
+  pthread_mutex_unlock(&fd_table_lock);
+
+  pthread_mutex_lock(&loop->lock);
+  uring_arm_recv(loop, conn);
+  uring_publish(loop);
+  unsigned n = loop->to_submit;
+  loop->to_submit = 0;
+  pthread_mutex_unlock(&loop->lock);
+  if (uring_enter(loop->ring_fd, n, 0, 0) < 0) {
+    error("io_uring_enter: %s", strerror(errno));
+  }
+  debug("connection %d assigned to io_uring loop %ld", connfd, loop - loops);
+  return 0;
+}
+
+/*
+ * Stop the io_uring loop threads and free their resources.  This should
+ * only be called once every client has been unregistered.
+ */
+void uring_fini(void) {
+  for (int i = 0; i < nloops; i++) {
+    URING_LOOP *loop = &loops[i];
+    pthread_mutex_lock(&loop->lock);
+    struct io_uring_sqe *sqe = uring_get_sqe_wait(loop);
+    if (sqe != NULL) {
+      sqe->opcode = IORING_OP_NOP;
+      sqe->user_data = URING_TAG_STOP;
+    }
+    uring_publish(loop);
+    unsigned n = loop->to_submit;
+    loop->to_submit = 0;
+    pthread_mutex_unlock(&loop->lock);
+    uring_enter(loop->ring_fd, n, 0, 0);
+  }
+  for (int i = 0; i < nloops; i++) {
+    pthread_join(loops[i].tid, NULL);
+    uring_loop_fini(&loops[i]);
+  }
+  free(loops);
+  loops = NULL;
+  nloops = 0;
+  free(fd_table);
+  fd_table = NULL;
+  fd_table_size = 0;
+}
@@ -0,0 +1,173 @@
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "includeme.h"
+#include "worker_pool.h"
+#include "admission.h"
+
+/*
+ * One slot of the connection queue.  The sequence number tells producers
+ * and consumers whose turn it is to use the slot, which makes the queue
+ * safe for several acceptors and several workers without a lock.
+ */
+typedef struct pool_slot {
+  atomic_size_t seq;
+  int connfd;
+} POOL_SLOT;
+
+typedef struct worker_pool {
+  POOL_SLOT *slots;
+  size_t mask;
+  atomic_size_t enqueue_pos;
+  atomic_size_t dequeue_pos;
+  // counts queued connections, so idle workers can sleep
+  sem_t items;
+  atomic_int stopping;
+  pthread_t *workers;
+  int nworkers;
+} WORKER_POOL;
+
+static WORKER_POOL pool;
+
+static int pool_push(int connfd) {
+  size_t pos = atomic_load_explicit(&pool.enqueue_pos, memory_order_relaxed);
+  while (1) {
+    POOL_SLOT *slot = &pool.slots[pos & pool.mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&pool.enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        slot->connfd = connfd;
+        atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+        return 0;
+      }
+    } else if (diff < 0) {
+      // the slot still holds a connection from the previous lap: full
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&pool.enqueue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+static int pool_pop(void) {
+  size_t pos = atomic_load_explicit(&pool.dequeue_pos, memory_order_relaxed);
+  while (1) {
+    POOL_SLOT *slot = &pool.slots[pos & pool.mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&pool.dequeue_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        int connfd = slot->connfd;
+        atomic_store_explicit(&slot->seq, pos + pool.mask + 1, memory_order_release);
+        return connfd;
+      }
+    } else if (diff < 0) {
+      // empty
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&pool.dequeue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+static void *pool_worker(void *arg) {
+  while (1) {
+    sem_wait(&pool.items);
+    int connfd;
+    // a post means a connection is queued, though its producer may not
+    // have finished publishing it yet
+    while ((connfd = pool_pop()) < 0 && !atomic_load(&pool.stopping)) {
+      sched_yield();
+    }
+    if (connfd < 0) {
+      break;
+    }
+    debug("worker %ld servicing connection %d", (long)arg, connfd);
+    jeux_serve_connection(connfd);
+  }
+  return NULL;
+}
+
+/*
+ * Start the service workers.
+ *
+ * @param nworkers  The number of workers to start.
+ * @param capacity  The maximum number of accepted connections that may
+ * wait for a worker.  This is rounded up to a power of two (at least 2).
+ * @return 0 if the pool was started, otherwise -1.
+ */
+int pool_start(int nworkers, int capacity) {
+  // the slot sequence numbers need at least two slots to tell laps apart
+  size_t size = 2;
+  while (size < (size_t)capacity) {
+    size <<= 1;
+  }
+  pool.slots = calloc(size, sizeof(POOL_SLOT));
+  pool.workers = calloc(nworkers, sizeof(pthread_t));
+  if (pool.slots == NULL || pool.workers == NULL) {
+    free(pool.slots);
+    free(pool.workers);
+    return -1;
+  }
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&pool.slots[i].seq, i);
+  }
+  pool.mask = size - 1;
+  atomic_init(&pool.enqueue_pos, 0);
+  atomic_init(&pool.dequeue_pos, 0);
+  atomic_init(&pool.stopping, 0);
+  if (sem_init(&pool.items, 0, 0) != 0) {
+    return -1;
+  }
+  for (long i = 0; i < nworkers; i++) {
+    if (pthread_create(&pool.workers[i], NULL, pool_worker, (void *)i) != 0) {
+      error("pthread_create");
+      return -1;
+    }
+    pool.nworkers++;
+  }
+  info("Started %d service workers (queue capacity %zu)", pool.nworkers, size);
+  return 0;
+}
+
+/*
+ * Hand an accepted connection to the pool.  If the queue is full the
+ * connection is sent a NACK and closed.
+ *
+ * @param connfd  The file descriptor of the accepted connection.
+ * @return 0 if the connection was queued, -1 if it was rejected.
+ */
+int pool_submit(int connfd) {
+  if (pool_push(connfd) == 0) {
+    sem_post(&pool.items);
+    return 0;
+  }
+  warn("connection queue full, rejecting connection %d", connfd);
+  adm_refuse(connfd);
+  // it was admitted, but will never be registered
+  adm_release();
+  return -1;
+}
+
+/*
+ * Stop the workers once the queue has drained and wait for them to
+ * finish.  Connections still waiting in the queue are refused by the
+ * client registry (it has been shut down) and closed by the workers.
+ */
+void pool_fini(void) {
+  atomic_store(&pool.stopping, 1);
+  for (int i = 0; i < pool.nworkers; i++) {
+    sem_post(&pool.items);
+  }
+  for (int i = 0; i < pool.nworkers; i++) {
+    pthread_join(pool.workers[i], NULL);
+  }
+  sem_destroy(&pool.items);
+  free(pool.workers);
+  free(pool.slots);
+  memset(&pool, 0, sizeof(pool));
+}
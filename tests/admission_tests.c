@@ -0,0 +1,65 @@
+#include <criterion/criterion.h>
+#include <sys/socket.h>
+
+#include "includeme.h"
+#include "admission.h"
+#include "stats.h"
+
+static int admitted[8];
+static int nadmitted;
+
+static void record_admission(int connfd) {
+  admitted[nadmitted++] = connfd;
+}
+
+/*
+ * Check that a refused connection was sent a NACK and closed.
+ */
+static void assert_refused(int peer) {
+  JEUX_PACKET_HEADER hdr;
+  void *payload = NULL;
+  cr_assert_eq(proto_recv_packet(peer, &hdr, &payload), 0, "No NACK was sent");
+  cr_assert_eq(hdr.type, JEUX_NACK_PKT);
+  char c;
+  cr_assert_eq(read(peer, &c, 1), 0, "Connection was not closed");
+}
+
+Test(admission_suite, admit_queue_and_shed, .timeout = 5) {
+  cr_assert_eq(tw_start(10), 0);
+  cr_assert_eq(adm_init(1, 1, 100, record_admission), 0);
+  int a[2], b[2], c[2], d[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, a), 0);
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, b), 0);
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, c), 0);
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, d), 0);
+
+  // the first connection fills the server, the second waits, and the
+  // third is turned away at once
+  cr_assert_eq(adm_submit(a[0]), 0);
+  cr_assert_eq(adm_submit(b[0]), 0);
+  cr_assert_eq(adm_submit(c[0]), -1);
+  cr_assert_eq(nadmitted, 1);
+  cr_assert_eq(admitted[0], a[0]);
+  assert_refused(c[1]);
+
+  // a released slot goes to the waiting connection
+  adm_release();
+  cr_assert_eq(nadmitted, 2);
+  cr_assert_eq(admitted[1], b[0]);
+
+  // a connection that waits past its deadline is turned away
+  long expired = stats_get(STAT_ADMIT_EXPIRED);
+  cr_assert_eq(adm_submit(d[0]), 0);
+  assert_refused(d[1]);
+  cr_assert_eq(nadmitted, 2);
+  cr_assert_eq(stats_get(STAT_ADMIT_EXPIRED), expired + 1);
+
+  adm_shutdown();
+  tw_fini();
+  close(a[0]);
+  close(b[0]);
+  close(a[1]);
+  close(b[1]);
+  close(c[1]);
+  close(d[1]);
+}
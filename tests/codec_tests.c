@@ -0,0 +1,344 @@
+#include <criterion/criterion.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "includeme.h"
+#include "stats.h"
+
+/*
+ * Encode a header with a codec and feed the bytes to an assembler one at
+ * a time, as the slowest possible client would send them.
+ */
+static JEUX_PACKET_HEADER assemble_bytewise(const PROTO_CODEC *codec, JEUX_PACKET_HEADER *in,
+                                            char *payload, size_t *lenp) {
+  char buf[PROTO_HEADER_MAX + 256];
+  size_t len = codec->encode(in, buf);
+  *lenp = len;
+  memcpy(buf + len, payload, ntohs(in->size));
+  len += ntohs(in->size);
+  PROTO_ASSEMBLER pa = {.codec = codec};
+  int done = 0;
+  for (size_t i = 0; i < len; i++) {
+    cr_assert_eq(done, 0, "Packet was complete after %zu of %zu bytes", i, len);
+    cr_assert_eq(proto_assemble(&pa, buf + i, 1, &done), 1, "Byte %zu was not consumed", i);
+  }
+  cr_assert_eq(done, 1, "Packet was not completed");
+  JEUX_PACKET_HEADER out;
+  char *got = proto_assembler_take(&pa, &out);
+  if (ntohs(in->size) > 0) {
+    cr_assert_str_eq(got, payload);
+  }
+  proto_assembler_fini(&pa);
+  return out;
+}
+
+Test(codec_suite, compact_headers_round_trip, .timeout = 5) {
+  char payload[200];
+  memset(payload, 'x', sizeof(payload) - 1);
+  payload[sizeof(payload) - 1] = '\0';
+  size_t sizes[] = {0, 5, 127, 128, 199};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    JEUX_PACKET_HEADER in;
+    init_header(&in, JEUX_MOVED_PKT, 42, SECOND_PLAYER_ROLE, sizes[i]);
+    payload[sizes[i]] = '\0';
+    size_t len;
+    JEUX_PACKET_HEADER out = assemble_bytewise(&proto_codec_v2, &in, payload, &len);
+    cr_assert_eq(len, sizes[i] < 128 ? 3 : 4, "Header of a %zu-byte packet is %zu bytes", sizes[i], len);
+    cr_assert_eq(out.type, in.type);
+    cr_assert_eq(out.id, in.id);
+    cr_assert_eq(out.role, in.role);
+    cr_assert_eq(out.size, in.size);
+    cr_assert_eq(out.timestamp_sec, 0, "Timestamp was sent without being asked for");
+
+    out = assemble_bytewise(&proto_codec_v2_ts, &in, payload, &len);
+    cr_assert_eq(len, (sizes[i] < 128 ? 3 : 4) + 8);
+    cr_assert_eq(out.size, in.size);
+    cr_assert_eq(out.timestamp_sec, in.timestamp_sec);
+    cr_assert_eq(out.timestamp_nsec, in.timestamp_nsec);
+    payload[sizes[i]] = 'x';
+  }
+}
+
+Test(codec_suite, malformed_compact_header_is_rejected, .timeout = 5) {
+  // a size that runs on for more than three bytes
+  char bad[] = {JEUX_USERS_PKT, 0, (char)0x80, (char)0x80, (char)0x80, 0x01};
+  PROTO_ASSEMBLER pa = {.codec = &proto_codec_v2};
+  int done = 0;
+  proto_assemble(&pa, bad, sizeof(bad), &done);
+  cr_assert_eq(done, -1, "Malformed header was accepted");
+  proto_assembler_fini(&pa);
+}
+
+Test(codec_suite, login_negotiates_compact_framing, .timeout = 5) {
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int sv[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  CLIENT *client = creg_register(client_registry, sv[0]);
+  cr_assert_not_null(client);
+  PROTO_RECV_BUF *rb = malloc(sizeof(PROTO_RECV_BUF));
+  proto_recv_buf_init(rb, sv[0]);
+  int logged_in = 0;
+
+  // the LOGIN asks for the compact framing, and for a bit nobody knows
+  JEUX_PACKET_HEADER hdr;
+  init_header(&hdr, JEUX_LOGIN_PKT, 0, PROTO_CAP_COMPACT | 0x80, 3);
+  cr_assert_eq(proto_send_packet(sv[1], &hdr, "zed"), 0);
+  char *payload;
+  cr_assert_eq(proto_recv_packet_buffered(rb, &hdr, &payload), 0);
+  jeux_dispatch_packet(client, sv[0], &hdr, payload, &logged_in);
+  rb->codec = client_get_codec(client);
+  cr_assert_eq(rb->codec, &proto_codec_v2);
+
+  // the ACK still has the standard framing, and tells what was accepted
+  JEUX_PACKET_HEADER ack;
+  void *none = NULL;
+  cr_assert_eq(proto_recv_packet(sv[1], &ack, &none), 0);
+  cr_assert_eq(ack.type, JEUX_ACK_PKT);
+  cr_assert_eq(ack.role, PROTO_CAP_COMPACT, "ACK accepted caps %#x", ack.role);
+
+  // and from then on, both directions are compact
+  char users[] = {JEUX_USERS_PKT, 0, 0};
+  cr_assert_eq(write(sv[1], users, sizeof(users)), sizeof(users));
+  cr_assert_eq(proto_recv_packet_buffered(rb, &hdr, &payload), 0);
+  cr_assert_eq(hdr.type, JEUX_USERS_PKT);
+  jeux_dispatch_packet(client, sv[0], &hdr, payload, &logged_in);
+  char reply[3 + sizeof("zed\t1500\n")];
+  cr_assert_eq(read(sv[1], reply, sizeof(reply) - 1), sizeof(reply) - 1);
+  cr_assert_eq(reply[0], JEUX_ACK_PKT);
+  cr_assert_eq(reply[2], strlen("zed\t1500\n"));
+  cr_assert_eq(memcmp(reply + 3, "zed\t1500\n", reply[2]), 0);
+
+  creg_unregister(client_registry, client);
+  proto_recv_buf_fini(rb);
+  free(rb);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+Test(codec_suite, delta_moves_and_state_resync, .timeout = 5) {
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int sv[2][2];
+  CLIENT *clients[2];
+  char *names[] = {"amy", "ben"};
+  for (int i = 0; i < 2; i++) {
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]), 0);
+    clients[i] = creg_register(client_registry, sv[i][0]);
+    PLAYER *player = preg_register(player_registry, names[i]);
+    cr_assert_eq(client_login(clients[i], player), 0);
+    player_unref(player, "logged in by test");
+  }
+  // only ben asked for deltas
+  client_set_caps(clients[1], PROTO_CAP_DELTA);
+
+  int id = client_make_invitation(clients[0], clients[1], FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+  cr_assert_neq(id, -1);
+  JEUX_PACKET_HEADER hdr;
+  char *payload = NULL;
+  cr_assert_eq(proto_recv_packet(sv[1][1], &hdr, (void **)&payload), 0);
+  int bid = hdr.id;
+  free(payload);
+  char *state = NULL;
+  cr_assert_eq(client_accept_invitation(clients[1], bid, &state), 0);
+  free(state);
+  cr_assert_eq(proto_recv_packet(sv[0][1], &hdr, (void **)&payload), 0);
+  free(payload);
+
+  // ben is sent the move and the version it leads to, amy the whole board
+  cr_assert_eq(client_make_move(clients[0], id, "5"), 0);
+  cr_assert_eq(proto_recv_packet(sv[1][1], &hdr, (void **)&payload), 0);
+  cr_assert_eq(hdr.type, JEUX_MOVED_PKT);
+  cr_assert_str_eq(payload, "1 5");
+  free(payload);
+  cr_assert_eq(client_make_move(clients[1], bid, "1"), 0);
+  cr_assert_eq(proto_recv_packet(sv[0][1], &hdr, (void **)&payload), 0);
+  cr_assert_str_eq(payload, "O| | \n-----\n |X| \n-----\n | | \nX to move\n");
+  free(payload);
+
+  // and the full state can be asked for at any time
+  state = client_get_game_state(clients[1], bid);
+  cr_assert_str_eq(state, "2\nO| | \n-----\n |X| \n-----\n | | \nX to move\n");
+  free(state);
+  cr_assert_null(client_get_game_state(clients[1], bid + 1));
+
+  for (int i = 0; i < 2; i++) {
+    creg_unregister(client_registry, clients[i]);
+    close(sv[i][1]);
+  }
+}
+
+Test(codec_suite, multiplexed_sessions_log_in_separately, .timeout = 5) {
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int sv[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  CLIENT *client = creg_register(client_registry, sv[0]);
+  cr_assert_not_null(client);
+  int logged_in = 0;
+  JEUX_PACKET_HEADER hdr;
+  init_header(&hdr, JEUX_LOGIN_PKT, 0, PROTO_CAP_COMPACT | PROTO_CAP_MUX, 3);
+  jeux_dispatch_packet(client, sv[0], &hdr, "zed", &logged_in);
+  cr_assert_eq(client_get_codec(client), &proto_codec_mux);
+  JEUX_PACKET_HEADER ack;
+  void *none = NULL;
+  cr_assert_eq(proto_recv_packet(sv[1], &ack, &none), 0);
+  cr_assert_eq(ack.role, PROTO_CAP_COMPACT | PROTO_CAP_MUX, "ACK accepted caps %#x", ack.role);
+
+  // two sessions log in under names of their own, the second with a two-byte id
+  int sessions[] = {1, 300};
+  char *names[] = {"amy", "ben"};
+  for (int i = 0; i < 2; i++) {
+    init_header(&hdr, JEUX_LOGIN_PKT, 0, 0, 3);
+    hdr.timestamp_sec = htonl(sessions[i]);
+    char frame[PROTO_HEADER_MAX + 3];
+    size_t len = proto_codec_mux.encode(&hdr, frame);
+    memcpy(frame + len, names[i], 3);
+    len += 3;
+    PROTO_ASSEMBLER pa = {.codec = &proto_codec_mux};
+    int done = 0;
+    cr_assert_eq(proto_assemble(&pa, frame, len, &done), len);
+    cr_assert_eq(done, 1);
+    JEUX_PACKET_HEADER in;
+    char *payload = proto_assembler_take(&pa, &in);
+    cr_assert_eq(PROTO_SESSION(&in), sessions[i]);
+    jeux_dispatch_packet(client, sv[0], &in, payload, &logged_in);
+    proto_assembler_fini(&pa);
+
+    // the ACK names the session it answers
+    unsigned char reply[5];
+    size_t want = sessions[i] < 128 ? 4 : 5;
+    cr_assert_eq(read(sv[1], reply, want), want);
+    cr_assert_eq(reply[0], JEUX_ACK_PKT, "Session %d was sent type %d", sessions[i], reply[0]);
+    cr_assert_eq(reply[2] & 0x7f, sessions[i] & 0x7f);
+    cr_assert_eq(reply[want - 1], 0);
+  }
+  CLIENT *amy = client_get_session(client, 1);
+  CLIENT *ben = client_get_session(client, 300);
+  cr_assert(amy != NULL && ben != NULL && amy != ben && amy != client);
+  cr_assert_str_eq(player_get_name(client_get_player(amy)), "amy");
+  cr_assert_str_eq(player_get_name(client_get_player(ben)), "ben");
+  CLIENT *found = creg_lookup(client_registry, "ben");
+  cr_assert_eq(found, ben);
+  client_unref(found, "looked up by test");
+
+  // and they are logged out with their connection
+  creg_unregister(client_registry, client);
+  cr_assert_null(creg_lookup(client_registry, "ben"));
+  close(sv[0]);
+  close(sv[1]);
+}
+
+Test(codec_suite, correlated_replies_carry_request_ids, .timeout = 5) {
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int sv[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  CLIENT *client = creg_register(client_registry, sv[0]);
+  cr_assert_not_null(client);
+  int logged_in = 0;
+  JEUX_PACKET_HEADER hdr;
+  init_header(&hdr, JEUX_LOGIN_PKT, 0, PROTO_CAP_COMPACT | PROTO_CAP_CORRELATION, 3);
+  jeux_dispatch_packet(client, sv[0], &hdr, "zed", &logged_in);
+  cr_assert_eq(client_get_codec(client), &proto_codec_v2_corr);
+  JEUX_PACKET_HEADER ack;
+  void *none = NULL;
+  cr_assert_eq(proto_recv_packet(sv[1], &ack, &none), 0);
+  cr_assert_eq(ack.role, PROTO_CAP_COMPACT | PROTO_CAP_CORRELATION);
+
+  // two requests in flight at once: one that succeeds, one that fails
+  char frames[] = {JEUX_USERS_PKT, 0, 7, 0, JEUX_INVITE_PKT | (SECOND_PLAYER_ROLE << 6), 0,
+                   (char)0x81, 0x01, 3, 'b', 'o', 'b'};
+  PROTO_RECV_BUF *rb = malloc(sizeof(PROTO_RECV_BUF));
+  proto_recv_buf_init(rb, sv[0]);
+  rb->codec = client_get_codec(client);
+  cr_assert_eq(write(sv[1], frames, sizeof(frames)), sizeof(frames));
+  char *payload;
+  cr_assert_eq(proto_recv_packet_buffered(rb, &hdr, &payload), 0);
+  cr_assert_eq(PROTO_CORRELATION(&hdr), 7);
+  cr_assert(proto_recv_buf_ready(rb), "Pipelined request was not buffered");
+  jeux_dispatch_packet(client, sv[0], &hdr, payload, &logged_in);
+  cr_assert_eq(proto_recv_packet_buffered(rb, &hdr, &payload), 0);
+  cr_assert_eq(PROTO_CORRELATION(&hdr), 129);
+  cr_assert(!proto_recv_buf_ready(rb));
+  jeux_dispatch_packet(client, sv[0], &hdr, payload, &logged_in);
+
+  // each answer carries the ID of its request
+  char reply[4 + sizeof("zed\t1500\n") - 1 + 5];
+  cr_assert_eq(read(sv[1], reply, sizeof(reply)), sizeof(reply));
+  cr_assert_eq(reply[0], JEUX_ACK_PKT);
+  cr_assert_eq(reply[2], 7);
+  cr_assert_eq(reply[3], strlen("zed\t1500\n"));
+  char *nack = reply + 4 + reply[3];
+  cr_assert_eq(nack[0], JEUX_NACK_PKT);
+  cr_assert_eq((unsigned char)nack[2], 0x81);
+  cr_assert_eq(nack[3], 0x01);
+  cr_assert_eq(nack[4], 0);
+
+  creg_unregister(client_registry, client);
+  proto_recv_buf_fini(rb);
+  free(rb);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+/*
+ * Serialize one packet for a session of a multiplexed connection.
+ */
+static OUTQ_BUF *session_packet(int type, int id, int session) {
+  JEUX_PACKET_HEADER hdr;
+  init_header(&hdr, type, id, 0, 1);
+  hdr.timestamp_sec = htonl(session);
+  PROTO_PACKET pkt = {.hdr = &hdr, .data = "x"};
+  OUTQ_BUF *buf = outq_buf_create(&proto_codec_mux, &pkt, 1);
+  cr_assert_not_null(buf);
+  return buf;
+}
+
+Test(codec_suite, coalescing_keeps_moves_of_other_sessions, .timeout = 5) {
+  OUTQ_LIMITS limits = {.high_bytes = 64 * 1024, .high_pkts = 4,
+                        .low_bytes = 32 * 1024, .low_pkts = 1,
+                        .policy = OUTQ_POLICY_COALESCE};
+  cr_assert_eq(outq_start(1, &limits), 0);
+  int sv[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  // fill the socket, so that everything pushed stays queued
+  fcntl(sv[0], F_SETFL, O_NONBLOCK);
+  char fill[4096] = {0};
+  while (write(sv[0], fill, sizeof(fill)) > 0) {
+  }
+  while (write(sv[0], fill, 1) > 0) {
+  }
+  OUTQ *q = outq_create(sv[0]);
+  cr_assert_not_null(q);
+
+  // both sessions have a game with invitation ID 0
+  OUTQ_BUF *bufs[] = {session_packet(JEUX_MOVED_PKT, 0, 1), session_packet(JEUX_MOVED_PKT, 0, 2),
+                      session_packet(JEUX_ACK_PKT, 0, 1), session_packet(JEUX_ACK_PKT, 0, 1),
+                      session_packet(JEUX_ACK_PKT, 0, 2), session_packet(JEUX_MOVED_PKT, 0, 1)};
+  long coalesced = stats_get(STAT_SLOW_COALESCED);
+  for (int i = 0; i < 6; i++) {
+    cr_assert_eq(outq_push(q, bufs[i]), 0, "Push %d failed", i);
+  }
+  // the newer move of session 1 replaces its older one, not session 2's
+  cr_assert_eq(stats_get(STAT_SLOW_COALESCED), coalesced + 1);
+  size_t len;
+  char *saved = outq_save(q, &len);
+  cr_assert_not_null(saved);
+  JEUX_PACKET_HEADER hdr;
+  size_t size = proto_codec_mux.header_size(saved, len);
+  cr_assert(size > 0 && size <= len);
+  cr_assert_eq(proto_codec_mux.decode(saved, size, &hdr), 0);
+  cr_assert_eq(hdr.type, JEUX_MOVED_PKT);
+  cr_assert_eq(PROTO_SESSION(&hdr), 2, "Session 2's move was coalesced away");
+  free(saved);
+
+  for (int i = 0; i < 6; i++) {
+    outq_buf_unref(bufs[i]);
+  }
+  outq_close(q);
+  outq_unref(q);
+  outq_fini();
+  close(sv[0]);
+  close(sv[1]);
+}
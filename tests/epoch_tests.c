@@ -0,0 +1,47 @@
+#include <criterion/criterion.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "includeme.h"
+#include "epoch.h"
+
+static atomic_int reclaimed;
+static sem_t entered, leave;
+
+static void count_reclaim(void *object) {
+  free(object);
+  atomic_fetch_add(&reclaimed, 1);
+}
+
+static void *reader_thread(void *arg) {
+  epoch_enter();
+  sem_post(&entered);
+  sem_wait(&leave);
+  epoch_exit();
+  return NULL;
+}
+
+Test(epoch_suite, retired_objects_outlive_their_readers, .timeout = 5) {
+  sem_init(&entered, 0, 0);
+  sem_init(&leave, 0, 0);
+  pthread_t tid;
+  pthread_create(&tid, NULL, reader_thread, NULL);
+  sem_wait(&entered);
+
+  // however often the writer retires, nothing goes while the reader is in
+  for (int i = 0; i < 100; i++) {
+    epoch_retire(malloc(16), count_reclaim);
+  }
+  cr_assert_eq(atomic_load(&reclaimed), 0, "An object was reclaimed under a reader");
+
+  // a section of this thread's own, nested, does not hold anything up
+  epoch_enter();
+  epoch_enter();
+  epoch_exit();
+  epoch_exit();
+
+  sem_post(&leave);
+  pthread_join(tid, NULL);
+  epoch_synchronize();
+  cr_assert_eq(atomic_load(&reclaimed), 100);
+}
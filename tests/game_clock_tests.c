@@ -0,0 +1,91 @@
+#include <criterion/criterion.h>
+#include <sys/socket.h>
+
+#include "includeme.h"
+#include "test_util.h"
+
+Test(game_clock_suite, flag_fall_ends_game, .timeout = 5) {
+  cr_assert_eq(tw_start(10), 0);
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int apeer, bpeer;
+  CLIENT *alice = logged_in_client("alice", &apeer);
+  CLIENT *bob = logged_in_client("bob", &bpeer);
+
+  // alice plays first, with 300 ms on each clock
+  TIME_CONTROL tc = {.base_ms = 300, .increment_ms = 0};
+  int id = client_make_timed_invitation(alice, bob, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE, &tc);
+  cr_assert_neq(id, -1);
+  JEUX_PACKET_HEADER invited = read_packet(bpeer);
+  cr_assert_eq(invited.type, JEUX_INVITED_PKT);
+  char *state = NULL;
+  cr_assert_eq(client_accept_invitation(bob, invited.id, &state), 0);
+  free(state);
+  cr_assert_eq(read_packet(apeer).type, JEUX_ACCEPTED_PKT);
+
+  // alice moves in time, then bob lets his clock run out
+  cr_assert_eq(client_make_move(alice, id, "5<-X"), 0);
+  cr_assert_eq(read_packet(bpeer).type, JEUX_MOVED_PKT);
+  JEUX_PACKET_HEADER ended = read_packet(bpeer);
+  cr_assert_eq(ended.type, JEUX_ENDED_PKT, "Bob was not told the game ended");
+  cr_assert_eq(ended.id, invited.id);
+  cr_assert_eq(ended.role, FIRST_PLAYER_ROLE, "Bob did not lose on time");
+  ended = read_packet(apeer);
+  cr_assert_eq(ended.type, JEUX_ENDED_PKT, "Alice was not told the game ended");
+  cr_assert_eq(ended.id, id);
+  cr_assert_eq(ended.role, FIRST_PLAYER_ROLE);
+
+  // the game is gone (the move waits for the flag fall to be finished
+  // with), and the result has been posted
+  cr_assert_eq(client_make_move(bob, invited.id, "1<-O"), -1);
+  cr_assert_gt(player_get_rating(client_get_player(alice)),
+               player_get_rating(client_get_player(bob)));
+
+  creg_unregister(client_registry, alice);
+  creg_unregister(client_registry, bob);
+  close(apeer);
+  close(bpeer);
+  tw_fini();
+}
+
+Test(game_clock_suite, moves_in_time_keep_game_going, .timeout = 5) {
+  cr_assert_eq(tw_start(10), 0);
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int apeer, bpeer;
+  CLIENT *alice = logged_in_client("alice", &apeer);
+  CLIENT *bob = logged_in_client("bob", &bpeer);
+
+  // each move takes longer than the base time, but the increment covers it
+  TIME_CONTROL tc = {.base_ms = 150, .increment_ms = 200};
+  int id = client_make_timed_invitation(alice, bob, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE, &tc);
+  JEUX_PACKET_HEADER invited = read_packet(bpeer);
+  char *state = NULL;
+  cr_assert_eq(client_accept_invitation(bob, invited.id, &state), 0);
+  free(state);
+  read_packet(apeer);
+  cr_assert_eq(client_make_move(alice, id, "1<-X"), 0);
+  read_packet(bpeer);
+  usleep(100 * 1000);
+  cr_assert_eq(client_make_move(bob, invited.id, "5<-O"), 0);
+  read_packet(apeer);
+  usleep(200 * 1000);
+  cr_assert_eq(client_make_move(alice, id, "9<-X"), 0, "Alice's increment was not added");
+  cr_assert_eq(read_packet(bpeer).type, JEUX_MOVED_PKT);
+
+  // resigning stops the clocks, so no ENDED follows the RESIGNED
+  cr_assert_eq(client_resign_game(bob, invited.id), 0);
+  cr_assert_eq(read_packet(apeer).type, JEUX_RESIGNED_PKT);
+  usleep(500 * 1000);
+  struct timeval tv = {0, 0};
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(apeer, &fds);
+  cr_assert_eq(select(apeer + 1, &fds, NULL, NULL, &tv), 0, "Packet sent after resignation");
+
+  creg_unregister(client_registry, alice);
+  creg_unregister(client_registry, bob);
+  close(apeer);
+  close(bpeer);
+  tw_fini();
+}
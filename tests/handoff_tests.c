@@ -0,0 +1,70 @@
+#include <criterion/criterion.h>
+#include <sys/socket.h>
+
+#include "includeme.h"
+#include "test_util.h"
+
+Test(handoff_suite, games_survive_save_and_restore, .timeout = 5) {
+  cr_assert_eq(tw_start(10), 0);
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int apeer, bpeer;
+  CLIENT *alice = logged_in_client("alice", &apeer);
+  CLIENT *bob = logged_in_client("bob", &bpeer);
+
+  // a timed game in which alice has moved, and an invitation bob has
+  // not answered yet
+  TIME_CONTROL tc = {.base_ms = 60000, .increment_ms = 1000};
+  int id = client_make_timed_invitation(alice, bob, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE, &tc);
+  cr_assert_neq(id, -1);
+  JEUX_PACKET_HEADER invited = read_packet(bpeer);
+  char *state = NULL;
+  cr_assert_eq(client_accept_invitation(bob, invited.id, &state), 0);
+  free(state);
+  cr_assert_eq(read_packet(apeer).type, JEUX_ACCEPTED_PKT);
+  cr_assert_eq(client_make_move(alice, id, "5<-X"), 0);
+  cr_assert_eq(read_packet(bpeer).type, JEUX_MOVED_PKT);
+  int pending = client_make_invitation(alice, bob, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+  cr_assert_neq(pending, -1);
+  JEUX_PACKET_HEADER pending_invited = read_packet(bpeer);
+
+  char *snapshot = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&snapshot, &len);
+  CLIENT *clients[] = {alice, bob};
+  client_save_games(clients, 2, out);
+  fclose(out);
+
+  // rebuild both clients in fresh registries, as the successor would
+  int apeer2, bpeer2;
+  client_registry = creg_init();
+  player_registry = preg_init();
+  CLIENT *alice2 = logged_in_client("alice", &apeer2);
+  CLIENT *bob2 = logged_in_client("bob", &bpeer2);
+  CLIENT *restored[] = {alice2, bob2};
+  FILE *in = fmemopen(snapshot, len, "r");
+  cr_assert_eq(client_restore_games(restored, 2, in), 0, "Games were not restored");
+  fclose(in);
+  free(snapshot);
+
+  // the game carries on under the same ids, with bob to move
+  cr_assert_eq(client_make_move(alice2, id, "1<-X"), -1, "Alice moved out of turn");
+  cr_assert_eq(client_make_move(bob2, invited.id, "1<-O"), 0, "Bob could not move");
+  JEUX_PACKET_HEADER moved = read_packet(apeer2);
+  cr_assert_eq(moved.type, JEUX_MOVED_PKT);
+  cr_assert_eq(moved.id, id);
+
+  // and the open invitation can still be declined
+  cr_assert_eq(client_decline_invitation(bob2, pending_invited.id), 0);
+  JEUX_PACKET_HEADER declined = read_packet(apeer2);
+  cr_assert_eq(declined.type, JEUX_DECLINED_PKT);
+  cr_assert_eq(declined.id, pending);
+
+  creg_unregister(client_registry, alice2);
+  creg_unregister(client_registry, bob2);
+  close(apeer);
+  close(bpeer);
+  close(apeer2);
+  close(bpeer2);
+  tw_fini();
+}
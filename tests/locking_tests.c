@@ -0,0 +1,112 @@
+#include <criterion/criterion.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "includeme.h"
+#include "test_util.h"
+
+/*
+ * Start a game between two clients, the first of them to move first.
+ *
+ * @return the source's ID for the game; the target's is put in *tidp.
+ */
+static int start_game(CLIENT *source, int speer, CLIENT *target, int tpeer, int *tidp) {
+  int id = client_make_invitation(source, target, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+  cr_assert_neq(id, -1);
+  JEUX_PACKET_HEADER invited = read_packet(tpeer);
+  cr_assert_eq(invited.type, JEUX_INVITED_PKT);
+  char *state = NULL;
+  cr_assert_eq(client_accept_invitation(target, invited.id, &state), 0);
+  free(state);
+  cr_assert_eq(read_packet(speer).type, JEUX_ACCEPTED_PKT);
+  *tidp = invited.id;
+  return id;
+}
+
+static struct {
+  CLIENT *client;
+  int id;
+  int ret;
+  sem_t done;
+} mover;
+
+static void *make_move_thread(void *arg) {
+  mover.ret = client_make_move(mover.client, mover.id, "5");
+  sem_post(&mover.done);
+  return NULL;
+}
+
+Test(locking_suite, unrelated_games_proceed_in_parallel, .timeout = 5) {
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int apeer, bpeer, cpeer, dpeer, bid, did;
+  CLIENT *amy = logged_in_client("amy", &apeer);
+  CLIENT *ben = logged_in_client("ben", &bpeer);
+  CLIENT *cat = logged_in_client("cat", &cpeer);
+  CLIENT *dan = logged_in_client("dan", &dpeer);
+  int aid = start_game(amy, apeer, ben, bpeer, &bid);
+  int cid = start_game(cat, cpeer, dan, dpeer, &did);
+
+  // while an operation holds amy and ben's game, cat can still move in
+  // hers
+  INVITATION *inv = client_get_invitation(amy, aid);
+  cr_assert_not_null(inv);
+  inv_lock(inv);
+  sem_init(&mover.done, 0, 0);
+  mover.client = cat;
+  mover.id = cid;
+  pthread_t tid;
+  pthread_create(&tid, NULL, make_move_thread, NULL);
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += 2;
+  int moved = sem_timedwait(&mover.done, &deadline) == 0;
+  inv_unlock(inv);
+  pthread_join(tid, NULL);
+  cr_assert(moved, "A move in one game waited for another game");
+  cr_assert_eq(mover.ret, 0);
+  cr_assert_eq(read_packet(dpeer).type, JEUX_MOVED_PKT);
+
+  // and amy and ben's game goes on once it is released
+  cr_assert_eq(client_make_move(amy, aid, "5"), 0);
+  cr_assert_eq(read_packet(bpeer).type, JEUX_MOVED_PKT);
+  inv_unref(inv, "looked up by test");
+
+  // a player who logs out resigns, and the game leaves both lists
+  cr_assert_eq(client_logout(ben), 0);
+  cr_assert_eq(read_packet(apeer).type, JEUX_RESIGNED_PKT);
+  cr_assert_null(client_get_invitation(amy, aid));
+  cr_assert_eq(client_make_move(dan, did, "1"), 0);
+}
+
+static void *churn_thread(void *arg) {
+  CLIENT *client = arg;
+  PLAYER *player = client_get_player(client);
+  for (int i = 0; i < 100000; i++) {
+    client_ref(client, "churn");
+    player_ref(player, "churn");
+    player_unref(player, "churn");
+    client_unref(client, "churn");
+  }
+  return NULL;
+}
+
+Test(locking_suite, references_survive_concurrent_churn, .timeout = 10) {
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int peer;
+  CLIENT *eve = logged_in_client("eve", &peer);
+  pthread_t tids[4];
+  for (int i = 0; i < 4; i++) {
+    pthread_create(&tids[i], NULL, churn_thread, eve);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  // every reference taken was given back, so eve is still whole
+  PLAYER *player = preg_register(player_registry, "eve");
+  cr_assert_eq(client_get_player(eve), player);
+  player_unref(player, "looked up by test");
+  cr_assert_eq(client_logout(eve), 0);
+}
@@ -0,0 +1,213 @@
+#include <criterion/criterion.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "includeme.h"
+#include "test_util.h"
+
+/*
+ * Allocation counting.  The test binary interposes on the allocator, and
+ * while a test has counting switched on, allocations made by its thread
+ * are counted, both in total and for one size of interest.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static __thread int counting;
+static __thread size_t watched_size;
+static __thread int watched_allocs;
+static __thread int all_allocs;
+
+static void count_alloc(size_t size) {
+  if (counting) {
+    all_allocs++;
+    if (size == watched_size) {
+      watched_allocs++;
+    }
+  }
+}
+
+void *malloc(size_t size) {
+  count_alloc(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  count_alloc(nmemb * size);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  count_alloc(size);
+  return __libc_realloc(ptr, size);
+}
+
+static void start_counting(size_t size) {
+  watched_size = size;
+  watched_allocs = 0;
+  all_allocs = 0;
+  counting = 1;
+}
+
+static void stop_counting(void) {
+  counting = 0;
+}
+
+/*
+ * Write one packet, as a client would.
+ */
+static void write_packet(int fd, int type, int id, int role, char *payload) {
+  JEUX_PACKET_HEADER hdr = {0};
+  hdr.type = type;
+  hdr.id = id;
+  hdr.role = role;
+  hdr.size = htons(payload == NULL ? 0 : strlen(payload));
+  cr_assert_eq(proto_send_packet(fd, &hdr, payload), 0, "Failed to write packet");
+}
+
+/*
+ * Receive the next packet on a server-side connection and dispatch it.
+ */
+static void serve_one(PROTO_RECV_BUF *rb, CLIENT *client, int *logged_in) {
+  JEUX_PACKET_HEADER hdr;
+  char *payload;
+  cr_assert_eq(proto_recv_packet_buffered(rb, &hdr, &payload), 0, "Failed to receive packet");
+  jeux_dispatch_packet(client, rb->fd, &hdr, payload, logged_in);
+}
+
+Test(payload_suite, recv_reuses_payload_buffer, .timeout = 5) {
+  int sv[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  PROTO_RECV_BUF *rb = malloc(sizeof(PROTO_RECV_BUF));
+  proto_recv_buf_init(rb, sv[0]);
+  write_packet(sv[1], JEUX_MOVE_PKT, 0, 0, "1<-X");
+  write_packet(sv[1], JEUX_MOVE_PKT, 0, 0, "2<-O");
+
+  JEUX_PACKET_HEADER hdr;
+  char *payload;
+  cr_assert_eq(proto_recv_packet_buffered(rb, &hdr, &payload), 0);
+  cr_assert_str_eq(payload, "1<-X");
+  // once the payload buffer exists, receiving costs no allocation
+  start_counting(0);
+  int ret = proto_recv_packet_buffered(rb, &hdr, &payload);
+  stop_counting();
+  cr_assert_eq(ret, 0);
+  cr_assert_str_eq(payload, "2<-O", "Payload is not NUL-terminated in place");
+  cr_assert_eq(all_allocs, 0, "Receiving a packet did %d allocations", all_allocs);
+  proto_recv_buf_fini(rb);
+  free(rb);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+Test(payload_suite, move_payload_is_not_copied, .timeout = 5) {
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int a[2], b[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, a), 0);
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, b), 0);
+  CLIENT *alice = creg_register(client_registry, a[0]);
+  CLIENT *bob = creg_register(client_registry, b[0]);
+  cr_assert_not_null(alice);
+  cr_assert_not_null(bob);
+  PROTO_RECV_BUF *arb = malloc(sizeof(PROTO_RECV_BUF));
+  PROTO_RECV_BUF *brb = malloc(sizeof(PROTO_RECV_BUF));
+  proto_recv_buf_init(arb, a[0]);
+  proto_recv_buf_init(brb, b[0]);
+  int alice_in = 0, bob_in = 0;
+
+  write_packet(a[1], JEUX_LOGIN_PKT, 0, 0, "alice");
+  serve_one(arb, alice, &alice_in);
+  cr_assert_eq(read_packet(a[1]).type, JEUX_ACK_PKT);
+  write_packet(b[1], JEUX_LOGIN_PKT, 0, 0, "bob");
+  serve_one(brb, bob, &bob_in);
+  cr_assert_eq(read_packet(b[1]).type, JEUX_ACK_PKT);
+
+  // alice invites bob to play second, so alice moves first
+  write_packet(a[1], JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, "bob");
+  serve_one(arb, alice, &alice_in);
+  JEUX_PACKET_HEADER ack = read_packet(a[1]);
+  cr_assert_eq(ack.type, JEUX_ACK_PKT);
+  JEUX_PACKET_HEADER invited = read_packet(b[1]);
+  cr_assert_eq(invited.type, JEUX_INVITED_PKT);
+  write_packet(b[1], JEUX_ACCEPT_PKT, invited.id, 0, NULL);
+  serve_one(brb, bob, &bob_in);
+  cr_assert_eq(read_packet(b[1]).type, JEUX_ACK_PKT);
+  cr_assert_eq(read_packet(a[1]).type, JEUX_ACCEPTED_PKT);
+
+  // The move payload used to be allocated three times (size + 1 bytes
+  // each): by the receive, by the service loop and by process_move().
+  char *move = "1<-X";
+  write_packet(a[1], JEUX_MOVE_PKT, ack.id, 0, move);
+  start_counting(strlen(move) + 1);
+  serve_one(arb, alice, &alice_in);
+  stop_counting();
+  cr_assert_eq(watched_allocs, 0, "MOVE payload was copied %d times", watched_allocs);
+  cr_assert_eq(read_packet(b[1]).type, JEUX_MOVED_PKT, "Move was not made");
+  cr_assert_eq(read_packet(a[1]).type, JEUX_ACK_PKT, "Move was not acknowledged");
+
+  creg_unregister(client_registry, alice);
+  creg_unregister(client_registry, bob);
+  proto_recv_buf_fini(arb);
+  proto_recv_buf_fini(brb);
+  free(arb);
+  free(brb);
+  close(a[0]);
+  close(a[1]);
+  close(b[0]);
+  close(b[1]);
+}
+
+/*
+ * Send the packets that make up most of the server's traffic: an ACK, a
+ * NACK, and a finishing MOVED+ENDED pair sent the way a request handler
+ * sends them, inside a cork.  Allocations are counted while sending (but
+ * not while the peer reads them back).
+ */
+static int send_round(CLIENT *client, int peer) {
+  JEUX_PACKET_HEADER moved, ended;
+  init_header(&moved, JEUX_MOVED_PKT, 0, 0, 5);
+  init_header(&ended, JEUX_ENDED_PKT, 0, FIRST_PLAYER_ROLE, 0);
+  PROTO_PACKET pkts[] = {{.hdr = &moved, .data = "X|O|X"}, {.hdr = &ended, .data = NULL}};
+  start_counting(0);
+  cr_assert_eq(client_send_ack(client, NULL, 0), 0);
+  cr_assert_eq(client_send_nack(client), 0);
+  client_cork();
+  cr_assert_eq(client_send_packets(client, pkts, 2), 0);
+  client_uncork();
+  stop_counting();
+  cr_assert_eq(read_packet(peer).type, JEUX_ACK_PKT);
+  cr_assert_eq(read_packet(peer).type, JEUX_NACK_PKT);
+  cr_assert_eq(read_packet(peer).type, JEUX_MOVED_PKT);
+  cr_assert_eq(read_packet(peer).type, JEUX_ENDED_PKT);
+  return all_allocs;
+}
+
+static void assert_sends_do_not_allocate(void) {
+  client_registry = creg_init();
+  int sv[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  CLIENT *client = creg_register(client_registry, sv[0]);
+  cr_assert_not_null(client);
+  // the first round may set up per-thread storage
+  send_round(client, sv[1]);
+  int allocs = send_round(client, sv[1]);
+  cr_assert_eq(allocs, 0, "Sending ACK, NACK, MOVED and ENDED did %d allocations", allocs);
+  creg_unregister(client_registry, client);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+Test(send_suite, direct_sends_do_not_allocate, .timeout = 5) {
+  assert_sends_do_not_allocate();
+}
+
+Test(send_suite, queued_sends_do_not_allocate, .timeout = 5) {
+  OUTQ_LIMITS limits = {.high_bytes = 64 * 1024, .high_pkts = 256,
+                        .low_bytes = 32 * 1024, .low_pkts = 128,
+                        .policy = OUTQ_POLICY_DROP};
+  cr_assert_eq(outq_start(1, &limits), 0);
+  assert_sends_do_not_allocate();
+  outq_fini();
+}
@@ -0,0 +1,222 @@
+#include <criterion/criterion.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "includeme.h"
+#include "test_util.h"
+
+#define MANY_CLIENTS 100000
+
+Test(registry_suite, holds_many_clients_by_name, .timeout = 20) {
+  client_registry = creg_init();
+  int sv[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  CLIENT **clients = calloc(MANY_CLIENTS, sizeof(CLIENT *));
+  cr_assert_not_null(clients);
+  char name[32];
+  for (int i = 0; i < MANY_CLIENTS; i++) {
+    // the clients share a socket, as nothing is sent to them
+    clients[i] = creg_register(client_registry, sv[0]);
+    cr_assert_not_null(clients[i], "Client %d was not registered", i);
+    // indexed the way client_login() does it, without the players
+    snprintf(name, sizeof(name), "user%d", i);
+    cr_assert_eq(creg_add_name(client_registry, clients[i], name), 0);
+  }
+
+  // every one of them is found by name, and a name cannot be taken twice
+  for (int i = 0; i < MANY_CLIENTS; i++) {
+    snprintf(name, sizeof(name), "user%d", i);
+    CLIENT *found = creg_lookup(client_registry, name);
+    cr_assert_eq(found, clients[i], "Lookup of %s found the wrong client", name);
+    client_unref(found, "looked up by test");
+  }
+  cr_assert_null(creg_lookup(client_registry, "nobody"));
+  cr_assert_eq(creg_add_name(client_registry, clients[8], "user7"), -1);
+
+  // only its own client takes a name out of the index
+  creg_remove_name(client_registry, clients[8], "user7");
+  CLIENT *kept = creg_lookup(client_registry, "user7");
+  cr_assert_eq(kept, clients[7]);
+  for (int i = 0; i < MANY_CLIENTS; i++) {
+    snprintf(name, sizeof(name), "user%d", i);
+    creg_remove_name(client_registry, clients[i], name);
+    cr_assert_eq(creg_unregister(client_registry, clients[i]), 0);
+  }
+  cr_assert_null(creg_lookup(client_registry, "user7"));
+  cr_assert_eq(creg_unregister(client_registry, kept), -1);
+  client_unref(kept, "looked up by test");
+  creg_wait_for_empty(client_registry);
+  free(clients);
+}
+
+Test(registry_suite, login_and_logout_keep_the_index, .timeout = 5) {
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int sv[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  CLIENT *fay = creg_register(client_registry, sv[0]);
+  CLIENT *imposter = creg_register(client_registry, sv[0]);
+  PLAYER *player = preg_register(player_registry, "fay");
+  cr_assert_eq(client_login(fay, player), 0);
+  cr_assert_eq(client_login(imposter, player), -1);
+
+  CLIENT *found = creg_lookup(client_registry, "fay");
+  cr_assert_eq(found, fay);
+  client_unref(found, "looked up by test");
+  PLAYER **players = creg_all_players(client_registry);
+  cr_assert_eq(players[0], player);
+  cr_assert_null(players[1]);
+  player_unref(players[0], "listed by test");
+  free(players);
+
+  // once fay is gone, the name can be used again
+  cr_assert_eq(creg_unregister(client_registry, fay), 0);
+  cr_assert_null(creg_lookup(client_registry, "fay"));
+  cr_assert_eq(client_login(imposter, player), 0);
+  player_unref(player, "logged in by test");
+  cr_assert_eq(creg_unregister(client_registry, imposter), 0);
+  creg_wait_for_empty(client_registry);
+}
+
+static atomic_int churning;
+
+static void *lookup_thread(void *arg) {
+  CLIENT *expected = arg;
+  long misses = 0;
+  while (atomic_load(&churning)) {
+    CLIENT *found = creg_lookup(client_registry, "steady");
+    misses += found != expected;
+    if (found != NULL) {
+      client_unref(found, "looked up by test");
+    }
+    PLAYER **players = creg_all_players(client_registry);
+    for (PLAYER **p = players; *p != NULL; p++) {
+      player_unref(*p, "listed by test");
+    }
+    free(players);
+  }
+  return (void *)misses;
+}
+
+Test(registry_suite, lookups_run_through_login_storms, .timeout = 20) {
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int sv[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  CLIENT *steady = creg_register(client_registry, sv[0]);
+  PLAYER *player = preg_register(player_registry, "steady");
+  cr_assert_eq(client_login(steady, player), 0);
+  player_unref(player, "logged in by test");
+
+  atomic_store(&churning, 1);
+  pthread_t readers[2];
+  for (int i = 0; i < 2; i++) {
+    pthread_create(&readers[i], NULL, lookup_thread, steady);
+  }
+  // clients come and go, growing the shards and retiring their entries,
+  // while the readers look on
+  char name[32];
+  for (int round = 0; round < 20; round++) {
+    CLIENT *clients[200];
+    for (int i = 0; i < 200; i++) {
+      clients[i] = creg_register(client_registry, sv[0]);
+      snprintf(name, sizeof(name), "churn%d", i);
+      player = preg_register(player_registry, name);
+      cr_assert_eq(client_login(clients[i], player), 0);
+      player_unref(player, "logged in by test");
+    }
+    for (int i = 0; i < 200; i++) {
+      cr_assert_eq(creg_unregister(client_registry, clients[i]), 0);
+    }
+  }
+  atomic_store(&churning, 0);
+  for (int i = 0; i < 2; i++) {
+    void *misses;
+    pthread_join(readers[i], &misses);
+    cr_assert_eq((long)misses, 0, "A lookup missed a client that never left");
+  }
+  cr_assert_eq(creg_unregister(client_registry, steady), 0);
+  creg_wait_for_empty(client_registry);
+}
+
+#define RIVALS 8
+
+static struct {
+  CLIENT *clients[RIVALS];
+  PLAYER *player;
+  atomic_int wins;
+  pthread_barrier_t start;
+} rivals;
+
+static void *rival_thread(void *arg) {
+  CLIENT *client = rivals.clients[(long)arg];
+  pthread_barrier_wait(&rivals.start);
+  if (client_login(client, rivals.player) == 0) {
+    atomic_fetch_add(&rivals.wins, 1);
+  }
+  return NULL;
+}
+
+Test(registry_suite, one_of_racing_logins_wins, .timeout = 5) {
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int sv[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  rivals.player = preg_register(player_registry, "gus");
+  pthread_barrier_init(&rivals.start, NULL, RIVALS);
+  pthread_t tids[RIVALS];
+  for (long i = 0; i < RIVALS; i++) {
+    rivals.clients[i] = creg_register(client_registry, sv[0]);
+    pthread_create(&tids[i], NULL, rival_thread, (void *)i);
+  }
+  for (int i = 0; i < RIVALS; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  cr_assert_eq(atomic_load(&rivals.wins), 1);
+
+  // the losers are left logged out, and the winner is the one found
+  CLIENT *winner = creg_lookup(client_registry, "gus");
+  cr_assert_not_null(winner);
+  for (int i = 0; i < RIVALS; i++) {
+    int won = rivals.clients[i] == winner;
+    cr_assert_eq(client_get_player(rivals.clients[i]) != NULL, won);
+    cr_assert_eq(client_logout(rivals.clients[i]), won ? 0 : -1);
+  }
+  client_unref(winner, "looked up by test");
+  player_unref(rivals.player, "logged in by test");
+}
+
+Test(registry_suite, duplicate_login_is_refused_on_the_wire, .timeout = 5) {
+  client_registry = creg_init();
+  player_registry = preg_init();
+  int sv[2][2];
+  CLIENT *clients[2];
+  int logged_in[2] = {0, 0};
+  char name[] = "gus";
+  JEUX_PACKET_HEADER hdr;
+  for (int i = 0; i < 2; i++) {
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]), 0);
+    clients[i] = creg_register(client_registry, sv[i][0]);
+    cr_assert_not_null(clients[i]);
+    init_header(&hdr, JEUX_LOGIN_PKT, 0, 0, sizeof(name) - 1);
+    jeux_dispatch_packet(clients[i], sv[i][0], &hdr, name, &logged_in[i]);
+  }
+  cr_assert_eq(read_packet(sv[0][1]).type, JEUX_ACK_PKT);
+  cr_assert_eq(logged_in[0], 1);
+
+  // the second connection is told no, once, and stays logged out
+  cr_assert_eq(read_packet(sv[1][1]).type, JEUX_NACK_PKT);
+  char extra;
+  cr_assert_eq(recv(sv[1][1], &extra, 1, MSG_DONTWAIT), -1, "More than a NACK was sent");
+  cr_assert_eq(logged_in[1], 0);
+  cr_assert_null(client_get_player(clients[1]));
+  init_header(&hdr, JEUX_USERS_PKT, 0, 0, 0);
+  jeux_dispatch_packet(clients[1], sv[1][0], &hdr, NULL, &logged_in[1]);
+  cr_assert_eq(read_packet(sv[1][1]).type, JEUX_NACK_PKT);
+
+  for (int i = 0; i < 2; i++) {
+    creg_unregister(client_registry, clients[i]);
+    close(sv[i][0]);
+    close(sv[i][1]);
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <criterion/criterion.h>
+#include <sys/socket.h>
+
+#include "includeme.h"
+
+/*
+ * Read one packet sent to a client, returning its header.
+ */
+static JEUX_PACKET_HEADER read_packet(int fd) {
+  JEUX_PACKET_HEADER hdr;
+  void *payload = NULL;
+  cr_assert_eq(proto_recv_packet(fd, &hdr, &payload), 0, "Failed to read packet");
+  free(payload);
+  return hdr;
+}
+
+/*
+ * Register a client on one end of a socketpair and log it in.  The other
+ * end, on which the client's packets arrive, is returned in *peer.
+ */
+static CLIENT *logged_in_client(char *name, int *peer) {
+  int sv[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  CLIENT *client = creg_register(client_registry, sv[0]);
+  cr_assert_not_null(client);
+  PLAYER *player = preg_register(player_registry, name);
+  cr_assert_eq(client_login(client, player), 0);
+  player_unref(player, "logged in by test");
+  *peer = sv[1];
+  return client;
+}
+
+#endif
@@ -0,0 +1,67 @@
+#include <criterion/criterion.h>
+#include <stdatomic.h>
+
+#include "includeme.h"
+
+/*
+ * A timer that records the tick at which it fired.
+ */
+typedef struct test_timer {
+  TW_TIMER timer;
+  _Atomic uint64_t fired_at;
+  atomic_int fired;
+} TEST_TIMER;
+
+static void record_expiry(TW_TIMER *timer) {
+  TEST_TIMER *t = (TEST_TIMER *)timer;
+  atomic_store(&t->fired_at, tw_now());
+  atomic_fetch_add(&t->fired, 1);
+}
+
+static void wait_until(uint64_t tick) {
+  while (tw_now() < tick) {
+    usleep(1000);
+  }
+}
+
+Test(timer_wheel_suite, timers_fire_on_time_at_every_level, .timeout = 10) {
+  cr_assert_eq(tw_start(1), 0);
+  // one delay for each of the first three wheels
+  uint64_t delays[] = {5, 100, 4200};
+  TEST_TIMER timers[3] = {0};
+  uint64_t armed_at = tw_now();
+  for (int i = 0; i < 3; i++) {
+    tw_init(&timers[i].timer, record_expiry);
+    tw_arm(&timers[i].timer, delays[i]);
+  }
+  wait_until(armed_at + delays[2] + 50);
+  for (int i = 0; i < 3; i++) {
+    cr_assert_eq(atomic_load(&timers[i].fired), 1, "Timer %d fired %d times", i,
+                 atomic_load(&timers[i].fired));
+    uint64_t at = atomic_load(&timers[i].fired_at);
+    // arming and expiry may straddle a tick on either side
+    cr_assert(at >= armed_at + delays[i] && at <= armed_at + delays[i] + 1,
+              "Timer %d armed for %lu ticks fired after %lu", i,
+              (unsigned long)delays[i], (unsigned long)(at - armed_at));
+  }
+  tw_fini();
+}
+
+Test(timer_wheel_suite, cancelled_and_moved_timers, .timeout = 5) {
+  cr_assert_eq(tw_start(1), 0);
+  TEST_TIMER cancelled = {0}, moved = {0};
+  tw_init(&cancelled.timer, record_expiry);
+  tw_init(&moved.timer, record_expiry);
+  uint64_t armed_at = tw_now();
+  tw_arm(&cancelled.timer, 20);
+  tw_arm(&moved.timer, 20);
+  tw_cancel(&cancelled.timer);
+  // arming a pending timer again replaces its expiry
+  tw_arm(&moved.timer, 200);
+  wait_until(armed_at + 100);
+  cr_assert_eq(atomic_load(&moved.fired), 0, "Moved timer fired at its old expiry");
+  wait_until(armed_at + 250);
+  cr_assert_eq(atomic_load(&cancelled.fired), 0, "Cancelled timer fired");
+  cr_assert_eq(atomic_load(&moved.fired), 1, "Moved timer did not fire");
+  tw_fini();
+}